@@ -22,5 +22,13 @@
 #define TFS_DISK_ALREADY_MOUNTED -15
 #define TFS_INVALID_FILESYSTEM -16
 #define TFS_MEMORY_ERROR -17
+#define TFS_CHECKSUM_ERROR -18
+#define TFS_NOT_A_DIRECTORY -19
+#define TFS_IS_A_DIRECTORY -20
+#define TFS_DIRECTORY_NOT_EMPTY -21
+#define TFS_INVALID_NAME -22
+#define TFS_BUSY -23
+#define TFS_INVALID_SIZE -24
+#define TFS_ATTR_NOT_FOUND -25
 
 #endif
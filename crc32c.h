@@ -0,0 +1,15 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+Computes the CRC32C (Castagnoli) checksum of 'len' bytes at 'buf',
+continuing from a previous result 'crc' (pass 0 to start a new one).
+Uses the SSE4.2 crc32 instruction when the CPU supports it and a
+table-driven implementation otherwise; both give identical results.
+*/
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+#endif
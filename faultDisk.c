@@ -0,0 +1,205 @@
+#include "faultDisk.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define FAULT_PREFIX "fault:"
+
+/* Settings and counters for one underlying disk name. They outlive the
+   open disk so a test can configure a disk before tfs_mount opens it and
+   read the counters after tfs_unmount closes it. */
+typedef struct faultSettings {
+    char *name;
+    faultDiskConfig config;
+    faultDiskStats stats;
+    int writes_left;    /* countdown for fail_after_writes */
+    struct faultSettings *next;
+} faultSettings;
+
+typedef struct {
+    int lower;          /* disk number of the device underneath */
+    faultSettings *settings;
+} faultDisk;
+
+static faultSettings *all_settings = NULL;
+
+static char *strip_prefix(char *name) {
+    size_t len = strlen(FAULT_PREFIX);
+    return strncmp(name, FAULT_PREFIX, len) == 0 ? name + len : name;
+}
+
+static faultSettings *get_settings(char *name, int create) {
+    faultSettings *s;
+    for (s = all_settings; s != NULL; s = s->next) {
+        if (strcmp(s->name, name) == 0) {
+            return s;
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+
+    s = calloc(1, sizeof(faultSettings));
+    if (s == NULL || (s->name = strdup(name)) == NULL) {
+        free(s);
+        return NULL;
+    }
+    faultDiskDefaults(&s->config);
+    s->writes_left = -1;
+    s->next = all_settings;
+    all_settings = s;
+    return s;
+}
+
+/*
+ Fills 'config' with settings that inject nothing
+*/
+void faultDiskDefaults(faultDiskConfig *config) {
+    memset(config, 0, sizeof(*config));
+    config->fail_after_writes = -1;
+    config->fail_write_block = -1;
+    config->fail_read_block = -1;
+}
+
+/*
+ Sets the faults and delays for disk 'name' (with or without the "fault:"
+ prefix). Takes effect immediately, also for a disk that is already open,
+ and restarts the fail_after_writes countdown. Once that countdown runs
+ out every later write fails, like a device that died mid-run.
+*/
+int faultDiskConfigure(char *name, const faultDiskConfig *config) {
+    faultSettings *s = get_settings(strip_prefix(name), 1);
+    if (s == NULL) {
+        return TFS_MEMORY_ERROR;
+    }
+    s->config = *config;
+    s->writes_left = config->fail_after_writes;
+    return TFS_SUCCESS;
+}
+
+/*
+ Copies the counters for disk 'name' into 'stats'
+*/
+int faultDiskGetStats(char *name, faultDiskStats *stats) {
+    faultSettings *s = get_settings(strip_prefix(name), 0);
+    if (s == NULL) {
+        return TFS_DISK_NOT_FOUND;
+    }
+    *stats = s->stats;
+    return TFS_SUCCESS;
+}
+
+/*
+ * Sleeps for the configured latency plus the time one block takes at the
+ * configured bandwidth
+ */
+static void simulate_delay(faultSettings *s, long latency_ns) {
+    long long ns = latency_ns;
+    if (s->config.bytes_per_sec > 0) {
+        ns += (long long)BLOCKSIZE * 1000000000LL / s->config.bytes_per_sec;
+    }
+    if (ns <= 0) {
+        return;
+    }
+    struct timespec ts;
+    ts.tv_sec = ns / 1000000000LL;
+    ts.tv_nsec = ns % 1000000000LL;
+    while (nanosleep(&ts, &ts) != 0)
+        ;
+    s->stats.delay_ns += ns;
+}
+
+static int fault_open(char *name, int nBytes, void **state, int *nBlocks) {
+    faultSettings *s = get_settings(name, 1);
+    faultDisk *disk = malloc(sizeof(faultDisk));
+    if (s == NULL || disk == NULL) {
+        free(disk);
+        return TFS_MEMORY_ERROR;
+    }
+
+    disk->lower = openDisk(name, nBytes);
+    if (disk->lower < 0) {
+        int ret = disk->lower;
+        free(disk);
+        return ret;
+    }
+    disk->settings = s;
+    *nBlocks = diskBlocks(disk->lower);
+    *state = disk;
+    return TFS_SUCCESS;
+}
+
+static int fault_close(void *state) {
+    faultDisk *disk = state;
+    int ret = closeDisk(disk->lower);
+    free(disk);
+    return ret;
+}
+
+static int fault_read(void *state, int bNum, void *block) {
+    faultDisk *disk = state;
+    faultSettings *s = disk->settings;
+
+    s->stats.reads++;
+    simulate_delay(s, s->config.read_latency_ns);
+    if (bNum == s->config.fail_read_block) {
+        s->stats.failed_reads++;
+        return TFS_READ_ERROR;
+    }
+    return readBlock(disk->lower, bNum, block);
+}
+
+static int fault_write(void *state, int bNum, void *block) {
+    faultDisk *disk = state;
+    faultSettings *s = disk->settings;
+    int fail = 0;
+
+    s->stats.writes++;
+    simulate_delay(s, s->config.write_latency_ns);
+    if (s->writes_left == 0) {
+        fail = 1;
+    } else if (s->writes_left > 0) {
+        s->writes_left--;
+    }
+    if (s->config.fail_every_writes > 0 && s->stats.writes % s->config.fail_every_writes == 0) {
+        fail = 1;
+    }
+    if (bNum == s->config.fail_write_block) {
+        fail = 1;
+    }
+    if (!fail) {
+        return writeBlock(disk->lower, bNum, block);
+    }
+
+    s->stats.failed_writes++;
+    if (s->config.torn_bytes > 0) {
+        // Only the start of the new block reaches the disk
+        char torn[BLOCKSIZE];
+        int len = s->config.torn_bytes < BLOCKSIZE ? s->config.torn_bytes : BLOCKSIZE;
+        if (readBlock(disk->lower, bNum, torn) == TFS_SUCCESS) {
+            memcpy(torn, block, len);
+            writeBlock(disk->lower, bNum, torn);
+            s->stats.torn_writes++;
+        }
+    }
+    return TFS_WRITE_ERROR;
+}
+
+static int fault_unlink(char *name) {
+    return unlinkDisk(name);
+}
+
+static int fault_resize(void *state, int nBlocks) {
+    faultDisk *disk = state;
+    return resizeDisk(disk->lower, nBlocks * BLOCKSIZE);
+}
+
+static int fault_fast_blocks(void *state) {
+    faultDisk *disk = state;
+    return diskFastBlocks(disk->lower);
+}
+
+const diskBackend faultDiskBackend = {
+    FAULT_PREFIX, fault_open, fault_close, fault_read, fault_write, fault_unlink, NULL, fault_resize,
+    fault_fast_blocks
+};
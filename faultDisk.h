@@ -0,0 +1,37 @@
+#ifndef FAULTDISK_H
+#define FAULTDISK_H
+
+#include "libDisk.h"
+
+/* Fault injection and latency simulation layered over another disk.
+   After registerDiskBackend(&faultDiskBackend), opening "fault:<name>"
+   opens <name> (any backend, e.g. "fault:ram:x") and passes every block
+   access through the settings configured for <name>. */
+
+typedef struct {
+    long read_latency_ns;       /* added to every block read */
+    long write_latency_ns;      /* added to every block write */
+    long bytes_per_sec;         /* bandwidth cap for reads and writes, 0 = none */
+    int fail_after_writes;      /* fail the write after this many more succeed, -1 = never */
+    int fail_every_writes;      /* fail every Nth write, 0 = never */
+    int fail_write_block;       /* always fail writes to this block, -1 = none */
+    int fail_read_block;        /* always fail reads of this block, -1 = none */
+    int torn_bytes;             /* a failed write still stores its first torn_bytes bytes */
+} faultDiskConfig;
+
+typedef struct {
+    unsigned long reads;
+    unsigned long writes;
+    unsigned long failed_reads;
+    unsigned long failed_writes;
+    unsigned long torn_writes;
+    long long delay_ns;         /* total simulated latency and bandwidth delay */
+} faultDiskStats;
+
+extern const diskBackend faultDiskBackend;
+
+void faultDiskDefaults(faultDiskConfig *config);
+int faultDiskConfigure(char *name, const faultDiskConfig *config);
+int faultDiskGetStats(char *name, faultDiskStats *stats);
+
+#endif
@@ -0,0 +1,145 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include "libTinyFS.h"
+#include "faultDisk.h"
+
+/* Exercises the fault injection backend: simulated latency and bandwidth,
+   deterministic write failures and torn writes, first on a raw RAM disk
+   and then underneath a mounted TinyFS. Returns non-zero on failure. */
+
+#define NUM_BLOCKS 50
+#define RAW_DISK "fault:ram:raw"
+#define FS_DISK "ram:fs"
+
+static int failures = 0;
+
+static void check(int ok, char *what) {
+    printf("] %s: %s\n", ok ? "ok" : "FAILED", what);
+    if (!ok) {
+        failures++;
+    }
+}
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void test_delays(int disk) {
+    faultDiskConfig config;
+    char buffer[BLOCKSIZE];
+    long long start;
+    int i;
+
+    faultDiskDefaults(&config);
+    config.read_latency_ns = 200000; /* 0.2 ms per read */
+    faultDiskConfigure(RAW_DISK, &config);
+    start = now_ns();
+    for (i = 0; i < 20; i++) {
+        readBlock(disk, i, buffer);
+    }
+    check(now_ns() - start >= 20 * 200000LL, "read latency is added to every read");
+
+    faultDiskDefaults(&config);
+    config.bytes_per_sec = 256 * 1000; /* 1000 blocks per second */
+    faultDiskConfigure(RAW_DISK, &config);
+    start = now_ns();
+    for (i = 0; i < 20; i++) {
+        writeBlock(disk, i, buffer);
+    }
+    check(now_ns() - start >= 20 * 1000000LL, "bandwidth cap slows writes to 1000 blocks/s");
+}
+
+static void test_write_failures(int disk) {
+    faultDiskConfig config;
+    faultDiskStats stats;
+    char buffer[BLOCKSIZE], old[BLOCKSIZE];
+    int i;
+
+    faultDiskDefaults(&config);
+    config.fail_after_writes = 3;
+    faultDiskConfigure(RAW_DISK, &config);
+    memset(buffer, '$', BLOCKSIZE);
+    for (i = 0; i < 3; i++) {
+        check(writeBlock(disk, 10 + i, buffer) == TFS_SUCCESS, "write before the failure point succeeds");
+    }
+    check(writeBlock(disk, 13, buffer) == TFS_WRITE_ERROR, "write after the failure point fails");
+    check(writeBlock(disk, 14, buffer) == TFS_WRITE_ERROR, "later writes keep failing");
+
+    faultDiskDefaults(&config);
+    config.fail_every_writes = 2;
+    faultDiskConfigure(RAW_DISK, &config);
+    faultDiskGetStats(RAW_DISK, &stats);
+    int odd = (stats.writes + 1) % 2;
+    check((writeBlock(disk, 20, buffer) < 0) == !odd, "every other write fails");
+    check((writeBlock(disk, 21, buffer) < 0) == odd, "every other write fails");
+
+    // Torn write: only the first 100 bytes of the new block land
+    faultDiskDefaults(&config);
+    faultDiskConfigure(RAW_DISK, &config);
+    memset(old, 'o', BLOCKSIZE);
+    writeBlock(disk, 30, old);
+    config.fail_write_block = 30;
+    config.torn_bytes = 100;
+    faultDiskConfigure(RAW_DISK, &config);
+    memset(buffer, 'n', BLOCKSIZE);
+    check(writeBlock(disk, 30, buffer) == TFS_WRITE_ERROR, "torn write reports failure");
+    readBlock(disk, 30, buffer);
+    check(buffer[0] == 'n' && buffer[99] == 'n' && buffer[100] == 'o' && buffer[BLOCKSIZE - 1] == 'o',
+          "torn write stores only its first 100 bytes");
+
+    faultDiskGetStats(RAW_DISK, &stats);
+    check(stats.torn_writes == 1, "torn writes are counted");
+}
+
+/* A torn write underneath the file system is caught by the block checksum */
+static void test_file_system(void) {
+    faultDiskConfig config;
+    char content[1000], c;
+    fileDescriptor FD;
+
+    memset(content, 'a', sizeof(content));
+    faultDiskDefaults(&config);
+    faultDiskConfigure(FS_DISK, &config);
+    check(tfs_mkfs(FS_DISK, BLOCKSIZE * NUM_BLOCKS) == TFS_SUCCESS, "mkfs on a RAM disk");
+    check(tfs_mount("fault:" FS_DISK) == TFS_SUCCESS, "mount through the fault layer");
+    FD = tfs_openFile("/f");
+    check(tfs_writeFile(FD, content, sizeof(content)) == TFS_SUCCESS, "write a file");
+
+    config.fail_after_writes = 0;
+    config.torn_bytes = 40;
+    faultDiskConfigure(FS_DISK, &config);
+    check(tfs_writeByte(FD, 600, 'b') < 0, "write during a device failure fails");
+
+    faultDiskDefaults(&config);
+    faultDiskConfigure(FS_DISK, &config);
+    tfs_seek(FD, 600);
+    check(tfs_readByte(FD, &c) < 0, "checksum rejects the torn block");
+    check(tfs_unmount() == TFS_SUCCESS, "unmount");
+    unlinkDisk(FS_DISK);
+}
+
+int main() {
+    int disk;
+
+    registerDiskBackend(&faultDiskBackend);
+    disk = openDisk(RAW_DISK, BLOCKSIZE * NUM_BLOCKS);
+    if (disk < 0) {
+        printf("] openDisk() failed to create a disk (%i). Exiting.\n", disk);
+        return 1;
+    }
+    check(diskBlocks(disk) == NUM_BLOCKS, "fault disk has the size of the disk below it");
+
+    test_delays(disk);
+    test_write_failures(disk);
+    closeDisk(disk);
+    unlinkDisk(RAW_DISK);
+
+    test_file_system();
+
+    printf("] %d failures\n", failures);
+    return failures != 0;
+}
@@ -1,8 +1,76 @@
+#define _GNU_SOURCE /* O_DIRECT */
 #include "libTinyFS.h"
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+/* An open disk: the backend serving it and the backend's own state */
+typedef struct {
+    const diskBackend *backend;
+    void *state;
+    int nBlocks;
+    int in_use;
+} openDiskEntry;
+
+/* Entries never move, so readBlock and writeBlock can run in several
+   threads while another thread opens or closes a different disk */
+#define MAX_OPEN_DISKS 64
+
+static openDiskEntry open_disks[MAX_OPEN_DISKS];
+static int num_open_disks = 0;
+
+#define MAX_BACKENDS 8
+
+static const diskBackend *backends[MAX_BACKENDS] = {
+    &mmapDiskBackend, &ramDiskBackend, &directDiskBackend, &tierDiskBackend
+};
+static int num_backends = 4;
+
+/*
+ * Picks the backend for 'filename' (longest matching prefix wins) and
+ * returns the name with that prefix removed in *name.
+ */
+static const diskBackend *find_backend(char *filename, char **name) {
+    const diskBackend *best = &fileDiskBackend;
+    size_t best_len = 0;
+    int i;
+    for (i = 0; i < num_backends; i++) {
+        size_t len = strlen(backends[i]->prefix);
+        if (len > best_len && strncmp(filename, backends[i]->prefix, len) == 0) {
+            best = backends[i];
+            best_len = len;
+        }
+    }
+    *name = filename + best_len;
+    return best;
+}
+
+static openDiskEntry *get_disk(int disk) {
+    if (disk < 0 || disk >= num_open_disks || !open_disks[disk].in_use) {
+        return NULL;
+    }
+    return &open_disks[disk];
+}
+
+/*
+ Adds a backend that openDisk selects for filenames starting with its
+ prefix. Backends registered later take part in the same longest-prefix
+ match as the built-in ones.
+*/
+int registerDiskBackend(const diskBackend *backend) {
+    if (backend == NULL || backend->prefix == NULL || backend->prefix[0] == '\0') {
+        return TFS_ERROR;
+    }
+    if (num_backends == MAX_BACKENDS) {
+        return TFS_MEMORY_ERROR;
+    }
+    backends[num_backends++] = backend;
+    return TFS_SUCCESS;
+}
 
 /*
 This functions opens a regular UNIX file and designates the first
@@ -15,36 +83,48 @@ may be overwritten. If nBytes is 0, an existing disk is opened, and the
 content must not be overwritten in this function. There is no requirement
 to maintain integrity of any file content beyond nBytes. The return value
 is negative on failure or a disk number on success.
+
+A filename starting with a registered backend prefix ("ram:", "mmap:")
+opens that kind of device instead of a plain UNIX file.
 */
 int openDisk(char *filename, int nBytes) {
-    int file;
-    int adjusted_nBytes = (nBytes / BLOCKSIZE) * BLOCKSIZE;
-    char buff[adjusted_nBytes];
-    int i;
+    char *name;
+    const diskBackend *backend = find_backend(filename, &name);
+    void *state;
+    int nBlocks;
 
-    if ((nBytes == 0) && (access(filename, F_OK) != -1)) {
-        file = open(filename, O_RDWR);
-        if (file < 0){
-            return TFS_DISK_NOT_FOUND;
+    int ret = backend->open(name, nBytes, &state, &nBlocks);
+    if (ret < 0) {
+        return ret;
+    }
+
+    int disk;
+    for (disk = 0; disk < num_open_disks; disk++) {
+        if (!open_disks[disk].in_use) {
+            break;
         }
-        return file;
-    } else if (nBytes < BLOCKSIZE) {
-        return TFS_ERROR;
-    } else if ((file = open(filename, O_RDWR | O_CREAT | O_TRUNC, S_IWGRP | S_IRGRP | S_IWUSR | S_IRUSR)) == -1) {
-        return TFS_ERROR;
     }
-    // designating first "adjusted_nBytes" of space for the emulated disk
-    for (i = 0; i < adjusted_nBytes; i++) {
-        buff[i] = 0;
+    if (disk == MAX_OPEN_DISKS) {
+        backend->close(state);
+        return TFS_MEMORY_ERROR;
     }
-    if (write(file, buff, adjusted_nBytes) < 0) {
-        return TFS_ERROR;
+    if (disk == num_open_disks) {
+        num_open_disks++;
     }
-    return file;
+    open_disks[disk].backend = backend;
+    open_disks[disk].state = state;
+    open_disks[disk].nBlocks = nBlocks;
+    open_disks[disk].in_use = 1;
+    return disk;
 }
 
 int closeDisk(int disk) {
-    return close(disk);
+    openDiskEntry *entry = get_disk(disk);
+    if (entry == NULL) {
+        return TFS_FILE_NOT_OPEN;
+    }
+    entry->in_use = 0;
+    return entry->backend->close(entry->state);
 }
 
 /*
@@ -60,23 +140,15 @@ opened) or any other failures. You must define your own error code
 system.
 */
 int readBlock(int disk, int bNum, void *block) {
-    if (disk < 0) {
+    openDiskEntry *entry = get_disk(disk);
+    if (entry == NULL) {
         return TFS_FILE_NOT_OPEN;
     }
 
     if (bNum < 0) {
         return TFS_INVALID_BLOCK;
     }
-    lseek(disk, 0, SEEK_SET);
-    if (lseek(disk, bNum * BLOCKSIZE, SEEK_SET) == -1) {
-        return TFS_INVALID_SEEK;
-    }
-
-    if (read(disk, block, BLOCKSIZE) != BLOCKSIZE) {
-        return TFS_READ_ERROR;
-    }
-    //printf("in read block, block contains: %s\n", block+4);
-    return TFS_SUCCESS;
+    return entry->backend->read(entry->state, bNum, block);
 }
 
 /*
@@ -89,20 +161,717 @@ is not available (i.e. hasn’t been opened) or any other failures. You
 must define your own error code system.
 */
 int writeBlock(int disk, int bNum, void *block) {
-    if (disk < 0) {
+    openDiskEntry *entry = get_disk(disk);
+    if (entry == NULL) {
         return TFS_FILE_NOT_OPEN;
     }
 
     if (bNum < 0) {
         return TFS_INVALID_BLOCK;
     }
-    lseek(disk, 0, SEEK_SET);
-    if (lseek(disk, bNum * BLOCKSIZE, SEEK_SET) == -1) {
-        return TFS_INVALID_SEEK;
+    return entry->backend->write(entry->state, bNum, block);
+}
+
+/*
+ Writes 'count' blocks stored back to back in 'blocks' to bNum, bNum + 1,
+ ... Backends with a writeRun operation do it in one transfer; the others
+ get one write per block. Returns 0 on success or the first error.
+*/
+int writeBlocks(int disk, int bNum, int count, void *blocks) {
+    openDiskEntry *entry = get_disk(disk);
+    if (entry == NULL) {
+        return TFS_FILE_NOT_OPEN;
+    }
+
+    if (bNum < 0 || count < 0) {
+        return TFS_INVALID_BLOCK;
+    }
+    if (entry->backend->writeRun != NULL) {
+        return entry->backend->writeRun(entry->state, bNum, count, blocks);
+    }
+    int i;
+    for (i = 0; i < count; i++) {
+        int ret = entry->backend->write(entry->state, bNum + i, (char *)blocks + (size_t)i * BLOCKSIZE);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return TFS_SUCCESS;
+}
+
+/*
+ Returns the number of blocks on an open disk
+*/
+int diskBlocks(int disk) {
+    openDiskEntry *entry = get_disk(disk);
+    if (entry == NULL) {
+        return TFS_FILE_NOT_OPEN;
+    }
+    return entry->nBlocks;
+}
+
+/*
+ Grows or shrinks an open disk to nBytes (rounded down to whole blocks).
+ Blocks inside both sizes keep their contents; new blocks read as zeros.
+ Fails with TFS_ERROR on backends that can't be resized.
+*/
+int resizeDisk(int disk, int nBytes) {
+    openDiskEntry *entry = get_disk(disk);
+    if (entry == NULL) {
+        return TFS_FILE_NOT_OPEN;
+    }
+    if (nBytes < BLOCKSIZE || entry->backend->resize == NULL) {
+        return TFS_ERROR;
+    }
+    int ret = entry->backend->resize(entry->state, nBytes / BLOCKSIZE);
+    if (ret == TFS_SUCCESS) {
+        entry->nBlocks = nBytes / BLOCKSIZE;
+    }
+    return ret;
+}
+
+/*
+ Returns how many blocks at the start of an open disk are on its fast
+ device, or 0 if the disk isn't made of two tiers
+*/
+int diskFastBlocks(int disk) {
+    openDiskEntry *entry = get_disk(disk);
+    if (entry == NULL) {
+        return TFS_FILE_NOT_OPEN;
+    }
+    if (entry->backend->fastBlocks == NULL) {
+        return 0;
+    }
+    return entry->backend->fastBlocks(entry->state);
+}
+
+/*
+ Removes a disk's storage (the UNIX file, or a RAM disk's memory). The
+ disk must not be open.
+*/
+int unlinkDisk(char *filename) {
+    char *name;
+    const diskBackend *backend = find_backend(filename, &name);
+    if (backend->unlink == NULL) {
+        return TFS_ERROR;
     }
+    return backend->unlink(name);
+}
+
+/*
+ * Opens or creates the UNIX file behind a file or mmap disk and sizes it.
+ * Returns the file descriptor.
+ */
+static int open_unix_file(char *name, int nBytes, int *nBlocks) {
+    int file;
+    int adjusted_nBytes = (nBytes / BLOCKSIZE) * BLOCKSIZE;
+    struct stat st;
 
-    if (write(disk, block, BLOCKSIZE) != BLOCKSIZE) {
+    if ((nBytes == 0) && (access(name, F_OK) != -1)) {
+        file = open(name, O_RDWR);
+        if (file < 0 || fstat(file, &st) < 0) {
+            if (file >= 0) {
+                close(file);
+            }
+            return TFS_DISK_NOT_FOUND;
+        }
+        *nBlocks = st.st_size / BLOCKSIZE;
+        return file;
+    } else if (nBytes < BLOCKSIZE) {
+        return TFS_ERROR;
+    } else if ((file = open(name, O_RDWR | O_CREAT | O_TRUNC, S_IWGRP | S_IRGRP | S_IWUSR | S_IRUSR)) == -1) {
+        return TFS_ERROR;
+    }
+    // designating first "adjusted_nBytes" of space for the emulated disk
+    // (a truncated file extended with ftruncate reads back as zeros)
+    if (ftruncate(file, adjusted_nBytes) < 0) {
+        close(file);
+        return TFS_ERROR;
+    }
+    *nBlocks = adjusted_nBytes / BLOCKSIZE;
+    return file;
+}
+
+static int unlink_unix_file(char *name) {
+    return unlink(name) < 0 ? TFS_DISK_NOT_FOUND : TFS_SUCCESS;
+}
+
+/* File backend: every block access is one pread/pwrite */
+
+static int file_open(char *name, int nBytes, void **state, int *nBlocks) {
+    int file = open_unix_file(name, nBytes, nBlocks);
+    if (file < 0) {
+        return file;
+    }
+    *state = (void *)(long)file;
+    return TFS_SUCCESS;
+}
+
+static int file_close(void *state) {
+    return close((int)(long)state);
+}
+
+static int file_read(void *state, int bNum, void *block) {
+    if (pread((int)(long)state, block, BLOCKSIZE, (off_t)bNum * BLOCKSIZE) != BLOCKSIZE) {
+        return TFS_READ_ERROR;
+    }
+    return TFS_SUCCESS;
+}
+
+static int file_write(void *state, int bNum, void *block) {
+    if (pwrite((int)(long)state, block, BLOCKSIZE, (off_t)bNum * BLOCKSIZE) != BLOCKSIZE) {
         return TFS_WRITE_ERROR;
     }
     return TFS_SUCCESS;
 }
+
+static int file_write_run(void *state, int bNum, int count, void *blocks) {
+    size_t len = (size_t)count * BLOCKSIZE;
+    if (pwrite((int)(long)state, blocks, len, (off_t)bNum * BLOCKSIZE) != (ssize_t)len) {
+        return TFS_WRITE_ERROR;
+    }
+    return TFS_SUCCESS;
+}
+
+static int file_resize(void *state, int nBlocks) {
+    return ftruncate((int)(long)state, (off_t)nBlocks * BLOCKSIZE) < 0 ? TFS_ERROR : TFS_SUCCESS;
+}
+
+const diskBackend fileDiskBackend = {
+    "", file_open, file_close, file_read, file_write, unlink_unix_file, file_write_run, file_resize, NULL
+};
+
+/* mmap backend: the whole file is mapped shared, so block accesses are
+   memcpy and the kernel writes dirty pages back. Resizing may move the
+   mapping, so block accesses hold 'lock' shared and resizing holds it
+   exclusively. */
+
+typedef struct {
+    pthread_rwlock_t lock;
+    int file;
+    char *data;
+    int nBlocks;
+} mmapDisk;
+
+static int mmap_open(char *name, int nBytes, void **state, int *nBlocks) {
+    mmapDisk *disk = malloc(sizeof(mmapDisk));
+    if (disk == NULL) {
+        return TFS_MEMORY_ERROR;
+    }
+    disk->file = open_unix_file(name, nBytes, nBlocks);
+    if (disk->file < 0) {
+        int ret = disk->file;
+        free(disk);
+        return ret;
+    }
+    if (*nBlocks == 0) {
+        close(disk->file);
+        free(disk);
+        return TFS_ERROR;
+    }
+    disk->nBlocks = *nBlocks;
+    disk->data = mmap(NULL, (size_t)disk->nBlocks * BLOCKSIZE, PROT_READ | PROT_WRITE, MAP_SHARED, disk->file, 0);
+    if (disk->data == MAP_FAILED) {
+        close(disk->file);
+        free(disk);
+        return TFS_ERROR;
+    }
+    pthread_rwlock_init(&disk->lock, NULL);
+    *state = disk;
+    return TFS_SUCCESS;
+}
+
+static int mmap_close(void *state) {
+    mmapDisk *disk = state;
+    munmap(disk->data, (size_t)disk->nBlocks * BLOCKSIZE);
+    int ret = close(disk->file);
+    pthread_rwlock_destroy(&disk->lock);
+    free(disk);
+    return ret;
+}
+
+static int mmap_read(void *state, int bNum, void *block) {
+    mmapDisk *disk = state;
+    int ret = TFS_SUCCESS;
+    pthread_rwlock_rdlock(&disk->lock);
+    if (bNum >= disk->nBlocks) {
+        ret = TFS_INVALID_BLOCK;
+    } else {
+        memcpy(block, disk->data + (size_t)bNum * BLOCKSIZE, BLOCKSIZE);
+    }
+    pthread_rwlock_unlock(&disk->lock);
+    return ret;
+}
+
+static int mmap_write_run(void *state, int bNum, int count, void *blocks) {
+    mmapDisk *disk = state;
+    int ret = TFS_SUCCESS;
+    pthread_rwlock_rdlock(&disk->lock);
+    if (bNum + count > disk->nBlocks) {
+        ret = TFS_INVALID_BLOCK;
+    } else {
+        memcpy(disk->data + (size_t)bNum * BLOCKSIZE, blocks, (size_t)count * BLOCKSIZE);
+    }
+    pthread_rwlock_unlock(&disk->lock);
+    return ret;
+}
+
+static int mmap_write(void *state, int bNum, void *block) {
+    return mmap_write_run(state, bNum, 1, block);
+}
+
+static int mmap_resize(void *state, int nBlocks) {
+    mmapDisk *disk = state;
+    int ret = TFS_SUCCESS;
+    pthread_rwlock_wrlock(&disk->lock);
+    char *data = MAP_FAILED;
+    if (ftruncate(disk->file, (off_t)nBlocks * BLOCKSIZE) == 0) {
+        data = mmap(NULL, (size_t)nBlocks * BLOCKSIZE, PROT_READ | PROT_WRITE, MAP_SHARED, disk->file, 0);
+    }
+    if (data == MAP_FAILED) {
+        ret = TFS_ERROR;
+    } else {
+        // Both mappings share the file's pages, so nothing needs copying
+        munmap(disk->data, (size_t)disk->nBlocks * BLOCKSIZE);
+        disk->data = data;
+        disk->nBlocks = nBlocks;
+    }
+    pthread_rwlock_unlock(&disk->lock);
+    return ret;
+}
+
+const diskBackend mmapDiskBackend = {
+    "mmap:", mmap_open, mmap_close, mmap_read, mmap_write, unlink_unix_file, mmap_write_run, mmap_resize, NULL
+};
+
+/* Direct I/O backend: the file is opened with O_DIRECT so the page cache
+   is bypassed and TinyFS's block cache is the only copy in memory. Direct
+   I/O has to move whole, aligned sectors, and blocks are smaller than a
+   sector, so the backend keeps the one sector it touched last in an
+   aligned buffer: a block read loads its sector unless it is already
+   there, and a block write patches the sector and writes all of it. The
+   buffer is shared, so reads and writes take turns on it. */
+
+typedef struct {
+    pthread_mutex_t lock;
+    int file;
+    char *sector;       /* DIRECT_SECTOR_SIZE bytes, aligned to it */
+    long sector_num;    /* sector held in 'sector', -1 = none */
+    int nBlocks;
+} directDisk;
+
+static int direct_close(void *state);
+
+static int direct_open(char *name, int nBytes, void **state, int *nBlocks) {
+#ifdef O_DIRECT
+    directDisk *disk = malloc(sizeof(directDisk));
+    if (disk == NULL) {
+        return TFS_MEMORY_ERROR;
+    }
+    disk->sector_num = -1;
+    disk->sector = NULL;
+    disk->file = open_unix_file(name, nBytes, nBlocks);
+    if (disk->file < 0) {
+        int ret = disk->file;
+        free(disk);
+        return ret;
+    }
+    pthread_mutex_init(&disk->lock, NULL);
+    disk->nBlocks = *nBlocks;
+
+    // The file must end on a sector boundary for the last sector to be
+    // read and written whole; blocks past nBlocks are never used
+    off_t size = (off_t)disk->nBlocks * BLOCKSIZE;
+    off_t rounded = (size + DIRECT_SECTOR_SIZE - 1) / DIRECT_SECTOR_SIZE * DIRECT_SECTOR_SIZE;
+    int flags = fcntl(disk->file, F_GETFL);
+    if ((rounded != size && ftruncate(disk->file, rounded) < 0) ||
+        flags < 0 || fcntl(disk->file, F_SETFL, flags | O_DIRECT) < 0 ||
+        posix_memalign((void **)&disk->sector, DIRECT_SECTOR_SIZE, DIRECT_SECTOR_SIZE) != 0) {
+        direct_close(disk);
+        return TFS_ERROR; // e.g. a file system without direct I/O support
+    }
+    *state = disk;
+    return TFS_SUCCESS;
+#else
+    return TFS_ERROR;
+#endif
+}
+
+static int direct_close(void *state) {
+    directDisk *disk = state;
+    int ret = close(disk->file);
+    pthread_mutex_destroy(&disk->lock);
+    free(disk->sector);
+    free(disk);
+    return ret;
+}
+
+static int direct_load_sector(directDisk *disk, int bNum) {
+    long sector_num = (long)bNum * BLOCKSIZE / DIRECT_SECTOR_SIZE;
+    if (sector_num == disk->sector_num) {
+        return TFS_SUCCESS;
+    }
+    disk->sector_num = -1;
+    if (pread(disk->file, disk->sector, DIRECT_SECTOR_SIZE, (off_t)sector_num * DIRECT_SECTOR_SIZE) != DIRECT_SECTOR_SIZE) {
+        return TFS_READ_ERROR;
+    }
+    disk->sector_num = sector_num;
+    return TFS_SUCCESS;
+}
+
+static int direct_read(void *state, int bNum, void *block) {
+    directDisk *disk = state;
+    if (bNum >= disk->nBlocks) {
+        return TFS_INVALID_BLOCK;
+    }
+    int ret = TFS_SUCCESS;
+    pthread_mutex_lock(&disk->lock);
+    if (direct_load_sector(disk, bNum) < 0) {
+        ret = TFS_READ_ERROR;
+    } else {
+        memcpy(block, disk->sector + (size_t)bNum * BLOCKSIZE % DIRECT_SECTOR_SIZE, BLOCKSIZE);
+    }
+    pthread_mutex_unlock(&disk->lock);
+    return ret;
+}
+
+static int direct_write(void *state, int bNum, void *block) {
+    directDisk *disk = state;
+    if (bNum >= disk->nBlocks) {
+        return TFS_INVALID_BLOCK;
+    }
+    int ret = TFS_SUCCESS;
+    pthread_mutex_lock(&disk->lock);
+    if (direct_load_sector(disk, bNum) < 0) {
+        ret = TFS_WRITE_ERROR;
+    } else {
+        memcpy(disk->sector + (size_t)bNum * BLOCKSIZE % DIRECT_SECTOR_SIZE, block, BLOCKSIZE);
+        if (pwrite(disk->file, disk->sector, DIRECT_SECTOR_SIZE, (off_t)disk->sector_num * DIRECT_SECTOR_SIZE) != DIRECT_SECTOR_SIZE) {
+            disk->sector_num = -1; // what reached the disk is unknown
+            ret = TFS_WRITE_ERROR;
+        }
+    }
+    pthread_mutex_unlock(&disk->lock);
+    return ret;
+}
+
+/*
+ * Writes a run of blocks one sector at a time. Sectors the run covers
+ * completely are not read first, so a long run costs one sector write per
+ * DIRECT_SECTOR_SIZE / BLOCKSIZE blocks.
+ */
+static int direct_write_run(void *state, int bNum, int count, void *blocks) {
+    directDisk *disk = state;
+    if (bNum + count > disk->nBlocks) {
+        return TFS_INVALID_BLOCK;
+    }
+    int per_sector = DIRECT_SECTOR_SIZE / BLOCKSIZE;
+    int ret = TFS_SUCCESS;
+    pthread_mutex_lock(&disk->lock);
+    while (count > 0 && ret == TFS_SUCCESS) {
+        int first = bNum % per_sector;
+        int n = per_sector - first < count ? per_sector - first : count;
+        if (n < per_sector && direct_load_sector(disk, bNum) < 0) {
+            ret = TFS_WRITE_ERROR;
+            break;
+        }
+        disk->sector_num = (long)bNum / per_sector;
+        memcpy(disk->sector + (size_t)first * BLOCKSIZE, blocks, (size_t)n * BLOCKSIZE);
+        if (pwrite(disk->file, disk->sector, DIRECT_SECTOR_SIZE, (off_t)disk->sector_num * DIRECT_SECTOR_SIZE) != DIRECT_SECTOR_SIZE) {
+            disk->sector_num = -1;
+            ret = TFS_WRITE_ERROR;
+        }
+        bNum += n;
+        count -= n;
+        blocks = (char *)blocks + (size_t)n * BLOCKSIZE;
+    }
+    pthread_mutex_unlock(&disk->lock);
+    return ret;
+}
+
+static int direct_resize(void *state, int nBlocks) {
+    directDisk *disk = state;
+    off_t size = (off_t)nBlocks * BLOCKSIZE;
+    off_t rounded = (size + DIRECT_SECTOR_SIZE - 1) / DIRECT_SECTOR_SIZE * DIRECT_SECTOR_SIZE;
+    int ret = TFS_SUCCESS;
+    pthread_mutex_lock(&disk->lock);
+    if (ftruncate(disk->file, rounded) < 0) {
+        ret = TFS_ERROR;
+    } else {
+        disk->sector_num = -1; // a shrunk sector may have lost blocks
+        disk->nBlocks = nBlocks;
+    }
+    pthread_mutex_unlock(&disk->lock);
+    return ret;
+}
+
+const diskBackend directDiskBackend = {
+    "direct:", direct_open, direct_close, direct_read, direct_write, unlink_unix_file, direct_write_run,
+    direct_resize, NULL
+};
+
+/* RAM backend: named disks that live in memory until unlinkDisk, so a
+   file system made with tfs_mkfs("ram:x", ...) can then be mounted.
+   Resizing moves the data, so block accesses hold 'lock' shared and
+   resizing holds it exclusively. */
+
+typedef struct ramDisk {
+    pthread_rwlock_t lock;
+    char *name;
+    char *data;
+    int nBlocks;
+    int opens;
+    struct ramDisk *next;
+} ramDisk;
+
+static ramDisk *ram_disks = NULL;
+
+static ramDisk *find_ram_disk(char *name) {
+    ramDisk *disk;
+    for (disk = ram_disks; disk != NULL; disk = disk->next) {
+        if (strcmp(disk->name, name) == 0) {
+            return disk;
+        }
+    }
+    return NULL;
+}
+
+static int ram_open(char *name, int nBytes, void **state, int *nBlocks) {
+    ramDisk *disk = find_ram_disk(name);
+
+    if (nBytes == 0) {
+        if (disk == NULL) {
+            return TFS_DISK_NOT_FOUND;
+        }
+    } else if (nBytes < BLOCKSIZE) {
+        return TFS_ERROR;
+    } else {
+        if (disk == NULL) {
+            disk = calloc(1, sizeof(ramDisk));
+            if (disk == NULL || (disk->name = strdup(name)) == NULL) {
+                free(disk);
+                return TFS_MEMORY_ERROR;
+            }
+            pthread_rwlock_init(&disk->lock, NULL);
+            disk->next = ram_disks;
+            ram_disks = disk;
+        } else if (disk->opens > 0) {
+            return TFS_DISK_ALREADY_MOUNTED;
+        }
+        // Recreating a disk starts it over from zeros at the new size
+        char *data = calloc(nBytes / BLOCKSIZE, BLOCKSIZE);
+        if (data == NULL) {
+            return TFS_MEMORY_ERROR;
+        }
+        free(disk->data);
+        disk->data = data;
+        disk->nBlocks = nBytes / BLOCKSIZE;
+    }
+
+    disk->opens++;
+    *state = disk;
+    *nBlocks = disk->nBlocks;
+    return TFS_SUCCESS;
+}
+
+static int ram_close(void *state) {
+    ramDisk *disk = state;
+    disk->opens--;
+    return TFS_SUCCESS;
+}
+
+static int ram_read(void *state, int bNum, void *block) {
+    ramDisk *disk = state;
+    int ret = TFS_SUCCESS;
+    pthread_rwlock_rdlock(&disk->lock);
+    if (bNum >= disk->nBlocks) {
+        ret = TFS_INVALID_BLOCK;
+    } else {
+        memcpy(block, disk->data + (size_t)bNum * BLOCKSIZE, BLOCKSIZE);
+    }
+    pthread_rwlock_unlock(&disk->lock);
+    return ret;
+}
+
+static int ram_write_run(void *state, int bNum, int count, void *blocks) {
+    ramDisk *disk = state;
+    int ret = TFS_SUCCESS;
+    pthread_rwlock_rdlock(&disk->lock);
+    if (bNum + count > disk->nBlocks) {
+        ret = TFS_INVALID_BLOCK;
+    } else {
+        memcpy(disk->data + (size_t)bNum * BLOCKSIZE, blocks, (size_t)count * BLOCKSIZE);
+    }
+    pthread_rwlock_unlock(&disk->lock);
+    return ret;
+}
+
+static int ram_write(void *state, int bNum, void *block) {
+    return ram_write_run(state, bNum, 1, block);
+}
+
+static int ram_resize(void *state, int nBlocks) {
+    ramDisk *disk = state;
+    int ret = TFS_SUCCESS;
+    pthread_rwlock_wrlock(&disk->lock);
+    char *data = realloc(disk->data, (size_t)nBlocks * BLOCKSIZE);
+    if (data == NULL) {
+        ret = TFS_MEMORY_ERROR;
+    } else {
+        if (nBlocks > disk->nBlocks) {
+            memset(data + (size_t)disk->nBlocks * BLOCKSIZE, 0, (size_t)(nBlocks - disk->nBlocks) * BLOCKSIZE);
+        }
+        disk->data = data;
+        disk->nBlocks = nBlocks;
+    }
+    pthread_rwlock_unlock(&disk->lock);
+    return ret;
+}
+
+static int ram_unlink(char *name) {
+    ramDisk **link;
+    for (link = &ram_disks; *link != NULL; link = &(*link)->next) {
+        ramDisk *disk = *link;
+        if (strcmp(disk->name, name) == 0) {
+            if (disk->opens > 0) {
+                return TFS_DISK_ALREADY_MOUNTED;
+            }
+            *link = disk->next;
+            pthread_rwlock_destroy(&disk->lock);
+            free(disk->data);
+            free(disk->name);
+            free(disk);
+            return TFS_SUCCESS;
+        }
+    }
+    return TFS_DISK_NOT_FOUND;
+}
+
+const diskBackend ramDiskBackend = {
+    "ram:", ram_open, ram_close, ram_read, ram_write, ram_unlink, ram_write_run, ram_resize, NULL
+};
+
+/* Tier backend: "tier:<fast>+<slow>" joins two disks of any backend end to
+   end (split at the first '+'), so block numbers below the fast disk's
+   size go to it and the rest to the slow disk. The fast disk is never
+   created or resized here: it has to exist already, and its size is the
+   boundary. Opening with nBytes > 0 makes the slow disk hold the rest of
+   nBytes, and resizing resizes the slow disk. */
+
+typedef struct {
+    int fast;
+    int slow;
+    int fastBlocks;
+} tierDisk;
+
+static int tier_open(char *name, int nBytes, void **state, int *nBlocks) {
+    char *split = strchr(name, '+');
+    if (split == NULL || split == name || split[1] == '\0') {
+        return TFS_DISK_NOT_FOUND;
+    }
+    char *fastName = strndup(name, split - name);
+    tierDisk *disk = malloc(sizeof(tierDisk));
+    if (fastName == NULL || disk == NULL) {
+        free(fastName);
+        free(disk);
+        return TFS_MEMORY_ERROR;
+    }
+
+    int ret = TFS_SUCCESS;
+    disk->slow = -1;
+    disk->fast = openDisk(fastName, 0);
+    free(fastName);
+    if (disk->fast < 0) {
+        ret = disk->fast;
+    } else {
+        disk->fastBlocks = diskBlocks(disk->fast);
+        if (nBytes > 0 && nBytes / BLOCKSIZE <= disk->fastBlocks) {
+            ret = TFS_ERROR; // nothing left for the slow disk
+        } else {
+            disk->slow = openDisk(split + 1, nBytes > 0 ? nBytes - disk->fastBlocks * BLOCKSIZE : 0);
+            ret = disk->slow < 0 ? disk->slow : TFS_SUCCESS;
+        }
+    }
+    if (ret < 0) {
+        if (disk->fast >= 0) {
+            closeDisk(disk->fast);
+        }
+        free(disk);
+        return ret;
+    }
+    *nBlocks = disk->fastBlocks + diskBlocks(disk->slow);
+    *state = disk;
+    return TFS_SUCCESS;
+}
+
+static int tier_close(void *state) {
+    tierDisk *disk = state;
+    int ret = closeDisk(disk->fast);
+    int slow = closeDisk(disk->slow);
+    free(disk);
+    return ret < 0 ? ret : slow;
+}
+
+static int tier_read(void *state, int bNum, void *block) {
+    tierDisk *disk = state;
+    if (bNum < disk->fastBlocks) {
+        return readBlock(disk->fast, bNum, block);
+    }
+    return readBlock(disk->slow, bNum - disk->fastBlocks, block);
+}
+
+static int tier_write(void *state, int bNum, void *block) {
+    tierDisk *disk = state;
+    if (bNum < disk->fastBlocks) {
+        return writeBlock(disk->fast, bNum, block);
+    }
+    return writeBlock(disk->slow, bNum - disk->fastBlocks, block);
+}
+
+static int tier_write_run(void *state, int bNum, int count, void *blocks) {
+    tierDisk *disk = state;
+    if (bNum < disk->fastBlocks) {
+        int n = disk->fastBlocks - bNum < count ? disk->fastBlocks - bNum : count;
+        int ret = writeBlocks(disk->fast, bNum, n, blocks);
+        if (ret < 0 || n == count) {
+            return ret;
+        }
+        bNum += n;
+        count -= n;
+        blocks = (char *)blocks + (size_t)n * BLOCKSIZE;
+    }
+    return writeBlocks(disk->slow, bNum - disk->fastBlocks, count, blocks);
+}
+
+static int tier_unlink(char *name) {
+    char *split = strchr(name, '+');
+    if (split == NULL) {
+        return TFS_DISK_NOT_FOUND;
+    }
+    char *fastName = strndup(name, split - name);
+    if (fastName == NULL) {
+        return TFS_MEMORY_ERROR;
+    }
+    int ret = unlinkDisk(fastName);
+    int slow = unlinkDisk(split + 1);
+    free(fastName);
+    return ret < 0 ? ret : slow;
+}
+
+static int tier_resize(void *state, int nBlocks) {
+    tierDisk *disk = state;
+    if (nBlocks <= disk->fastBlocks) {
+        return TFS_ERROR;
+    }
+    return resizeDisk(disk->slow, (nBlocks - disk->fastBlocks) * BLOCKSIZE);
+}
+
+static int tier_fast_blocks(void *state) {
+    tierDisk *disk = state;
+    return disk->fastBlocks;
+}
+
+const diskBackend tierDiskBackend = {
+    "tier:", tier_open, tier_close, tier_read, tier_write, tier_unlink, tier_write_run, tier_resize,
+    tier_fast_blocks
+};
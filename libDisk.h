@@ -8,9 +8,54 @@
 #include <fcntl.h>
 #include <stdlib.h>
 
+/* A block device backend. openDisk picks the backend whose prefix starts
+   the filename ("ram:scratch", "mmap:disk.dsk"); names without a known
+   prefix use the UNIX file backend. The prefix is stripped before the
+   backend sees the name, so a layering backend can open the rest of the
+   name with openDisk and stack on top of it. */
+typedef struct {
+    const char *prefix;
+    /* Opens or creates the device as openDisk describes; stores the
+       backend's private state in *state and the size in *nBlocks */
+    int (*open)(char *name, int nBytes, void **state, int *nBlocks);
+    int (*close)(void *state);
+    int (*read)(void *state, int bNum, void *block);
+    int (*write)(void *state, int bNum, void *block);
+    /* Removes the device's storage; may be NULL */
+    int (*unlink)(char *name);
+    /* Writes 'count' consecutive blocks starting at bNum in one go; may
+       be NULL, then writeBlocks writes them one at a time */
+    int (*writeRun)(void *state, int bNum, int count, void *blocks);
+    /* Changes the device to nBlocks blocks, keeping the blocks both sizes
+       have; may be NULL if the device can't be resized */
+    int (*resize)(void *state, int nBlocks);
+    /* Number of blocks at the start of the device that live on faster
+       storage, for devices made of two tiers; may be NULL */
+    int (*fastBlocks)(void *state);
+} diskBackend;
+
+extern const diskBackend fileDiskBackend;  /* plain UNIX file, read()/write() */
+extern const diskBackend mmapDiskBackend;  /* "mmap:" UNIX file mapped into memory */
+extern const diskBackend ramDiskBackend;   /* "ram:" named in-memory disk */
+extern const diskBackend directDiskBackend; /* "direct:" UNIX file with O_DIRECT, bypassing the page cache */
+extern const diskBackend tierDiskBackend;  /* "tier:<fast>+<slow>" two disks joined end to end */
+
+/* Unit of I/O for the direct backend: a multiple of any common device
+   sector size, so every transfer is aligned in offset, length and memory */
+#define DIRECT_SECTOR_SIZE 4096
+
+/* readBlock and writeBlock may be called from several threads at once on
+   the built-in backends; openDisk, closeDisk and unlinkDisk may not run
+   concurrently with each other */
 int openDisk(char *filename, int nBytes);
 int closeDisk(int disk);
 int readBlock(int disk, int bNum, void *block);
 int writeBlock(int disk, int bNum, void *block);
+int writeBlocks(int disk, int bNum, int count, void *blocks);
+int diskBlocks(int disk);
+int resizeDisk(int disk, int nBytes);
+int diskFastBlocks(int disk);
+int unlinkDisk(char *filename);
+int registerDiskBackend(const diskBackend *backend);
 
 #endif
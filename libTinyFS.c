@@ -1,628 +1,6981 @@
 #include "libTinyFS.h"
+#include "crc32c.h"
+#include "lzCompress.h"
+#include "memPool.h"
+#include <pthread.h>
+#include <sched.h>
+#include <limits.h>
 
 static fileMetadata *file_md = NULL;
 static int num_fd = 0;
 static int mounted_disk = -1;
+static int root_inode = 0;
+
+/* A directory loaded this mount */
+typedef struct {
+    fileMetadata *meta;
+    long bytes;     /* in-core size when last counted into dir_bytes */
+    int referenced; /* clock bit */
+} cachedDir;
+
+static cachedDir *dir_cache = NULL;
+static int num_dirs_cached = 0;
+static int dir_hand = 0;
+static long dir_bytes = 0;
+
+static int checksums_enabled = 1;
+static int checksums_required = 0; /* the superblock says every block has one */
+static tfsChecksumStats checksum_stats;
+static tfsStats stats;
+static poolStats pool_base; /* pool counters at the last tfs_resetStats */
+static __thread int current_op = -1; /* TFS_OP_* that this thread's disk I/O is charged to */
+
+/* In-core reference count of every data block, indexed by block number */
+typedef struct {
+    int refs;
+    uint32_t fingerprint; /* content fingerprint, valid when 'indexed' is set */
+    int indexed;          /* block is listed in the dedup index */
+    int attrs;            /* an attribute block rather than file data */
+} blockRef;
+
+static blockRef *block_refs = NULL;
+static int refs_len = 0;
+
+/* Dedup index: open addressing table from content fingerprint to block */
+typedef struct {
+    uint32_t fingerprint;
+    int block; /* 0 = empty slot, -1 = deleted slot */
+} dedupEntry;
+
+static int dedup_enabled = 0;
+static dedupEntry *dedup_index = NULL;
+static int dedup_cap = 0;
+static int dedup_used = 0; /* live plus deleted slots */
+static tfsDedupStats dedup_stats;
+
+/* Point-in-time copies of every file in the tree. Each holds its own copy
+   of every file's block map and one reference to each block in it. */
+typedef struct {
+    char path[TFS_MAX_PATH];
+    fileMetadata meta;
+} snapshotFile;
+
+typedef struct {
+    char name[TFS_MAX_NAME + 1];
+    int id;
+    time_t creation_t;
+    snapshotFile *files;
+    int num_files;
+} snapshot;
+
+/* Bytes held in the append buffers of all open files */
+static int append_buffered = 0;
+
+/* In-core index of the free list, rebuilt at mount. The list on disk stays
+   a singly linked chain from the superblock; the back links and per-group
+   counts let the allocator take any free block, not just the head. */
+static int *free_next = NULL;  /* next block in the chain, 0 = end */
+static int *free_prev = NULL;  /* previous block in the chain, 0 = superblock */
+static char *free_map = NULL;  /* set for blocks on the free list */
+static int *group_free = NULL; /* free blocks in each allocation group */
+static int free_head = 0;
+static int disk_blocks = 0;
+static int num_groups = 0;
+
+/* A disk made of two tiers (diskFastBlocks) has its fast device first:
+   blocks below fast_blocks are on it. 0 on a single device. */
+static int fast_blocks = 0;
+static int fast_free = 0; /* free blocks on the fast device */
+static unsigned long fast_reads = 0; /* disk block reads served by each device */
+static unsigned long slow_reads = 0;
+static unsigned long blocks_promoted = 0; /* blocks tfs_migrate moved to each device */
+static unsigned long blocks_demoted = 0;
+
+static snapshot *snapshots = NULL;
+static int num_snapshots = 0;
+static int next_snapshot_id = 1;
+
+/* Progress of an incremental pass over all files (tfs_defrag,
+   tfs_migrate), kept between calls */
+typedef struct {
+    int *files;     /* file inodes, collected when a pass starts */
+    int num_files;
+    int next;       /* file being worked on */
+    int index;      /* its next logical block to move */
+    int dest;       /* where that block goes, 0 = not started */
+    int moved;      /* blocks moved so far in this pass */
+} filePass;
+
+static filePass defrag_pass;
+static filePass migrate_pass;
+
+/* Every public call runs under fs_mutex, except the fast paths of
+   tfs_pread, tfs_readByte and tfs_seek. Those never take the lock: they
+   work from an immutable fileVersion of the file's size and block map,
+   which writers publish when their call ends, and read the block cache
+   through its sequence counters. A replaced version (or descriptor table,
+   or a closed file's cursor) is retired and freed only once no reader
+   that could still hold it is inside a read: each reader announces the
+   global epoch when it starts, and anything retired before the oldest
+   announced epoch is unreachable. Blocks freed while readers exist wait
+   out the same grace period before they go back on the free list, so a
+   reader holding an old block map never sees a block reused. */
+static pthread_mutex_t fs_mutex = PTHREAD_MUTEX_INITIALIZER;
+static __thread int lock_depth = 0; /* nested public calls in this thread */
+
+/* Start of everything readers can hold; links the retire list */
+typedef struct rcuHeader {
+    struct rcuHeader *next;
+    unsigned long epoch; /* global epoch when it was retired */
+} rcuHeader;
+
+/* What a lock-free reader sees of an open file */
+typedef struct {
+    rcuHeader rcu;
+    int size;
+    int compressed; /* chunks need the file's chunk buffer: readers take the lock */
+    int buffered;   /* appended data is still in memory: readers take the lock */
+    int map_len;
+    int block_map[];
+} fileVersion;
+
+/* Per open file; the descriptor table entry readers find it through */
+struct fileCursor {
+    rcuHeader rcu;
+    fileVersion *version; /* NULL until published */
+    int offset;           /* the file pointer */
+    int stale;            /* metadata changed since 'version' was made */
+    time_t read_time;     /* last read through this descriptor, 0 if none */
+};
+typedef struct fileCursor fileCursor;
+
+/* Published copy of the descriptor table */
+typedef struct {
+    rcuHeader rcu;
+    int num_fd;
+    fileCursor *cursors[];
+} fdTable;
+
+/* A thread that has taken a fast path. Records are never freed; one left
+   by a finished thread is taken over by the next new reader. */
+typedef struct readerThread {
+    unsigned long epoch;          /* announced while inside a read, else 0 */
+    int in_use;
+    tfsStats stats;               /* counters for its lock-free calls */
+    tfsChecksumStats checksums;
+    struct readerThread *next;
+} readerThread;
+
+/* A block freed while readers existed, waiting for them */
+typedef struct {
+    int bNum;
+    unsigned long epoch;
+} deferredFree;
+
+static readerThread *readers = NULL;
+static __thread readerThread *this_reader = NULL;
+static pthread_key_t reader_key;
+static pthread_once_t reader_key_once = PTHREAD_ONCE_INIT;
+static unsigned long global_epoch = 1;
+static fdTable *fd_table = NULL;
+static int fd_table_stale = 0;
+static rcuHeader *retired = NULL; /* oldest first */
+static rcuHeader **retired_tail = &retired;
+static deferredFree *deferred = NULL;
+static int num_deferred = 0;
+static int deferred_cap = 0;
+
+/* Block cache: recently read blocks of the mounted disk, found through a
+   hash on the block number. Writes go through to disk and update the
+   cached copy. Entries pinned by a read view are never replaced; a write
+   to a pinned block detaches the entry instead, so the view keeps the
+   contents it pinned. Lock-free readers look entries up without the lock;
+   'seq' is odd while a writer changes an entry, so a reader that sees it
+   change discards what it copied.
+
+   Replacement is a simplified CLOCK-Pro. A block comes in cold, and the
+   cold hand evicts cold blocks that were not used again since they came
+   in; one that was turns hot. Hot blocks are left to the hot hand, which
+   only moves while more than three quarters of the cached blocks are hot
+   and demotes the ones not used since it last passed. A sequential scan
+   uses each block once, so it only ever replaces cold blocks. Metadata
+   blocks (inodes, block maps, directory buckets) come in hot, and so does
+   a block read again soon after the cold hand evicted it, which the ghost
+   table remembers. */
+typedef struct {
+    int bNum;       /* -1 = unused or detached */
+    unsigned seq;
+    int pins;
+    int referenced; /* used since a hand last passed */
+    int hot;
+    int next;       /* hash chain, -1 = end */
+    char *block;    /* BLOCKSIZE bytes, NULL until the entry is first used */
+} cacheEntry;
+
+/* Entries, hash heads and the ghost table, allocated together. The table
+   is replaced when the budget changes; readers may still be walking the
+   old one, so it goes through the retire list. */
+typedef struct {
+    rcuHeader rcu;
+    int slots;
+    int *heads;  /* bNum % slots -> first entry of the chain */
+    int *ghost;  /* bNum % slots -> block the cold hand evicted, -1 = none */
+    cacheEntry entries[];
+} cacheTable;
+
+/* Bytes of the table for each entry, on top of the block it holds */
+#define CACHE_SLOT_BYTES ((long)(sizeof(cacheEntry) + 2 * sizeof(int)))
+
+static cacheTable *cache = NULL;
+static int cache_hand = 0;     /* cold hand */
+static int cache_hot_hand = 0;
+static int cache_blocks = 0;   /* entries holding a block buffer */
+static int cache_hot = 0;      /* hot entries */
+static int cache_pinned = 0;   /* pins held by all read views */
+static unsigned long cache_writes = 0; /* blocks written to the mounted disk */
+static long cache_budget = TFS_CACHE_BUDGET;
+static tfsCacheUsage cache_counters; /* evictions and ghost hits this mount */
+static __thread int last_read_block = -1; /* block this thread read last */
+
+static int find_free_block(int goal, int run);
+static int find_meta_block(int goal);
+static int free_file_blocks(fileMetadata *meta);
+static int index_blocks_needed(int map_len);
+static int ref_count(int bNum);
+static int set_ref_count(int bNum, int refs);
+static int store_attr_block(char *block, int goal);
+static uint32_t block_fingerprint(char *block);
+static int dedup_insert(int bNum, uint32_t fingerprint);
+static int release_block(int bNum);
+static int flush_appends(fileMetadata *meta, int all);
+static void discard_appends(fileMetadata *meta);
+static void publish_versions(void);
+static void trim_caches(void);
+
+static long long elapsed_ns(struct timespec *start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) * 1000000000LL + (end.tv_nsec - start->tv_nsec);
+}
+
+static void record_latency(tfsOpStats *op, long long ns, int ret) {
+    int bucket = 0;
+    while (bucket < TFS_LATENCY_BUCKETS - 1 && (2LL << bucket) <= ns) {
+        bucket++;
+    }
+    op->calls++;
+    op->total_ns += ns;
+    if (ns > op->max_ns) {
+        op->max_ns = ns;
+    }
+    op->latency[bucket]++;
+    if (ret < 0) {
+        op->errors++;
+    }
+}
+
+/*
+ * Adds the counters in 'op' to 'sum'
+ */
+static void add_op_stats(tfsOpStats *sum, tfsOpStats *op) {
+    int i;
+    sum->calls += op->calls;
+    sum->errors += op->errors;
+    sum->total_ns += op->total_ns;
+    if (op->max_ns > sum->max_ns) {
+        sum->max_ns = op->max_ns;
+    }
+    sum->blocks_read += op->blocks_read;
+    sum->blocks_written += op->blocks_written;
+    for (i = 0; i < TFS_LATENCY_BUCKETS; i++) {
+        sum->latency[i] += op->latency[i];
+    }
+}
+
+static void count_call(tfsStats *counters, int op, long long ns, int ret) {
+    record_latency(&counters->ops[op], ns, ret);
+    if (ret >= 0) {
+        if (op == TFS_OP_READ_BYTE) {
+            counters->bytes_read++;
+        } else if (op == TFS_OP_PREAD || op == TFS_OP_READ_VIEW) {
+            counters->bytes_read += ret;
+        }
+    }
+}
+
+/*
+ * Takes the library lock. Public calls made from inside the library (or
+ * from a call that already holds the lock) just nest.
+ */
+static void fs_lock(void) {
+    if (lock_depth++ == 0) {
+        pthread_mutex_lock(&fs_mutex);
+    }
+}
+
+/*
+ * Releases the lock once the outermost call is done, bringing the caches
+ * back within their budget and publishing what the call changed to
+ * lock-free readers first
+ */
+static void fs_unlock(void) {
+    if (--lock_depth == 0) {
+        trim_caches();
+        publish_versions();
+        pthread_mutex_unlock(&fs_mutex);
+    }
+}
+
+/*
+ * Starts timing a public call and takes the lock. Disk I/O is charged to
+ * the innermost call, so the previous operation is returned for op_end to
+ * restore.
+ */
+static int op_begin(int op, struct timespec *start) {
+    fs_lock();
+    int prev = current_op;
+    current_op = op;
+    clock_gettime(CLOCK_MONOTONIC, start);
+    return prev;
+}
+
+static int op_end(int prev, struct timespec *start, int ret) {
+    count_call(&stats, current_op, elapsed_ns(start), ret);
+    current_op = prev;
+    fs_unlock();
+    return ret;
+}
+
+/*
+ * CRC32C of a block, skipping the checksum field itself (bytes 4..7)
+ */
+static uint32_t block_checksum(char *block) {
+    uint32_t crc = crc32c(0, block, 4);
+    return crc32c(crc, block + BLOCK_HEADER_SIZE, BLOCK_DATA_SIZE);
+}
+
+/*
+ * Verifies a block's checksum. Blocks written while checksums were
+ * disabled carry no checksum flag and are passed through unchecked,
+ * unless the disk never had such a mount, in which case the missing flag
+ * is itself damage.
+ */
+static int verify_block(char *block, tfsChecksumStats *counters) {
+    if (!checksums_enabled) {
+        return TFS_SUCCESS;
+    }
+    if (!(block[3] & BLOCK_FLAG_CHECKSUM)) {
+        if (checksums_required) {
+            counters->checksum_failures++;
+            return TFS_CHECKSUM_ERROR;
+        }
+        counters->blocks_unchecked++;
+        return TFS_SUCCESS;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uint32_t stored;
+    memcpy(&stored, block + 4, sizeof(stored));
+    int ok = (stored == block_checksum(block));
+    counters->verify_ns += elapsed_ns(&start);
+    counters->blocks_verified++;
+
+    if (!ok) {
+        counters->checksum_failures++;
+        return TFS_CHECKSUM_ERROR;
+    }
+    return TFS_SUCCESS;
+}
+
+/*
+ * Counts a disk read against the device of a tiered disk that serves it.
+ * Lock-free readers count too, so the counters are updated atomically.
+ */
+static void count_tier_read(int bNum) {
+    if (fast_blocks > 0) {
+        __atomic_fetch_add(bNum < fast_blocks ? &fast_reads : &slow_reads, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Reads a block and verifies its checksum
+ */
+static int read_disk_block(int disk, int bNum, char *block) {
+    struct timespec io_start;
+    clock_gettime(CLOCK_MONOTONIC, &io_start);
+    int ret = readBlock(disk, bNum, block);
+    record_latency(&stats.disk_read, elapsed_ns(&io_start), ret);
+    count_tier_read(bNum);
+    if (current_op >= 0) {
+        stats.ops[current_op].blocks_read++;
+    }
+    if (ret < 0) {
+        return ret;
+    }
+    return verify_block(block, &checksum_stats);
+}
+
+/*
+ * Entries a cache table gets under a budget of 'bytes'
+ */
+static int cache_slots(long bytes) {
+    return (int)(bytes / (BLOCKSIZE + CACHE_SLOT_BYTES));
+}
+
+static long cache_table_bytes(int slots) {
+    return (long)sizeof(cacheTable) + slots * CACHE_SLOT_BYTES;
+}
+
+/*
+ * Allocates an empty cache table; entries get their block buffers as
+ * they are first used
+ */
+static cacheTable *cache_new_table(int slots) {
+    cacheTable *table = pool_alloc(cache_table_bytes(slots));
+    if (table == NULL) {
+        return NULL;
+    }
+    int i;
+    table->slots = slots;
+    table->heads = (int *)(table->entries + slots);
+    table->ghost = table->heads + slots;
+    for (i = 0; i < slots; i++) {
+        table->entries[i].bNum = -1;
+        table->entries[i].seq = 0;
+        table->entries[i].pins = 0;
+        table->entries[i].referenced = 0;
+        table->entries[i].hot = 0;
+        table->entries[i].next = -1;
+        table->entries[i].block = NULL;
+        table->heads[i] = -1;
+        table->ghost[i] = -1;
+    }
+    return table;
+}
+
+static int cache_init(void) {
+    cache = cache_new_table(cache_slots(cache_budget));
+    if (cache == NULL) {
+        return TFS_MEMORY_ERROR;
+    }
+    cache_hand = cache_hot_hand = 0;
+    cache_blocks = cache_hot = 0;
+    memset(&cache_counters, 0, sizeof(cache_counters));
+    return TFS_SUCCESS;
+}
+
+/*
+ * Frees the table and every block buffer; readers are gone by now
+ */
+static void cache_drop(void) {
+    int i;
+    if (cache != NULL) {
+        for (i = 0; i < cache->slots; i++) {
+            free(cache->entries[i].block);
+        }
+    }
+    pool_free(cache);
+    cache = NULL;
+    cache_blocks = cache_hot = 0;
+    cache_pinned = 0;
+}
+
+/*
+ * Bytes the caches use together: the block cache table, the blocks it
+ * holds and the cached directories
+ */
+static long cache_used(void) {
+    if (cache == NULL) {
+        return 0;
+    }
+    return cache_table_bytes(cache->slots) + (long)cache_blocks * BLOCKSIZE + dir_bytes;
+}
+
+/*
+ * A writer changing a cache entry brackets the change with these, making
+ * its sequence number odd while the change is in progress
+ */
+static void cache_change_begin(int i) {
+    __atomic_store_n(&cache->entries[i].seq, cache->entries[i].seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void cache_change_end(int i) {
+    __atomic_store_n(&cache->entries[i].seq, cache->entries[i].seq + 1, __ATOMIC_RELEASE);
+}
+
+static int cache_find(int bNum) {
+    int i;
+    for (i = cache->heads[bNum % cache->slots]; i >= 0; i = cache->entries[i].next) {
+        if (cache->entries[i].bNum == bNum) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Unlinks entry 'i' from its hash chain and marks it unused. Readers
+ * already on the chain can still follow its old 'next'.
+ */
+static void cache_detach(int i) {
+    cacheEntry *entry = &cache->entries[i];
+    int *link = &cache->heads[entry->bNum % cache->slots];
+    while (*link != i) {
+        link = &cache->entries[*link].next;
+    }
+    cache_change_begin(i);
+    __atomic_store_n(link, entry->next, __ATOMIC_RELEASE);
+    __atomic_store_n(&entry->next, -1, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->bNum, -1, __ATOMIC_RELAXED);
+    cache_change_end(i);
+    if (entry->hot) {
+        entry->hot = 0;
+        cache_hot--;
+    }
+}
+
+/*
+ * Runs the hot hand until at most three quarters of the cached blocks are
+ * hot, demoting hot blocks not used since it last passed them
+ */
+static void cache_cool(void) {
+    int tries;
+    for (tries = 0; cache_hot > cache_blocks - cache_blocks / 4 && tries < 2 * cache->slots; tries++) {
+        cacheEntry *entry = &cache->entries[cache_hot_hand];
+        cache_hot_hand = (cache_hot_hand + 1) % cache->slots;
+        if (!entry->hot) {
+            continue;
+        }
+        if (entry->referenced) {
+            entry->referenced = 0;
+            continue;
+        }
+        entry->hot = 0;
+        cache_hot--;
+    }
+}
+
+/*
+ * Finds an entry for a new block with the cold hand: an unused entry that
+ * has a buffer (or any unused entry if 'grow' is set), or else a cold
+ * block not used since it came in, which is evicted and remembered in the
+ * ghost table. Cold blocks used meanwhile turn hot as the hand passes.
+ * Only after a whole turn without a victim are hot blocks taken too.
+ * Returns -1 if every entry is pinned.
+ */
+static int cache_victim(int grow) {
+    int tries;
+    cache_cool();
+    for (tries = 0; tries < 3 * cache->slots; tries++) {
+        int i = cache_hand;
+        cacheEntry *entry = &cache->entries[i];
+        cache_hand = (cache_hand + 1) % cache->slots;
+        if (entry->pins > 0) {
+            continue;
+        }
+        if (entry->bNum < 0) {
+            if (entry->block != NULL || grow) {
+                return i;
+            }
+            continue;
+        }
+        if (entry->hot && tries < cache->slots) {
+            continue;
+        }
+        if (entry->referenced && !entry->hot) {
+            // Keeps its clock bit, so the hot hand passes it once
+            entry->hot = 1;
+            cache_hot++;
+            cache_cool();
+            continue;
+        }
+        if (entry->referenced) {
+            entry->referenced = 0;
+            continue;
+        }
+        if (!entry->hot) {
+            cache->ghost[entry->bNum % cache->slots] = entry->bNum;
+        }
+        cache_detach(i);
+        cache_counters.evictions++;
+        return i;
+    }
+    return -1;
+}
+
+/*
+ * Notes that this thread read block 'bNum' from 'entry'. Reading the block
+ * it read last continues a read across a block boundary rather than using
+ * the block again, so only another block sets the clock bit; otherwise a
+ * sequential read done in pieces would turn every block it reads hot.
+ */
+static void cache_touch(cacheEntry *entry, int bNum) {
+    if (bNum != last_read_block) {
+        __atomic_store_n(&entry->referenced, 1, __ATOMIC_RELAXED);
+    }
+    last_read_block = bNum;
+}
+
+/*
+ * Stores a copy of block 'bNum' in the cache, in an entry cache_victim
+ * picks. A new buffer is only allocated while the caches are under their
+ * budget. Returns the entry, or -1 if every entry is pinned (or a buffer
+ * could not be had).
+ */
+static int cache_insert(int bNum, char *block) {
+    int i = cache_victim(cache_used() + BLOCKSIZE <= cache_budget);
+    if (i < 0) {
+        return -1;
+    }
+    cacheEntry *entry = &cache->entries[i];
+    if (entry->block == NULL) {
+        // malloc'd rather than pooled: the pool header would push a block
+        // into the next size class, twice its size
+        char *buffer = malloc(BLOCKSIZE);
+        if (buffer == NULL) {
+            return -1;
+        }
+        __atomic_store_n(&entry->block, buffer, __ATOMIC_RELAXED);
+        cache_blocks++;
+    }
+
+    // Metadata and blocks the cold hand evicted recently skip the cold
+    // stage
+    int hot = (block[0] == 2 || block[0] == 5 || block[0] == 6);
+    int *ghost = &cache->ghost[bNum % cache->slots];
+    if (*ghost == bNum) {
+        *ghost = -1;
+        cache_counters.ghost_hits++;
+        hot = 1;
+    }
+
+    cache_change_begin(i);
+    memcpy(entry->block, block, BLOCKSIZE);
+    __atomic_store_n(&entry->bNum, bNum, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->next, cache->heads[bNum % cache->slots], __ATOMIC_RELAXED);
+    cache_change_end(i);
+    entry->referenced = 0;
+    if (hot) {
+        entry->hot = 1;
+        cache_hot++;
+    }
+    last_read_block = bNum;
+    __atomic_store_n(&cache->heads[bNum % cache->slots], i, __ATOMIC_RELEASE);
+    return i;
+}
+
+/*
+ * Reads a block through the block cache. Only blocks of the mounted disk
+ * are cached, and only once they passed the checksum check.
+ */
+static int read_fs_block(int disk, int bNum, char *block) {
+    if (cache == NULL || disk != mounted_disk) {
+        return read_disk_block(disk, bNum, block);
+    }
+    int i = cache_find(bNum);
+    if (i >= 0) {
+        stats.cache_hits++;
+        cache_touch(&cache->entries[i], bNum);
+        memcpy(block, cache->entries[i].block, BLOCKSIZE);
+        return TFS_SUCCESS;
+    }
+    stats.cache_misses++;
+    int ret = read_disk_block(disk, bNum, block);
+    if (ret == TFS_SUCCESS) {
+        cache_insert(bNum, block);
+    }
+    return ret;
+}
+
+/*
+ * Pins block 'bNum' in the cache, reading it first if needed, and returns
+ * its entry. The entry keeps its contents until cache_unpin.
+ */
+static int cache_pin(int bNum) {
+    int i = cache_find(bNum);
+    if (i < 0) {
+        char block[BLOCKSIZE];
+        stats.cache_misses++;
+        int ret = read_disk_block(mounted_disk, bNum, block);
+        if (ret < 0) {
+            return ret;
+        }
+        if ((i = cache_insert(bNum, block)) < 0) {
+            return TFS_MEMORY_ERROR; // every entry is pinned already
+        }
+    } else {
+        stats.cache_hits++;
+    }
+    cache->entries[i].pins++;
+    cache_touch(&cache->entries[i], bNum);
+    cache_pinned++;
+    return i;
+}
+
+static void cache_unpin(int i) {
+    cache->entries[i].pins--;
+    cache_pinned--;
+}
+
+/*
+ * Stamps the block with a fresh checksum, or clears the checksum flag when
+ * 'checksum' is 0
+ */
+static void stamp_block(char *block, int checksum, tfsChecksumStats *counters) {
+    if (checksum) {
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        block[3] |= BLOCK_FLAG_CHECKSUM;
+        uint32_t crc = block_checksum(block);
+        memcpy(block + 4, &crc, sizeof(crc));
+        counters->update_ns += elapsed_ns(&start);
+        counters->blocks_updated++;
+    } else {
+        block[3] &= ~BLOCK_FLAG_CHECKSUM;
+        memset(block + 4, 0, 4);
+    }
+}
+
+/*
+ * Stamps the block's checksum and writes it to disk
+ */
+static int write_fs_block(int disk, int bNum, char *block) {
+    // TFS_MOUNT_NO_CHECKSUM is about the mounted disk; others (one being
+    // made by tfs_mkfs) are always checksummed
+    stamp_block(block, checksums_enabled || disk != mounted_disk, &checksum_stats);
+
+    struct timespec io_start;
+    clock_gettime(CLOCK_MONOTONIC, &io_start);
+    int ret = writeBlock(disk, bNum, block);
+    record_latency(&stats.disk_write, elapsed_ns(&io_start), ret);
+    if (current_op >= 0) {
+        stats.ops[current_op].blocks_written++;
+    }
+    if (disk == mounted_disk) {
+        // Counted after the write, so a reader that read the block before
+        // it knows not to cache what it got
+        __atomic_store_n(&cache_writes, cache_writes + 1, __ATOMIC_RELEASE);
+    }
+
+    // Keep the cached copy in step; after a failed write the disk contents
+    // are unknown, so the block is read again next time
+    int i = (cache != NULL && disk == mounted_disk) ? cache_find(bNum) : -1;
+    if (i >= 0) {
+        if (ret < 0 || cache->entries[i].pins > 0) {
+            cache_detach(i);
+        } else {
+            cache_change_begin(i);
+            memcpy(cache->entries[i].block, block, BLOCKSIZE);
+            cache_change_end(i);
+        }
+    }
+    return ret;
+}
+
+static int get_int(char *p) {
+    int v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static void put_int(char *p, int v) {
+    memcpy(p, &v, sizeof(v));
+}
+
+static int group_of(int bNum) {
+    return bNum / TFS_ALLOC_GROUP_BLOCKS;
+}
+
+/*
+ * Adjusts the free block counts for 'bNum' joining (+1) or leaving (-1)
+ * the free list
+ */
+static void count_free(int bNum, int delta) {
+    group_free[group_of(bNum)] += delta;
+    if (bNum < fast_blocks) {
+        fast_free += delta;
+    }
+}
+
+/*
+ * Reads the free list starting at 'head' into the in-core free index of a
+ * file system of 'blocks' blocks
+ */
+static int load_free_index(int disk, int head, int blocks) {
+    disk_blocks = blocks;
+    num_groups = (disk_blocks + TFS_ALLOC_GROUP_BLOCKS - 1) / TFS_ALLOC_GROUP_BLOCKS;
+    free_next = calloc(disk_blocks, sizeof(int));
+    free_prev = calloc(disk_blocks, sizeof(int));
+    free_map = calloc(disk_blocks, 1);
+    group_free = calloc(num_groups, sizeof(int));
+    if (free_next == NULL || free_prev == NULL || free_map == NULL || group_free == NULL) {
+        return TFS_MEMORY_ERROR;
+    }
+
+    char block[BLOCKSIZE];
+    int prev = 0, bNum = head;
+    while (bNum != 0) {
+        if (bNum < 0 || bNum >= disk_blocks || free_map[bNum]) {
+            return TFS_INVALID_FILESYSTEM; // out of range or a cycle
+        }
+        if (read_fs_block(disk, bNum, block) < 0 || block[0] != 4) {
+            return TFS_INVALID_FILESYSTEM;
+        }
+        free_map[bNum] = 1;
+        free_prev[bNum] = prev;
+        if (prev != 0) {
+            free_next[prev] = bNum;
+        }
+        count_free(bNum, 1);
+        prev = bNum;
+        bNum = get_int(block + BLOCK_HEADER_SIZE + FREE_NEXT);
+    }
+    free_head = head;
+    return TFS_SUCCESS;
+}
+
+static void drop_free_index(void) {
+    free(free_next);
+    free(free_prev);
+    free(free_map);
+    free(group_free);
+    free_next = free_prev = group_free = NULL;
+    free_map = NULL;
+    disk_blocks = num_groups = free_head = 0;
+    fast_blocks = fast_free = 0;
+}
+
+/*
+ * Sets the on-disk link that points at a free block: the superblock's free
+ * list head when 'prev' is 0, otherwise the next pointer of block 'prev'.
+ * Free blocks carry nothing but that pointer, so 'prev' is rewritten
+ * without reading it first.
+ */
+static int set_free_link(int prev, int next) {
+    char block[BLOCKSIZE];
+    if (prev == 0) {
+        if (read_fs_block(mounted_disk, 0, block) < 0) {
+            return TFS_READ_ERROR;
+        }
+        put_int(block + BLOCK_HEADER_SIZE + SB_FREE_HEAD, next);
+        if (write_fs_block(mounted_disk, 0, block) < 0) {
+            return TFS_WRITE_ERROR;
+        }
+        free_head = next;
+        return TFS_SUCCESS;
+    }
+
+    memset(block, 0, BLOCKSIZE);
+    block[0] = 4; // Block type = free
+    block[1] = 0x44; // Magic number
+    put_int(block + BLOCK_HEADER_SIZE + FREE_NEXT, next);
+    return write_fs_block(mounted_disk, prev, block) < 0 ? TFS_WRITE_ERROR : TFS_SUCCESS;
+}
+
+/*
+ * Unlinks free block 'bNum' from wherever it sits in the free list
+ */
+static int take_free_block(int bNum) {
+    int prev = free_prev[bNum], next = free_next[bNum];
+    if (set_free_link(prev, next) < 0) {
+        return TFS_WRITE_ERROR;
+    }
+    if (prev != 0) {
+        free_next[prev] = next;
+    }
+    if (next != 0) {
+        free_prev[next] = prev;
+    }
+    free_map[bNum] = 0;
+    free_next[bNum] = free_prev[bNum] = 0;
+    count_free(bNum, -1);
+    return TFS_SUCCESS;
+}
+
+/*
+ * Returns a metadata block (inode, block map or directory bucket) to the
+ * head of the free list. Data blocks go through release_block instead.
+ */
+static int free_block_now(int bNum) {
+    char block[BLOCKSIZE] = {0};
+    block[0] = 4; // Block type = free
+    block[1] = 0x44; // Magic number
+    put_int(block + BLOCK_HEADER_SIZE + FREE_NEXT, free_head);
+    if (write_fs_block(mounted_disk, bNum, block) < 0) {
+        return TFS_WRITE_ERROR;
+    }
+
+    int next = free_head;
+    if (set_free_link(0, bNum) < 0) {
+        return TFS_WRITE_ERROR;
+    }
+    free_map[bNum] = 1;
+    free_prev[bNum] = 0;
+    free_next[bNum] = next;
+    if (next != 0) {
+        free_prev[next] = bNum;
+    }
+    count_free(bNum, 1);
+    stats.blocks_freed++;
+    return TFS_SUCCESS;
+}
+
+/*
+ * Puts something lock-free readers may still hold on the retire list
+ */
+static void retire(rcuHeader *obj) {
+    obj->epoch = global_epoch;
+    obj->next = NULL;
+    *retired_tail = obj;
+    retired_tail = &obj->next;
+}
+
+/*
+ * Oldest epoch announced by a reader that is inside a read, or ULONG_MAX
+ */
+static unsigned long oldest_reader_epoch(void) {
+    unsigned long oldest = ULONG_MAX;
+    readerThread *reader;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (reader = readers; reader != NULL; reader = reader->next) {
+        unsigned long epoch = __atomic_load_n(&reader->epoch, __ATOMIC_ACQUIRE);
+        if (epoch != 0 && epoch < oldest) {
+            oldest = epoch;
+        }
+    }
+    return oldest;
+}
+
+/*
+ * Frees the retired objects and deferred blocks no reader can reach any
+ * more: those retired before the oldest epoch a reader announced
+ */
+static void reclaim(void) {
+    unsigned long oldest = oldest_reader_epoch();
+    while (retired != NULL && retired->epoch < oldest) {
+        rcuHeader *obj = retired;
+        retired = obj->next;
+        pool_free(obj);
+    }
+    if (retired == NULL) {
+        retired_tail = &retired;
+    }
+
+    int done = 0;
+    while (done < num_deferred && deferred[done].epoch < oldest) {
+        if (free_block_now(deferred[done].bNum) < 0) {
+            break; // tried again next time
+        }
+        done++;
+    }
+    if (done > 0) {
+        memmove(deferred, deferred + done, sizeof(deferredFree) * (num_deferred - done));
+        num_deferred -= done;
+    }
+}
+
+/*
+ * Waits until no reader can hold anything retired so far, then reclaims it
+ * all. Readers never wait for the lock, so this may run with it held.
+ */
+static void wait_for_readers(void) {
+    if (readers == NULL) {
+        reclaim(); // frees that failed to write get another try
+        return;
+    }
+    unsigned long epoch = global_epoch;
+    __atomic_store_n(&global_epoch, epoch + 1, __ATOMIC_SEQ_CST);
+    while (oldest_reader_epoch() <= epoch) {
+        sched_yield();
+    }
+    reclaim();
+}
+
+/*
+ * Returns a block to the free list, or queues it: while there are readers,
+ * until the readers that might still see it in an old block map are done,
+ * and when putting it on the free list fails to write, to be tried again
+ * later rather than lost
+ */
+static int free_block(int bNum) {
+    int ret = TFS_SUCCESS;
+    if (readers == NULL && (ret = free_block_now(bNum)) == TFS_SUCCESS) {
+        return ret;
+    }
+    if (num_deferred == deferred_cap) {
+        int cap = deferred_cap ? 2 * deferred_cap : 64;
+        deferredFree *grown = pool_realloc(deferred, sizeof(deferredFree) * cap);
+        if (grown == NULL) {
+            if (readers == NULL) {
+                return ret;
+            }
+            wait_for_readers(); // empties the queue
+            return free_block_now(bNum);
+        }
+        deferred = grown;
+        deferred_cap = cap;
+    }
+    deferred[num_deferred].bNum = bNum;
+    deferred[num_deferred].epoch = global_epoch;
+    num_deferred++;
+    return TFS_SUCCESS;
+}
+
+/*
+ * Notes that an open file's size, block map or buffered data changed, so
+ * readers get a new version when the call ends
+ */
+static void mark_stale(fileMetadata *meta) {
+    if (meta->cursor != NULL) {
+        meta->cursor->stale = 1;
+    }
+}
+
+/*
+ * Records a read of an open file. Readers may hold no lock, so they only
+ * note the time in the cursor; collect_access makes it the access time.
+ */
+static void note_read(fileCursor *cursor) {
+    time_t now = time(NULL);
+    if (__atomic_load_n(&cursor->read_time, __ATOMIC_RELAXED) != now) {
+        __atomic_store_n(&cursor->read_time, now, __ATOMIC_RELAXED);
+    }
+}
+
+static void collect_access(fileMetadata *meta) {
+    if (meta->cursor != NULL) {
+        time_t read_time = __atomic_load_n(&meta->cursor->read_time, __ATOMIC_RELAXED);
+        if (read_time > meta->accessed_t) {
+            meta->accessed_t = read_time;
+        }
+    }
+}
+
+static fileCursor *new_cursor(void) {
+    fileCursor *cursor = pool_calloc(1, sizeof(fileCursor));
+    if (cursor != NULL) {
+        cursor->stale = 1;
+    }
+    return cursor;
+}
+
+/*
+ * Gets rid of a closed file's cursor and version, through the retire list
+ * while readers may still be looking at them
+ */
+static void drop_cursor(fileCursor *cursor) {
+    fd_table_stale = 1;
+    if (readers == NULL) {
+        pool_free(cursor->version);
+        pool_free(cursor);
+        return;
+    }
+    if (cursor->version != NULL) {
+        retire(&cursor->version->rcu);
+    }
+    retire(&cursor->rcu);
+}
+
+static fileVersion *make_version(fileMetadata *meta) {
+    fileVersion *version = pool_alloc(sizeof(fileVersion) + sizeof(int) * meta->map_len);
+    if (version == NULL) {
+        return NULL;
+    }
+    version->size = meta->size;
+    version->compressed = meta->compressed;
+    version->buffered = (meta->append_len > 0);
+    version->map_len = meta->map_len;
+    if (meta->map_len > 0) {
+        memcpy(version->block_map, meta->block_map, sizeof(int) * meta->map_len);
+    }
+    return version;
+}
+
+/*
+ * Runs as the outermost call gives up the lock: gives readers a new
+ * version of every open file the call changed and a new descriptor table
+ * if files were opened or closed, then frees what readers have let go of.
+ * Nothing is published before the first reader shows up; everything is
+ * still marked stale then, so it all goes out the first time. Frees that
+ * failed to write are tried again either way.
+ */
+static void publish_versions(void) {
+    if (readers == NULL) {
+        if (num_deferred > 0) {
+            reclaim();
+        }
+        return;
+    }
+    int i;
+    for (i = 0; i < num_fd; i++) {
+        fileCursor *cursor = file_md[i].cursor;
+        if (!cursor->stale) {
+            continue;
+        }
+        // Without memory for a new version readers take the lock instead
+        // of going on with the old one
+        fileVersion *old = cursor->version;
+        fileVersion *version = make_version(&file_md[i]);
+        __atomic_store_n(&cursor->version, version, __ATOMIC_RELEASE);
+        cursor->stale = (version == NULL);
+        if (old != NULL) {
+            retire(&old->rcu);
+        }
+    }
+
+    if (fd_table_stale) {
+        fdTable *old = fd_table;
+        fdTable *table = pool_alloc(sizeof(fdTable) + sizeof(fileCursor *) * num_fd);
+        if (table != NULL) {
+            table->num_fd = num_fd;
+            for (i = 0; i < num_fd; i++) {
+                table->cursors[i] = file_md[i].cursor;
+            }
+        }
+        __atomic_store_n(&fd_table, table, __ATOMIC_RELEASE);
+        fd_table_stale = (table == NULL);
+        if (old != NULL) {
+            retire(&old->rcu);
+        }
+    }
+
+    if (retired != NULL || num_deferred > 0) {
+        // Readers that start from here on see what was just published
+        __atomic_store_n(&global_epoch, global_epoch + 1, __ATOMIC_SEQ_CST);
+        reclaim();
+    }
+}
+
+static void release_reader(void *reader) {
+    __atomic_store_n(&((readerThread *)reader)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void make_reader_key(void) {
+    pthread_key_create(&reader_key, release_reader);
+}
+
+/*
+ * Returns the calling thread's reader record, or NULL when the call has to
+ * take the lock: the thread holds it already (a call made from inside the
+ * library) or no record could be allocated. A thread takes the lock once
+ * to register; the first reader makes writers start publishing versions.
+ */
+static readerThread *get_reader(void) {
+    if (lock_depth > 0) {
+        return NULL;
+    }
+    if (this_reader != NULL) {
+        return this_reader;
+    }
+
+    pthread_once(&reader_key_once, make_reader_key);
+    fs_lock();
+    readerThread *reader = readers;
+    while (reader != NULL && __atomic_load_n(&reader->in_use, __ATOMIC_ACQUIRE)) {
+        reader = reader->next;
+    }
+    if (reader == NULL && (reader = calloc(1, sizeof(readerThread))) != NULL) {
+        reader->next = readers;
+        readers = reader;
+    }
+    if (reader != NULL) {
+        reader->in_use = 1;
+        pthread_setspecific(reader_key, reader);
+        this_reader = reader;
+    }
+    fs_unlock();
+    return reader;
+}
+
+/*
+ * Announces the epoch a read starts in. Loading it with acquire makes the
+ * versions published before it visible; the fence orders the announcement
+ * before every pointer the read loads.
+ */
+static void reader_enter(readerThread *reader) {
+    __atomic_store_n(&reader->epoch, __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE), __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static void reader_exit(readerThread *reader) {
+    __atomic_store_n(&reader->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Descriptor FD's cursor as readers see it, or NULL if the descriptor is
+ * not published (not open, or nothing mounted)
+ */
+static fileCursor *reader_cursor(fileDescriptor FD) {
+    fdTable *table = __atomic_load_n(&fd_table, __ATOMIC_ACQUIRE);
+    if (table == NULL || FD < 0 || FD >= table->num_fd) {
+        return NULL;
+    }
+    return table->cursors[FD];
+}
+
+/*
+ * Copies block 'bNum' out of the cache without the lock, if it is there.
+ * An entry only counts if its sequence number was even and did not change
+ * across the copy; a writer changing it meanwhile turns the lookup into a
+ * miss. Chains may be relinked under the reader, so the walk is bounded.
+ */
+static int cache_read_shared(int bNum, char *block) {
+    cacheTable *table = __atomic_load_n(&cache, __ATOMIC_ACQUIRE);
+    if (table == NULL) {
+        return 0;
+    }
+    int i = __atomic_load_n(&table->heads[bNum % table->slots], __ATOMIC_ACQUIRE);
+    int steps;
+    for (steps = 0; i >= 0 && steps < table->slots; steps++) {
+        cacheEntry *entry = &table->entries[i];
+        unsigned seq = __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE);
+        if (!(seq & 1) && __atomic_load_n(&entry->bNum, __ATOMIC_RELAXED) == bNum) {
+            char *data = __atomic_load_n(&entry->block, __ATOMIC_RELAXED);
+            if (data == NULL) {
+                return 0;
+            }
+            memcpy(block, data, BLOCKSIZE);
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&entry->seq, __ATOMIC_RELAXED) != seq) {
+                return 0;
+            }
+            cache_touch(entry, bNum);
+            return 1;
+        }
+        i = __atomic_load_n(&entry->next, __ATOMIC_ACQUIRE);
+    }
+    return 0;
+}
+
+/*
+ * Reads a block for a lock-free reader, counting into the reader's own
+ * stats. A block read from disk goes into the cache only if the lock is
+ * free right now and nothing was written to the disk since the read began,
+ * so a reader never caches contents a writer has already replaced.
+ */
+static int reader_read_block(readerThread *reader, int op, int bNum, char *block) {
+    if (cache_read_shared(bNum, block)) {
+        reader->stats.cache_hits++;
+        return TFS_SUCCESS;
+    }
+    reader->stats.cache_misses++;
+
+    unsigned long writes = __atomic_load_n(&cache_writes, __ATOMIC_ACQUIRE);
+    struct timespec io_start;
+    clock_gettime(CLOCK_MONOTONIC, &io_start);
+    int ret = readBlock(mounted_disk, bNum, block);
+    record_latency(&reader->stats.disk_read, elapsed_ns(&io_start), ret);
+    reader->stats.ops[op].blocks_read++;
+    count_tier_read(bNum);
+    if (ret < 0 || (ret = verify_block(block, &reader->checksums)) < 0) {
+        return ret;
+    }
+
+    if (pthread_mutex_trylock(&fs_mutex) == 0) {
+        if (cache_writes == writes && cache_find(bNum) < 0) {
+            cache_insert(bNum, block);
+        }
+        pthread_mutex_unlock(&fs_mutex);
+    }
+    return TFS_SUCCESS;
+}
+
+/*
+ * Copies up to 'size' bytes at 'offset' out of an uncompressed file's
+ * version; pread_file does the same under the lock
+ */
+static int read_version(readerThread *reader, int op, fileVersion *version, char *buffer, int size, int offset) {
+    if (offset < 0 || size < 0) {
+        return TFS_INVALID_SEEK;
+    }
+    if (offset >= version->size) {
+        return 0;
+    }
+    if (size > version->size - offset) {
+        size = version->size - offset;
+    }
+
+    int done = 0;
+    while (done < size) {
+        int pos = offset + done;
+        int index = pos / BLOCK_DATA_SIZE;
+        int in_block = pos % BLOCK_DATA_SIZE;
+        int n = BLOCK_DATA_SIZE - in_block;
+        if (n > size - done) {
+            n = size - done;
+        }
+        if (index >= version->map_len || version->block_map[index] == 0) {
+            memset(buffer + done, 0, n); // a hole
+        } else {
+            char block[BLOCKSIZE];
+            if (reader_read_block(reader, op, version->block_map[index], block) < 0) {
+                return TFS_READ_ERROR;
+            }
+            memcpy(buffer + done, block + BLOCK_HEADER_SIZE + in_block, n);
+        }
+        done += n;
+    }
+    return done;
+}
+
+/*
+ * Bytes at the end of the inode that a block map of 'map_len' entries
+ * leaves to inline attributes
+ */
+static int xattr_room(int map_len) {
+    return map_len < INODE_DIRECT_COUNT ? 4 * (INODE_DIRECT_COUNT - map_len) : 0;
+}
+
+/*
+ * Whether an inode's size and block map length, as read from disk, can
+ * be right: a file's map covers exactly its size (whole chunks when it is
+ * compressed), a directory's table has a power of two slots, and either
+ * map's block map blocks fit on the disk. Keeps a damaged inode read
+ * without checksums from asking for a huge or negative allocation.
+ */
+static int map_len_valid(fileMetadata *meta) {
+    if (meta->size < 0 || meta->map_len < 0) {
+        return 0;
+    }
+    if (meta->is_dir) {
+        if (meta->map_len == 0 || meta->map_len > (1 << DIR_MAX_DEPTH) ||
+            (meta->map_len & (meta->map_len - 1)) != 0) {
+            return 0;
+        }
+    } else {
+        long long blocks = ((long long)meta->size + BLOCK_DATA_SIZE - 1) / BLOCK_DATA_SIZE;
+        if (meta->compressed) {
+            blocks = ((long long)meta->size + COMPRESS_CHUNK_SIZE - 1) / COMPRESS_CHUNK_SIZE * COMPRESS_CHUNK_BLOCKS;
+        }
+        if (meta->map_len > blocks) {
+            return 0;
+        }
+    }
+    return index_blocks_needed(meta->map_len) < disk_blocks;
+}
+
+/*
+ * Reads inode 'ino' and its block map into 'meta'
+ */
+static int load_inode(int ino, fileMetadata *meta) {
+    char block[BLOCKSIZE];
+    if (read_fs_block(mounted_disk, ino, block) < 0) {
+        return TFS_READ_ERROR;
+    }
+    if (block[0] != 2 || block[1] != 0x44) {
+        return TFS_INVALID_FILESYSTEM;
+    }
+
+    char *p = block + BLOCK_HEADER_SIZE;
+    long long ctime_on_disk, mtime_on_disk, atime_on_disk;
+    memset(meta, 0, sizeof(*meta));
+    meta->inode = ino;
+    meta->is_dir = (p[INODE_KIND] == INODE_DIR);
+    meta->read_only = (p[INODE_FLAGS] & INODE_FLAG_READ_ONLY) ? 1 : 0;
+    meta->compressed = (p[INODE_FLAGS] & INODE_FLAG_COMPRESSED) ? 1 : 0;
+    meta->size = get_int(p + INODE_SIZE);
+    memcpy(&ctime_on_disk, p + INODE_CTIME, sizeof(ctime_on_disk));
+    memcpy(&mtime_on_disk, p + INODE_MTIME, sizeof(mtime_on_disk));
+    memcpy(&atime_on_disk, p + INODE_ATIME, sizeof(atime_on_disk));
+    meta->creation_t = (time_t)ctime_on_disk;
+    meta->modified_t = mtime_on_disk ? (time_t)mtime_on_disk : meta->creation_t;
+    meta->accessed_t = atime_on_disk ? (time_t)atime_on_disk : meta->creation_t;
+    meta->saved_atime = meta->accessed_t;
+    meta->parent = get_int(p + INODE_PARENT);
+    meta->map_len = get_int(p + INODE_MAP_LEN);
+    meta->chunk_index = -1;
+    if (!map_len_valid(meta)) {
+        return TFS_INVALID_FILESYSTEM;
+    }
+
+    // Inline attributes come along; an attribute block is only read when
+    // the attributes are asked for
+    int xattr = get_int(p + INODE_XATTR);
+    if (p[INODE_FLAGS] & INODE_FLAG_INLINE_XATTR) {
+        if (xattr <= 0 || xattr > xattr_room(meta->map_len)) {
+            return TFS_INVALID_FILESYSTEM;
+        }
+        if ((meta->xattrs = pool_alloc(xattr)) == NULL) {
+            return TFS_MEMORY_ERROR;
+        }
+        memcpy(meta->xattrs, p + BLOCK_DATA_SIZE - xattr, xattr);
+        meta->xattr_len = xattr;
+    } else {
+        meta->xattr_block = xattr;
+        meta->xattr_len = xattr > 0 ? -1 : 0;
+    }
+
+    meta->block_map = pool_calloc(meta->map_len > 0 ? meta->map_len : 1, sizeof(int));
+    if (meta->block_map == NULL) {
+        pool_free(meta->xattrs);
+        return TFS_MEMORY_ERROR;
+    }
+
+    int i;
+    for (i = 0; i < meta->map_len && i < INODE_DIRECT_COUNT; i++) {
+        meta->block_map[i] = get_int(p + INODE_DIRECT + 4 * i);
+    }
+
+    // The rest of the map continues in a chain of block map blocks
+    int next = get_int(p + INODE_MAP_NEXT);
+    while (i < meta->map_len) {
+        if (next <= 0 || read_fs_block(mounted_disk, next, block) < 0 || block[0] != 5) {
+            pool_free(meta->block_map);
+            pool_free(meta->index_blocks);
+            pool_free(meta->xattrs);
+            return TFS_INVALID_FILESYSTEM;
+        }
+        int *grown = pool_realloc(meta->index_blocks, sizeof(int) * (meta->num_index_blocks + 1));
+        if (grown == NULL) {
+            pool_free(meta->block_map);
+            pool_free(meta->index_blocks);
+            pool_free(meta->xattrs);
+            return TFS_MEMORY_ERROR;
+        }
+        meta->index_blocks = grown;
+        meta->index_blocks[meta->num_index_blocks++] = next;
+        stats.chain_hops++;
+
+        int j;
+        for (j = 0; j < MAP_ENTRY_COUNT && i < meta->map_len; j++, i++) {
+            meta->block_map[i] = get_int(block + BLOCK_HEADER_SIZE + MAP_ENTRIES + 4 * j);
+        }
+        next = get_int(block + BLOCK_HEADER_SIZE + MAP_NEXT);
+    }
+
+    meta->start_block = meta->map_len > 0 ? meta->block_map[0] : -1;
+    return TFS_SUCCESS;
+}
+
+/*
+ * Number of block map blocks a map of 'map_len' entries needs past the
+ * entries held in the inode itself
+ */
+static int index_blocks_needed(int map_len) {
+    if (map_len <= INODE_DIRECT_COUNT) {
+        return 0;
+    }
+    return (map_len - INODE_DIRECT_COUNT + MAP_ENTRY_COUNT - 1) / MAP_ENTRY_COUNT;
+}
+
+/*
+ * Fills 'block' with block map block 'k' of the file, which lists the map
+ * entries after the inode's and those of the k map blocks before it
+ */
+static void map_block_image(fileMetadata *meta, int k, char *block) {
+    int needed = index_blocks_needed(meta->map_len);
+    int j, i = INODE_DIRECT_COUNT + k * MAP_ENTRY_COUNT;
+    memset(block, 0, BLOCKSIZE);
+    block[0] = 5; // Block type = block map
+    block[1] = 0x44; // Magic number
+    put_int(block + BLOCK_HEADER_SIZE + MAP_NEXT, k + 1 < needed ? meta->index_blocks[k + 1] : 0);
+    for (j = 0; j < MAP_ENTRY_COUNT && i < meta->map_len; j++, i++) {
+        put_int(block + BLOCK_HEADER_SIZE + MAP_ENTRIES + 4 * j, meta->block_map[i]);
+    }
+}
+
+/*
+ * Fills 'block' with the file's inode
+ */
+static void inode_image(fileMetadata *meta, char *block) {
+    memset(block, 0, BLOCKSIZE);
+    block[0] = 2; // Block type = inode
+    block[1] = 0x44; // Magic number
+    char *p = block + BLOCK_HEADER_SIZE;
+    long long ctime_on_disk = meta->creation_t;
+    long long mtime_on_disk = meta->modified_t;
+    long long atime_on_disk = meta->accessed_t;
+    p[INODE_KIND] = meta->is_dir ? INODE_DIR : INODE_FILE;
+    p[INODE_FLAGS] = (meta->read_only ? INODE_FLAG_READ_ONLY : 0) |
+                     (meta->compressed ? INODE_FLAG_COMPRESSED : 0);
+    put_int(p + INODE_SIZE, meta->size);
+    memcpy(p + INODE_CTIME, &ctime_on_disk, sizeof(ctime_on_disk));
+    memcpy(p + INODE_MTIME, &mtime_on_disk, sizeof(mtime_on_disk));
+    memcpy(p + INODE_ATIME, &atime_on_disk, sizeof(atime_on_disk));
+    put_int(p + INODE_MAP_LEN, meta->map_len);
+    put_int(p + INODE_MAP_NEXT, meta->map_len > INODE_DIRECT_COUNT ? meta->index_blocks[0] : 0);
+    put_int(p + INODE_PARENT, meta->parent);
+    int i;
+    for (i = 0; i < meta->map_len && i < INODE_DIRECT_COUNT; i++) {
+        put_int(p + INODE_DIRECT + 4 * i, meta->block_map[i]);
+    }
+    if (meta->xattr_block != 0) {
+        put_int(p + INODE_XATTR, meta->xattr_block);
+    } else if (meta->xattr_len > 0) {
+        p[INODE_FLAGS] |= INODE_FLAG_INLINE_XATTR;
+        put_int(p + INODE_XATTR, meta->xattr_len);
+        memcpy(p + BLOCK_DATA_SIZE - meta->xattr_len, meta->xattrs, meta->xattr_len);
+    }
+}
+
+/*
+ * Decides where the attributes go before the inode is written: inline
+ * while they fit next to the block map, else an attribute block, which is
+ * only written when they changed. Attributes never read from their block
+ * this mount stay in it. Sets '*stale' to a block the inode stops using,
+ * to be released once the inode no longer points at it, and '*taken' to
+ * the block it took a reference on, to be released if the inode can't be
+ * written.
+ */
+static int place_xattrs(fileMetadata *meta, int *stale, int *taken) {
+    *stale = *taken = 0;
+    if (meta->xattr_len < 0) {
+        return TFS_SUCCESS;
+    }
+    int old = meta->xattr_block;
+    if (meta->xattr_len <= xattr_room(meta->map_len)) {
+        meta->xattr_block = 0;
+        *stale = old;
+    } else if (old == 0 || meta->xattr_dirty) {
+        char block[BLOCKSIZE] = {0};
+        block[0] = 7; // Block type = extended attributes
+        block[1] = 0x44; // Magic number
+        put_int(block + BLOCK_HEADER_SIZE + XATTR_LEN, meta->xattr_len);
+        memcpy(block + BLOCK_HEADER_SIZE + XATTR_ENTRIES, meta->xattrs, meta->xattr_len);
+        int bNum = store_attr_block(block, meta->inode);
+        if (bNum < 0) {
+            return bNum;
+        }
+        meta->xattr_block = *taken = bNum;
+        *stale = old; // may be bNum itself, which then holds one reference more
+    }
+    meta->xattr_dirty = 0;
+    return TFS_SUCCESS;
+}
+
+/*
+ * Gives back what a save_inode that failed before the inode was written
+ * allocated: block map blocks past the 'had' the inode on disk names, and
+ * the attribute block reference 'taken'. The inode goes back to the
+ * attribute block 'xattr_block' it has on disk.
+ */
+static void undo_save(fileMetadata *meta, int had, int taken, int xattr_block, int xattr_dirty) {
+    while (meta->num_index_blocks > had) {
+        free_block(meta->index_blocks[--meta->num_index_blocks]);
+    }
+    if (taken != 0) {
+        release_block(taken);
+    }
+    meta->xattr_block = xattr_block;
+    meta->xattr_dirty = xattr_dirty;
+}
+
+/*
+ * Writes the inode and its block map back to disk, growing or shrinking
+ * the chain of block map blocks to fit the map. Blocks the chain no longer
+ * needs are freed only once the inode stops pointing at them.
+ */
+static int save_inode(fileMetadata *meta) {
+    mark_stale(meta);
+    collect_access(meta);
+    int xattr_block = meta->xattr_block, xattr_dirty = meta->xattr_dirty;
+    int stale_xattrs, taken;
+    int ret = place_xattrs(meta, &stale_xattrs, &taken);
+    if (ret < 0) {
+        return ret;
+    }
+    int had = meta->num_index_blocks;
+    int needed = index_blocks_needed(meta->map_len);
+
+    while (meta->num_index_blocks < needed) {
+        int *grown = pool_realloc(meta->index_blocks, sizeof(int) * (meta->num_index_blocks + 1));
+        if (grown == NULL) {
+            undo_save(meta, had, taken, xattr_block, xattr_dirty);
+            return TFS_MEMORY_ERROR;
+        }
+        meta->index_blocks = grown;
+        int bNum = find_meta_block(meta->inode);
+        if (bNum < 0) {
+            undo_save(meta, had, taken, xattr_block, xattr_dirty);
+            return bNum;
+        }
+        meta->index_blocks[meta->num_index_blocks++] = bNum;
+    }
+
+    char block[BLOCKSIZE];
+    int k;
+    for (k = 0; k < needed; k++) {
+        map_block_image(meta, k, block);
+        if (write_fs_block(mounted_disk, meta->index_blocks[k], block) < 0) {
+            undo_save(meta, had, taken, xattr_block, xattr_dirty);
+            return TFS_WRITE_ERROR;
+        }
+    }
+
+    inode_image(meta, block);
+    if (write_fs_block(mounted_disk, meta->inode, block) < 0) {
+        undo_save(meta, had, taken, xattr_block, xattr_dirty);
+        return TFS_WRITE_ERROR;
+    }
+    meta->saved_atime = meta->accessed_t;
+    while (meta->num_index_blocks > needed) {
+        if (free_block(meta->index_blocks[--meta->num_index_blocks]) < 0) {
+            return TFS_WRITE_ERROR;
+        }
+    }
+    if (stale_xattrs != 0 && release_block(stale_xattrs) < 0) {
+        return TFS_WRITE_ERROR;
+    }
+    return TFS_SUCCESS;
+}
+
+/*
+ * Writes a file's access time if it is due: when nothing else wrote the
+ * inode since the last read, and this is the first read since the file
+ * changed or the time on disk is TFS_ATIME_INTERVAL old. Snapshot views
+ * have no inode of their own.
+ */
+static int save_access_time(fileMetadata *meta) {
+    collect_access(meta);
+    if (meta->snapshot_id != 0 || meta->accessed_t <= meta->saved_atime) {
+        return TFS_SUCCESS;
+    }
+    if (meta->saved_atime > meta->modified_t &&
+        meta->accessed_t - meta->saved_atime < TFS_ATIME_INTERVAL) {
+        return TFS_SUCCESS;
+    }
+    return save_inode(meta);
+}
+
+/*
+ * Frees the in-core copy of an inode (not its blocks on disk)
+ */
+static void drop_inode(fileMetadata *meta) {
+    discard_appends(meta);
+    pool_free(meta->block_map);
+    pool_free(meta->chunk_buf);
+    pool_free(meta->index_blocks);
+    pool_free(meta->xattrs);
+    meta->block_map = NULL;
+    meta->chunk_buf = NULL;
+    meta->index_blocks = NULL;
+    meta->xattrs = NULL;
+}
+
+static uint32_t dir_hash(char *name) {
+    return crc32c(0, name, strlen(name));
+}
+
+static int dir_depth(fileMetadata *dir) {
+    int depth = 0;
+    while ((1 << depth) < dir->map_len) {
+        depth++;
+    }
+    return depth;
+}
+
+/*
+ * In-core size of a cached directory, as counted against the cache budget
+ */
+static long dir_size(fileMetadata *dir) {
+    return (long)sizeof(fileMetadata) + sizeof(int) * (dir->map_len + dir->num_index_blocks);
+}
+
+/*
+ * Returns the in-core copy of directory 'ino', loading it on first use.
+ * A cached directory lets a lookup read just the one bucket block the name
+ * hashes to. Directories stay cached until the caches go over their budget
+ * at the end of a call (see shrink_caches), so the pointer is good for the
+ * rest of the call.
+ */
+static int get_dir(int ino, fileMetadata **dir) {
+    int i;
+    for (i = 0; i < num_dirs_cached; i++) {
+        cachedDir *cached = &dir_cache[i];
+        if (cached->meta->inode == ino) {
+            // The bucket map may have grown since it was last counted
+            long bytes = dir_size(cached->meta);
+            dir_bytes += bytes - cached->bytes;
+            cached->bytes = bytes;
+            cached->referenced = 1;
+            *dir = cached->meta;
+            return TFS_SUCCESS;
+        }
+    }
+
+    fileMetadata *loaded = pool_alloc(sizeof(fileMetadata));
+    if (loaded == NULL) {
+        return TFS_MEMORY_ERROR;
+    }
+    int ret = load_inode(ino, loaded);
+    if (ret < 0) {
+        pool_free(loaded);
+        return ret;
+    }
+    if (!loaded->is_dir) {
+        drop_inode(loaded);
+        pool_free(loaded);
+        return TFS_NOT_A_DIRECTORY;
+    }
+
+    cachedDir *grown = pool_realloc(dir_cache, sizeof(cachedDir) * (num_dirs_cached + 1));
+    if (grown == NULL) {
+        drop_inode(loaded);
+        pool_free(loaded);
+        return TFS_MEMORY_ERROR;
+    }
+    dir_cache = grown;
+    dir_cache[num_dirs_cached].meta = loaded;
+    dir_cache[num_dirs_cached].bytes = dir_size(loaded);
+    dir_cache[num_dirs_cached].referenced = 1;
+    dir_bytes += dir_cache[num_dirs_cached].bytes;
+    num_dirs_cached++;
+    *dir = loaded;
+    return TFS_SUCCESS;
+}
+
+static void drop_cached_dir(int i) {
+    dir_bytes -= dir_cache[i].bytes;
+    drop_inode(dir_cache[i].meta);
+    pool_free(dir_cache[i].meta);
+    dir_cache[i] = dir_cache[--num_dirs_cached];
+}
+
+static void forget_dir(int ino) {
+    int i;
+    for (i = 0; i < num_dirs_cached; i++) {
+        if (dir_cache[i].meta->inode == ino) {
+            drop_cached_dir(i);
+            return;
+        }
+    }
+}
+
+/*
+ * Drops the first cached directory the directory clock finds unused since
+ * it last passed. Returns 0 if there is none to drop.
+ */
+static int evict_dir(void) {
+    int tries;
+    for (tries = 0; tries <= 2 * num_dirs_cached; tries++) {
+        if (dir_hand >= num_dirs_cached) {
+            if (num_dirs_cached == 0) {
+                return 0;
+            }
+            dir_hand = 0;
+        }
+        if (dir_cache[dir_hand].referenced) {
+            dir_cache[dir_hand].referenced = 0;
+            dir_hand++;
+            continue;
+        }
+        drop_cached_dir(dir_hand);
+        cache_counters.dir_evictions++;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Frees block buffers taken out of the cache, linked through their first
+ * bytes, once no lock-free reader can still be copying from one
+ */
+static void free_cache_buffers(char *released) {
+    if (released == NULL) {
+        return;
+    }
+    wait_for_readers();
+    while (released != NULL) {
+        char *next;
+        memcpy(&next, released, sizeof(next));
+        free(released);
+        released = next;
+    }
+}
+
+/*
+ * Releases cached directories and blocks until the caches use at most
+ * 'target' bytes, or nothing more can go. Under pressure directories keep
+ * at most half of it, in directory clock order, and blocks go through
+ * the cold hand (pinned blocks stay). Block buffers are freed once no
+ * lock-free reader can be copying from them. Only runs between calls,
+ * since a call holds pointers to cached directories. Returns the bytes
+ * released.
+ */
+static long shrink_caches(long target) {
+    long before = cache_used();
+    char *released = NULL; // buffers linked through their first bytes
+
+    while (cache_used() > target) {
+        if (dir_bytes > target / 2 && evict_dir()) {
+            continue;
+        }
+        int i = cache_victim(0);
+        if (i < 0) {
+            if (!evict_dir()) {
+                break;
+            }
+            continue;
+        }
+        cacheEntry *entry = &cache->entries[i];
+        char *buffer = entry->block;
+        cache_change_begin(i);
+        __atomic_store_n(&entry->block, NULL, __ATOMIC_RELAXED);
+        cache_change_end(i);
+        memcpy(buffer, &released, sizeof(released));
+        released = buffer;
+        cache_blocks--;
+    }
+
+    free_cache_buffers(released);
+    return before - cache_used();
+}
+
+/*
+ * Runs as the outermost call ends: evicts what the caches hold beyond
+ * their budget, which directories loaded during the call can push them
+ * over
+ */
+static void trim_caches(void) {
+    if (cache != NULL && cache_used() > cache_budget) {
+        shrink_caches(cache_budget);
+    }
+}
+
+/*
+ * Replaces the cache table with one of 'slots' entries. A bigger table
+ * keeps every entry at its index, so pinned entries stay where their views
+ * have them; a smaller one packs the cached blocks at the front and is
+ * only built while nothing is pinned. Entries of the old table are left
+ * odd, so readers still walking it miss, and it goes on the retire list.
+ */
+static int cache_resize(int slots) {
+    cacheTable *old = cache;
+    if (slots == old->slots) {
+        return TFS_SUCCESS;
+    }
+    if (slots < old->slots && cache_pinned > 0) {
+        return TFS_BUSY;
+    }
+    cacheTable *table = cache_new_table(slots);
+    if (table == NULL) {
+        return TFS_MEMORY_ERROR;
+    }
+
+    int i, j = 0;
+    char *released = NULL;
+    cache_hot = 0;
+    cache_blocks = 0;
+    for (i = 0; i < old->slots; i++) {
+        cacheEntry *entry = &old->entries[i];
+        if (slots > old->slots) {
+            j = i; // growing: keep the index
+        } else if (entry->bNum < 0 || j == slots) {
+            // packing: drop unused buffers and blocks that no longer fit
+            if (entry->block != NULL) {
+                memcpy(entry->block, &released, sizeof(released));
+                released = entry->block;
+            }
+            continue;
+        }
+        table->entries[j] = *entry;
+        table->entries[j].seq = 0;
+        table->entries[j].next = -1;
+        if (entry->bNum >= 0) {
+            table->entries[j].next = table->heads[entry->bNum % slots];
+            table->heads[entry->bNum % slots] = j;
+        }
+        cache_blocks += (entry->block != NULL);
+        cache_hot += entry->hot;
+        j++;
+    }
+    for (i = 0; i < old->slots; i++) {
+        if (old->ghost[i] >= 0) {
+            table->ghost[old->ghost[i] % slots] = old->ghost[i];
+        }
+        __atomic_store_n(&old->entries[i].seq, old->entries[i].seq | 1, __ATOMIC_RELAXED);
+    }
+
+    __atomic_store_n(&cache, table, __ATOMIC_RELEASE);
+    cache_hand %= slots;
+    cache_hot_hand %= slots;
+    if (readers == NULL) {
+        pool_free(old);
+    } else {
+        retire(&old->rcu);
+    }
+    free_cache_buffers(released);
+    return TFS_SUCCESS;
+}
+
+/*
+ * Looks 'name' up in a directory. Reads exactly one bucket block.
+ * Returns the entry's inode, 0 if there is no such entry, or an error.
+ */
+static int dir_lookup(fileMetadata *dir, char *name, int *kind) {
+    char block[BLOCKSIZE];
+    int bNum = dir->block_map[dir_hash(name) & (dir->map_len - 1)];
+    if (read_fs_block(mounted_disk, bNum, block) < 0) {
+        return TFS_READ_ERROR;
+    }
+
+    int k;
+    for (k = 0; k < BUCKET_SLOTS; k++) {
+        char *entry = block + BLOCK_HEADER_SIZE + BUCKET_ENTRIES + k * DIRENT_SIZE;
+        int ino = get_int(entry + DIRENT_INODE);
+        if (ino != 0 && strncmp(entry + DIRENT_NAME, name, TFS_MAX_NAME + 1) == 0) {
+            if (kind != NULL) {
+                *kind = entry[DIRENT_KIND];
+            }
+            return ino;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Adds an entry to a directory. When the target bucket is full it is split
+ * in two on the next hash bit (doubling the directory's table first if the
+ * bucket already uses every bit the table has), then the insert is retried.
+ */
+static int dir_insert(fileMetadata *dir, char *name, int ino, int kind) {
+    uint32_t hash = dir_hash(name);
+    char block[BLOCKSIZE];
+
+    while (1) {
+        int bNum = dir->block_map[hash & (dir->map_len - 1)];
+        if (read_fs_block(mounted_disk, bNum, block) < 0) {
+            return TFS_READ_ERROR;
+        }
+        char *p = block + BLOCK_HEADER_SIZE;
+        int depth = p[BUCKET_DEPTH];
+        int k;
+
+        if (p[BUCKET_COUNT] < BUCKET_SLOTS) {
+            for (k = 0; k < BUCKET_SLOTS; k++) {
+                char *entry = p + BUCKET_ENTRIES + k * DIRENT_SIZE;
+                if (get_int(entry + DIRENT_INODE) == 0) {
+                    put_int(entry + DIRENT_INODE, ino);
+                    entry[DIRENT_KIND] = (char)kind;
+                    memset(entry + DIRENT_NAME, 0, DIRENT_SIZE - DIRENT_NAME);
+                    strncpy(entry + DIRENT_NAME, name, TFS_MAX_NAME);
+                    break;
+                }
+            }
+            p[BUCKET_COUNT]++;
+            return write_fs_block(mounted_disk, bNum, block) < 0 ? TFS_WRITE_ERROR : TFS_SUCCESS;
+        }
+
+        // Bucket is full: split it
+        stats.bucket_splits++;
+        if (depth == dir_depth(dir)) {
+            if (depth >= DIR_MAX_DEPTH) {
+                return TFS_DISK_FULL;
+            }
+            int *grown = pool_realloc(dir->block_map, sizeof(int) * dir->map_len * 2);
+            if (grown == NULL) {
+                return TFS_MEMORY_ERROR;
+            }
+            memcpy(grown + dir->map_len, grown, sizeof(int) * dir->map_len);
+            dir->block_map = grown;
+            dir->map_len *= 2;
+        }
+
+        int new_bNum = find_meta_block(dir->inode);
+        if (new_bNum < 0) {
+            return new_bNum;
+        }
+        char new_block[BLOCKSIZE] = {0};
+        char *q = new_block + BLOCK_HEADER_SIZE;
+        new_block[0] = 6; // Block type = directory bucket
+        new_block[1] = 0x44; // Magic number
+
+        int moved = 0;
+        for (k = 0; k < BUCKET_SLOTS; k++) {
+            char *entry = p + BUCKET_ENTRIES + k * DIRENT_SIZE;
+            if ((dir_hash(entry + DIRENT_NAME) >> depth) & 1) {
+                memcpy(q + BUCKET_ENTRIES + moved * DIRENT_SIZE, entry, DIRENT_SIZE);
+                memset(entry, 0, DIRENT_SIZE);
+                moved++;
+            }
+        }
+        p[BUCKET_DEPTH] = (char)(depth + 1);
+        p[BUCKET_COUNT] -= moved;
+        q[BUCKET_DEPTH] = (char)(depth + 1);
+        q[BUCKET_COUNT] = (char)moved;
+
+        int s;
+        for (s = 0; s < dir->map_len; s++) {
+            if (dir->block_map[s] == bNum && ((s >> depth) & 1)) {
+                dir->block_map[s] = new_bNum;
+            }
+        }
+        if (write_fs_block(mounted_disk, bNum, block) < 0 ||
+            write_fs_block(mounted_disk, new_bNum, new_block) < 0) {
+            return TFS_WRITE_ERROR;
+        }
+        int ret = save_inode(dir);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+}
+
+/*
+ * Removes 'name' from a directory
+ */
+static int dir_remove(fileMetadata *dir, char *name) {
+    char block[BLOCKSIZE];
+    int bNum = dir->block_map[dir_hash(name) & (dir->map_len - 1)];
+    if (read_fs_block(mounted_disk, bNum, block) < 0) {
+        return TFS_READ_ERROR;
+    }
+
+    int k;
+    for (k = 0; k < BUCKET_SLOTS; k++) {
+        char *entry = block + BLOCK_HEADER_SIZE + BUCKET_ENTRIES + k * DIRENT_SIZE;
+        if (get_int(entry + DIRENT_INODE) != 0 &&
+            strncmp(entry + DIRENT_NAME, name, TFS_MAX_NAME + 1) == 0) {
+            memset(entry, 0, DIRENT_SIZE);
+            block[BLOCK_HEADER_SIZE + BUCKET_COUNT]--;
+            return write_fs_block(mounted_disk, bNum, block) < 0 ? TFS_WRITE_ERROR : TFS_SUCCESS;
+        }
+    }
+    return TFS_FILE_NOT_FOUND;
+}
+
+/*
+ * True if table slot 's' points at a bucket already seen at a lower slot.
+ * A bucket with local depth d owns every slot with the same low d bits, so
+ * slot s repeats slot s minus its highest bit exactly when both hold the
+ * same block.
+ */
+static int dir_slot_is_duplicate(fileMetadata *dir, int s) {
+    int high = 1;
+    if (s == 0) {
+        return 0;
+    }
+    while (high * 2 <= s) {
+        high *= 2;
+    }
+    return dir->block_map[s] == dir->block_map[s - high];
+}
+
+/*
+ * Calls 'visit' for every entry of a directory, reading each bucket once.
+ * Stops early and returns the first non-zero value 'visit' returns.
+ */
+static int dir_for_each(fileMetadata *dir, int (*visit)(char *name, int ino, int kind, void *arg), void *arg) {
+    char block[BLOCKSIZE];
+    int s, k;
+    for (s = 0; s < dir->map_len; s++) {
+        if (dir_slot_is_duplicate(dir, s)) {
+            continue;
+        }
+        if (read_fs_block(mounted_disk, dir->block_map[s], block) < 0) {
+            return TFS_READ_ERROR;
+        }
+        for (k = 0; k < BUCKET_SLOTS; k++) {
+            char *entry = block + BLOCK_HEADER_SIZE + BUCKET_ENTRIES + k * DIRENT_SIZE;
+            int ino = get_int(entry + DIRENT_INODE);
+            if (ino != 0) {
+                char name[TFS_MAX_NAME + 1];
+                strncpy(name, entry + DIRENT_NAME, TFS_MAX_NAME);
+                name[TFS_MAX_NAME] = '\0';
+                int ret = visit(name, ino, entry[DIRENT_KIND], arg);
+                if (ret != 0) {
+                    return ret;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+typedef struct {
+    char *path;
+    int (*visit)(char *path, int ino, int kind, void *arg);
+    void *arg;
+} treeWalk;
+
+static int walk_entry(char *name, int ino, int kind, void *arg);
+
+/*
+ * Calls 'visit' with the full path of every file and directory below
+ * directory 'ino' (whose path is 'path'), parents before children.
+ */
+static int walk_tree(int ino, char *path, int (*visit)(char *path, int ino, int kind, void *arg), void *arg) {
+    fileMetadata *dir;
+    int ret = get_dir(ino, &dir);
+    if (ret < 0) {
+        return ret;
+    }
+    treeWalk walk = { path, visit, arg };
+    return dir_for_each(dir, walk_entry, &walk);
+}
+
+static int walk_entry(char *name, int ino, int kind, void *arg) {
+    treeWalk *walk = arg;
+    char path[TFS_MAX_PATH];
+    snprintf(path, sizeof(path), "%s/%s", strcmp(walk->path, "/") == 0 ? "" : walk->path, name);
+
+    int ret = walk->visit(path, ino, kind, walk->arg);
+    if (ret == 0 && kind == INODE_DIR) {
+        ret = walk_tree(ino, path, walk->visit, walk->arg);
+    }
+    return ret;
+}
+
+/*
+ * Finds the directory that should hold 'path' and copies the last path
+ * component to 'leaf'. Paths are absolute ("/a/b") or taken relative to
+ * the root directory ("a/b").
+ */
+static int resolve_parent(char *path, fileMetadata **parent, char *leaf) {
+    char copy[TFS_MAX_PATH];
+    if (path == NULL || strlen(path) >= TFS_MAX_PATH) {
+        return TFS_INVALID_NAME;
+    }
+    strcpy(copy, path);
+
+    fileMetadata *dir;
+    int ret = get_dir(root_inode, &dir);
+    if (ret < 0) {
+        return ret;
+    }
+
+    char *save = NULL;
+    char *component = strtok_r(copy, "/", &save);
+    if (component == NULL) {
+        return TFS_INVALID_NAME; // "" or "/"
+    }
+    while (1) {
+        if (strlen(component) > TFS_MAX_NAME) {
+            return TFS_INVALID_NAME;
+        }
+        char *next = strtok_r(NULL, "/", &save);
+        if (next == NULL) {
+            break;
+        }
+
+        int kind;
+        int ino = dir_lookup(dir, component, &kind);
+        if (ino < 0) {
+            return ino;
+        }
+        if (ino == 0) {
+            return TFS_FILE_NOT_FOUND;
+        }
+        if (kind != INODE_DIR) {
+            return TFS_NOT_A_DIRECTORY;
+        }
+        if ((ret = get_dir(ino, &dir)) < 0) {
+            return ret;
+        }
+        component = next;
+    }
+
+    strcpy(leaf, component);
+    *parent = dir;
+    return TFS_SUCCESS;
+}
+
+/*
+ * Finds the inode 'path' names and its kind. "/" is the root directory.
+ */
+static int resolve_path(char *path, int *ino, int *kind) {
+    if (path != NULL && strspn(path, "/") == strlen(path)) {
+        *ino = root_inode;
+        *kind = INODE_DIR;
+        return TFS_SUCCESS;
+    }
+
+    fileMetadata *parent;
+    char leaf[TFS_MAX_NAME + 1];
+    int ret = resolve_parent(path, &parent, leaf);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = dir_lookup(parent, leaf, kind);
+    if (ret <= 0) {
+        return ret < 0 ? ret : TFS_FILE_NOT_FOUND;
+    }
+    *ino = ret;
+    return TFS_SUCCESS;
+}
+
+/*
+ * Counts one reference to a data or attribute block. On a TFS_MOUNT_DEDUP
+ * mount a block seen for the first time also goes into the dedup index,
+ * so data written before the mount is shared too. A block that can't be
+ * read is left out of the index and found by fsck instead.
+ */
+static int count_block_ref(int bNum) {
+    int refs = ref_count(bNum);
+    if (set_ref_count(bNum, refs + 1) < 0) {
+        return TFS_MEMORY_ERROR;
+    }
+    char block[BLOCKSIZE];
+    if (refs == 0 && dedup_enabled && read_fs_block(mounted_disk, bNum, block) == TFS_SUCCESS) {
+        dedup_insert(bNum, block_fingerprint(block)); // without memory it just isn't shared
+    }
+    return TFS_SUCCESS;
+}
+
+/*
+ * Counts one reference for every data block of a file
+ */
+static int count_file_refs(char *path, int ino, int kind, void *arg) {
+    if (kind != INODE_FILE) {
+        return 0;
+    }
+    fileMetadata meta;
+    int ret = load_inode(ino, &meta);
+    if (ret < 0) {
+        return ret;
+    }
+    int i;
+    for (i = 0; i < meta.map_len && ret == 0; i++) {
+        if (meta.block_map[i] != 0) {
+            ret = count_block_ref(meta.block_map[i]);
+        }
+    }
+    if (meta.xattr_block != 0 && ret == 0 && (ret = count_block_ref(meta.xattr_block)) == 0) {
+        block_refs[meta.xattr_block].attrs = 1;
+    }
+    drop_inode(&meta);
+    return ret;
+}
+
+/*
+Makes a blank TinyFS file system of size nBytes on the unix file
+specified by ‘filename’. This function should use the emulated disk
+library to open the specified unix file, and upon success, format the
+file to be a mountable disk. This includes initializing all data to 0x00,
+setting magic numbers, initializing and writing the superblock and
+inodes, etc. Must return a specified success/error code.
+*/
+static int make_fs(char *filename, int nBytes) {
+    int disk = openDisk(filename, nBytes);
+    if (disk < 0) {
+        return TFS_DISK_FAILURE;
+    }
+
+    int num_blocks = nBytes / BLOCKSIZE;
+    char block[BLOCKSIZE] = {0};
+    char *p = block + BLOCK_HEADER_SIZE;
+
+    // Superblock, root directory inode and its first bucket
+    if (num_blocks < 4) {
+        closeDisk(disk);
+        return TFS_ERROR;
+    }
+
+    // Initialize superblock
+    block[0] = 1; // Block type = superblock
+    block[1] = 0x44; // Magic number
+    put_int(p + SB_FREE_HEAD, 3); // Pointer to first free block
+    put_int(p + SB_ROOT_INODE, 1);
+    put_int(p + SB_BLOCK_COUNT, num_blocks);
+    put_int(p + SB_BLOCK_SIZE, BLOCKSIZE);
+    put_int(p + SB_FLAGS, SB_FLAG_CHECKSUMMED);
+
+    int ret = write_fs_block(disk, 0, block) < 0 ? TFS_WRITE_ERROR : TFS_SUCCESS;
+
+    // Root directory: an inode with a single empty hash bucket
+    memset(block, 0, BLOCKSIZE);
+    long long now = time(NULL);
+    block[0] = 2; // Block type = inode
+    block[1] = 0x44; // Magic number
+    p[INODE_KIND] = INODE_DIR;
+    memcpy(p + INODE_CTIME, &now, sizeof(now));
+    put_int(p + INODE_MAP_LEN, 1);
+    put_int(p + INODE_PARENT, 1);
+    put_int(p + INODE_DIRECT, 2);
+    if (ret == TFS_SUCCESS && write_fs_block(disk, 1, block) < 0) {
+        ret = TFS_WRITE_ERROR;
+    }
+
+    memset(block, 0, BLOCKSIZE);
+    block[0] = 6; // Block type = directory bucket
+    block[1] = 0x44; // Magic number
+    if (ret == TFS_SUCCESS && write_fs_block(disk, 2, block) < 0) {
+        ret = TFS_WRITE_ERROR;
+    }
+
+    // Initialize free blocks
+    int i;
+    for (i = 3; i < num_blocks && ret == TFS_SUCCESS; i++) {
+        memset(block, 0, BLOCKSIZE);
+        block[0] = 4; // Block type = free
+        block[1] = 0x44; // Magic number
+        put_int(p + FREE_NEXT, (i == num_blocks - 1) ? 0 : i + 1); // Link to the next free block or 0 if the last block
+
+        if (write_fs_block(disk, i, block) < 0) {
+            ret = TFS_WRITE_ERROR;
+        }
+    }
+
+    closeDisk(disk);
+    return ret;
+}
+
+int tfs_mkfs(char *filename, int nBytes) {
+    struct timespec start;
+    int prev = op_begin(TFS_OP_MKFS, &start);
+    return op_end(prev, &start, make_fs(filename, nBytes));
+}
+
+/*
+mounts a TinyFS file system located within given diskname.
+As part of the mount operation, tfs_mount should verify the file
+system is the correct type. In tinyFS, only one file system may be
+mounted at a time. Use tfs_unmount to cleanly unmount the currently
+mounted file system. Must return a specified success/error code.
+*/
+int tfs_mount(char *diskname) {
+    return tfs_mountWithOptions(diskname, 0);
+}
+
+/*
+Same as tfs_mount, but takes a bitmask of TFS_MOUNT_* options.
+TFS_MOUNT_NO_CHECKSUM turns off block checksum verification on reads
+and checksum updates on writes for the lifetime of the mount.
+TFS_MOUNT_DEDUP shares identical data blocks between files.
+*/
+static int mount_disk(char *diskname, int options) {
+    if (mounted_disk != -1) {
+        return TFS_DISK_ALREADY_MOUNTED;
+    }
+
+    int disk = openDisk(diskname, 0);
+    if (disk < 0) {
+        return TFS_DISK_FAILURE;
+    }
+
+    checksums_enabled = !(options & TFS_MOUNT_NO_CHECKSUM);
+    checksums_required = 0; // known once the superblock is read
+    dedup_enabled = (options & TFS_MOUNT_DEDUP) ? 1 : 0;
+
+    char block[BLOCKSIZE];
+    int ret = read_fs_block(disk, 0, block);
+    if (ret < 0) {
+        closeDisk(disk);
+        return ret == TFS_CHECKSUM_ERROR ? TFS_INVALID_FILESYSTEM : TFS_READ_ERROR;
+    }
+
+    if (block[0] != 1 || block[1] != 0x44) {
+        closeDisk(disk);
+        return TFS_INVALID_FILESYSTEM;
+    }
+
+    // The file system may end before the disk does (a direct I/O disk is
+    // padded to a whole sector), but never after it
+    int blocks = get_int(block + BLOCK_HEADER_SIZE + SB_BLOCK_COUNT);
+    int block_size = get_int(block + BLOCK_HEADER_SIZE + SB_BLOCK_SIZE);
+    if (blocks == 0) {
+        blocks = diskBlocks(disk);
+    }
+    if ((block_size != 0 && block_size != BLOCKSIZE) || blocks > diskBlocks(disk)) {
+        closeDisk(disk);
+        return TFS_INVALID_FILESYSTEM;
+    }
+
+    // On a disk whose blocks all carry checksums a block without one is
+    // damaged, the superblock included. A mount that writes none clears
+    // the flag first.
+    int sb_flags = get_int(block + BLOCK_HEADER_SIZE + SB_FLAGS);
+    if ((sb_flags & SB_FLAG_CHECKSUMMED) && checksums_enabled) {
+        if (!(block[3] & BLOCK_FLAG_CHECKSUM)) {
+            closeDisk(disk);
+            return TFS_INVALID_FILESYSTEM;
+        }
+        checksums_required = 1;
+    } else if (sb_flags & SB_FLAG_CHECKSUMMED) {
+        put_int(block + BLOCK_HEADER_SIZE + SB_FLAGS, sb_flags & ~SB_FLAG_CHECKSUMMED);
+        if (write_fs_block(disk, 0, block) < 0) {
+            closeDisk(disk);
+            return TFS_WRITE_ERROR;
+        }
+    }
+
+    mounted_disk = disk;
+    root_inode = get_int(block + BLOCK_HEADER_SIZE + SB_ROOT_INODE);
+
+    // On a disk made of two tiers the allocator keeps metadata and hot
+    // files on the fast device
+    int fast = diskFastBlocks(disk);
+    fast_blocks = (fast > 0 && fast < blocks) ? fast : 0;
+    fast_reads = slow_reads = blocks_promoted = blocks_demoted = 0;
+
+    // Rebuild the in-core free index and the reference counts of all data
+    // blocks in the tree
+    fileMetadata *root;
+    ret = cache_init();
+    if (ret == TFS_SUCCESS) {
+        ret = load_free_index(disk, get_int(block + BLOCK_HEADER_SIZE + SB_FREE_HEAD), blocks);
+    }
+    if (ret == TFS_SUCCESS) {
+        ret = get_dir(root_inode, &root);
+    }
+    if (ret == TFS_SUCCESS) {
+        ret = walk_tree(root_inode, "/", count_file_refs, NULL);
+    }
+    if (ret < 0) {
+        tfs_unmount();
+        return ret == TFS_MEMORY_ERROR ? ret : TFS_INVALID_FILESYSTEM;
+    }
+    return TFS_SUCCESS;
+}
+
+int tfs_mountWithOptions(char *diskname, int options) {
+    struct timespec start;
+    int prev = op_begin(TFS_OP_MOUNT, &start);
+    return op_end(prev, &start, mount_disk(diskname, options));
+}
+
+/*
+unmounts the currently mounted file system. Must return a specified success/error code.
+Appended data and access times still in memory are written first; if that
+fails the disk is still unmounted and the first error is returned.
+*/
+static int unmount_disk(void) {
+    if (mounted_disk == -1) {
+        return TFS_DISK_NOT_OPEN;
+    }
+    if (cache_pinned > 0) {
+        return TFS_BUSY; // read views still point into the block cache
+    }
+
+    // Appended data and access times still in memory go to disk first
+    int i, j, ret = TFS_SUCCESS, err;
+    for (i = 0; i < num_fd; i++) {
+        if ((err = flush_appends(&file_md[i], 1)) < 0 && ret == TFS_SUCCESS) {
+            ret = err;
+        }
+        if ((err = save_access_time(&file_md[i])) < 0 && ret == TFS_SUCCESS) {
+            ret = err;
+        }
+    }
+
+    // Snapshots live only in memory, so they end here: the blocks that
+    // only they (or open snapshot views) still use go back on the free list
+    for (i = 0; i < num_snapshots; i++) {
+        for (j = 0; j < snapshots[i].num_files; j++) {
+            free_file_blocks(&snapshots[i].files[j].meta);
+        }
+    }
+    for (i = 0; i < num_fd; i++) {
+        if (file_md[i].snapshot_id != 0) {
+            free_file_blocks(&file_md[i]);
+        }
+    }
+
+    // Take everything away from lock-free readers and wait for the ones
+    // still reading, which also puts their deferred blocks on the free list
+    for (i = 0; i < num_fd; i++) {
+        drop_cursor(file_md[i].cursor);
+    }
+    if (fd_table != NULL) {
+        retire(&fd_table->rcu);
+        __atomic_store_n(&fd_table, NULL, __ATOMIC_RELEASE);
+    }
+    fd_table_stale = 0;
+    wait_for_readers();
+
+    closeDisk(mounted_disk);
+    mounted_disk = -1;
+    root_inode = 0;
+    num_deferred = 0; // frees the disk never took; their blocks stay lost
+
+    // Everything is on disk now; just drop the in-core state
+    for (i = 0; i < num_fd; i++) {
+        drop_inode(&file_md[i]);
+    }
+    pool_free(file_md);
+    file_md = NULL;
+    num_fd = 0;
+
+    while (num_dirs_cached > 0) {
+        drop_cached_dir(0);
+    }
+    pool_free(dir_cache);
+    dir_cache = NULL;
+    dir_hand = 0;
+
+    for (i = 0; i < num_snapshots; i++) {
+        for (j = 0; j < snapshots[i].num_files; j++) {
+            drop_inode(&snapshots[i].files[j].meta);
+        }
+        free(snapshots[i].files);
+    }
+    free(snapshots);
+    snapshots = NULL;
+    num_snapshots = 0;
+
+    free(block_refs);
+    block_refs = NULL;
+    refs_len = 0;
+    drop_free_index();
+    cache_drop();
+    pool_trim();
+    free(defrag_pass.files);
+    free(migrate_pass.files);
+    memset(&defrag_pass, 0, sizeof(defrag_pass));
+    memset(&migrate_pass, 0, sizeof(migrate_pass));
+    free(dedup_index);
+    dedup_index = NULL;
+    dedup_cap = 0;
+    dedup_used = 0;
+    dedup_enabled = 0;
+    memset(&dedup_stats, 0, sizeof(dedup_stats));
+    return ret;
+}
+
+int tfs_unmount(void) {
+    struct timespec start;
+    int prev = op_begin(TFS_OP_UNMOUNT, &start);
+    return op_end(prev, &start, unmount_disk());
+}
+
+/*
+Creates or Opens a file for reading and writing on the currently
+mounted file system. Creates a dynamic resource table entry for the file,
+and returns a file descriptor (integer) that can be used to reference
+this entry while the filesystem is mounted. 'name' may be a path such as
+"/dir/file"; every directory on the way must already exist.
+*/
+static int open_file(char *name) {
+    if (mounted_disk == -1) {
+        return TFS_DISK_NOT_OPEN;
+    }
+
+    fileMetadata *parent;
+    char leaf[TFS_MAX_NAME + 1];
+    int ret = resolve_parent(name, &parent, leaf);
+    if (ret < 0) {
+        return ret;
+    }
+
+    int kind;
+    int ino = dir_lookup(parent, leaf, &kind);
+    if (ino < 0) {
+        return ino;
+    }
+    if (ino > 0 && kind == INODE_DIR) {
+        return TFS_IS_A_DIRECTORY;
+    }
+
+    int i;
+    for (i = 0; i < num_fd; i++) {
+        if (file_md[i].snapshot_id == 0 && file_md[i].inode == ino) {
+            return i; // File is already open, return its descriptor
+        }
+    }
+
+    fileMetadata *meta = pool_realloc(file_md, sizeof(fileMetadata) * (num_fd + 1));
+    if (meta == NULL) {
+        return TFS_MEMORY_ERROR;
+    }
+    file_md = meta;
+
+    fileMetadata *new_meta = &file_md[num_fd];
+    if (ino > 0) {
+        if ((ret = load_inode(ino, new_meta)) < 0) {
+            return ret;
+        }
+    } else {
+        // Create the file: a new inode with an empty block map
+        ino = find_meta_block(parent->inode);
+        if (ino < 0) {
+            return ino;
+        }
+        memset(new_meta, 0, sizeof(*new_meta));
+        new_meta->inode = ino;
+        new_meta->parent = parent->inode;
+        new_meta->start_block = -1;
+        new_meta->creation_t = time(NULL);
+        new_meta->modified_t = new_meta->creation_t;
+        new_meta->accessed_t = new_meta->creation_t;
+        new_meta->chunk_index = -1;
+        if ((ret = save_inode(new_meta)) < 0 ||
+            (ret = dir_insert(parent, leaf, ino, INODE_FILE)) < 0) {
+            free_block(ino);
+            return ret;
+        }
+    }
+    strcpy(new_meta->name, leaf);
+    if ((new_meta->cursor = new_cursor()) == NULL) {
+        drop_inode(new_meta);
+        return TFS_MEMORY_ERROR;
+    }
+
+    num_fd++;
+    fd_table_stale = 1;
+    return num_fd - 1;
+}
+
+fileDescriptor tfs_openFile(char *name) {
+    struct timespec start;
+    int prev = op_begin(TFS_OP_OPEN, &start);
+    return op_end(prev, &start, open_file(name));
+}
+
+/*
+Closes the file, de-allocates all system resources, and removes table entry.
+*/
+static int close_file(fileDescriptor FD) {
+    if (mounted_disk == -1) {
+        return TFS_DISK_NOT_OPEN;
+    }
+
+    if (FD < 0 || FD >= num_fd) {
+        return TFS_FILE_NOT_OPEN;
+    }
+
+    int ret = flush_appends(&file_md[FD], 1);
+    if (ret < 0 || (ret = save_access_time(&file_md[FD])) < 0) {
+        return ret;
+    }
+    if (file_md[FD].snapshot_id != 0) {
+        // A snapshot view holds its own references to the snapshot's blocks
+        if (free_file_blocks(&file_md[FD]) < 0) {
+            return TFS_WRITE_ERROR;
+        }
+    }
+    // The inode is written whenever it changes, so only memory is left to free
+    drop_inode(&file_md[FD]);
+    drop_cursor(file_md[FD].cursor);
+
+    // Shift all file descriptors after FD one position left to remove FD
+    int i;
+    for (i = FD; i < num_fd - 1; i++) {
+        file_md[i] = file_md[i + 1];
+    }
+
+    num_fd--; // the table keeps its memory for the next open
+
+    return TFS_SUCCESS;
+}
+
+int tfs_closeFile(fileDescriptor FD) {
+    struct timespec start;
+    int prev = op_begin(TFS_OP_CLOSE, &start);
+    return op_end(prev, &start, close_file(FD));
+}
+
+
+/*
+ * Returns the first block of a run of 'len' free blocks at or after
+ * 'goal', wrapping around the end of the disk, or 0 if there is none
+ */
+static int find_free_run(int goal, int len) {
+    int i, run = 0;
+    for (i = 0; i < disk_blocks; i++) {
+        int bNum = (goal + i) % disk_blocks;
+        if (bNum == 0) {
+            run = 0; // a run can't wrap around the end of the disk
+        }
+        if (group_free[group_of(bNum)] == 0) {
+            // Skip the rest of a full group
+            int skip = TFS_ALLOC_GROUP_BLOCKS - bNum % TFS_ALLOC_GROUP_BLOCKS - 1;
+            i += skip;
+            run = 0;
+        } else if (!free_map[bNum]) {
+            run = 0;
+        } else if (++run == len) {
+            return bNum - len + 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Allocates a free block as close after 'goal' as possible: 'goal' itself,
+ * else the start of the next run of 'run' free blocks, else the next free
+ * block in the same allocation group, else the first free block of the
+ * next group that has one. Asking for a run keeps a file from being
+ * threaded through the small holes left by deleted files. The caller
+ * writes the block right away, so it is only unlinked from the free list.
+ */
+static int find_free_block(int goal, int run) {
+    if (free_head == 0) {
+        return TFS_DISK_FULL; // No free blocks available
+    }
+    if (goal <= 0 || goal >= disk_blocks) {
+        goal = free_head;
+    }
+
+    int bNum = free_map[goal] ? goal : 0;
+    if (bNum == 0 && run > 1) {
+        bNum = find_free_run(goal, run);
+    }
+    if (bNum == 0) {
+        int group = group_of(goal);
+        int end = (group + 1) * TFS_ALLOC_GROUP_BLOCKS;
+        bNum = goal;
+        while (bNum < end && bNum < disk_blocks && !free_map[bNum]) {
+            bNum++;
+        }
+        if (bNum >= end || bNum >= disk_blocks) {
+            int i;
+            for (i = 1; i <= num_groups; i++) {
+                group = (group_of(goal) + i) % num_groups;
+                if (group_free[group] > 0) {
+                    break;
+                }
+            }
+            bNum = group * TFS_ALLOC_GROUP_BLOCKS;
+            while (!free_map[bNum]) {
+                bNum++;
+            }
+        }
+    }
+
+    if (take_free_block(bNum) < 0) {
+        return TFS_WRITE_ERROR;
+    }
+    stats.blocks_allocated++;
+    return bNum;
+}
+
+/*
+ * Whether the fast device of a tiered disk can take 'blocks' more data
+ * blocks and still keep 1/TFS_TIER_RESERVE of itself free for metadata
+ */
+static int tier_room(int blocks) {
+    return fast_blocks > 0 && fast_free - blocks >= fast_blocks / TFS_TIER_RESERVE;
+}
+
+/*
+ * Allocates a block for metadata (an inode, block map block, directory
+ * bucket or attribute block) near 'goal', moving the goal to the start of
+ * the fast device of a tiered disk while that has a free block
+ */
+static int find_meta_block(int goal) {
+    if (fast_blocks > 0 && goal >= fast_blocks && fast_free > 0) {
+        goal = 1;
+    }
+    return find_free_block(goal, 1);
+}
+
+/*
+ * Picks where a new directory should live: the start of the allocation
+ * group with the most free blocks, looking first at the groups after the
+ * parent's so sibling directories spread out. On a tiered disk only the
+ * groups that start on the fast device take part.
+ */
+static int dir_goal(int parent_ino) {
+    int best = group_of(parent_ino);
+    int i;
+    for (i = 1; i < num_groups; i++) {
+        int group = (group_of(parent_ino) + i) % num_groups;
+        if (fast_blocks > 0 && group * TFS_ALLOC_GROUP_BLOCKS >= fast_blocks) {
+            continue;
+        }
+        if (group_free[group] > group_free[best]) {
+            best = group;
+        }
+    }
+    return best == group_of(parent_ino) ? parent_ino : best * TFS_ALLOC_GROUP_BLOCKS;
+}
+
+/*
+ * Where logical block 'index' of a file should go: right after the
+ * nearest earlier block of the file, or after its inode if it has none.
+ * On a tiered disk that stays on the fast device only for the first
+ * TFS_TIER_SMALL_BLOCKS blocks of a file and while tier_room allows it;
+ * otherwise the block goes to the slow device.
+ */
+static int data_goal(fileMetadata *meta, int index) {
+    int i, goal = meta->inode + 1;
+    for (i = index - 1; i >= 0; i--) {
+        if (meta->block_map[i] > 0) {
+            goal = meta->block_map[i] + (index - i);
+            break;
+        }
+    }
+    if (goal < fast_blocks && (index >= TFS_TIER_SMALL_BLOCKS || !tier_room(1))) {
+        goal = fast_blocks;
+    }
+    return goal;
+}
+
+static int ref_count(int bNum) {
+    return bNum < refs_len ? block_refs[bNum].refs : 0;
+}
+
+static int set_ref_count(int bNum, int refs) {
+    if (bNum >= refs_len) {
+        int new_len = refs_len ? refs_len : 64;
+        while (new_len <= bNum) {
+            new_len *= 2;
+        }
+        blockRef *grown = realloc(block_refs, sizeof(blockRef) * new_len);
+        if (grown == NULL) {
+            return TFS_MEMORY_ERROR;
+        }
+        memset(grown + refs_len, 0, sizeof(blockRef) * (new_len - refs_len));
+        block_refs = grown;
+        refs_len = new_len;
+    }
+    block_refs[bNum].refs = refs;
+    return TFS_SUCCESS;
+}
+
+/*
+ * Fingerprint of a data block's content: everything except the checksum
+ * field and checksum flag, which depend on how the block was written.
+ */
+static uint32_t block_fingerprint(char *block) {
+    char head[3] = { block[0], block[1], block[3] & ~BLOCK_FLAG_CHECKSUM };
+    uint32_t crc = crc32c(0, head, sizeof(head));
+    return crc32c(crc, block + BLOCK_HEADER_SIZE, BLOCK_DATA_SIZE);
+}
+
+static int same_content(char *a, char *b) {
+    return a[0] == b[0] && a[1] == b[1] &&
+           (a[3] & ~BLOCK_FLAG_CHECKSUM) == (b[3] & ~BLOCK_FLAG_CHECKSUM) &&
+           memcmp(a + BLOCK_HEADER_SIZE, b + BLOCK_HEADER_SIZE, BLOCK_DATA_SIZE) == 0;
+}
+
+static int dedup_insert(int bNum, uint32_t fingerprint);
+
+/*
+ * Doubles the dedup index (or drops deleted slots) and reinserts every entry
+ */
+static int dedup_grow(void) {
+    dedupEntry *old = dedup_index;
+    int old_cap = dedup_cap;
+    int new_cap = dedup_cap ? dedup_cap * 2 : 64;
+    dedup_index = calloc(new_cap, sizeof(dedupEntry));
+    if (dedup_index == NULL) {
+        dedup_index = old;
+        return TFS_MEMORY_ERROR;
+    }
+    dedup_cap = new_cap;
+    dedup_used = 0;
+
+    int i;
+    for (i = 0; i < old_cap; i++) {
+        if (old[i].block > 0) {
+            dedup_insert(old[i].block, old[i].fingerprint);
+        }
+    }
+    free(old);
+    return TFS_SUCCESS;
+}
+
+static int dedup_insert(int bNum, uint32_t fingerprint) {
+    if ((dedup_used + 1) * 10 >= dedup_cap * 7 && dedup_grow() < 0) {
+        return TFS_MEMORY_ERROR;
+    }
+    int slot = fingerprint & (dedup_cap - 1);
+    while (dedup_index[slot].block > 0) {
+        slot = (slot + 1) & (dedup_cap - 1);
+    }
+    if (dedup_index[slot].block == 0) {
+        dedup_used++;
+    }
+    dedup_index[slot].fingerprint = fingerprint;
+    dedup_index[slot].block = bNum;
+    block_refs[bNum].fingerprint = fingerprint;
+    block_refs[bNum].indexed = 1;
+    return TFS_SUCCESS;
+}
+
+/*
+ * Drops a block from the dedup index, e.g. before its content changes
+ */
+static void dedup_forget(int bNum) {
+    if (bNum >= refs_len || !block_refs[bNum].indexed) {
+        return;
+    }
+    int slot = block_refs[bNum].fingerprint & (dedup_cap - 1);
+    while (dedup_index[slot].block != 0) {
+        if (dedup_index[slot].block == bNum) {
+            dedup_index[slot].block = -1;
+            break;
+        }
+        slot = (slot + 1) & (dedup_cap - 1);
+    }
+    block_refs[bNum].indexed = 0;
+}
+
+/*
+ * Looks for a block already on disk with exactly the content of 'block'.
+ * Fingerprint matches are confirmed by reading the candidate back, so a
+ * collision never links unrelated data. Returns the block number or 0.
+ */
+static int dedup_find(char *block, uint32_t fingerprint) {
+    if (dedup_cap == 0) {
+        return 0;
+    }
+    int slot = fingerprint & (dedup_cap - 1);
+    while (dedup_index[slot].block != 0) {
+        dedupEntry *entry = &dedup_index[slot];
+        if (entry->block > 0 && entry->fingerprint == fingerprint) {
+            char candidate[BLOCKSIZE];
+            if (read_fs_block(mounted_disk, entry->block, candidate) == TFS_SUCCESS &&
+                same_content(block, candidate)) {
+                return entry->block;
+            }
+        }
+        slot = (slot + 1) & (dedup_cap - 1);
+    }
+    return 0;
+}
+
+/*
+ * Stores a filled-in data block and returns the disk block now holding it.
+ * With dedup enabled an identical existing block is shared instead of
+ * writing a new one.
+ */
+static int store_data_block(char *block, int goal) {
+    uint32_t fingerprint = 0;
+    if (dedup_enabled) {
+        dedup_stats.blocks_written++;
+        fingerprint = block_fingerprint(block);
+        int shared = dedup_find(block, fingerprint);
+        if (shared > 0) {
+            dedup_stats.blocks_shared++;
+            set_ref_count(shared, ref_count(shared) + 1);
+            return shared;
+        }
+    }
+
+    int bNum = find_free_block(goal, TFS_ALLOC_MIN_RUN);
+    if (bNum < 0) {
+        return bNum;
+    }
+    if (write_fs_block(mounted_disk, bNum, block) < 0) {
+        free_block(bNum); // nothing points at it yet
+        return TFS_WRITE_ERROR;
+    }
+    if (set_ref_count(bNum, 1) < 0) {
+        free_block(bNum);
+        return TFS_MEMORY_ERROR;
+    }
+    if (dedup_enabled) {
+        dedup_insert(bNum, fingerprint);
+    }
+    return bNum;
+}
+
+/*
+ * Stores a filled-in attribute block and returns the disk block now
+ * holding it. Files with identical attributes share one block, found
+ * through the dedup index whether or not data dedup is on (without
+ * TFS_MOUNT_DEDUP, blocks written before this mount aren't in it until
+ * they are rewritten).
+ */
+static int store_attr_block(char *block, int goal) {
+    uint32_t fingerprint = block_fingerprint(block);
+    int bNum = dedup_find(block, fingerprint);
+    if (bNum > 0) {
+        return set_ref_count(bNum, ref_count(bNum) + 1) < 0 ? TFS_MEMORY_ERROR : bNum;
+    }
+
+    if ((bNum = find_meta_block(goal)) < 0) {
+        return bNum;
+    }
+    if (write_fs_block(mounted_disk, bNum, block) < 0) {
+        free_block(bNum); // nothing points at it yet
+        return TFS_WRITE_ERROR;
+    }
+    if (set_ref_count(bNum, 1) < 0) {
+        free_block(bNum);
+        return TFS_MEMORY_ERROR;
+    }
+    block_refs[bNum].attrs = 1;
+    dedup_insert(bNum, fingerprint); // without memory for the index it just isn't shared
+    return bNum;
+}
+
+/*
+ * Drops one reference to a data (or attribute) block. When no file uses
+ * it any more the block is marked as free and pushed onto the head of the
+ * free list.
+ */
+static int release_block(int bNum) {
+    if (ref_count(bNum) > 1) {
+        block_refs[bNum].refs--;
+        return TFS_SUCCESS;
+    }
+    dedup_forget(bNum);
+    set_ref_count(bNum, 0);
+    block_refs[bNum].attrs = 0;
+    return free_block(bNum);
+}
+
+/*
+ * Stores new content for a file block that currently lives in 'bNum' and
+ * returns the block that holds it afterwards. A block shared with other
+ * files is never patched in place: the new content goes to another block
+ * (copy-on-write) and this file's reference to the old one is dropped.
+ */
+static int replace_data_block(int bNum, char *block) {
+    if (ref_count(bNum) > 1) {
+        int new_block = store_data_block(block, bNum);
+        if (new_block < 0) {
+            return new_block;
+        }
+        dedup_stats.cow_copies++;
+        release_block(bNum);
+        return new_block;
+    }
+
+    if (dedup_enabled) {
+        // The old content is going away, and the new one may already exist
+        dedup_forget(bNum);
+        uint32_t fingerprint = block_fingerprint(block);
+        int shared = dedup_find(block, fingerprint);
+        if (shared > 0) {
+            dedup_stats.blocks_shared++;
+            set_ref_count(shared, ref_count(shared) + 1);
+            release_block(bNum);
+            return shared;
+        }
+        if (write_fs_block(mounted_disk, bNum, block) < 0) {
+            return TFS_WRITE_ERROR;
+        }
+        dedup_insert(bNum, fingerprint);
+        return bNum;
+    }
+
+    if (write_fs_block(mounted_disk, bNum, block) < 0) {
+        return TFS_WRITE_ERROR;
+    }
+    return bNum;
+}
+
+/*
+ * Frees every block in the file's block map and empties the map
+ */
+static int free_file_blocks(fileMetadata *meta) {
+    int i;
+    for (i = 0; i < meta->map_len; i++) {
+        if (meta->block_map[i] != 0 && release_block(meta->block_map[i]) < 0) {
+            return TFS_WRITE_ERROR;
+        }
+    }
+    pool_free(meta->block_map);
+    meta->block_map = NULL;
+    meta->map_len = 0;
+    meta->start_block = -1;
+    meta->chunk_index = -1;
+    return TFS_SUCCESS;
+}
+
+/*
+ * True if all 'len' bytes at 'data' are zero
+ */
+static int is_zero(char *data, int len) {
+    int i;
+    for (i = 0; i < len; i++) {
+        if (data[i] != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Reads logical block 'index' of an uncompressed file. A hole (map entry
+ * 0, or past the end of the map) reads back as zeros without disk I/O.
+ */
+static int read_file_block(fileMetadata *meta, int index, char *block) {
+    if (index >= meta->map_len || meta->block_map[index] == 0) {
+        memset(block, 0, BLOCKSIZE);
+        block[0] = 3; // Data block type
+        block[1] = 0x44; // Magic number
+        return TFS_SUCCESS;
+    }
+    if (read_fs_block(mounted_disk, meta->block_map[index], block) < 0) {
+        return TFS_READ_ERROR;
+    }
+    return TFS_SUCCESS;
+}
+
+/*
+ * Stores new content for logical block 'index' of an uncompressed file.
+ * A hole gets a block allocated; a block that becomes all zeros is
+ * released and turned back into a hole.
+ */
+static int set_file_block(fileMetadata *meta, int index, char *block) {
+    int bNum = meta->block_map[index];
+    if (is_zero(block + BLOCK_HEADER_SIZE, BLOCK_DATA_SIZE)) {
+        if (bNum != 0 && release_block(bNum) < 0) {
+            return TFS_WRITE_ERROR;
+        }
+        meta->block_map[index] = 0;
+        return TFS_SUCCESS;
+    }
+
+    bNum = (bNum == 0) ? store_data_block(block, data_goal(meta, index)) : replace_data_block(bNum, block);
+    if (bNum < 0) {
+        return bNum;
+    }
+    meta->block_map[index] = bNum;
+    return TFS_SUCCESS;
+}
+
+/*
+ * Extends the block map to 'map_len' entries; the new entries are holes
+ */
+static int grow_map(fileMetadata *meta, int map_len) {
+    if (map_len <= meta->map_len) {
+        return TFS_SUCCESS;
+    }
+    int *grown = pool_realloc(meta->block_map, sizeof(int) * map_len);
+    if (grown == NULL) {
+        return TFS_MEMORY_ERROR;
+    }
+    memset(grown + meta->map_len, 0, sizeof(int) * (map_len - meta->map_len));
+    meta->block_map = grown;
+    meta->map_len = map_len;
+    return TFS_SUCCESS;
+}
+
+/*
+ * Number of file bytes held by chunk 'chunk' (the last chunk may be short)
+ */
+static int chunk_length(fileMetadata *meta, int chunk) {
+    int len = meta->size - chunk * COMPRESS_CHUNK_SIZE;
+    return len > COMPRESS_CHUNK_SIZE ? COMPRESS_CHUNK_SIZE : len;
+}
+
+/*
+ * Writes one chunk of a compressed file into its map slots
+ * [chunk * COMPRESS_CHUNK_BLOCKS, (chunk + 1) * COMPRESS_CHUNK_BLOCKS).
+ * The chunk is stored LZ compressed, prefixed by its 2 byte compressed
+ * length, when that saves at least one block; otherwise it is stored raw
+ * exactly like an uncompressed file. Unused slots stay 0. A chunk of
+ * zeros is not stored at all: all its slots stay 0 (a hole).
+ */
+static int write_chunk(fileMetadata *meta, int chunk, char *data, int len) {
+    char packed[COMPRESS_CHUNK_SIZE];
+    int first_slot = chunk * COMPRESS_CHUNK_BLOCKS;
+    int num_blocks = (len + BLOCK_DATA_SIZE - 1) / BLOCK_DATA_SIZE;
+    char *src = data;
+    int src_len = len;
+    int is_packed = 0;
+
+    if (is_zero(data, len)) {
+        return TFS_SUCCESS;
+    }
+
+    int packed_len = lz_compress(data, len, packed + 2, sizeof(packed) - 2);
+    if (packed_len >= 0) {
+        int packed_blocks = (packed_len + 2 + BLOCK_DATA_SIZE - 1) / BLOCK_DATA_SIZE;
+        if (packed_blocks < num_blocks) {
+            packed[0] = (char)(packed_len & 0xFF);
+            packed[1] = (char)(packed_len >> 8);
+            src = packed;
+            src_len = packed_len + 2;
+            num_blocks = packed_blocks;
+            is_packed = 1;
+        }
+    }
+
+    int i;
+    for (i = 0; i < num_blocks; i++) {
+        char block[BLOCKSIZE] = {0};
+        block[0] = 3; // Data block type
+        block[1] = 0x44; // Magic number
+        if (is_packed && i == 0) {
+            block[3] = BLOCK_FLAG_COMPRESSED;
+        }
+        int remaining = src_len - i * BLOCK_DATA_SIZE;
+        memcpy(block + BLOCK_HEADER_SIZE, src + i * BLOCK_DATA_SIZE,
+               remaining > BLOCK_DATA_SIZE ? BLOCK_DATA_SIZE : remaining);
+
+        int bNum = store_data_block(block, data_goal(meta, first_slot + i));
+        if (bNum < 0) {
+            return bNum;
+        }
+        meta->block_map[first_slot + i] = bNum;
+    }
+    return TFS_SUCCESS;
+}
+
+/*
+ * Makes sure chunk 'chunk' of a compressed file is decompressed in the
+ * file's chunk buffer. Only the blocks of that chunk are read.
+ */
+static int load_chunk(fileMetadata *meta, int chunk) {
+    if (meta->chunk_index == chunk) {
+        return TFS_SUCCESS;
+    }
+    if (meta->chunk_buf == NULL) {
+        meta->chunk_buf = pool_alloc(COMPRESS_CHUNK_SIZE);
+        if (meta->chunk_buf == NULL) {
+            return TFS_MEMORY_ERROR;
+        }
+    }
+
+    int first_slot = chunk * COMPRESS_CHUNK_BLOCKS;
+    int len = chunk_length(meta, chunk);
+    char block[BLOCKSIZE];
+    if (meta->block_map[first_slot] == 0) {
+        // A hole: nothing stored, the chunk is all zeros
+        memset(meta->chunk_buf, 0, COMPRESS_CHUNK_SIZE);
+        meta->chunk_index = chunk;
+        return TFS_SUCCESS;
+    }
+    if (read_fs_block(mounted_disk, meta->block_map[first_slot], block) < 0) {
+        return TFS_READ_ERROR;
+    }
+
+    if (!(block[3] & BLOCK_FLAG_COMPRESSED)) {
+        // Raw chunk: copy the blocks straight into the buffer
+        int i;
+        for (i = 0; i * BLOCK_DATA_SIZE < len; i++) {
+            if (i > 0 && read_fs_block(mounted_disk, meta->block_map[first_slot + i], block) < 0) {
+                return TFS_READ_ERROR;
+            }
+            int remaining = len - i * BLOCK_DATA_SIZE;
+            memcpy(meta->chunk_buf + i * BLOCK_DATA_SIZE, block + BLOCK_HEADER_SIZE,
+                   remaining > BLOCK_DATA_SIZE ? BLOCK_DATA_SIZE : remaining);
+        }
+    } else {
+        char packed[COMPRESS_CHUNK_SIZE];
+        int packed_len = (unsigned char)block[BLOCK_HEADER_SIZE] |
+                         ((unsigned char)block[BLOCK_HEADER_SIZE + 1] << 8);
+        int total = packed_len + 2;
+        if (total > COMPRESS_CHUNK_SIZE) {
+            return TFS_INVALID_FILESYSTEM;
+        }
+
+        int i;
+        for (i = 0; i * BLOCK_DATA_SIZE < total; i++) {
+            if (i > 0 && read_fs_block(mounted_disk, meta->block_map[first_slot + i], block) < 0) {
+                return TFS_READ_ERROR;
+            }
+            int remaining = total - i * BLOCK_DATA_SIZE;
+            memcpy(packed + i * BLOCK_DATA_SIZE, block + BLOCK_HEADER_SIZE,
+                   remaining > BLOCK_DATA_SIZE ? BLOCK_DATA_SIZE : remaining);
+        }
+        if (lz_decompress(packed + 2, packed_len, meta->chunk_buf, COMPRESS_CHUNK_SIZE) != len) {
+            return TFS_INVALID_FILESYSTEM;
+        }
+    }
+
+    meta->chunk_index = chunk;
+    return TFS_SUCCESS;
+}
+
+/*
+ * Replaces chunk 'chunk' of a compressed file with the contents of the
+ * chunk buffer, releasing the blocks of the old version first.
+ */
+static int rewrite_chunk(fileMetadata *meta, int chunk) {
+    int first_slot = chunk * COMPRESS_CHUNK_BLOCKS;
+    int i;
+    for (i = 0; i < COMPRESS_CHUNK_BLOCKS && first_slot + i < meta->map_len; i++) {
+        if (meta->block_map[first_slot + i] != 0) {
+            if (release_block(meta->block_map[first_slot + i]) < 0) {
+                return TFS_WRITE_ERROR;
+            }
+            meta->block_map[first_slot + i] = 0;
+        }
+    }
+    int ret = write_chunk(meta, chunk, meta->chunk_buf, chunk_length(meta, chunk));
+    meta->start_block = meta->block_map[0];
+    return ret;
+}
+
+
+/*
+ * Gives a file with no blocks a new block map for 'size' bytes and writes
+ * 'buffer' into it, compressed or not as the file is set up. On failure
+ * the blocks written so far stay in the map for the caller to free.
+ */
+static int write_layout(fileMetadata *meta, char *buffer, int size) {
+    int total_blocks = (size + BLOCK_DATA_SIZE - 1) / BLOCK_DATA_SIZE;
+    if (meta->compressed) {
+        // Map slots are reserved for whole chunks, even the short last one
+        int chunks = (size + COMPRESS_CHUNK_SIZE - 1) / COMPRESS_CHUNK_SIZE;
+        total_blocks = chunks * COMPRESS_CHUNK_BLOCKS;
+    }
+    meta->block_map = pool_calloc(total_blocks > 0 ? total_blocks : 1, sizeof(int));
+    if (meta->block_map == NULL) {
+        return TFS_MEMORY_ERROR;
+    }
+    meta->map_len = total_blocks;
+    meta->size = size;
+
+    int ret = TFS_SUCCESS;
+    int i;
+    if (meta->compressed) {
+        for (i = 0; i * COMPRESS_CHUNK_SIZE < size && ret == TFS_SUCCESS; i++) {
+            ret = write_chunk(meta, i, buffer + i * COMPRESS_CHUNK_SIZE, chunk_length(meta, i));
+        }
+    } else {
+        int remaining_size = size;
+        for (i = 0; i < total_blocks; i++) {
+            // Write the data to the current block
+            char block[BLOCKSIZE] = {0};
+            block[0] = 3; // Data block type
+            block[1] = 0x44; // Magic number
+            int bytes_to_write = (remaining_size > BLOCK_DATA_SIZE) ? BLOCK_DATA_SIZE : remaining_size;
+            memcpy(block + BLOCK_HEADER_SIZE, buffer + i * BLOCK_DATA_SIZE, bytes_to_write);
+            remaining_size -= bytes_to_write;
+            if (is_zero(block + BLOCK_HEADER_SIZE, bytes_to_write)) {
+                continue; // leave a hole, it reads back as zeros
+            }
+
+            int cur_block = store_data_block(block, data_goal(meta, i));
+            if (cur_block < 0) {
+                ret = cur_block;
+                break;
+            }
+            meta->block_map[i] = cur_block;
+        }
+    }
+    if (ret == TFS_SUCCESS) {
+        meta->start_block = total_blocks > 0 ? meta->block_map[0] : -1;
+    }
+    return ret;
+}
+
+/*
+Writes buffer ‘buffer’ of size ‘size’, which represents an entire
+file’s content, to the file system. Previous content (if any) will be
+completely lost. Sets the file pointer to 0 (the start of file) when
+done. Returns success/error codes. Blocks (or compressed chunks) that
+are all zeros are left as holes and take no disk space.
+*/
+static int write_file(fileDescriptor FD, char *buffer, int size) {
+    if (mounted_disk == -1) {
+        return TFS_DISK_NOT_OPEN;
+    }
+
+    if (FD < 0 || FD >= num_fd) {
+        return TFS_FILE_NOT_OPEN;
+    }
+    if (file_md[FD].read_only) {
+        return TFS_FILE_READ_ONLY;
+    }
+
+    fileMetadata *meta = &file_md[FD];
+    discard_appends(meta); // the new content replaces anything appended
+    meta->modified_t = time(NULL);
+    if (free_file_blocks(meta) < 0) {
+        return TFS_WRITE_ERROR;
+    }
+    __atomic_store_n(&meta->cursor->offset, 0, __ATOMIC_RELAXED);
+
+    int ret = write_layout(meta, buffer, size);
+    if (ret == TFS_SUCCESS) {
+        ret = save_inode(meta);
+    }
+    if (ret < 0) {
+        // Don't leave a half written file behind
+        free_file_blocks(meta);
+        meta->size = 0;
+        save_inode(meta);
+    }
+    return ret;
+}
+
+int tfs_writeFile(fileDescriptor FD, char *buffer, int size) {
+    struct timespec start;
+    int prev = op_begin(TFS_OP_WRITE_FILE, &start);
+    return op_end(prev, &start, write_file(FD, buffer, size));
+}
+
+
+/*
+deletes a file and marks its blocks as free on disk.
+*/
+static int delete_file(fileDescriptor FD) {
+    if (mounted_disk == -1) {
+        return TFS_DISK_NOT_OPEN;
+    }
+
+    if (FD < 0 || FD >= num_fd) {
+        return TFS_FILE_NOT_OPEN;
+    }
+    if (file_md[FD].snapshot_id != 0) {
+        return TFS_FILE_READ_ONLY;
+    }
+
+    fileMetadata *meta = &file_md[FD];
+    fileMetadata *parent;
+    int ret = get_dir(meta->parent, &parent);
+    if (ret < 0) {
+        return ret;
+    }
+    if ((ret = dir_remove(parent, meta->name)) < 0) {
+        return ret;
+    }
+
+    // Data blocks and attributes, then the block map chain, then the inode itself
+    if (free_file_blocks(meta) < 0) {
+        return TFS_WRITE_ERROR;
+    }
+    if (meta->xattr_block != 0 && release_block(meta->xattr_block) < 0) {
+        return TFS_WRITE_ERROR;
+    }
+    int i;
+    for (i = 0; i < meta->num_index_blocks; i++) {
+        if (free_block(meta->index_blocks[i]) < 0) {
+            return TFS_WRITE_ERROR;
+        }
+    }
+    meta->num_index_blocks = 0;
+    if (free_block(meta->inode) < 0) {
+        return TFS_WRITE_ERROR;
+    }
+    drop_inode(meta);
+    drop_cursor(meta->cursor);
+
+    for (i = FD; i < num_fd - 1; i++) {
+        file_md[i] = file_md[i + 1];
+    }
+    num_fd--;
+
+    return TFS_SUCCESS;
+}
+
+int tfs_deleteFile(fileDescriptor FD) {
+    struct timespec start;
+    int prev = op_begin(TFS_OP_DELETE, &start);
+    return op_end(prev, &start, delete_file(FD));
+}
+
+/*
+reads one byte from the file and copies it to buffer, using the
+current file pointer location and incrementing it by one upon success.
+If the file pointer is already past the end of the file then
+tfs_readByte() should return an error and not increment the file pointer
+*/
+static int read_byte(fileDescriptor FD, char *buffer) {
+    if (mounted_disk == -1) {
+        return TFS_DISK_NOT_OPEN;
+    }
+
+    if (FD < 0 || FD >= num_fd) {
+        return TFS_FILE_NOT_OPEN;
+    }
+
+    fileMetadata *meta = &file_md[FD];
+    int flushed = flush_appends(meta, 1);
+    if (flushed < 0) {
+        return flushed;
+    }
+    int pos = __atomic_load_n(&meta->cursor->offset, __ATOMIC_RELAXED);
+    if (pos >= meta->size) {
+        return TFS_EOF;
+    }
+
+    if (meta->compressed) {
+        int ret = load_chunk(meta, pos / COMPRESS_CHUNK_SIZE);
+        if (ret < 0) {
+            return ret;
+        }
+        *buffer = meta->chunk_buf[pos % COMPRESS_CHUNK_SIZE];
+    } else {
+        int offset = pos % BLOCK_DATA_SIZE + BLOCK_HEADER_SIZE; // Data offset within the block, skipping the header
+
+        char block[BLOCKSIZE];
+        if (read_file_block(meta, pos / BLOCK_DATA_SIZE, block) < 0) {
+            return TFS_READ_ERROR;
+        }
+        *buffer = block[offset];
+    }
+
+    __atomic_store_n(&meta->cursor->offset, pos + 1, __ATOMIC_RELAXED);
+    note_read(meta->cursor);
+    return TFS_SUCCESS;
+}
+
+/*
+ * Lock-free tfs_readByte; returns 0 when the call has to take the lock.
+ * The file pointer only moves if nobody moved it during the read, so
+ * threads sharing a descriptor each get a different byte.
+ */
+static int fast_read_byte(fileDescriptor FD, char *buffer, int *ret) {
+    readerThread *reader = get_reader();
+    if (reader == NULL) {
+        return 0;
+    }
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    reader_enter(reader);
+    fileCursor *cursor = reader_cursor(FD);
+    fileVersion *version = cursor ? __atomic_load_n(&cursor->version, __ATOMIC_ACQUIRE) : NULL;
+    int served = (version != NULL && !version->compressed && !version->buffered);
+    if (served) {
+        int pos = __atomic_load_n(&cursor->offset, __ATOMIC_RELAXED);
+        do {
+            if (pos >= version->size) {
+                *ret = TFS_EOF;
+                break;
+            }
+            *ret = read_version(reader, TFS_OP_READ_BYTE, version, buffer, 1, pos);
+        } while (*ret >= 0 && !__atomic_compare_exchange_n(&cursor->offset, &pos, pos + 1, 0,
+                                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+        if (*ret > 0) {
+            *ret = TFS_SUCCESS;
+            note_read(cursor);
+        }
+    }
+    reader_exit(reader);
+    if (served) {
+        count_call(&reader->stats, TFS_OP_READ_BYTE, elapsed_ns(&start), *ret);
+    }
+    return served;
+}
+
+int tfs_readByte(fileDescriptor FD, char *buffer) {
+    struct timespec start;
+    int ret;
+    if (fast_read_byte(FD, buffer, &ret)) {
+        return ret;
+    }
+    int prev = op_begin(TFS_OP_READ_BYTE, &start);
+    return op_end(prev, &start, read_byte(FD, buffer));
+}
+
+/*
+Reads up to 'size' bytes starting at byte 'offset' of the file into
+'buffer' without moving the file pointer. For a compressed file only
+the chunks overlapping the range are read and decompressed. Returns the
+number of bytes read (0 at end of file) or an error code.
+*/
+static int pread_file(fileDescriptor FD, char *buffer, int size, int offset) {
+    if (mounted_disk == -1) {
+        return TFS_DISK_NOT_OPEN;
+    }
+
+    if (FD < 0 || FD >= num_fd) {
+        return TFS_FILE_NOT_OPEN;
+    }
+
+    fileMetadata *meta = &file_md[FD];
+    int flushed = flush_appends(meta, 1);
+    if (flushed < 0) {
+        return flushed;
+    }
+    if (offset < 0 || size < 0) {
+        return TFS_INVALID_SEEK;
+    }
+    if (offset >= meta->size) {
+        return 0;
+    }
+    if (size > meta->size - offset) {
+        size = meta->size - offset;
+    }
+    note_read(meta->cursor);
+
+    int done = 0;
+    while (done < size) {
+        int pos = offset + done;
+        int n;
+        if (meta->compressed) {
+            int ret = load_chunk(meta, pos / COMPRESS_CHUNK_SIZE);
+            if (ret < 0) {
+                return ret;
+            }
+            int in_chunk = pos % COMPRESS_CHUNK_SIZE;
+            n = COMPRESS_CHUNK_SIZE - in_chunk;
+            if (n > size - done) {
+                n = size - done;
+            }
+            memcpy(buffer + done, meta->chunk_buf + in_chunk, n);
+        } else {
+            char block[BLOCKSIZE];
+            int in_block = pos % BLOCK_DATA_SIZE;
+            if (read_file_block(meta, pos / BLOCK_DATA_SIZE, block) < 0) {
+                return TFS_READ_ERROR;
+            }
+            n = BLOCK_DATA_SIZE - in_block;
+            if (n > size - done) {
+                n = size - done;
+            }
+            memcpy(buffer + done, block + BLOCK_HEADER_SIZE + in_block, n);
+        }
+        done += n;
+    }
+
+    return done;
+}
+
+/*
+ * Lock-free tfs_pread; returns 0 when the call has to take the lock
+ */
+static int fast_pread(fileDescriptor FD, char *buffer, int size, int offset, int *ret) {
+    readerThread *reader = get_reader();
+    if (reader == NULL) {
+        return 0;
+    }
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    reader_enter(reader);
+    fileCursor *cursor = reader_cursor(FD);
+    fileVersion *version = cursor ? __atomic_load_n(&cursor->version, __ATOMIC_ACQUIRE) : NULL;
+    int served = (version != NULL && !version->compressed && !version->buffered);
+    if (served) {
+        *ret = read_version(reader, TFS_OP_PREAD, version, buffer, size, offset);
+        if (*ret > 0) {
+            note_read(cursor);
+        }
+    }
+    reader_exit(reader);
+    if (served) {
+        count_call(&reader->stats, TFS_OP_PREAD, elapsed_ns(&start), *ret);
+    }
+    return served;
+}
+
+int tfs_pread(fileDescriptor FD, char *buffer, int size, int offset) {
+    struct timespec start;
+    int ret;
+    if (fast_pread(FD, buffer, size, offset, &ret)) {
+        return ret;
+    }
+    int prev = op_begin(TFS_OP_PREAD, &start);
+    return op_end(prev, &start, pread_file(FD, buffer, size, offset));
+}
+
+/* Segment that lends out the zeros of a hole */
+static const char zero_data[BLOCK_DATA_SIZE];
+
+/*
+ * Adds a segment to a view, growing its arrays as needed
+ */
+static int view_add(tfsReadView *view, const char *data, int len, int pin) {
+    tfsSegment *segments = pool_realloc(view->segments, sizeof(tfsSegment) * (view->num_segments + 1));
+    if (segments == NULL) {
+        return TFS_MEMORY_ERROR;
+    }
+    view->segments = segments;
+    if (pin >= 0) {
+        int *pins = pool_realloc(view->pins, sizeof(int) * (view->num_pins + 1));
+        if (pins == NULL) {
+            return TFS_MEMORY_ERROR;
+        }
+        view->pins = pins;
+        view->pins[view->num_pins++] = pin;
+    }
+    segments[view->num_segments].data = data;
+    segments[view->num_segments].len = len;
+    view->num_segments++;
+    view->len += len;
+    return TFS_SUCCESS;
+}
+
+/*
+ Releases everything a view holds: the pinned cache blocks and its arrays
+*/
+static int unpin_view(tfsReadView *view) {
+    if (view == NULL) {
+        return TFS_ERROR;
+    }
+    int i;
+    for (i = 0; i < view->num_pins; i++) {
+        cache_unpin(view->pins[i]);
+    }
+    pool_free(view->segments);
+    pool_free(view->pins);
+    pool_free(view->copy);
+    memset(view, 0, sizeof(*view));
+    return TFS_SUCCESS;
+}
+
+int tfs_unpinView(tfsReadView *view) {
+    fs_lock();
+    int ret = unpin_view(view);
+    fs_unlock();
+    return ret;
+}
+
+/*
+ Lends out up to 'len' bytes of the file starting at 'offset' without
+ copying them: the view's segments point straight into pinned block cache
+ entries (holes point at shared zeros). The data stays valid and unchanged
+ until tfs_unpinView, even if the file is written in the meantime. Compressed
+ files have no block holding the plain data, so their view is one segment
+ decompressed into memory owned by the view. Returns the bytes covered, which
+ is less than 'len' at the end of the file. A view can pin at most as
+ many blocks as the cache budget holds, less whatever other views hold.
+*/
+static int read_view(fileDescriptor FD, int offset, int len, tfsReadView *view) {
+    if (view == NULL) {
+        return TFS_ERROR;
+    }
+    memset(view, 0, sizeof(*view));
+    if (mounted_disk == -1) {
+        return TFS_DISK_NOT_OPEN;
+    }
+    if (FD < 0 || FD >= num_fd) {
+        return TFS_FILE_NOT_OPEN;
+    }
+
+    fileMetadata *meta = &file_md[FD];
+    int ret = flush_appends(meta, 1);
+    if (ret < 0) {
+        return ret;
+    }
+    if (offset < 0 || len < 0) {
+        return TFS_INVALID_SEEK;
+    }
+    if (offset >= meta->size) {
+        return 0;
+    }
+    if (len > meta->size - offset) {
+        len = meta->size - offset;
+    }
+    note_read(meta->cursor);
+
+    if (meta->compressed) {
+        if ((view->copy = pool_alloc(len > 0 ? len : 1)) == NULL) {
+            return TFS_MEMORY_ERROR;
+        }
+        ret = pread_file(FD, view->copy, len, offset);
+        if (ret < 0 || (ret = view_add(view, view->copy, len, -1)) < 0) {
+            tfs_unpinView(view);
+            return ret;
+        }
+        return view->len;
+    }
+
+    int done = 0;
+    while (done < len) {
+        int pos = offset + done;
+        int index = pos / BLOCK_DATA_SIZE;
+        int in_block = pos % BLOCK_DATA_SIZE;
+        int n = BLOCK_DATA_SIZE - in_block;
+        if (n > len - done) {
+            n = len - done;
+        }
+
+        if (index >= meta->map_len || meta->block_map[index] == 0) {
+            ret = view_add(view, zero_data + in_block, n, -1);
+        } else {
+            int entry = cache_pin(meta->block_map[index]);
+            if (entry < 0) {
+                ret = entry;
+            } else if ((ret = view_add(view, cache->entries[entry].block + BLOCK_HEADER_SIZE + in_block, n, entry)) < 0) {
+                cache_unpin(entry);
+            }
+        }
+        if (ret < 0) {
+            tfs_unpinView(view);
+            return ret;
+        }
+        done += n;
+    }
+    return view->len;
+}
+
+int tfs_readView(fileDescriptor FD, int offset, int len, tfsReadView *view) {
+    struct timespec start;
+    int prev = op_begin(TFS_OP_READ_VIEW, &start);
+    return op_end(prev, &start, read_view(FD, offset, len, view));
+}
+
+
+
+/*
+ * Overwrites chunk 'chunk' of a compressed file, whose size goes from
+ * 'old_size' to 'new_size', with the part of [offset, offset + size) that
+ * falls inside it. Bytes of the chunk past the old end become zeros.
+ */
+static int patch_chunk(fileMetadata *meta, int chunk, int old_size, int new_size,
+                       char *buffer, int offset, int size) {
+    int chunk_start = chunk * COMPRESS_CHUNK_SIZE;
+    int old_len = old_size - chunk_start;
+    int ret;
+
+    if (old_len > 0) {
+        meta->size = old_size;
+        if ((ret = load_chunk(meta, chunk)) < 0) {
+            return ret;
+        }
+    } else {
+        if (meta->chunk_buf == NULL && (meta->chunk_buf = pool_alloc(COMPRESS_CHUNK_SIZE)) == NULL) {
+            return TFS_MEMORY_ERROR;
+        }
+        old_len = 0;
+    }
+    if (old_len < COMPRESS_CHUNK_SIZE) {
+        memset(meta->chunk_buf + old_len, 0, COMPRESS_CHUNK_SIZE - old_len);
+    }
+
+    int from = offset > chunk_start ? offset : chunk_start;
+    int to = offset + size < chunk_start + COMPRESS_CHUNK_SIZE ? offset + size : chunk_start + COMPRESS_CHUNK_SIZE;
+    if (from < to) {
+        memcpy(meta->chunk_buf + (from - chunk_start), buffer + (from - offset), to - from);
+    }
+
+    meta->size = new_size;
+    meta->chunk_index = chunk;
+    if ((ret = rewrite_chunk(meta, chunk)) < 0) {
+        meta->chunk_index = -1;
+    }
+    return ret;
+}
+
+/*
+ * Ends a write that failed part way: the file now ends at 'size', the old
+ * end or the end of what got written if that is further, and the map
+ * entries grown for the rest of the write are dropped again, so the inode
+ * stays one that load_inode accepts.
+ */
+static void end_failed_write(fileMetadata *meta, int size) {
+    int map_len = (size + BLOCK_DATA_SIZE - 1) / BLOCK_DATA_SIZE;
+    if (meta->compressed) {
+        map_len = (size + COMPRESS_CHUNK_SIZE - 1) / COMPRESS_CHUNK_SIZE * COMPRESS_CHUNK_BLOCKS;
+        meta->chunk_index = -1;
+    }
+    int i;
+    for (i = map_len; i < meta->map_len; i++) {
+        if (meta->block_map[i] != 0) {
+            release_block(meta->block_map[i]);
+            meta->block_map[i] = 0;
+        }
+    }
+    if (map_len < meta->map_len) {
+        meta->map_len = map_len;
+    }
+    meta->size = size;
+}
+
+/*
+ * Writes 'size' bytes at 'offset' into a file, growing it when the range
+ * ends past the end. Anything between the old end and 'offset' becomes a
+ * hole. Returns the number of bytes written or an error code; after an
+ * error the file keeps what was written before it (see end_failed_write).
+ */
+static int write_range(fileMetadata *meta, char *buffer, int size, int offset) {
+    int old_size = meta->size;
+    int new_size = offset + size > old_size ? offset + size : old_size;
+    int ret, done;
+
+    if (size == 0) {
+        return 0;
+    }
+
+    if (meta->compressed) {
+        int first = offset / COMPRESS_CHUNK_SIZE;
+        int last = (offset + size - 1) / COMPRESS_CHUNK_SIZE;
+        if ((ret = grow_map(meta, (last + 1) * COMPRESS_CHUNK_BLOCKS)) < 0) {
+            return ret;
+        }
+        // A short last chunk gets longer when the file grows past it
+        int old_last = (old_size - 1) / COMPRESS_CHUNK_SIZE;
+        if (new_size > old_size && old_size % COMPRESS_CHUNK_SIZE != 0 && old_last < first) {
+            if ((ret = patch_chunk(meta, old_last, old_size, new_size, buffer, offset, 0)) < 0) {
+                end_failed_write(meta, old_size);
+                return ret;
+            }
+        }
+        int chunk;
+        for (chunk = first; chunk <= last; chunk++) {
+            if ((ret = patch_chunk(meta, chunk, old_size, new_size, buffer, offset, size)) < 0) {
+                int written = chunk * COMPRESS_CHUNK_SIZE;
+                end_failed_write(meta, old_size > written ? old_size : (written < new_size ? written : new_size));
+                return ret;
+            }
+        }
+        return size;
+    }
+
+    if ((ret = grow_map(meta, (offset + size + BLOCK_DATA_SIZE - 1) / BLOCK_DATA_SIZE)) < 0) {
+        return ret;
+    }
+    for (done = 0; done < size; ) {
+        int pos = offset + done;
+        int in_block = pos % BLOCK_DATA_SIZE;
+        int n = BLOCK_DATA_SIZE - in_block;
+        if (n > size - done) {
+            n = size - done;
+        }
+
+        // Only a partly overwritten block has to be read first
+        char block[BLOCKSIZE] = {0};
+        if (n < BLOCK_DATA_SIZE) {
+            ret = read_file_block(meta, pos / BLOCK_DATA_SIZE, block);
+        } else {
+            block[0] = 3; // Data block type
+            block[1] = 0x44; // Magic number
+            ret = TFS_SUCCESS;
+        }
+        if (ret == TFS_SUCCESS) {
+            memcpy(block + BLOCK_HEADER_SIZE + in_block, buffer + done, n);
+            ret = set_file_block(meta, pos / BLOCK_DATA_SIZE, block);
+        }
+        if (ret < 0) {
+            end_failed_write(meta, old_size > pos ? old_size : pos);
+            return ret;
+        }
+        done += n;
+    }
+    meta->size = new_size;
+    return size;
+}
+
+/*
+Writes 'size' bytes from 'buffer' at byte 'offset' of the file without
+moving the file pointer. Writing past the end grows the file; the gap
+between the old end and 'offset' becomes a hole that reads back as
+zeros and uses no disk blocks. Returns the number of bytes written or an
+error code.
+*/
+static int pwrite_file(fileDescriptor FD, char *buffer, int size, int offset) {
+    if (mounted_disk == -1) {
+        return TFS_DISK_NOT_OPEN;
+    }
+
+    if (FD < 0 || FD >= num_fd) {
+        return TFS_FILE_NOT_OPEN;
+    }
+    if (file_md[FD].read_only) {
+        return TFS_FILE_READ_ONLY;
+    }
+    if (offset < 0 || size < 0 || offset > 0x7FFFFFFF - size) {
+        return TFS_INVALID_SEEK;
+    }
+
+    fileMetadata *meta = &file_md[FD];
+    int ret = flush_appends(meta, 1);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = write_range(meta, buffer, size, offset);
+    meta->start_block = meta->map_len > 0 ? meta->block_map[0] : -1;
+    meta->modified_t = time(NULL);
+    int saved = save_inode(meta);
+    return ret < 0 ? ret : (saved < 0 ? saved : ret);
+}
+
+int tfs_pwrite(fileDescriptor FD, char *buffer, int size, int offset) {
+    struct timespec start;
+    int prev = op_begin(TFS_OP_PWRITE, &start);
+    return op_end(prev, &start, pwrite_file(FD, buffer, size, offset));
+}
+
+/*
+ * Writes a file's buffered appends to disk. Unless 'all' is set, the part
+ * that would only fill the last block (or compressed chunk) partly stays
+ * in memory, so later appends complete it before it is written.
+ */
+static int flush_appends(fileMetadata *meta, int all) {
+    int len = meta->append_len;
+    if (len == 0) {
+        return TFS_SUCCESS;
+    }
+    if (!all) {
+        int unit = meta->compressed ? COMPRESS_CHUNK_SIZE : BLOCK_DATA_SIZE;
+        len = ((meta->size + len) / unit) * unit - meta->size;
+        if (len <= 0) {
+            return TFS_SUCCESS;
+        }
+    }
+
+    // A failed write keeps what it wrote, so that part leaves the buffer
+    // and the inode records it either way
+    int old_size = meta->size;
+    int ret = write_range(meta, meta->append_buf, len, old_size);
+    int written = meta->size - old_size;
+    memmove(meta->append_buf, meta->append_buf + written, meta->append_len - written);
+    meta->append_len -= written;
+    append_buffered -= written;
+
+    meta->start_block = meta->map_len > 0 ? meta->block_map[0] : -1;
+    int saved = save_inode(meta);
+    return ret < 0 ? ret : saved;
+}
+
+/*
+ * Drops a file's buffered appends without writing them
+ */
+static void discard_appends(fileMetadata *meta) {
+    mark_stale(meta);
+    append_buffered -= meta->append_len;
+    pool_free(meta->append_buf);
+    meta->append_buf = NULL;
+    meta->append_len = 0;
+    meta->append_cap = 0;
+}
+
+/*
+Appends 'size' bytes to the end of the file. The data is only buffered
+in memory: blocks are allocated and written when the buffer holds
+TFS_APPEND_FLUSH_SIZE bytes, when all open files together buffer more than
+TFS_APPEND_MEMORY_LIMIT, and on tfs_flush, tfs_closeFile and tfs_unmount,
+so many small appends turn into a few full-block writes. Reads, seeks
+and other writes on the same descriptor flush first and see the data.
+*/
+static int append_file(fileDescriptor FD, char *buffer, int size) {
+    if (mounted_disk == -1) {
+        return TFS_DISK_NOT_OPEN;
+    }
+
+    if (FD < 0 || FD >= num_fd) {
+        return TFS_FILE_NOT_OPEN;
+    }
+    if (file_md[FD].read_only) {
+        return TFS_FILE_READ_ONLY;
+    }
+
+    fileMetadata *meta = &file_md[FD];
+    if (size < 0 || meta->size + meta->append_len > 0x7FFFFFFF - size) {
+        return TFS_INVALID_SEEK;
+    }
+    if (meta->append_len + size > meta->append_cap) {
+        int cap = meta->append_cap ? meta->append_cap : BLOCK_DATA_SIZE;
+        while (cap < meta->append_len + size) {
+            cap *= 2;
+        }
+        char *grown = pool_realloc(meta->append_buf, cap);
+        if (grown == NULL) {
+            return TFS_MEMORY_ERROR;
+        }
+        meta->append_buf = grown;
+        meta->append_cap = cap;
+    }
+    memcpy(meta->append_buf + meta->append_len, buffer, size);
+    meta->append_len += size;
+    append_buffered += size;
+    meta->modified_t = time(NULL);
+    mark_stale(meta);
+
+    int ret = TFS_SUCCESS;
+    if (meta->append_len >= TFS_APPEND_FLUSH_SIZE) {
+        ret = flush_appends(meta, 0);
+    }
+    if (ret == TFS_SUCCESS && append_buffered > TFS_APPEND_MEMORY_LIMIT) {
+        int i;
+        for (i = 0; i < num_fd && ret == TFS_SUCCESS; i++) {
+            ret = flush_appends(&file_md[i], 0);
+        }
+    }
+    return ret;
+}
+
+int tfs_append(fileDescriptor FD, char *buffer, int size) {
+    struct timespec start;
+    int prev = op_begin(TFS_OP_APPEND, &start);
+    return op_end(prev, &start, append_file(FD, buffer, size));
+}
+
+/*
+Writes everything tfs_append buffered for the file to disk, and the
+access time if it is due
+*/
+static int flush_file(fileDescriptor FD) {
+    if (mounted_disk == -1) {
+        return TFS_DISK_NOT_OPEN;
+    }
+
+    if (FD < 0 || FD >= num_fd) {
+        return TFS_FILE_NOT_OPEN;
+    }
+    int ret = flush_appends(&file_md[FD], 1);
+    return ret < 0 ? ret : save_access_time(&file_md[FD]);
+}
+
+int tfs_flush(fileDescriptor FD) {
+    fs_lock();
+    int ret = flush_file(FD);
+    fs_unlock();
+    return ret;
+}
+
+/*
+change the file pointer location to offset (absolute). Returns
+success/error codes.
+*/
+static int seek_file(fileDescriptor FD, int offset) {
+    if (mounted_disk == -1) {
+        return TFS_DISK_NOT_OPEN;
+    }
+
+    if (FD < 0 || FD >= num_fd) {
+        return TFS_FILE_NOT_OPEN;
+    }
+
+    int ret = flush_appends(&file_md[FD], 1);
+    if (ret < 0) {
+        return ret;
+    }
+    if (offset < 0 || offset >= file_md[FD].size) {
+        return TFS_INVALID_SEEK;
+    }
+
+    __atomic_store_n(&file_md[FD].cursor->offset, offset, __ATOMIC_RELAXED);
+    return TFS_SUCCESS;
+}
+
+/*
+ * Lock-free tfs_seek; returns 0 when the call has to take the lock
+ */
+static int fast_seek(fileDescriptor FD, int offset, int *ret) {
+    readerThread *reader = get_reader();
+    if (reader == NULL) {
+        return 0;
+    }
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    reader_enter(reader);
+    fileCursor *cursor = reader_cursor(FD);
+    fileVersion *version = cursor ? __atomic_load_n(&cursor->version, __ATOMIC_ACQUIRE) : NULL;
+    int served = (version != NULL && !version->buffered);
+    if (served) {
+        if (offset < 0 || offset >= version->size) {
+            *ret = TFS_INVALID_SEEK;
+        } else {
+            __atomic_store_n(&cursor->offset, offset, __ATOMIC_RELAXED);
+            *ret = TFS_SUCCESS;
+        }
+    }
+    reader_exit(reader);
+    if (served) {
+        count_call(&reader->stats, TFS_OP_SEEK, elapsed_ns(&start), *ret);
+    }
+    return served;
+}
+
+int tfs_seek(fileDescriptor FD, int offset) {
+    struct timespec start;
+    int ret;
+    if (fast_seek(FD, offset, &ret)) {
+        return ret;
+    }
+    int prev = op_begin(TFS_OP_SEEK, &start);
+    return op_end(prev, &start, seek_file(FD, offset));
+}
+
+/*
+Turns compression on (enabled != 0) or off for a file. New content is
+written in chunks of COMPRESS_CHUNK_SIZE bytes, each compressed on its
+own so reads only decompress the chunk they touch. Existing content is
+rewritten in the new format and the file pointer is reset to 0. The new
+copy is written before the old one is freed, so the disk needs room for
+both; if it runs out the file keeps its old format and contents.
+*/
+static int set_compression(fileDescriptor FD, int enabled) {
+    if (mounted_disk == -1) {
+        return TFS_DISK_NOT_OPEN;
+    }
+
+    if (FD < 0 || FD >= num_fd) {
+        return TFS_FILE_NOT_OPEN;
+    }
+    if (file_md[FD].read_only) {
+        return TFS_FILE_READ_ONLY;
+    }
+
+    enabled = enabled ? 1 : 0;
+    if (file_md[FD].compressed == enabled) {
+        return TFS_SUCCESS;
+    }
+
+    // Appended data still in memory is part of what gets rewritten
+    int ret = flush_appends(&file_md[FD], 1);
+    if (ret < 0) {
+        return ret;
+    }
+    int size = file_md[FD].size;
+    char *content = pool_alloc(size > 0 ? size : 1);
+    if (content == NULL) {
+        return TFS_MEMORY_ERROR;
+    }
+    ret = tfs_pread(FD, content, size, 0);
+    if (ret < 0) {
+        pool_free(content);
+        return ret;
+    }
+
+    // Write the new layout next to the old one and switch the inode over
+    fileMetadata *meta = &file_md[FD], old = file_md[FD];
+    meta->block_map = NULL;
+    meta->map_len = 0;
+    meta->compressed = enabled;
+    meta->chunk_index = -1;
+    meta->modified_t = time(NULL);
+    ret = write_layout(meta, content, size);
+    int saved = ret == TFS_SUCCESS ? save_inode(meta) : TFS_SUCCESS;
+    pool_free(content);
+    if (ret < 0 || saved < 0) {
+        free_file_blocks(meta);
+        meta->block_map = old.block_map;
+        meta->map_len = old.map_len;
+        meta->start_block = old.start_block;
+        meta->compressed = old.compressed;
+        meta->modified_t = old.modified_t;
+        if (saved < 0) {
+            save_inode(meta); // the inode on disk may be half written
+        }
+        return ret < 0 ? ret : saved;
+    }
+
+    int i;
+    for (i = 0; i < old.map_len; i++) {
+        if (old.block_map[i] != 0) {
+            release_block(old.block_map[i]);
+        }
+    }
+    pool_free(old.block_map);
+    __atomic_store_n(&meta->cursor->offset, 0, __ATOMIC_RELAXED);
+    return TFS_SUCCESS;
+}
+
+int tfs_setCompression(fileDescriptor FD, int enabled) {
+    fs_lock();
+    int ret = set_compression(FD, enabled);
+    fs_unlock();
+    return ret;
+}
+
+/* EXTRA FUNCTIONS. CHECK HEADER FILE FOR MORE INFO ON HOW WE SHOULD APPROACH THESE */
+
+/* Per-block state kept while checking consistency */
+#define FSCK_FREE 1
+#define FSCK_META 2
+#define FSCK_DATA 3
+#define FSCK_ATTR 4
+
+typedef struct {
+    char *state; /* FSCK_* or 0 when not seen yet */
+    int *refs;   /* users of each data or attribute block */
+    int len;
+} fsckState;
+
+/*
+ * Records that block 'bNum' is used as 'kind' and, the first time, that it
+ * carries block type 'type' (0 = don't check). Only data and attribute
+ * blocks may be claimed more than once.
+ */
+static int fsck_claim(fsckState *fsck, int bNum, int kind, int type) {
+    if (bNum <= 0) {
+        return TFS_INVALID_FILESYSTEM;
+    }
+    if (bNum >= fsck->len) {
+        int len = fsck->len ? fsck->len : 64;
+        while (len <= bNum) {
+            len *= 2;
+        }
+        char *state = realloc(fsck->state, len);
+        if (state == NULL) {
+            return TFS_MEMORY_ERROR;
+        }
+        fsck->state = state;
+        int *refs = realloc(fsck->refs, sizeof(int) * len);
+        if (refs == NULL) {
+            return TFS_MEMORY_ERROR;
+        }
+        fsck->refs = refs;
+        memset(fsck->state + fsck->len, 0, len - fsck->len);
+        memset(fsck->refs + fsck->len, 0, sizeof(int) * (len - fsck->len));
+        fsck->len = len;
+    }
+
+    int shared = (kind == FSCK_DATA || kind == FSCK_ATTR);
+    if (fsck->state[bNum] != 0 && (!shared || fsck->state[bNum] != kind)) {
+        return TFS_INVALID_FILESYSTEM;
+    }
+    if (fsck->state[bNum] == 0 && type != 0) {
+        char block[BLOCKSIZE];
+        if (read_fs_block(mounted_disk, bNum, block) < 0) {
+            return TFS_ERROR;
+        }
+        if (block[0] != type || block[1] != 0x44) {
+            return TFS_INVALID_FILESYSTEM;
+        }
+    }
+    fsck->state[bNum] = (char)kind;
+    if (shared) {
+        fsck->refs[bNum]++;
+    }
+    return TFS_SUCCESS;
+}
+
+/*
+ * Claims every data block a file's block map points at
+ */
+static int fsck_data(fileMetadata *meta, fsckState *fsck) {
+    int i, ret;
+    for (i = 0; i < meta->map_len; i++) {
+        if (meta->block_map[i] != 0 && (ret = fsck_claim(fsck, meta->block_map[i], FSCK_DATA, 3)) < 0) {
+            return ret;
+        }
+    }
+    return TFS_SUCCESS;
+}
+
+/*
+ * Claims an inode, its block map chain and the blocks it maps: data blocks
+ * and the attribute block for a file, each distinct bucket for a directory
+ */
+static int fsck_inode(int ino, fsckState *fsck) {
+    fileMetadata meta;
+    int ret = fsck_claim(fsck, ino, FSCK_META, 2);
+    if (ret < 0) {
+        return ret;
+    }
+    if ((ret = load_inode(ino, &meta)) < 0) {
+        return ret;
+    }
+
+    int i;
+    for (i = 0; i < meta.num_index_blocks && ret == TFS_SUCCESS; i++) {
+        ret = fsck_claim(fsck, meta.index_blocks[i], FSCK_META, 5);
+    }
+    if (!meta.is_dir) {
+        if (ret == TFS_SUCCESS) {
+            ret = fsck_data(&meta, fsck);
+        }
+        if (ret == TFS_SUCCESS && meta.xattr_block != 0) {
+            ret = fsck_claim(fsck, meta.xattr_block, FSCK_ATTR, 7);
+        }
+    } else {
+        for (i = 0; i < meta.map_len && ret == TFS_SUCCESS; i++) {
+            if (!dir_slot_is_duplicate(&meta, i)) {
+                ret = fsck_claim(fsck, meta.block_map[i], FSCK_META, 6);
+            }
+        }
+    }
+    drop_inode(&meta);
+    return ret;
+}
+
+static int fsck_entry(char *path, int ino, int kind, void *arg) {
+    return fsck_inode(ino, arg);
+}
+
+/*
+Perform checks for file system consistency.
+
+General ideas for consistency checks:
+- Read the superblock and extract information about free blocks and inode pointers
+- Traverse the list of free blocks and ensure they are marked as free
+- traverse the list of inodes and ensure that allocated blocks are not marked as free
+- Check for block corruption (for example: invalid magic numbers, incorrect block types).
+- Every block is either free or used: a block that is neither was leaked.
+
+Return TFS_SUCCESS if all checks pass, otherwise return an error code
+*/
+static int check_consistency(void) {
+    char block[BLOCKSIZE];
+    int i, ret;
+
+    if (mounted_disk == -1) {
+        return TFS_DISK_NOT_OPEN;
+    }
+    wait_for_readers(); // blocks freed under readers are back on the free list
+
+    // Read and verify the superblock
+
+    if (read_fs_block(mounted_disk, 0, block) < 0) {
+        return TFS_ERROR;
+    }
+
+    if (block[0] != 1 || block[1] != 0x44) {
+        return TFS_INVALID_FILESYSTEM;
+    }
+
+    int blocks = get_int(block + BLOCK_HEADER_SIZE + SB_BLOCK_COUNT);
+    if ((blocks != 0 && blocks != disk_blocks) || disk_blocks > diskBlocks(mounted_disk)) {
+        return TFS_INVALID_FILESYSTEM;
+    }
+
+    fsckState fsck = { NULL, NULL, 0 };
+    int free_block = get_int(block + BLOCK_HEADER_SIZE + SB_FREE_HEAD);
+
+    // Traverse free block list. A block seen twice means the list loops.
+    ret = TFS_SUCCESS;
+    while (free_block != 0 && ret == TFS_SUCCESS) {
+        if ((ret = fsck_claim(&fsck, free_block, FSCK_FREE, 0)) < 0) {
+            break;
+        }
+        if (read_fs_block(mounted_disk, free_block, block) < 0) {
+            ret = TFS_ERROR;
+            break;
+        }
+
+        // Free blocks must have block type 4 and magic number
+        if (block[0] != 4 || block[1] != 0x44) {
+            ret = TFS_INVALID_FILESYSTEM;
+            break;
+        }
+
+        free_block = get_int(block + BLOCK_HEADER_SIZE + FREE_NEXT);
+    }
+
+    // Every inode, map block and bucket in the tree is used exactly once and
+    // never on the free list; data blocks may be shared
+    if (ret == TFS_SUCCESS) {
+        ret = fsck_inode(root_inode, &fsck);
+    }
+    if (ret == TFS_SUCCESS) {
+        ret = walk_tree(root_inode, "/", fsck_entry, &fsck);
+    }
+
+    // Snapshots and open snapshot views hold references of their own
+    int k;
+    for (i = 0; i < num_snapshots && ret == TFS_SUCCESS; i++) {
+        for (k = 0; k < snapshots[i].num_files && ret == TFS_SUCCESS; k++) {
+            ret = fsck_data(&snapshots[i].files[k].meta, &fsck);
+        }
+    }
+    for (i = 0; i < num_fd && ret == TFS_SUCCESS; i++) {
+        if (file_md[i].snapshot_id != 0) {
+            ret = fsck_data(&file_md[i], &fsck);
+        }
+    }
+
+    // Each data and attribute block's reference count must match its users exactly
+    for (i = 0; i < fsck.len && ret == TFS_SUCCESS; i++) {
+        if (fsck.refs[i] != ref_count(i)) {
+            ret = TFS_INVALID_FILESYSTEM;
+        }
+    }
+    for (i = fsck.len; i < refs_len && ret == TFS_SUCCESS; i++) {
+        if (block_refs[i].refs != 0) {
+            ret = TFS_INVALID_FILESYSTEM;
+        }
+    }
+
+    // Every block is free, waiting to be freed, or used by something above;
+    // anything else was lost
+    for (i = 0; i < num_deferred && ret == TFS_SUCCESS; i++) {
+        ret = fsck_claim(&fsck, deferred[i].bNum, FSCK_FREE, 0);
+    }
+    for (i = 1; i < disk_blocks && ret == TFS_SUCCESS; i++) {
+        if (i >= fsck.len || fsck.state[i] == 0) {
+            ret = TFS_INVALID_FILESYSTEM;
+        }
+    }
+    free(fsck.state);
+    free(fsck.refs);
+    if (ret != TFS_SUCCESS) {
+        return ret == TFS_ERROR || ret == TFS_MEMORY_ERROR ? ret : TFS_INVALID_FILESYSTEM;
+    }
+
+    // Additional corruption checks: valid magic numbers and block checksums
+    for (i = 1; i < disk_blocks; i++) {
+        int ret = read_fs_block(mounted_disk, i, block);
+        if (ret == TFS_CHECKSUM_ERROR) {
+            return TFS_INVALID_FILESYSTEM;
+        }
+        if (ret < 0) {
+            return TFS_ERROR;
+        }
+
+        if (block[0] == 1 && block[1] != 0x44) {
+            return TFS_INVALID_FILESYSTEM;
+        }
+    }
+
+    return TFS_SUCCESS;
+}
+
+int tfs_checkConsistency() {
+    fs_lock();
+    int ret = check_consistency();
+    fs_unlock();
+    return ret;
+}
+
+ /*Renames a file. New name should be passed in. File has to be open.
+ A name containing '/' is taken as a path and moves the file to that
+ directory.*/
+static int rename_file(fileDescriptor FD, char* newName) {
+    if (mounted_disk == -1) {
+        return TFS_DISK_NOT_OPEN;
+    }
+
+    if (FD < 0 || FD >= num_fd) {
+        return TFS_FILE_NOT_OPEN;
+    }
+    if (file_md[FD].snapshot_id != 0) {
+        return TFS_FILE_READ_ONLY;
+    }
+
+    fileMetadata *meta = &file_md[FD];
+    fileMetadata *src, *dst;
+    char leaf[TFS_MAX_NAME + 1];
+    int ret = get_dir(meta->parent, &src);
+    if (ret < 0) {
+        return ret;
+    }
+    if (strchr(newName, '/') != NULL) {
+        ret = resolve_parent(newName, &dst, leaf);
+    } else if (newName[0] == '\0' || strlen(newName) > TFS_MAX_NAME) {
+        ret = TFS_INVALID_NAME;
+    } else {
+        dst = src;
+        strcpy(leaf, newName);
+    }
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = dir_lookup(dst, leaf, NULL);
+    if (ret != 0) {
+        return ret < 0 ? ret : TFS_FILE_ALREADY_EXISTS;
+    }
+
+    // The new entry goes in before the old one goes, and every failure puts
+    // things back, so the file is never left out of all directories
+    if ((ret = dir_insert(dst, leaf, meta->inode, INODE_FILE)) < 0) {
+        return ret;
+    }
+    if ((ret = dir_remove(src, meta->name)) < 0) {
+        dir_remove(dst, leaf);
+        return ret;
+    }
+    if (dst->inode != meta->parent) {
+        int old_parent = meta->parent;
+        meta->parent = dst->inode;
+        if ((ret = save_inode(meta)) < 0) {
+            meta->parent = old_parent;
+            if (dir_insert(src, meta->name, meta->inode, INODE_FILE) == TFS_SUCCESS) {
+                dir_remove(dst, leaf);
+            }
+            return ret;
+        }
+    }
+    strcpy(meta->name, leaf); // add null termination
+
+    return TFS_SUCCESS;
+}
+
+int tfs_rename(fileDescriptor FD, char* newName) {
+    struct timespec start;
+    int prev = op_begin(TFS_OP_RENAME, &start);
+    return op_end(prev, &start, rename_file(FD, newName));
+}
+
+
+static int print_entry(char *path, int ino, int kind, void *arg) {
+    printf("%s%s\n", path, kind == INODE_DIR ? "/" : "");
+    return 0;
+}
+
+/*
+ Lists all the files and directories on the disk, print the list to stdout.
+ Every entry is printed with its full path; directories end in '/'.
+*/
+static int print_tree(void) {
+    if (mounted_disk == -1) {
+        return TFS_DISK_NOT_OPEN;
+    }
+
+    printf("Files in TinyFS:\n");
+    int ret = walk_tree(root_inode, "/", print_entry, NULL);
+
+    return ret < 0 ? ret : TFS_SUCCESS;
+}
+
+int tfs_readdir() {
+    fs_lock();
+    int ret = print_tree();
+    fs_unlock();
+    return ret;
+}
+
+/*
+ Creates an empty directory at 'path'. The parent directory must exist.
+*/
+static int make_dir(char *path) {
+    if (mounted_disk == -1) {
+        return TFS_DISK_NOT_OPEN;
+    }
+
+    fileMetadata *parent;
+    char leaf[TFS_MAX_NAME + 1];
+    int ret = resolve_parent(path, &parent, leaf);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = dir_lookup(parent, leaf, NULL);
+    if (ret != 0) {
+        return ret < 0 ? ret : TFS_FILE_ALREADY_EXISTS;
+    }
+
+    // A new directory is an inode with a single empty hash bucket
+    int ino = find_meta_block(dir_goal(parent->inode));
+    if (ino < 0) {
+        return ino;
+    }
+    int bucket = find_meta_block(ino + 1);
+    if (bucket < 0) {
+        free_block(ino);
+        return bucket;
+    }
+    char block[BLOCKSIZE] = {0};
+    block[0] = 6; // Block type = directory bucket
+    block[1] = 0x44; // Magic number
+    if (write_fs_block(mounted_disk, bucket, block) < 0) {
+        free_block(bucket);
+        free_block(ino);
+        return TFS_WRITE_ERROR;
+    }
+
+    fileMetadata dir;
+    memset(&dir, 0, sizeof(dir));
+    dir.inode = ino;
+    dir.parent = parent->inode;
+    dir.is_dir = 1;
+    dir.creation_t = time(NULL);
+    dir.modified_t = dir.creation_t;
+    dir.accessed_t = dir.creation_t;
+    dir.map_len = 1;
+    dir.block_map = &bucket;
+    if ((ret = save_inode(&dir)) < 0 ||
+        (ret = dir_insert(parent, leaf, ino, INODE_DIR)) < 0) {
+        free_block(bucket);
+        free_block(ino);
+        return ret;
+    }
+    return TFS_SUCCESS;
+}
+
+int tfs_mkdir(char *path) {
+    struct timespec start;
+    int prev = op_begin(TFS_OP_MKDIR, &start);
+    return op_end(prev, &start, make_dir(path));
+}
+
+static int stop_at_entry(char *name, int ino, int kind, void *arg) {
+    return 1;
+}
+
+/*
+ Removes the directory at 'path'. The directory must be empty.
+*/
+static int remove_dir(char *path) {
+    if (mounted_disk == -1) {
+        return TFS_DISK_NOT_OPEN;
+    }
+
+    fileMetadata *parent, *dir;
+    char leaf[TFS_MAX_NAME + 1];
+    int ret = resolve_parent(path, &parent, leaf);
+    if (ret < 0) {
+        return ret;
+    }
+    int kind;
+    int ino = dir_lookup(parent, leaf, &kind);
+    if (ino <= 0) {
+        return ino < 0 ? ino : TFS_FILE_NOT_FOUND;
+    }
+    if (kind != INODE_DIR) {
+        return TFS_NOT_A_DIRECTORY;
+    }
+    if ((ret = get_dir(ino, &dir)) < 0) {
+        return ret;
+    }
+    ret = dir_for_each(dir, stop_at_entry, NULL);
+    if (ret != 0) {
+        return ret < 0 ? ret : TFS_DIRECTORY_NOT_EMPTY;
+    }
+
+    if ((ret = dir_remove(parent, leaf)) < 0) {
+        return ret;
+    }
+    int i;
+    for (i = 0; i < dir->map_len; i++) {
+        if (!dir_slot_is_duplicate(dir, i) && free_block(dir->block_map[i]) < 0) {
+            return TFS_WRITE_ERROR;
+        }
+    }
+    for (i = 0; i < dir->num_index_blocks; i++) {
+        if (free_block(dir->index_blocks[i]) < 0) {
+            return TFS_WRITE_ERROR;
+        }
+    }
+    if (free_block(ino) < 0) {
+        return TFS_WRITE_ERROR;
+    }
+    forget_dir(ino);
+    return TFS_SUCCESS;
+}
+
+int tfs_rmdir(char *path) {
+    struct timespec start;
+    int prev = op_begin(TFS_OP_RMDIR, &start);
+    return op_end(prev, &start, remove_dir(path));
+}
+
+/*
+ Starts listing the directory at 'path' ("/" is the root) into the
+ caller's cursor 'dir'. Entries come back in hash order, one bucket block
+ read at a time. Entries added or removed while a listing is in progress
+ may or may not be returned.
+*/
+static int open_dir(char *path, tfsDir *dir) {
+    if (mounted_disk == -1) {
+        return TFS_DISK_NOT_OPEN;
+    }
+    if (dir == NULL) {
+        return TFS_ERROR;
+    }
+
+    int ino, kind;
+    int ret = resolve_path(path, &ino, &kind);
+    if (ret < 0) {
+        return ret;
+    }
+    if (kind != INODE_DIR) {
+        return TFS_NOT_A_DIRECTORY;
+    }
+
+    dir->inode = ino;
+    dir->slot = 0;
+    dir->entry = 0;
+    dir->loaded = 0;
+    return TFS_SUCCESS;
+}
+
+int tfs_opendir(char *path, tfsDir *dir) {
+    fs_lock();
+    int ret = open_dir(path, dir);
+    fs_unlock();
+    return ret;
+}
+
+/*
+ Copies the next entry of an open directory listing into 'entry'.
+ Returns TFS_EOF once every entry has been returned.
+*/
+static int read_dir_next(tfsDir *dir, tfsDirEntry *entry) {
+    if (mounted_disk == -1) {
+        return TFS_DISK_NOT_OPEN;
+    }
+    if (dir == NULL || dir->inode == 0) {
+        return TFS_FILE_NOT_OPEN;
+    }
+
+    fileMetadata *meta;
+    int ret = get_dir(dir->inode, &meta);
+    if (ret < 0) {
+        return ret;
+    }
+
+    while (dir->slot < meta->map_len) {
+        if (!dir->loaded) {
+            if (dir_slot_is_duplicate(meta, dir->slot)) {
+                dir->slot++;
+                continue;
+            }
+            if (read_fs_block(mounted_disk, meta->block_map[dir->slot], dir->block) < 0) {
+                return TFS_READ_ERROR;
+            }
+            dir->loaded = 1;
+            dir->entry = 0;
+        }
+
+        while (dir->entry < BUCKET_SLOTS) {
+            char *p = dir->block + BLOCK_HEADER_SIZE + BUCKET_ENTRIES + dir->entry * DIRENT_SIZE;
+            dir->entry++;
+            int ino = get_int(p + DIRENT_INODE);
+            if (ino != 0) {
+                strncpy(entry->name, p + DIRENT_NAME, TFS_MAX_NAME);
+                entry->name[TFS_MAX_NAME] = '\0';
+                entry->inode = ino;
+                entry->is_dir = (p[DIRENT_KIND] == INODE_DIR);
+                return TFS_SUCCESS;
+            }
+        }
+        dir->slot++;
+        dir->loaded = 0;
+    }
+    return TFS_EOF;
+}
+
+int tfs_readdirNext(tfsDir *dir, tfsDirEntry *entry) {
+    struct timespec start;
+    int prev = op_begin(TFS_OP_READDIR, &start);
+    return op_end(prev, &start, read_dir_next(dir, entry));
+}
+
+/*
+ Ends a directory listing
+*/
+int tfs_closedir(tfsDir *dir) {
+    if (dir == NULL || dir->inode == 0) {
+        return TFS_FILE_NOT_OPEN;
+    }
+    dir->inode = 0;
+    return TFS_SUCCESS;
+}
+
+static void fill_stat(fileMetadata *meta, tfsStat *st) {
+    int i;
+    st->inode = meta->inode;
+    st->is_dir = meta->is_dir;
+    st->size = meta->is_dir ? 0 : meta->size + meta->append_len;
+    st->read_only = meta->read_only;
+    st->compressed = meta->compressed;
+    collect_access(meta);
+    st->creation_t = meta->creation_t;
+    st->modified_t = meta->modified_t;
+    st->accessed_t = meta->accessed_t;
+    st->blocks = 0;
+    st->extents = 0;
+    st->fast_blocks = 0;
+    int last = 0;
+    for (i = 0; i < meta->map_len; i++) {
+        if (meta->block_map[i] != 0 && !(meta->is_dir && dir_slot_is_duplicate(meta, i))) {
+            st->blocks++;
+            if (meta->block_map[i] < fast_blocks) {
+                st->fast_blocks++;
+            }
+            if (meta->block_map[i] != last + 1) {
+                st->extents++;
+            }
+            last = meta->block_map[i];
+        }
+    }
+}
+
+/*
+ Fills 'st' with the attributes of the file or directory at 'path'
+*/
+static int stat_path(char *path, tfsStat *st) {
+    if (mounted_disk == -1) {
+        return TFS_DISK_NOT_OPEN;
+    }
+    if (st == NULL) {
+        return TFS_ERROR;
+    }
+
+    int ino, kind;
+    int ret = resolve_path(path, &ino, &kind);
+    if (ret < 0) {
+        return ret;
+    }
+
+    // Open files and directories already have their inode in memory
+    int i;
+    for (i = 0; i < num_fd; i++) {
+        if (file_md[i].snapshot_id == 0 && file_md[i].inode == ino) {
+            fill_stat(&file_md[i], st);
+            return TFS_SUCCESS;
+        }
+    }
+    if (kind == INODE_DIR) {
+        fileMetadata *dir;
+        if ((ret = get_dir(ino, &dir)) < 0) {
+            return ret;
+        }
+        fill_stat(dir, st);
+        return TFS_SUCCESS;
+    }
+
+    fileMetadata meta;
+    if ((ret = load_inode(ino, &meta)) < 0) {
+        return ret;
+    }
+    fill_stat(&meta, st);
+    drop_inode(&meta);
+    return TFS_SUCCESS;
+}
+
+int tfs_stat(char *path, tfsStat *st) {
+    struct timespec start;
+    int prev = op_begin(TFS_OP_STAT, &start);
+    return op_end(prev, &start, stat_path(path, st));
+}
 
 /*
-Makes a blank TinyFS file system of size nBytes on the unix file
-specified by ‘filename’. This function should use the emulated disk
-library to open the specified unix file, and upon success, format the
-file to be a mountable disk. This includes initializing all data to 0x00,
-setting magic numbers, initializing and writing the superblock and
-inodes, etc. Must return a specified success/error code.
+ Fills 'st' with the attributes of an open file
 */
-int tfs_mkfs(char *filename, int nBytes) {
-    int disk = openDisk(filename, nBytes);
-    if (disk < 0) {
-        return TFS_DISK_FAILURE;
+static int fstat_file(fileDescriptor FD, tfsStat *st) {
+    if (mounted_disk == -1) {
+        return TFS_DISK_NOT_OPEN;
+    }
+    if (FD < 0 || FD >= num_fd) {
+        return TFS_FILE_NOT_OPEN;
+    }
+    if (st == NULL) {
+        return TFS_ERROR;
     }
+    fill_stat(&file_md[FD], st);
+    return TFS_SUCCESS;
+}
 
-    int num_blocks = nBytes / BLOCKSIZE;
-    char block[BLOCKSIZE] = {0};
+int tfs_fstat(fileDescriptor FD, tfsStat *st) {
+    fs_lock();
+    int ret = fstat_file(FD, st);
+    fs_unlock();
+    return ret;
+}
+
+/*
+ * Sets or clears the read-only flag of the file at 'path', both on disk
+ * and in the descriptor table if the file is open.
+ */
+static int set_read_only(char *path, int read_only) {
+    if (mounted_disk == -1) {
+        return TFS_DISK_NOT_OPEN;
+    }
+
+    int ino, kind;
+    int ret = resolve_path(path, &ino, &kind);
+    if (ret < 0) {
+        return ret == TFS_INVALID_NAME ? TFS_FILE_NOT_FOUND : ret;
+    }
+    if (kind != INODE_FILE) {
+        return TFS_IS_A_DIRECTORY;
+    }
+
+    int i;
+    for (i = 0; i < num_fd; i++) {
+        if (file_md[i].snapshot_id == 0 && file_md[i].inode == ino) {
+            file_md[i].read_only = read_only;
+            return save_inode(&file_md[i]);
+        }
+    }
+
+    fileMetadata meta;
+    if ((ret = load_inode(ino, &meta)) < 0) {
+        return ret;
+    }
+    meta.read_only = read_only;
+    ret = save_inode(&meta);
+    drop_inode(&meta);
+    return ret;
+}
+
+/*
+ makes the file read only. If a file is read only, all tfs_write() and
+ tfs_deleteFile() functions that try to use it fail.
+*/
+int tfs_makeRO(char *name) {
+    fs_lock();
+    int ret = set_read_only(name, 1);
+    fs_unlock();
+    return ret;
+}
+
+
+/*
+ makes the file read-write
+*/
+int tfs_makeRW(char *name) {
+    fs_lock();
+    int ret = set_read_only(name, 0);
+    fs_unlock();
+    return ret;
+}
+
+/*
+ * Finds the file at 'path' for an attribute call: its entry in the
+ * descriptor table if it is open, else its inode loaded into 'loaded',
+ * which the caller drops when '*meta' points at it. Attribute calls make
+ * sure the attributes themselves are in memory.
+ */
+static int xattr_file(char *path, fileMetadata *loaded, fileMetadata **meta) {
+    if (mounted_disk == -1) {
+        return TFS_DISK_NOT_OPEN;
+    }
+
+    int ino, kind;
+    int ret = resolve_path(path, &ino, &kind);
+    if (ret < 0) {
+        return ret == TFS_INVALID_NAME ? TFS_FILE_NOT_FOUND : ret;
+    }
+    if (kind != INODE_FILE) {
+        return TFS_IS_A_DIRECTORY;
+    }
+
+    int i;
+    *meta = NULL;
+    for (i = 0; i < num_fd && *meta == NULL; i++) {
+        if (file_md[i].snapshot_id == 0 && file_md[i].inode == ino) {
+            *meta = &file_md[i];
+        }
+    }
+    if (*meta == NULL) {
+        if ((ret = load_inode(ino, loaded)) < 0) {
+            return ret;
+        }
+        *meta = loaded;
+    }
+
+    if ((*meta)->xattr_len >= 0) {
+        return TFS_SUCCESS;
+    }
+    char block[BLOCKSIZE];
+    int len = 0;
+    if ((ret = read_fs_block(mounted_disk, (*meta)->xattr_block, block)) == TFS_SUCCESS) {
+        len = get_int(block + BLOCK_HEADER_SIZE + XATTR_LEN);
+        if (block[0] != 7 || len <= 0 || len > TFS_XATTR_MAX) {
+            ret = TFS_INVALID_FILESYSTEM;
+        } else if (((*meta)->xattrs = pool_alloc(len)) == NULL) {
+            ret = TFS_MEMORY_ERROR;
+        }
+    }
+    if (ret < 0) {
+        if (*meta == loaded) {
+            drop_inode(loaded);
+        }
+        return ret;
+    }
+    memcpy((*meta)->xattrs, block + BLOCK_HEADER_SIZE + XATTR_ENTRIES, len);
+    (*meta)->xattr_len = len;
+    return TFS_SUCCESS;
+}
+
+/*
+ * Offset of the entry for 'name' in the file's attributes, or -1
+ */
+static int xattr_find(fileMetadata *meta, char *name) {
+    int pos = 0, name_len = strlen(name);
+    while (pos < meta->xattr_len) {
+        unsigned char *entry = (unsigned char *)meta->xattrs + pos;
+        if (entry[0] == name_len && memcmp(entry + 2, name, name_len) == 0) {
+            return pos;
+        }
+        pos += 2 + entry[0] + entry[1];
+    }
+    return -1;
+}
+
+/*
+ * Replaces the file's attributes with the 'len' bytes at 'xattrs' (which
+ * it takes over) and writes the inode
+ */
+static int replace_xattrs(fileMetadata *meta, char *xattrs, int len) {
+    pool_free(meta->xattrs);
+    meta->xattrs = xattrs;
+    meta->xattr_len = len;
+    meta->xattr_dirty = 1;
+    return save_inode(meta);
+}
+
+/*
+ Sets extended attribute 'name' of the file at 'path' to the 'size' bytes
+ at 'value', adding it or replacing its old value. Names are up to
+ TFS_XATTR_NAME_MAX characters, and all of a file's names and values
+ together (plus two bytes per attribute) must fit in TFS_XATTR_MAX bytes.
+ Small sets are stored in the inode itself, so stat and open read nothing
+ more; larger ones spill to an attribute block shared by every file with
+ the same attributes.
+*/
+static int set_xattr(char *path, char *name, char *value, int size) {
+    int name_len = name != NULL ? strlen(name) : 0;
+    if (name_len == 0 || name_len > TFS_XATTR_NAME_MAX) {
+        return TFS_INVALID_NAME;
+    }
+    if (size < 0 || size > TFS_XATTR_MAX || (value == NULL && size > 0)) {
+        return TFS_INVALID_SIZE;
+    }
+
+    fileMetadata loaded, *meta;
+    int ret = xattr_file(path, &loaded, &meta);
+    if (ret < 0) {
+        return ret;
+    }
+
+    // The new list is the old one without 'name', then the new entry
+    int old = xattr_find(meta, name);
+    int old_size = old < 0 ? 0 : 2 + name_len + (unsigned char)meta->xattrs[old + 1];
+    int len = meta->xattr_len - old_size + 2 + name_len + size;
+    char *xattrs = NULL;
+    if (len > TFS_XATTR_MAX) {
+        ret = TFS_INVALID_SIZE;
+    } else if ((xattrs = pool_alloc(len)) == NULL) {
+        ret = TFS_MEMORY_ERROR;
+    } else {
+        int kept = meta->xattr_len - old_size;
+        if (old >= 0) {
+            memcpy(xattrs, meta->xattrs, old);
+            memcpy(xattrs + old, meta->xattrs + old + old_size, kept - old);
+        } else if (kept > 0) {
+            memcpy(xattrs, meta->xattrs, kept);
+        }
+        xattrs[kept] = (char)name_len;
+        xattrs[kept + 1] = (char)size;
+        memcpy(xattrs + kept + 2, name, name_len);
+        memcpy(xattrs + kept + 2 + name_len, value, size);
+        ret = replace_xattrs(meta, xattrs, len);
+    }
+    if (meta == &loaded) {
+        drop_inode(&loaded);
+    }
+    return ret;
+}
+
+int tfs_setXattr(char *path, char *name, char *value, int size) {
+    fs_lock();
+    int ret = set_xattr(path, name, value, size);
+    fs_unlock();
+    return ret;
+}
+
+/*
+ Copies up to 'size' bytes of the value of extended attribute 'name' of
+ the file at 'path' to 'value' and returns the value's length, which may
+ be more than 'size' (pass 0 to just ask for it). Returns
+ TFS_ATTR_NOT_FOUND if the file has no such attribute.
+*/
+static int get_xattr(char *path, char *name, char *value, int size) {
+    if (name == NULL || (value == NULL && size > 0)) {
+        return TFS_ERROR;
+    }
+    fileMetadata loaded, *meta;
+    int ret = xattr_file(path, &loaded, &meta);
+    if (ret < 0) {
+        return ret;
+    }
+
+    int pos = xattr_find(meta, name);
+    if (pos < 0) {
+        ret = TFS_ATTR_NOT_FOUND;
+    } else {
+        unsigned char *entry = (unsigned char *)meta->xattrs + pos;
+        ret = entry[1];
+        memcpy(value, entry + 2 + entry[0], size < ret ? size : ret);
+    }
+    if (meta == &loaded) {
+        drop_inode(&loaded);
+    }
+    return ret;
+}
+
+int tfs_getXattr(char *path, char *name, char *value, int size) {
+    fs_lock();
+    int ret = get_xattr(path, name, value, size);
+    fs_unlock();
+    return ret;
+}
+
+/*
+ Removes extended attribute 'name' from the file at 'path'. Returns
+ TFS_ATTR_NOT_FOUND if the file has no such attribute.
+*/
+static int remove_xattr(char *path, char *name) {
+    if (name == NULL) {
+        return TFS_ERROR;
+    }
+    fileMetadata loaded, *meta;
+    int ret = xattr_file(path, &loaded, &meta);
+    if (ret < 0) {
+        return ret;
+    }
+
+    int pos = xattr_find(meta, name);
+    if (pos < 0) {
+        ret = TFS_ATTR_NOT_FOUND;
+    } else {
+        unsigned char *entry = (unsigned char *)meta->xattrs + pos;
+        int entry_size = 2 + entry[0] + entry[1];
+        int len = meta->xattr_len - entry_size;
+        char *xattrs = len > 0 ? pool_alloc(len) : NULL;
+        if (len > 0 && xattrs == NULL) {
+            ret = TFS_MEMORY_ERROR;
+        } else {
+            if (len > 0) {
+                memcpy(xattrs, meta->xattrs, pos);
+                memcpy(xattrs + pos, meta->xattrs + pos + entry_size, len - pos);
+            }
+            ret = replace_xattrs(meta, xattrs, len);
+        }
+    }
+    if (meta == &loaded) {
+        drop_inode(&loaded);
+    }
+    return ret;
+}
+
+int tfs_removeXattr(char *path, char *name) {
+    fs_lock();
+    int ret = remove_xattr(path, name);
+    fs_unlock();
+    return ret;
+}
+
+/*
+ Copies the names of the extended attributes of the file at 'path' to
+ 'list', each followed by a NUL, as far as 'size' bytes allow. Returns
+ the length of the whole list, which may be more than 'size'.
+*/
+static int list_xattr(char *path, char *list, int size) {
+    if (list == NULL && size > 0) {
+        return TFS_ERROR;
+    }
+    fileMetadata loaded, *meta;
+    int ret = xattr_file(path, &loaded, &meta);
+    if (ret < 0) {
+        return ret;
+    }
+
+    int pos = 0, total = 0;
+    while (pos < meta->xattr_len) {
+        unsigned char *entry = (unsigned char *)meta->xattrs + pos;
+        int k;
+        for (k = 0; k <= entry[0]; k++, total++) {
+            if (total < size) {
+                list[total] = k < entry[0] ? entry[2 + k] : '\0';
+            }
+        }
+        pos += 2 + entry[0] + entry[1];
+    }
+    if (meta == &loaded) {
+        drop_inode(&loaded);
+    }
+    return total;
+}
+
+int tfs_listXattr(char *path, char *list, int size) {
+    fs_lock();
+    int ret = list_xattr(path, list, size);
+    fs_unlock();
+    return ret;
+}
+
+/*
+ * Function that can write to one specific byte in file
+ */
+static int write_byte(fileDescriptor FD, int offset, unsigned int data) {
+    if (mounted_disk == -1) {
+        return TFS_DISK_NOT_OPEN;
+    }
+
+    if (FD < 0 || FD >= num_fd) {
+        return TFS_FILE_NOT_OPEN;
+    }
+
+    if (file_md[FD].read_only) {
+        return TFS_FILE_READ_ONLY;
+    }
+
+    if (offset < 0 || offset >= file_md[FD].size) {
+        return TFS_INVALID_SEEK;
+    }
+
+    fileMetadata *meta = &file_md[FD];
+    int flushed = flush_appends(meta, 1);
+    if (flushed < 0) {
+        return flushed;
+    }
+    char byte = (char)data;
+    int ret = write_range(meta, &byte, 1, offset);
+    if (ret < 0) {
+        return ret == TFS_MEMORY_ERROR ? ret : TFS_WRITE_ERROR;
+    }
+    meta->start_block = meta->block_map[0];
+    meta->modified_t = time(NULL);
+    return save_inode(meta);
+}
+
+int tfs_writeByte(fileDescriptor FD, int offset, unsigned int data) {
+    struct timespec start;
+    int prev = op_begin(TFS_OP_WRITE_BYTE, &start);
+    return op_end(prev, &start, write_byte(FD, offset, data));
+}
+
+/*
+ prints the file’s metadata to stdout (tfs_fstat returns it as a struct)
+*/
+static int print_file_info(fileDescriptor FD) {
+    if (mounted_disk == -1) {
+        return TFS_DISK_NOT_OPEN;
+    }
+
+    if (FD < 0 || FD >= num_fd) {
+        return TFS_FILE_NOT_FOUND;
+    }
+
+    tfsStat st;
+    tfs_fstat(FD, &st);
+    printf("File name: %s\n", file_md[FD].name);
+    printf("File inode: %d\n", st.inode);
+    printf("File size: %d bytes\n", st.size);
+    printf("File start block: %d\n", file_md[FD].start_block);
+    printf("File creation time: %s", ctime(&st.creation_t));
+    printf("File modification time: %s", ctime(&st.modified_t));
+    printf("File access time: %s", ctime(&st.accessed_t));
+    printf("File read-only: %s\n", st.read_only ? "Yes" : "No");
+    printf("File compressed: %s\n", st.compressed ? "Yes" : "No");
+    printf("File blocks used: %d\n", st.blocks);
+
+    return TFS_SUCCESS;
+}
+
+int tfs_readFileInfo(fileDescriptor FD) {
+    fs_lock();
+    int ret = print_file_info(FD);
+    fs_unlock();
+    return ret;
+}
+
+/*
+ Sets the modification and access times of the file at 'path', as a
+ restore or a copy that keeps times needs to. The next change to the
+ contents or read moves them on as usual.
+*/
+static int set_times(char *path, time_t modified, time_t accessed) {
+    if (modified < 0 || accessed < 0) {
+        return TFS_ERROR;
+    }
+    fileMetadata loaded, *meta;
+    int ret = xattr_file(path, &loaded, &meta);
+    if (ret < 0) {
+        return ret;
+    }
+
+    // Forget reads already noted, or the next collect_access would undo this
+    if (meta->cursor != NULL) {
+        __atomic_store_n(&meta->cursor->read_time, 0, __ATOMIC_RELAXED);
+    }
+    meta->modified_t = modified;
+    meta->accessed_t = accessed;
+    ret = save_inode(meta);
+    if (meta == &loaded) {
+        drop_inode(&loaded);
+    }
+    return ret;
+}
+
+int tfs_setTimes(char *path, time_t modified, time_t accessed) {
+    fs_lock();
+    int ret = set_times(path, modified, accessed);
+    fs_unlock();
+    return ret;
+}
+
+/*
+ Copies the block checksum counters (blocks verified/updated, failures and
+ time spent) into 'stats'.
+*/
+int tfs_getChecksumStats(tfsChecksumStats *stats) {
+    if (stats == NULL) {
+        return TFS_ERROR;
+    }
+    fs_lock();
+    *stats = checksum_stats;
+    readerThread *reader;
+    for (reader = readers; reader != NULL; reader = reader->next) {
+        stats->blocks_verified += reader->checksums.blocks_verified;
+        stats->blocks_unchecked += reader->checksums.blocks_unchecked;
+        stats->checksum_failures += reader->checksums.checksum_failures;
+        stats->verify_ns += reader->checksums.verify_ns;
+    }
+    fs_unlock();
+    return TFS_SUCCESS;
+}
+
+/*
+ Resets all block checksum counters to zero
+*/
+void tfs_resetChecksumStats(void) {
+    fs_lock();
+    memset(&checksum_stats, 0, sizeof(checksum_stats));
+    readerThread *reader;
+    for (reader = readers; reader != NULL; reader = reader->next) {
+        memset(&reader->checksums, 0, sizeof(reader->checksums));
+    }
+    fs_unlock();
+}
+
+static const char *op_names[TFS_OP_COUNT] = {
+    "mkfs", "mount", "unmount", "openFile", "closeFile", "writeFile",
+    "deleteFile", "readByte", "pread", "seek", "writeByte", "rename",
+    "mkdir", "rmdir", "readdirNext", "stat", "snapshot", "pwrite", "append",
+    "defrag", "readView", "bulkImport", "resize", "migrate"
+};
+
+/*
+ Returns the name of a TFS_OP_* operation, or NULL for an unknown one
+*/
+const char *tfs_opName(int op) {
+    return (op >= 0 && op < TFS_OP_COUNT) ? op_names[op] : NULL;
+}
+
+/*
+ Copies the instrumentation counters into 'stats': calls, errors, time,
+ disk blocks and a log2 latency histogram for every TFS_OP_* operation and
+ for libDisk reads and writes, plus allocation and chain-walk counters.
+ Counting is always on; tfs_resetStats starts a new measurement window.
+*/
+int tfs_getStats(tfsStats *out) {
+    if (out == NULL) {
+        return TFS_ERROR;
+    }
+    fs_lock();
+    *out = stats;
+
+    // Lock-free calls count into their own thread's record
+    readerThread *reader;
+    int op;
+    for (reader = readers; reader != NULL; reader = reader->next) {
+        for (op = 0; op < TFS_OP_COUNT; op++) {
+            add_op_stats(&out->ops[op], &reader->stats.ops[op]);
+        }
+        add_op_stats(&out->disk_read, &reader->stats.disk_read);
+        out->cache_hits += reader->stats.cache_hits;
+        out->cache_misses += reader->stats.cache_misses;
+        out->bytes_read += reader->stats.bytes_read;
+    }
+
+    unsigned long blocks = out->ops[TFS_OP_READ_BYTE].blocks_read + out->ops[TFS_OP_PREAD].blocks_read +
+                           out->ops[TFS_OP_READ_VIEW].blocks_read;
+    out->blocks_per_byte_read = out->bytes_read ? (double)blocks / out->bytes_read : 0.0;
+
+    poolStats pool;
+    pool_get_stats(&pool);
+    out->pool_mallocs = pool.mallocs - pool_base.mallocs;
+    out->pool_reuses = pool.reuses - pool_base.reuses;
+    fs_unlock();
+    return TFS_SUCCESS;
+}
+
+/*
+ Resets all instrumentation counters to zero
+*/
+void tfs_resetStats(void) {
+    fs_lock();
+    memset(&stats, 0, sizeof(stats));
+    readerThread *reader;
+    for (reader = readers; reader != NULL; reader = reader->next) {
+        memset(&reader->stats, 0, sizeof(reader->stats));
+    }
+    pool_get_stats(&pool_base);
+    fs_unlock();
+}
+
+/*
+ * Upper bound, in ns, of the histogram bucket holding the pct-th percentile
+ */
+static long long latency_percentile(tfsOpStats *op, int pct) {
+    unsigned long seen = 0, want = (op->calls * pct + 99) / 100;
+    int i;
+    for (i = 0; i < TFS_LATENCY_BUCKETS; i++) {
+        seen += op->latency[i];
+        if (seen >= want && seen > 0) {
+            return 2LL << i;
+        }
+    }
+    return 0;
+}
+
+static void dump_op_json(FILE *out, const char *name, tfsOpStats *op, int last) {
+    int i;
+    fprintf(out, "    \"%s\": {\"calls\": %lu, \"errors\": %lu, \"total_ns\": %lld, "
+            "\"max_ns\": %lld, \"p50_ns\": %lld, \"p99_ns\": %lld, "
+            "\"blocks_read\": %lu, \"blocks_written\": %lu, \"latency_log2_ns\": [",
+            name, op->calls, op->errors, op->total_ns, op->max_ns,
+            latency_percentile(op, 50), latency_percentile(op, 99),
+            op->blocks_read, op->blocks_written);
+    for (i = 0; i < TFS_LATENCY_BUCKETS; i++) {
+        fprintf(out, "%s%lu", i ? ", " : "", op->latency[i]);
+    }
+    fprintf(out, "]}%s\n", last ? "" : ",");
+}
+
+/*
+ Writes the instrumentation counters to 'out' as a JSON object. Latency
+ percentiles are the upper bound of the log2 histogram bucket they fall in.
+*/
+int tfs_dumpStatsJSON(FILE *out) {
+    tfsStats snap;
+    int i;
+    if (out == NULL) {
+        return TFS_ERROR;
+    }
+    tfs_getStats(&snap);
 
-    // Initialize superblock
-    block[0] = 1; // Block type = superblock
-    block[1] = 0x44; // Magic number
-    block[2] = 1; // Pointer to first free block
+    fprintf(out, "{\n  \"ops\": {\n");
+    for (i = 0; i < TFS_OP_COUNT; i++) {
+        dump_op_json(out, op_names[i], &snap.ops[i], i == TFS_OP_COUNT - 1);
+    }
+    fprintf(out, "  },\n  \"disk\": {\n");
+    dump_op_json(out, "readBlock", &snap.disk_read, 0);
+    dump_op_json(out, "writeBlock", &snap.disk_write, 1);
+    fprintf(out, "  },\n");
+    fprintf(out, "  \"blocks_allocated\": %lu,\n  \"blocks_freed\": %lu,\n", snap.blocks_allocated, snap.blocks_freed);
+    fprintf(out, "  \"chain_hops\": %lu,\n  \"bucket_splits\": %lu,\n", snap.chain_hops, snap.bucket_splits);
+    fprintf(out, "  \"cache_hits\": %lu,\n  \"cache_misses\": %lu,\n", snap.cache_hits, snap.cache_misses);
+    fprintf(out, "  \"pool_mallocs\": %lu,\n  \"pool_reuses\": %lu,\n", snap.pool_mallocs, snap.pool_reuses);
+    fprintf(out, "  \"bytes_read\": %lu,\n  \"blocks_per_byte_read\": %.6f\n}\n",
+            snap.bytes_read, snap.blocks_per_byte_read);
+    return ferror(out) ? TFS_WRITE_ERROR : TFS_SUCCESS;
+}
 
-    if (writeBlock(disk, 0, block) < 0) {
-        return TFS_WRITE_ERROR;
+/*
+ Fills 'stats' with block deduplication counters: data block writes
+ requested, writes satisfied by sharing an existing block, copy-on-write
+ copies, and the current logical/physical data block counts and ratio.
+*/
+static int get_dedup_stats(tfsDedupStats *stats) {
+    if (stats == NULL) {
+        return TFS_ERROR;
+    }
+    if (mounted_disk == -1) {
+        return TFS_DISK_NOT_OPEN;
     }
 
-    // Initialize free blocks
+    *stats = dedup_stats;
+    stats->logical_blocks = 0;
+    stats->physical_blocks = 0;
     int i;
-    for (i = 1; i < num_blocks; i++) {
-        memset(block, 0, BLOCKSIZE);
-        block[0] = 4; // Block type = free
-        block[1] = 0x44; // Magic number
-        block[2] = (i == num_blocks - 1) ? 0 : i + 1; // Link to the next free block or 0 if the last block
-
-        if (writeBlock(disk, i, block) < 0) {
-            return TFS_WRITE_ERROR;
+    for (i = 0; i < refs_len; i++) {
+        if (block_refs[i].refs > 0 && !block_refs[i].attrs) {
+            stats->physical_blocks++;
+            stats->logical_blocks += block_refs[i].refs;
         }
     }
-
-    closeDisk(disk);
+    stats->dedup_ratio = stats->physical_blocks ?
+        (double)stats->logical_blocks / stats->physical_blocks : 1.0;
     return TFS_SUCCESS;
 }
 
+int tfs_getDedupStats(tfsDedupStats *stats) {
+    fs_lock();
+    int ret = get_dedup_stats(stats);
+    fs_unlock();
+    return ret;
+}
+
 /*
-mounts a TinyFS file system located within given diskname.
-As part of the mount operation, tfs_mount should verify the file
-system is the correct type. In tinyFS, only one file system may be
-mounted at a time. Use tfs_unmount to cleanly unmount the currently
-mounted file system. Must return a specified success/error code.
-*/
-int tfs_mount(char *diskname) {
-    if (mounted_disk != -1) {
-        return TFS_DISK_ALREADY_MOUNTED;
+ * Copies a file's metadata and block map, taking one more reference on
+ * every block so the copy keeps the data alive on its own.
+ */
+static int share_file(fileMetadata *dst, fileMetadata *src) {
+    *dst = *src;
+    dst->chunk_buf = NULL;
+    dst->chunk_index = -1;
+    dst->index_blocks = NULL;
+    dst->num_index_blocks = 0;
+    dst->append_buf = NULL;
+    dst->append_len = 0;
+    dst->append_cap = 0;
+    dst->cursor = NULL;
+    dst->xattrs = NULL; // copies keep the data, not the attributes
+    dst->xattr_len = 0;
+    dst->xattr_block = 0;
+    dst->block_map = NULL;
+    if (src->map_len > 0) {
+        dst->block_map = pool_alloc(sizeof(int) * src->map_len);
+        if (dst->block_map == NULL) {
+            return TFS_MEMORY_ERROR;
+        }
+        memcpy(dst->block_map, src->block_map, sizeof(int) * src->map_len);
     }
 
-    int disk = openDisk(diskname, 0);
-    if (disk < 0) {
-        return TFS_DISK_FAILURE;
+    int i;
+    for (i = 0; i < dst->map_len; i++) {
+        if (dst->block_map[i] != 0) {
+            set_ref_count(dst->block_map[i], ref_count(dst->block_map[i]) + 1);
+        }
     }
+    return TFS_SUCCESS;
+}
 
-    char block[BLOCKSIZE];
-    if (readBlock(disk, 0, block) < 0) {
-        return TFS_READ_ERROR;
+static snapshot *find_snapshot(char *name) {
+    int i;
+    for (i = 0; i < num_snapshots && name != NULL; i++) {
+        if (strcmp(snapshots[i].name, name) == 0) {
+            return &snapshots[i];
+        }
     }
+    return NULL;
+}
 
-    if (block[0] != 1 || block[1] != 0x44) {
-        closeDisk(disk);
-        return TFS_INVALID_FILESYSTEM;
+/*
+ * Tree walk visitor adding one file to the snapshot being taken
+ */
+static int snapshot_file(char *path, int ino, int kind, void *arg) {
+    snapshot *snap = arg;
+    if (kind != INODE_FILE) {
+        return 0;
     }
 
-    mounted_disk = disk;
-    return TFS_SUCCESS;
+    snapshotFile *grown = realloc(snap->files, sizeof(snapshotFile) * (snap->num_files + 1));
+    if (grown == NULL) {
+        return TFS_MEMORY_ERROR;
+    }
+    snap->files = grown;
+
+    fileMetadata live;
+    int ret = load_inode(ino, &live);
+    if (ret < 0) {
+        return ret;
+    }
+    snapshotFile *copy = &snap->files[snap->num_files];
+    ret = share_file(&copy->meta, &live);
+    drop_inode(&live);
+    if (ret < 0) {
+        return ret;
+    }
+    strcpy(copy->path, path);
+    strncpy(copy->meta.name, strrchr(path, '/') + 1, TFS_MAX_NAME);
+    copy->meta.read_only = 1;
+    copy->meta.snapshot_id = snap->id;
+    snap->num_files++;
+    return 0;
 }
 
 /*
-unmounts the currently mounted file system. Must return a specified success/error code.
+ Takes a read-only point-in-time snapshot of every file in the mounted
+ file system under 'name' (up to TFS_MAX_NAME characters). No data is
+ copied: the snapshot shares all blocks with the live files through
+ reference counts, and later writes to a shared block go to a new block
+ instead (copy-on-write), so the cost is proportional to the metadata, not
+ the data. Snapshots are kept in memory
+ and end with the mount; unmounting frees the blocks only they still use.
 */
-int tfs_unmount(void) {
+static int take_snapshot(char *name) {
     if (mounted_disk == -1) {
         return TFS_DISK_NOT_OPEN;
     }
+    if (name == NULL || name[0] == '\0' || strlen(name) > TFS_MAX_NAME) {
+        return TFS_INVALID_NAME;
+    }
+    if (find_snapshot(name) != NULL) {
+        return TFS_FILE_ALREADY_EXISTS;
+    }
 
-    closeDisk(mounted_disk);
-    mounted_disk = -1;
+    snapshot *grown = realloc(snapshots, sizeof(snapshot) * (num_snapshots + 1));
+    if (grown == NULL) {
+        return TFS_MEMORY_ERROR;
+    }
+    snapshots = grown;
+
+    snapshot *snap = &snapshots[num_snapshots];
+    strcpy(snap->name, name);
+    snap->id = next_snapshot_id;
+    snap->creation_t = time(NULL);
+    snap->num_files = 0;
+    snap->files = NULL;
+
+    // The snapshot is taken from the inodes on disk
+    int i, ret = TFS_SUCCESS;
+    for (i = 0; i < num_fd && ret == TFS_SUCCESS; i++) {
+        ret = flush_appends(&file_md[i], 1);
+    }
+    if (ret == TFS_SUCCESS) {
+        ret = walk_tree(root_inode, "/", snapshot_file, snap);
+    }
+    if (ret < 0) {
+        int j;
+        for (j = 0; j < snap->num_files; j++) {
+            free_file_blocks(&snap->files[j].meta);
+        }
+        free(snap->files);
+        return ret;
+    }
+
+    next_snapshot_id++;
+    num_snapshots++;
     return TFS_SUCCESS;
 }
 
+int tfs_snapshot(char *name) {
+    struct timespec start;
+    int prev = op_begin(TFS_OP_SNAPSHOT, &start);
+    return op_end(prev, &start, take_snapshot(name));
+}
+
 /*
-Creates or Opens a file for reading and writing on the currently
-mounted file system. Creates a dynamic resource table entry for the file,
-and returns a file descriptor (integer) that can be used to reference
-this entry while the filesystem is mounted
+ Opens file 'path' as it was when snapshot 'snapshotName' was taken.
+ The returned descriptor is read-only and works with tfs_readByte,
+ tfs_seek, tfs_pread and tfs_readFileInfo. Closing it releases the view.
 */
-fileDescriptor tfs_openFile(char *name) {
+static int open_snapshot_file(char *snapshotName, char *path) {
     if (mounted_disk == -1) {
         return TFS_DISK_NOT_OPEN;
     }
 
+    snapshot *snap = find_snapshot(snapshotName);
+    if (snap == NULL) {
+        return TFS_FILE_NOT_FOUND;
+    }
+
+    while (*path == '/') {
+        path++;
+    }
     int i;
-    for (i = 0; i < num_fd; i++) {
-        if (strcmp(file_md[i].name, name) == 0) {
-            return i; // File already exists, return its descriptor
+    for (i = 0; i < snap->num_files; i++) {
+        if (strcmp(snap->files[i].path + 1, path) == 0) {
+            break;
         }
     }
+    if (i == snap->num_files) {
+        return TFS_FILE_NOT_FOUND;
+    }
 
-    fileMetadata *meta = realloc(file_md, sizeof(fileMetadata) * (num_fd + 1));
+    fileMetadata *meta = pool_realloc(file_md, sizeof(fileMetadata) * (num_fd + 1));
     if (meta == NULL) {
         return TFS_MEMORY_ERROR;
     }
     file_md = meta;
 
-    fileMetadata *new_meta = &file_md[num_fd];
-    strncpy(new_meta->name, name, 8);
-    new_meta->name[8] = '\0';
-    new_meta->size = 0;
-    new_meta->start_block = -1;
-    new_meta->curr_block = -1;
-    new_meta->curr_offset = 0;
-    new_meta->read_only = 0;
-    new_meta->creation_t = time(NULL);
-
+    if (share_file(&file_md[num_fd], &snap->files[i].meta) < 0) {
+        return TFS_MEMORY_ERROR;
+    }
+    if ((file_md[num_fd].cursor = new_cursor()) == NULL) {
+        free_file_blocks(&file_md[num_fd]);
+        return TFS_MEMORY_ERROR;
+    }
     num_fd++;
+    fd_table_stale = 1;
     return num_fd - 1;
 }
 
+fileDescriptor tfs_openSnapshotFile(char *snapshotName, char *path) {
+    fs_lock();
+    fileDescriptor ret = open_snapshot_file(snapshotName, path);
+    fs_unlock();
+    return ret;
+}
+
 /*
-Closes the file, de-allocates all system resources, and removes table entry.
+ Deletes a snapshot, dropping its references. Blocks only the snapshot
+ still used go back to the free list.
 */
-int tfs_closeFile(fileDescriptor FD) {
+static int delete_snapshot(char *name) {
     if (mounted_disk == -1) {
         return TFS_DISK_NOT_OPEN;
     }
 
-    if (FD < 0 || FD >= num_fd) {
-        return TFS_FILE_NOT_OPEN;
+    snapshot *snap = find_snapshot(name);
+    if (snap == NULL) {
+        return TFS_FILE_NOT_FOUND;
     }
 
-    // Shift all file descriptors after FD one position left to remove FD
     int i;
-    for (i = FD; i < num_fd - 1; i++) {
-        file_md[i] = file_md[i + 1];
+    for (i = 0; i < snap->num_files; i++) {
+        if (free_file_blocks(&snap->files[i].meta) < 0) {
+            return TFS_WRITE_ERROR;
+        }
+        drop_inode(&snap->files[i].meta);
     }
+    free(snap->files);
 
-    num_fd--;
+    int index = snap - snapshots;
+    for (i = index; i < num_snapshots - 1; i++) {
+        snapshots[i] = snapshots[i + 1];
+    }
+    num_snapshots--;
+    return TFS_SUCCESS;
+}
+
+int tfs_deleteSnapshot(char *name) {
+    fs_lock();
+    int ret = delete_snapshot(name);
+    fs_unlock();
+    return ret;
+}
 
-    // shrink the array
-    fileMetadata *meta = realloc(file_md, sizeof(fileMetadata) * num_fd);
-    if (meta != NULL || num_fd == 0) {
-        file_md = meta;
+/*
+ Lists all snapshots and the files they contain, print the list to stdout
+*/
+static int list_snapshots(void) {
+    if (mounted_disk == -1) {
+        return TFS_DISK_NOT_OPEN;
     }
 
+    printf("Snapshots in TinyFS:\n");
+    int i, j;
+    for (i = 0; i < num_snapshots; i++) {
+        printf("%s (%d files) taken %s", snapshots[i].name, snapshots[i].num_files,
+               ctime(&snapshots[i].creation_t));
+        for (j = 0; j < snapshots[i].num_files; j++) {
+            printf("    %s\n", snapshots[i].files[j].path);
+        }
+    }
     return TFS_SUCCESS;
 }
 
+int tfs_listSnapshots() {
+    fs_lock();
+    int ret = list_snapshots();
+    fs_unlock();
+    return ret;
+}
 
 /*
- * Helper function for writeFile to find free block in disk memory
+ * Tree walk visitor collecting the inodes of all files for the filePass
+ * 'arg'
  */
-int find_free_block() {
-    char super_block[BLOCKSIZE];
-    if (readBlock(mounted_disk, 0, super_block) < 0) {
-        return TFS_READ_ERROR;
+static int collect_file(char *path, int ino, int kind, void *arg) {
+    filePass *pass = arg;
+    if (kind != INODE_FILE) {
+        return 0;
     }
-
-    int free_block = super_block[2];
-    if (free_block == 0) {
-        return TFS_DISK_FULL; // No free blocks available
+    int *grown = realloc(pass->files, sizeof(int) * (pass->num_files + 1));
+    if (grown == NULL) {
+        return TFS_MEMORY_ERROR;
     }
+    pass->files = grown;
+    pass->files[pass->num_files++] = ino;
+    return 0;
+}
 
-    char free_block_data[BLOCKSIZE];
-    if (readBlock(mounted_disk, free_block, free_block_data) < 0) {
-        return TFS_READ_ERROR;
+/*
+ * Starts a pass over all files over again if the current one is done.
+ * Returns 1 if there is a file to work on, 0 if the pass that just ended
+ * moved nothing (or there are no files), or an error.
+ */
+static int next_pass(filePass *pass) {
+    if (pass->files != NULL && pass->next < pass->num_files) {
+        return 1;
     }
-
-    // Update superblock to point to the next free block
-    super_block[2] = free_block_data[2];
-    if (writeBlock(mounted_disk, 0, super_block) < 0) {
-        return TFS_WRITE_ERROR;
+    int finished = (pass->files != NULL && pass->moved == 0);
+    free(pass->files);
+    memset(pass, 0, sizeof(*pass));
+    if (finished) {
+        return 0;
     }
-
-    // Mark the allocated block as used
-    free_block_data[0] = 3; // Data block type
-    free_block_data[2] = 0; // Clear next free block pointer
-    if (writeBlock(mounted_disk, free_block, free_block_data) < 0) {
-        return TFS_WRITE_ERROR;
+    int ret = walk_tree(root_inode, "/", collect_file, pass);
+    if (ret < 0) {
+        return ret;
     }
-
-    return free_block;
+    return pass->num_files > 0;
 }
 
-
 /*
-Writes buffer ‘buffer’ of size ‘size’, which represents an entire
-file’s content, to the file system. Previous content (if any) will be
-completely lost. Sets the file pointer to 0 (the start of file) when
-done. Returns success/error codes.
-*/
-int tfs_writeFile(fileDescriptor FD, char *buffer, int size) {
-    if (mounted_disk == -1) {
-        return TFS_DISK_NOT_OPEN;
+ * The in-core inode of file 'ino' for a pass: the open file's if it is
+ * open, else loaded into 'loaded'. NULL if the file was deleted (or its
+ * inode reused) since the pass started.
+ */
+static fileMetadata *pass_inode(int ino, fileMetadata *loaded) {
+    int i;
+    for (i = 0; i < num_fd; i++) {
+        if (file_md[i].snapshot_id == 0 && file_md[i].inode == ino) {
+            return &file_md[i];
+        }
+    }
+    int ret = load_inode(ino, loaded);
+    if (ret == TFS_SUCCESS && loaded->is_dir) {
+        drop_inode(loaded);
+        return NULL;
     }
+    return ret == TFS_SUCCESS ? loaded : NULL;
+}
 
-    if (FD < 0 || FD >= num_fd) {
-        return TFS_FILE_NOT_OPEN;
+/*
+ * Picks where a file's data should move to: the lowest run of free blocks
+ * that holds all of it, if the file is fragmented or that run lies before
+ * it. Returns 0 when the file should stay. Files sharing blocks with
+ * others (dedup, snapshots) stay, since moving would unshare them.
+ */
+static int defrag_target(fileMetadata *meta) {
+    int i, blocks = 0, extents = 0, first = 0, last = 0;
+    for (i = 0; i < meta->map_len; i++) {
+        int bNum = meta->block_map[i];
+        if (bNum == 0) {
+            continue;
+        }
+        if (ref_count(bNum) > 1) {
+            return 0;
+        }
+        if (first == 0) {
+            first = bNum;
+        }
+        if (bNum != last + 1) {
+            extents++;
+        }
+        last = bNum;
+        blocks++;
     }
-    if (file_md[FD].read_only) {
-        return TFS_FILE_READ_ONLY;
+    if (blocks == 0) {
+        return 0;
     }
 
-    int total_blocks = (size + BLOCKSIZE - 5) / (BLOCKSIZE - 4);
-    int remaining_size = size;
-    char *current_buffer = buffer;
-    int previous_block = -1;
-
-    file_md[FD].size = size;
-    file_md[FD].start_block = find_free_block();
-    if (file_md[FD].start_block == -1) {
-        return TFS_DISK_FULL; // No free blocks available
+    // On a tiered disk the data stays on the device it is on
+    int fast = first < fast_blocks;
+    int run = find_free_run(fast || fast_blocks == 0 ? 1 : fast_blocks, blocks);
+    if (run == 0 || (extents == 1 && run > first)) {
+        return 0;
+    }
+    if (fast_blocks > 0 && ((run < fast_blocks) != fast || (run + blocks - 1 < fast_blocks) != fast)) {
+        return 0;
     }
+    return run;
+}
 
-    file_md[FD].curr_block = file_md[FD].start_block;
-    int cur_block = file_md[FD].start_block;
+/* Blocks moved since a file's inode was last saved. The old copies stay
+   allocated until the inode that points at the new ones is on disk. */
+#define MOVE_BATCH 64
 
-    int i;
-    for (i = 0; i < total_blocks; i++) {
-        if (cur_block == -1) {
-            cur_block = find_free_block();
-            if (cur_block == -1) {
-                return TFS_DISK_FULL; // No free blocks available
-            }
+typedef struct {
+    int index[MOVE_BATCH]; /* logical block moved */
+    int old[MOVE_BATCH];   /* where it was before */
+    uint32_t fingerprint[MOVE_BATCH]; /* of its content, for the dedup index */
+    int count;
+} moveBatch;
 
-            // Link the previous block to the new block
-            if (previous_block != -1) {
-                char prev_block_data[BLOCKSIZE];
-                if (readBlock(mounted_disk, previous_block, prev_block_data) < 0) {
-                    return TFS_READ_ERROR;
-                }
-                //*((unsigned int *)(prev_block_data + 2)) = (unsigned int)cur_block;
-                prev_block_data[2] = (unsigned int) cur_block;
-                if (writeBlock(mounted_disk, previous_block, prev_block_data) < 0) {
-                    return TFS_WRITE_ERROR;
-                }
+/*
+ * Copies one block of a file to 'dest' and points the file at the copy.
+ * The old copy is released by commit_moves once the inode is saved.
+ */
+static int move_data_block(fileMetadata *meta, int index, int dest, moveBatch *batch) {
+    char block[BLOCKSIZE];
+    int bNum = meta->block_map[index];
+    if (read_fs_block(mounted_disk, bNum, block) < 0) {
+        return TFS_READ_ERROR;
+    }
+    if (take_free_block(dest) < 0) {
+        return TFS_WRITE_ERROR;
+    }
+    if (write_fs_block(mounted_disk, dest, block) < 0) {
+        free_block(dest); // the file keeps the old copy
+        return TFS_WRITE_ERROR;
+    }
+    if (set_ref_count(dest, 1) < 0) {
+        free_block(dest);
+        return TFS_MEMORY_ERROR;
+    }
+    stats.blocks_allocated++;
+    meta->block_map[index] = dest;
+    batch->index[batch->count] = index;
+    batch->old[batch->count] = bNum;
+    batch->fingerprint[batch->count] = dedup_enabled ? block_fingerprint(block) : 0;
+    batch->count++;
+    return TFS_SUCCESS;
+}
+
+/*
+ * Saves the inode of a file whose blocks were moved and then releases the
+ * old copies. If the inode can't be saved, the file goes back to the old
+ * copies (which the inode on disk still names) and the new ones are
+ * released instead. Blocks that changed device count as promoted or
+ * demoted.
+ */
+static int commit_moves(fileMetadata *meta, moveBatch *batch) {
+    int i, start = meta->start_block;
+    meta->start_block = meta->map_len > 0 ? meta->block_map[0] : -1;
+    int ret = save_inode(meta);
+    if (ret < 0) {
+        meta->start_block = start;
+    }
+    for (i = 0; i < batch->count; i++) {
+        int dest = meta->block_map[batch->index[i]];
+        if (ret < 0) {
+            meta->block_map[batch->index[i]] = batch->old[i];
+            release_block(dest);
+            continue;
+        }
+        release_block(batch->old[i]);
+        if ((dest < fast_blocks) != (batch->old[i] < fast_blocks)) {
+            if (dest < fast_blocks) {
+                blocks_promoted++;
+            } else {
+                blocks_demoted++;
             }
         }
-
-        // Write the data to the current block
-        char block[BLOCKSIZE] = {0};
-        block[0] = 3; // Data block type
-        block[1] = 0x44; // Magic number
-        int bytes_to_write = (remaining_size > (BLOCKSIZE - 4)) ? (BLOCKSIZE - 4) : remaining_size;
-        strncpy(block + 4, current_buffer, bytes_to_write);
-
-        if (writeBlock(mounted_disk, cur_block, block) < 0) {
-            return TFS_WRITE_ERROR;
+        if (dedup_enabled) {
+            dedup_insert(dest, batch->fingerprint[i]);
         }
+    }
+    batch->count = 0;
+    return ret;
+}
 
-        current_buffer += bytes_to_write;
-        remaining_size -= bytes_to_write;
+/*
+ * Works on the current file of the pass until it is done or 'budget' units
+ * of work (inode loads and block moves) are used up. The inode is saved
+ * after every step, so the file is consistent between calls. If the
+ * target run was taken in the meantime the file is left as it is.
+ */
+static int defrag_file(int budget, int *work) {
+    fileMetadata loaded, *meta = pass_inode(defrag_pass.files[defrag_pass.next], &loaded);
+    moveBatch batch;
+    int moved = 0, ret = TFS_SUCCESS;
+    batch.count = 0;
 
-        // Update previous and current block pointers
-        previous_block = cur_block;
-        cur_block = -1;
+    if (meta == NULL) {
+        defrag_pass.next++;
+        defrag_pass.dest = 0;
+        return 0;
     }
+    (*work)++;
 
-    file_md[FD].curr_offset = 0;
+    if (defrag_pass.dest == 0) {
+        defrag_pass.dest = defrag_target(meta);
+        defrag_pass.index = 0;
+    }
+    while (defrag_pass.dest != 0 && defrag_pass.index < meta->map_len && *work < budget) {
+        int bNum = meta->block_map[defrag_pass.index];
+        if (bNum == 0) {
+            defrag_pass.index++;
+            continue;
+        }
+        if (ref_count(bNum) > 1 || defrag_pass.dest >= disk_blocks || !free_map[defrag_pass.dest]) {
+            defrag_pass.dest = 0;
+            break;
+        }
+        if ((ret = move_data_block(meta, defrag_pass.index, defrag_pass.dest, &batch)) < 0) {
+            break;
+        }
+        defrag_pass.index++;
+        defrag_pass.dest++;
+        moved++;
+        (*work)++;
+        if (batch.count == MOVE_BATCH && (ret = commit_moves(meta, &batch)) < 0) {
+            break;
+        }
+    }
 
-    return TFS_SUCCESS;
+    if (batch.count > 0) {
+        int saved = commit_moves(meta, &batch);
+        if (ret == TFS_SUCCESS) {
+            ret = saved;
+        }
+    }
+    if (ret < 0) {
+        defrag_pass.dest = 0; // picked again on the next pass
+    }
+    if (defrag_pass.dest == 0 || defrag_pass.index >= meta->map_len) {
+        defrag_pass.next++;
+        defrag_pass.dest = 0;
+    }
+    if (meta == &loaded) {
+        drop_inode(&loaded);
+    }
+    defrag_pass.moved += moved;
+    return ret < 0 ? ret : moved;
 }
 
-
 /*
-deletes a file and marks its blocks as free on disk.
+ Does one bounded step of online defragmentation: moves each file's data
+ into one run of consecutive blocks, as low on the disk as it fits (on a
+ tiered disk, as low on the device holding it), so files read
+ sequentially and free space collects at the end of the disk.
+ A step does at most 'maxBlocks' units of work (one per block moved or
+ inode read), so it can run between foreground calls without holding
+ them up. Progress is kept between calls. Returns the number of blocks
+ moved, or TFS_EOF once a whole pass over the tree finds nothing to move.
 */
-int tfs_deleteFile(fileDescriptor FD) {
+static int defrag_disk(int maxBlocks) {
     if (mounted_disk == -1) {
         return TFS_DISK_NOT_OPEN;
     }
-
-    if (FD < 0 || FD >= num_fd) {
-        return TFS_FILE_NOT_OPEN;
+    if (maxBlocks <= 0) {
+        return TFS_ERROR;
     }
 
-    int curr_block = file_md[FD].start_block;
+    int work = 0, moved = 0;
+    while (work < maxBlocks) {
+        int ret = next_pass(&defrag_pass);
+        if (ret <= 0) {
+            return ret < 0 ? ret : (moved > 0 ? moved : TFS_EOF);
+        }
+        ret = defrag_file(maxBlocks, &work);
+        if (ret < 0) {
+            return ret;
+        }
+        moved += ret;
+    }
+    return moved;
+}
 
-    while (curr_block != -1) {
-        char block[BLOCKSIZE];
+int tfs_defrag(int maxBlocks) {
+    struct timespec start;
+    int prev = op_begin(TFS_OP_DEFRAG, &start);
+    return op_end(prev, &start, defrag_disk(maxBlocks));
+}
 
-        if (readBlock(mounted_disk, curr_block, block) < 0) {
-            return TFS_READ_ERROR;
+/*
+ * Returns a free block on the fast (or slow) device of a tiered disk, the
+ * first at or after 'from' if that is on it, or 0 if the device is full.
+ * The block stays on the free list.
+ */
+static int tier_free_block(int fast, int from) {
+    int lo = fast ? 1 : fast_blocks;
+    int n = (fast ? fast_blocks : disk_blocks) - lo;
+    if (from < lo || from >= lo + n) {
+        from = lo;
+    }
+    int i = 0;
+    while (i < n) {
+        int bNum = lo + (from - lo + i) % n;
+        if (group_free[group_of(bNum)] == 0) {
+            // Skip the rest of a full group, but not past the device's end
+            int skip = TFS_ALLOC_GROUP_BLOCKS - bNum % TFS_ALLOC_GROUP_BLOCKS;
+            i += skip < lo + n - bNum ? skip : lo + n - bNum;
+        } else if (free_map[bNum]) {
+            return bNum;
+        } else {
+            i++;
         }
+    }
+    return 0;
+}
 
-        int next_block = *((int*)(block + 2));
+/*
+ * Decides which device of a tiered disk a file belongs on: 1 to move it to
+ * the fast device, 0 to the slow one, -1 to leave it. A file is hot if it
+ * was read or written in the last 'hotAge' seconds; a hot file moves up
+ * only if all of its blocks on the slow device fit in tier_room. Files
+ * sharing blocks with others stay, like in defrag_target.
+ */
+static int migrate_target(fileMetadata *meta, int hotAge) {
+    int i, on_fast = 0, on_slow = 0;
+    for (i = 0; i < meta->map_len; i++) {
+        int bNum = meta->block_map[i];
+        if (bNum == 0) {
+            continue;
+        }
+        if (ref_count(bNum) > 1) {
+            return -1;
+        }
+        if (bNum < fast_blocks) {
+            on_fast++;
+        } else {
+            on_slow++;
+        }
+    }
 
-        memset(block, 0, BLOCKSIZE);
-        block[0] = 4; // Block type = free
-        block[1] = 0x44; // Magic number
+    collect_access(meta);
+    time_t last = meta->accessed_t > meta->modified_t ? meta->accessed_t : meta->modified_t;
+    if (time(NULL) - last < hotAge) {
+        return (on_slow > 0 && tier_room(on_slow)) ? 1 : -1;
+    }
+    return on_fast > 0 ? 0 : -1;
+}
 
-        if (writeBlock(mounted_disk, curr_block, block) < 0) {
-            return TFS_WRITE_ERROR;
-        }
+/*
+ * Works on the current file of the migration pass until its blocks are on
+ * the device migrate_target picks or 'budget' units of work are used up.
+ * Blocks go to the next free block after the last one moved, so a file
+ * moved in one go lands in as few runs as the free space allows. The inode
+ * is saved after every step, as in defrag_file.
+ */
+static int migrate_file(int budget, int hotAge, int *work) {
+    fileMetadata loaded, *meta = pass_inode(migrate_pass.files[migrate_pass.next], &loaded);
+    moveBatch batch;
+    int moved = 0, ret = TFS_SUCCESS;
+    batch.count = 0;
 
-        curr_block = next_block;
+    if (meta == NULL) {
+        migrate_pass.next++;
+        migrate_pass.index = 0;
+        return 0;
     }
+    (*work)++;
 
-    int i;
-    for (i = FD; i < num_fd - 1; i++) {
-        file_md[i] = file_md[i + 1];
+    int fast = migrate_target(meta, hotAge);
+    int stuck = 0; // the destination device filled up
+    while (fast >= 0 && migrate_pass.index < meta->map_len && *work < budget) {
+        int bNum = meta->block_map[migrate_pass.index];
+        if (bNum == 0 || (bNum < fast_blocks) == fast) {
+            migrate_pass.index++;
+            continue;
+        }
+        int dest = (fast && !tier_room(1)) ? 0 : tier_free_block(fast, migrate_pass.dest);
+        if (dest == 0) {
+            stuck = 1;
+            break;
+        }
+        if ((ret = move_data_block(meta, migrate_pass.index, dest, &batch)) < 0) {
+            break;
+        }
+        migrate_pass.index++;
+        migrate_pass.dest = dest + 1;
+        moved++;
+        (*work)++;
+        if (batch.count == MOVE_BATCH && (ret = commit_moves(meta, &batch)) < 0) {
+            break;
+        }
     }
-    num_fd--;
 
-    return TFS_SUCCESS;
+    if (batch.count > 0) {
+        int saved = commit_moves(meta, &batch);
+        if (ret == TFS_SUCCESS) {
+            ret = saved;
+        }
+    }
+    if (ret < 0) {
+        migrate_pass.index = 0; // blocks put back are picked up again
+    }
+    if (fast < 0 || stuck || migrate_pass.index >= meta->map_len) {
+        migrate_pass.next++;
+        migrate_pass.index = 0;
+    }
+    if (meta == &loaded) {
+        drop_inode(&loaded);
+    }
+    migrate_pass.moved += moved;
+    return ret < 0 ? ret : moved;
 }
 
-/*
-reads one byte from the file and copies it to buffer, using the
-current file pointer location and incrementing it by one upon success.
-If the file pointer is already past the end of the file then
-tfs_readByte() should return an error and not increment the file pointer
+/*
+ Does one bounded step of moving files between the devices of a tiered
+ disk (see diskFastBlocks): files read or written in the last 'hotAge'
+ seconds (TFS_TIER_HOT_AGE if 'hotAge' is 0 or less) move to the fast
+ device while it has room beyond its metadata reserve, and the others
+ move to the slow device. Steps are bounded and resumable like tfs_defrag
+ steps; run them until TFS_EOF after cold files were demoted to make room
+ for hot ones. Returns the number of blocks moved, or TFS_EOF once a whole
+ pass moves nothing (at once on a disk that isn't tiered).
 */
-int tfs_readByte(fileDescriptor FD, char *buffer) {
+static int migrate_disk(int maxBlocks, int hotAge) {
     if (mounted_disk == -1) {
         return TFS_DISK_NOT_OPEN;
     }
-
-    if (FD < 0 || FD >= num_fd) {
-        return TFS_FILE_NOT_OPEN;
+    if (maxBlocks <= 0) {
+        return TFS_ERROR;
     }
-
-    if (file_md[FD].curr_offset >= file_md[FD].size) {
+    if (fast_blocks == 0) {
         return TFS_EOF;
     }
-
-    int block_num = file_md[FD].curr_block;
-    int offset = file_md[FD].curr_offset % (BLOCKSIZE - 4) + 4; // Data offset within the block +4 to skip header
-
-
-    char block[BLOCKSIZE];
-    if (readBlock(mounted_disk, block_num, block) < 0) {
-        return TFS_READ_ERROR;
+    if (hotAge <= 0) {
+        hotAge = TFS_TIER_HOT_AGE;
     }
 
-    *buffer = block[offset];
-
-    file_md[FD].curr_offset++;
-
-    // Move to next block if necessary
-    if (file_md[FD].curr_offset % (BLOCKSIZE - 4) == 0 && file_md[FD].curr_offset < file_md[FD].size) {
-        file_md[FD].curr_block = (unsigned int)block[2];
+    int work = 0, moved = 0;
+    while (work < maxBlocks) {
+        int ret = next_pass(&migrate_pass);
+        if (ret <= 0) {
+            return ret < 0 ? ret : (moved > 0 ? moved : TFS_EOF);
+        }
+        ret = migrate_file(maxBlocks, hotAge, &work);
+        if (ret < 0) {
+            return ret;
+        }
+        moved += ret;
     }
-
-    return TFS_SUCCESS;
+    return moved;
 }
 
-
+int tfs_migrate(int maxBlocks, int hotAge) {
+    struct timespec start;
+    int prev = op_begin(TFS_OP_MIGRATE, &start);
+    return op_end(prev, &start, migrate_disk(maxBlocks, hotAge));
+}
 
 /*
-change the file pointer location to offset (absolute). Returns
-success/error codes.
+ Fills in how the blocks of a tiered disk are split between its devices
+ and how much of the reading each device served since the mount. On a
+ disk that isn't tiered everything but slow_blocks and slow_free is 0.
 */
-int tfs_seek(fileDescriptor FD, int offset) {
+static int get_tier_stats(tfsTierStats *st) {
     if (mounted_disk == -1) {
         return TFS_DISK_NOT_OPEN;
     }
-
-    if (FD < 0 || FD >= num_fd) {
-        return TFS_FILE_NOT_OPEN;
-    }
-
-    if (offset < 0 || offset >= file_md[FD].size) {
-        return TFS_INVALID_SEEK;
+    if (st == NULL) {
+        return TFS_ERROR;
     }
-
-    file_md[FD].curr_offset = offset;
-    int block_num = file_md[FD].start_block;
-    int i; 
-    for (i = 0; i < offset / (BLOCKSIZE - 4); i++) {
-        char block[BLOCKSIZE];
-        if (readBlock(mounted_disk, block_num, block) < 0) {
-            return TFS_READ_ERROR;
-        }
-        block_num = (unsigned int)block[2]; // Move to the next block
+    int i, free_blocks = 0;
+    for (i = 0; i < num_groups; i++) {
+        free_blocks += group_free[i];
     }
-
-    file_md[FD].curr_block = block_num;
-
+    st->fast_blocks = fast_blocks;
+    st->fast_free = fast_free;
+    st->slow_blocks = disk_blocks - fast_blocks;
+    st->slow_free = free_blocks - fast_free;
+    st->fast_reads = __atomic_load_n(&fast_reads, __ATOMIC_RELAXED);
+    st->slow_reads = __atomic_load_n(&slow_reads, __ATOMIC_RELAXED);
+    st->blocks_promoted = blocks_promoted;
+    st->blocks_demoted = blocks_demoted;
     return TFS_SUCCESS;
 }
 
-/* EXTRA FUNCTIONS. CHECK HEADER FILE FOR MORE INFO ON HOW WE SHOULD APPROACH THESE */
+int tfs_getTierStats(tfsTierStats *st) {
+    fs_lock();
+    int ret = get_tier_stats(st);
+    fs_unlock();
+    return ret;
+}
 
-/*
-Perform checks for file system consistency.
+/* One block written by tfs_bulkImport */
+typedef struct {
+    int file;  /* index into the import's files */
+    int part;  /* logical data block, IMPORT_INODE, or IMPORT_MAP - k for block map block k */
+} importSlot;
 
-General ideas for consistency checks:
-- Read the superblock and extract information about free blocks and inode pointers
-- Traverse the list of free blocks and ensure they are marked as free
-- traverse the list of inodes and ensure that allocated blocks are not marked as free
-- Check for block corruption (for example: invalid magic numbers, incorrect block types).
+#define IMPORT_INODE -1
+#define IMPORT_MAP -2
 
-Return TFS_SUCCESS if all checks pass, otherwise return an error code
-*/
-int tfs_checkConsistency() {
-    char block[BLOCKSIZE];
-    int free_block, next_free_block, i;
+/* One import thread and the run of slots it writes */
+typedef struct {
+    tfsImportFile *files;
+    fileMetadata *metas;
+    importSlot *slots;
+    int *blocks;     /* disk block of every slot */
+    int first;
+    int end;
+    int ret;
+    tfsStats stats;  /* added to the global counters once the thread is done */
+    tfsChecksumStats checksums;
+    pthread_t thread;
+} importWorker;
 
-    if (mounted_disk == -1) {
-        return TFS_DISK_NOT_OPEN;
+/*
+ * Works out where a file of the import goes and how many blocks it needs:
+ * its inode, a block for every logical block that isn't all zeros, and its
+ * block map blocks. A logical block that needs a block is marked -1 in the
+ * map until blocks are handed out. Returns the block count, 0 when the
+ * file must take the ordinary open and write path (it exists already or
+ * blocks are deduplicated) or an error.
+ */
+static int plan_import(tfsImportFile *file, fileMetadata *meta) {
+    if (file->name == NULL || file->size < 0 || (file->buffer == NULL && file->size > 0)) {
+        return TFS_ERROR;
+    }
+    fileMetadata *parent;
+    char leaf[TFS_MAX_NAME + 1];
+    int ret = resolve_parent(file->name, &parent, leaf);
+    if (ret < 0) {
+        return ret;
+    }
+    int kind;
+    int ino = dir_lookup(parent, leaf, &kind);
+    if (ino < 0) {
+        return ino;
+    }
+    if (ino > 0 && kind == INODE_DIR) {
+        return TFS_IS_A_DIRECTORY;
+    }
+    if (ino > 0 || dedup_enabled) {
+        return 0;
     }
 
-    // Read and verify the superblock
+    memset(meta, 0, sizeof(*meta));
+    strcpy(meta->name, leaf);
+    meta->parent = parent->inode;
+    meta->size = file->size;
+    meta->creation_t = time(NULL);
+    meta->modified_t = meta->creation_t;
+    meta->accessed_t = meta->creation_t;
+    meta->chunk_index = -1;
+    meta->map_len = (file->size + BLOCK_DATA_SIZE - 1) / BLOCK_DATA_SIZE;
+    meta->num_index_blocks = index_blocks_needed(meta->map_len);
+    meta->block_map = pool_calloc(meta->map_len > 0 ? meta->map_len : 1, sizeof(int));
+    meta->index_blocks = pool_calloc(meta->num_index_blocks > 0 ? meta->num_index_blocks : 1, sizeof(int));
+    if (meta->block_map == NULL || meta->index_blocks == NULL) {
+        return TFS_MEMORY_ERROR;
+    }
 
-    if (readBlock(mounted_disk, 0, block) < 0) {
-        return TFS_ERROR;
+    int i, blocks = 1 + meta->num_index_blocks;
+    for (i = 0; i < meta->map_len; i++) {
+        int off = i * BLOCK_DATA_SIZE;
+        int len = file->size - off < BLOCK_DATA_SIZE ? file->size - off : BLOCK_DATA_SIZE;
+        if (!is_zero(file->buffer + off, len)) {
+            meta->block_map[i] = -1;
+            blocks++;
+        }
     }
+    return blocks;
+}
 
-    if (block[0] != 1 || block[1] != 0x44) {
-        return TFS_INVALID_FILESYSTEM;
+/*
+ * Finds an earlier file of the import with the same parent and name, using
+ * an open addressing table of 'size' slots (a power of two) holding file
+ * index + 1. Adds 'i' and returns -1 when there is none.
+ */
+static int import_seen(fileMetadata *metas, int *table, int size, int i) {
+    uint32_t slot = (dir_hash(metas[i].name) ^ (uint32_t)metas[i].parent * 2654435761u) & (size - 1);
+    while (table[slot] != 0) {
+        fileMetadata *other = &metas[table[slot] - 1];
+        if (other->parent == metas[i].parent && strcmp(other->name, metas[i].name) == 0) {
+            return table[slot] - 1;
+        }
+        slot = (slot + 1) & (size - 1);
     }
+    table[slot] = i + 1;
+    return -1;
+}
 
-    free_block = block[2];
+static int compare_ints(const void *a, const void *b) {
+    int x = *(const int *)a, y = *(const int *)b;
+    return (x > y) - (x < y);
+}
 
-    // Traverse free block list
-    while (free_block != 0) {
-        if (readBlock(mounted_disk, free_block, block) < 0) {
-            return TFS_ERROR;
+/*
+ * Takes 'count' free blocks in one pass over the free index: a single run
+ * near 'goal' if there is one, else the free blocks in disk order from
+ * 'goal' on. The blocks are unlinked from the free list in memory first,
+ * and then each block whose next pointer changed is written once, instead
+ * of one free list write per block taken. If a write fails the blocks are
+ * linked back in memory: the links that did reach the disk only skip
+ * blocks, which leaves them lost on disk at worst, never free twice.
+ */
+static int take_free_blocks(int goal, int count, int *blocks) {
+    if (goal <= 0 || goal >= disk_blocks) {
+        goal = free_head;
+    }
+    int start = count > 0 ? find_free_run(goal, count) : 0;
+    int i, n = 0;
+    for (i = 0; n < count && i < disk_blocks; i++) {
+        int bNum = start > 0 ? start + i : (goal + i) % disk_blocks;
+        if (bNum != 0 && free_map[bNum]) {
+            blocks[n++] = bNum;
         }
+    }
+    if (n < count) {
+        return TFS_DISK_FULL;
+    }
 
-        // Free blocks must have block type 4 and magic number
-        if (block[0] != 4 || block[1] != 0x44) {
-            return TFS_INVALID_FILESYSTEM;
+    int *dirty = malloc(sizeof(int) * 3 * (count > 0 ? count : 1));
+    if (dirty == NULL) {
+        return TFS_MEMORY_ERROR;
+    }
+    int *old_prev = dirty + count, *old_next = old_prev + count;
+    int num_dirty = 0, head_moved = 0, old_head = free_head;
+    for (i = 0; i < count; i++) {
+        int bNum = blocks[i], prev = free_prev[bNum], next = free_next[bNum];
+        old_prev[i] = prev;
+        old_next[i] = next;
+        if (prev != 0) {
+            free_next[prev] = next;
+            dirty[num_dirty++] = prev;
+        } else {
+            free_head = next;
+            head_moved = 1;
+        }
+        if (next != 0) {
+            free_prev[next] = prev;
         }
+        free_map[bNum] = 0;
+        free_next[bNum] = free_prev[bNum] = 0;
+        count_free(bNum, -1);
 
-        next_free_block = block[2];
-        free_block = next_free_block;
+        // The block is about to be written behind the cache's back
+        int c = cache_find(bNum);
+        if (c >= 0) {
+            cache_detach(c);
+        }
     }
 
-    // Check all blocks to verify no allocated block is marked as free
-    for (i = 0; i < num_fd; i++) {
-        int curr_block = file_md[i].start_block;
+    int ret = TFS_SUCCESS;
+    qsort(dirty, num_dirty, sizeof(int), compare_ints);
+    for (i = 0; i < num_dirty && ret == TFS_SUCCESS; i++) {
+        if ((i == 0 || dirty[i] != dirty[i - 1]) && free_map[dirty[i]]) {
+            ret = set_free_link(dirty[i], free_next[dirty[i]]);
+        }
+    }
+    if (head_moved && ret == TFS_SUCCESS) {
+        ret = set_free_link(0, free_head);
+    }
 
-        while (curr_block != -1) {
-            if (readBlock(mounted_disk, curr_block, block) < 0) {
-                return TFS_ERROR;
+    if (ret < 0) {
+        // Undo the unlinks last to first, which restores the list exactly
+        for (i = count - 1; i >= 0; i--) {
+            int bNum = blocks[i], prev = old_prev[i], next = old_next[i];
+            if (prev != 0) {
+                free_next[prev] = bNum;
             }
-
-            // Can't be free
-            if (block[0] != 4) {
-                return TFS_INVALID_FILESYSTEM;
+            if (next != 0) {
+                free_prev[next] = bNum;
             }
-
-            curr_block = *((int *)(block + 2));
+            free_prev[bNum] = prev;
+            free_next[bNum] = next;
+            free_map[bNum] = 1;
+            count_free(bNum, 1);
         }
+        free_head = old_head;
+    } else {
+        stats.blocks_allocated += count;
     }
+    free(dirty);
+    return ret;
+}
 
-    // Additional corruption checks valid magic numbers
-    int num_blocks = DEFAULT_DISK_SIZE / BLOCKSIZE;
-    for (i = 1; i < num_blocks; i++) {
-        if (readBlock(mounted_disk, i, block) < 0) {
-            return TFS_ERROR;
-        }
+/*
+ * Builds the block for one slot of the import, checksum included
+ */
+static void import_block_image(importWorker *worker, int s, char *block) {
+    importSlot *slot = &worker->slots[s];
+    fileMetadata *meta = &worker->metas[slot->file];
+    if (slot->part == IMPORT_INODE) {
+        inode_image(meta, block);
+    } else if (slot->part <= IMPORT_MAP) {
+        map_block_image(meta, IMPORT_MAP - slot->part, block);
+    } else {
+        int off = slot->part * BLOCK_DATA_SIZE;
+        int len = meta->size - off < BLOCK_DATA_SIZE ? meta->size - off : BLOCK_DATA_SIZE;
+        memset(block, 0, BLOCKSIZE);
+        block[0] = 3; // Data block type
+        block[1] = 0x44; // Magic number
+        memcpy(block + BLOCK_HEADER_SIZE, worker->files[slot->file].buffer + off, len);
+    }
+    stamp_block(block, checksums_enabled, &worker->checksums);
+}
 
-        if (block[0] == 1 && block[1] != 0x44) {
-            return TFS_INVALID_FILESYSTEM;
+/*
+ * Import thread: writes its slots, batching runs of consecutive disk
+ * blocks into one writeBlocks call. It touches no shared state but the
+ * disk, so it runs without the library lock.
+ */
+static void *import_worker(void *arg) {
+    importWorker *worker = arg;
+    char batch[TFS_IMPORT_BATCH * BLOCKSIZE];
+    int s = worker->first;
+    while (s < worker->end && worker->ret == TFS_SUCCESS) {
+        int n = 0;
+        do {
+            import_block_image(worker, s + n, batch + n * BLOCKSIZE);
+            n++;
+        } while (n < TFS_IMPORT_BATCH && s + n < worker->end && worker->blocks[s + n] == worker->blocks[s] + n);
+
+        struct timespec io_start;
+        clock_gettime(CLOCK_MONOTONIC, &io_start);
+        int ret = writeBlocks(mounted_disk, worker->blocks[s], n, batch);
+        record_latency(&worker->stats.disk_write, elapsed_ns(&io_start), ret);
+        worker->stats.ops[TFS_OP_BULK_IMPORT].blocks_written += n;
+        if (ret < 0) {
+            worker->ret = TFS_WRITE_ERROR;
         }
+        s += n;
     }
-
-    return TFS_SUCCESS;
+    return NULL;
 }
 
- /*Renames a file. New name should be passed in. File has to be open*/
-int tfs_rename(fileDescriptor FD, char* newName) {
-    if (mounted_disk == -1) {
-        return TFS_DISK_NOT_OPEN;
+/*
+ * Writes all slots with up to 'threads' threads, each taking a contiguous
+ * share of them, and adds the threads' counters to the global ones
+ */
+static int write_import(tfsImportFile *files, fileMetadata *metas, importSlot *slots, int *blocks,
+                        int total, int threads) {
+    importWorker workers[TFS_IMPORT_MAX_THREADS];
+    int t, started = 0, ret = TFS_SUCCESS;
+    if (threads > (total + TFS_IMPORT_BATCH - 1) / TFS_IMPORT_BATCH) {
+        threads = (total + TFS_IMPORT_BATCH - 1) / TFS_IMPORT_BATCH;
     }
-
-    if (FD < 0 || FD >= num_fd) {
-        return TFS_FILE_NOT_OPEN;
+    for (t = 0; t < threads; t++) {
+        importWorker *worker = &workers[t];
+        memset(worker, 0, sizeof(*worker));
+        worker->files = files;
+        worker->metas = metas;
+        worker->slots = slots;
+        worker->blocks = blocks;
+        worker->first = (int)((long long)total * t / threads);
+        worker->end = (int)((long long)total * (t + 1) / threads);
+        // The last share is written by this thread
+        if (t == threads - 1 || pthread_create(&worker->thread, NULL, import_worker, worker) != 0) {
+            import_worker(worker);
+        } else {
+            started |= 1 << t;
+        }
     }
-    int i;
-    for (i = 0; i < num_fd; i++) {
-        if (strcmp(file_md[i].name, newName) == 0) {
-            return TFS_FILE_ALREADY_EXISTS;
+    for (t = 0; t < threads; t++) {
+        if (started & (1 << t)) {
+            pthread_join(workers[t].thread, NULL);
+        }
+        add_op_stats(&stats.disk_write, &workers[t].stats.disk_write);
+        stats.ops[TFS_OP_BULK_IMPORT].blocks_written += workers[t].stats.ops[TFS_OP_BULK_IMPORT].blocks_written;
+        checksum_stats.blocks_updated += workers[t].checksums.blocks_updated;
+        checksum_stats.update_ns += workers[t].checksums.update_ns;
+        if (workers[t].ret < 0) {
+            ret = workers[t].ret;
         }
     }
+    __atomic_store_n(&cache_writes, cache_writes + total, __ATOMIC_RELEASE);
+    return ret;
+}
 
-    strncpy(file_md[FD].name, newName, 8);
-    file_md[FD].name[8] = '\0'; // add null termination
+/*
+ * Lists every block of the planned files in disk layout order (each file's
+ * inode, then its data, then its block map blocks), hands out the disk
+ * blocks taken for them and fills in the block maps
+ */
+static void lay_out_import(fileMetadata *metas, int *planned, int count, importSlot *slots, int *blocks) {
+    int i, j, s = 0;
+    for (i = 0; i < count; i++) {
+        if (planned[i] <= 0) {
+            continue;
+        }
+        fileMetadata *meta = &metas[i];
+        slots[s].file = i;
+        slots[s].part = IMPORT_INODE;
+        meta->inode = blocks[s++];
+        for (j = 0; j < meta->map_len; j++) {
+            if (meta->block_map[j] == -1) {
+                slots[s].file = i;
+                slots[s].part = j;
+                meta->block_map[j] = blocks[s++];
+            }
+        }
+        for (j = 0; j < meta->num_index_blocks; j++) {
+            slots[s].file = i;
+            slots[s].part = IMPORT_MAP - j;
+            meta->index_blocks[j] = blocks[s++];
+        }
+        meta->start_block = meta->map_len > 0 ? meta->block_map[0] : -1;
+    }
+}
 
-    return TFS_SUCCESS;
+/*
+ * Gives back every block a planned file was given, after a failed import
+ */
+static void release_import(fileMetadata *meta) {
+    int j;
+    for (j = 0; j < meta->map_len; j++) {
+        if (meta->block_map[j] > 0) {
+            set_ref_count(meta->block_map[j], 0);
+            free_block(meta->block_map[j]);
+        }
+    }
+    for (j = 0; j < meta->num_index_blocks; j++) {
+        free_block(meta->index_blocks[j]);
+    }
+    free_block(meta->inode);
 }
 
+/*
+ * The ordinary path for one file: open (creating it if needed), write the
+ * whole content, and close it again unless it was open before
+ */
+static int import_one(tfsImportFile *file) {
+    int was_open = num_fd;
+    fileDescriptor FD = open_file(file->name);
+    if (FD < 0) {
+        return FD;
+    }
+    int ret = write_file(FD, file->buffer, file->size);
+    if (FD == was_open) {
+        int closed = close_file(FD);
+        if (ret == TFS_SUCCESS) {
+            ret = closed;
+        }
+    }
+    return ret;
+}
 
 /*
- Lists all the files and directories on the disk, print the list to stdout
-*/
-int tfs_readdir() {
+ * Creates many files at once. Every new file is planned first and the
+ * space for all of them is taken from the free list in one pass (one run
+ * of blocks when the disk has one), so each file lands in consecutive
+ * blocks: inode, data, block map. Building and writing the blocks, the
+ * bulk of the work, is split over 'threads' threads (TFS_IMPORT_THREADS
+ * for 0) that each write runs of up to TFS_IMPORT_BATCH blocks with one
+ * writeBlocks call. Only then are the files linked into their
+ * directories, so a failed write leaves no file behind. Names that exist
+ * already or appear twice, and every file on a deduplicating mount, go
+ * through the ordinary open and write path afterwards, in order.
+ *
+ * Sets files[i].ret for every file and returns how many were imported,
+ * or TFS_DISK_FULL without importing anything if the new files can't all
+ * fit.
+ */
+static int bulk_import(tfsImportFile *files, int count, int threads) {
     if (mounted_disk == -1) {
         return TFS_DISK_NOT_OPEN;
     }
+    if (files == NULL || count < 0) {
+        return TFS_ERROR;
+    }
+    if (threads <= 0) {
+        threads = TFS_IMPORT_THREADS;
+    }
+    if (threads > TFS_IMPORT_MAX_THREADS) {
+        threads = TFS_IMPORT_MAX_THREADS;
+    }
 
-    printf("Files in TinyFS:\n");
-    int i;
-    for (i = 0; i < num_fd; i++) {
-        printf("%s\n", file_md[i].name);
+    int table_size = 16;
+    while (table_size < 2 * count) {
+        table_size *= 2;
+    }
+    fileMetadata *metas = calloc(count > 0 ? count : 1, sizeof(fileMetadata));
+    int *planned = calloc(count > 0 ? count : 1, sizeof(int));
+    int *seen = calloc(table_size, sizeof(int));
+    if (metas == NULL || planned == NULL || seen == NULL) {
+        free(metas);
+        free(planned);
+        free(seen);
+        return TFS_MEMORY_ERROR;
     }
 
-    return TFS_SUCCESS;
-}
+    int i, total = 0, free_blocks = 0, ret = TFS_SUCCESS;
+    for (i = 0; i < count; i++) {
+        planned[i] = plan_import(&files[i], &metas[i]);
+        files[i].ret = planned[i] < 0 ? planned[i] : TFS_SUCCESS;
+        if (planned[i] > 0 && import_seen(metas, seen, table_size, i) >= 0) {
+            planned[i] = 0; // a later copy of a name replaces the earlier one
+        }
+        if (planned[i] > 0) {
+            total += planned[i];
+        }
+    }
+    for (i = 0; i < num_groups; i++) {
+        free_blocks += group_free[i];
+    }
 
-/*
- makes the file read only. If a file is read only, all tfs_write() and
- tfs_deleteFile() functions that try to use it fail.
-*/
-int tfs_makeRO(char *name) {
-    int i;
-    for (i = 0; i < num_fd; i++) {
-        if (strcmp(file_md[i].name, name) == 0) {
-            file_md[i].read_only = 1;
-            return TFS_SUCCESS;
+    importSlot *slots = malloc(sizeof(importSlot) * (total > 0 ? total : 1));
+    int *blocks = malloc(sizeof(int) * (total > 0 ? total : 1));
+    if (slots == NULL || blocks == NULL) {
+        ret = TFS_MEMORY_ERROR;
+    } else if (total > free_blocks) {
+        ret = TFS_DISK_FULL;
+    } else if (total > 0) {
+        // Near the first new file's directory, or on the slow device of a
+        // tiered disk if the fast one hasn't room for all of it
+        int goal = 0;
+        for (i = 0; i < count && goal == 0; i++) {
+            goal = planned[i] > 0 ? metas[i].parent + 1 : 0;
+        }
+        if (fast_blocks > 0 && !tier_room(total)) {
+            goal = fast_blocks;
+        }
+        ret = take_free_blocks(goal, total, blocks);
+        if (ret == TFS_SUCCESS) {
+            lay_out_import(metas, planned, count, slots, blocks);
+            for (i = 0; i < total; i++) {
+                if (slots[i].part >= 0) {
+                    set_ref_count(blocks[i], 1);
+                }
+            }
+            ret = write_import(files, metas, slots, blocks, total, threads);
+        }
+        if (ret < 0) {
+            for (i = 0; i < count; i++) {
+                if (planned[i] > 0 && metas[i].inode > 0) {
+                    release_import(&metas[i]);
+                }
+            }
         }
     }
-    return TFS_FILE_NOT_FOUND;
+
+    int imported = 0;
+    for (i = 0; i < count && ret == TFS_SUCCESS; i++) {
+        fileMetadata *parent;
+        if (planned[i] > 0) {
+            if ((files[i].ret = get_dir(metas[i].parent, &parent)) == TFS_SUCCESS) {
+                files[i].ret = dir_insert(parent, metas[i].name, metas[i].inode, INODE_FILE);
+            }
+            if (files[i].ret < 0) {
+                release_import(&metas[i]);
+            }
+        }
+    }
+    for (i = 0; i < count && ret == TFS_SUCCESS; i++) {
+        if (planned[i] == 0 && files[i].ret == TFS_SUCCESS) {
+            files[i].ret = import_one(&files[i]);
+        }
+        if (files[i].ret == TFS_SUCCESS) {
+            imported++;
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        if (ret < 0 && files[i].ret == TFS_SUCCESS) {
+            files[i].ret = ret;
+        }
+        pool_free(metas[i].block_map);
+        pool_free(metas[i].index_blocks);
+    }
+    free(metas);
+    free(planned);
+    free(seen);
+    free(slots);
+    free(blocks);
+    return ret < 0 ? ret : imported;
 }
 
+int tfs_bulkImport(tfsImportFile *files, int count, int threads) {
+    struct timespec start;
+    int prev = op_begin(TFS_OP_BULK_IMPORT, &start);
+    return op_end(prev, &start, bulk_import(files, count, threads));
+}
 
 /*
- makes the file read-write
-*/
-int tfs_makeRW(char *name) {
-    int i;
-    for (i = 0; i < num_fd; i++) {
-        if (strcmp(file_md[i].name, name) == 0) {
-            file_md[i].read_only = 0;
-            return TFS_SUCCESS;
-        }
+ * Grows the index arrays of the free list to cover 'blocks' blocks. The
+ * new entries are zero (not free).
+ */
+static int grow_free_index(int blocks) {
+    int groups = (blocks + TFS_ALLOC_GROUP_BLOCKS - 1) / TFS_ALLOC_GROUP_BLOCKS;
+    int *next = realloc(free_next, sizeof(int) * blocks);
+    if (next != NULL) {
+        free_next = next;
     }
-    return TFS_FILE_NOT_FOUND;
+    int *prev = realloc(free_prev, sizeof(int) * blocks);
+    if (prev != NULL) {
+        free_prev = prev;
+    }
+    char *map = realloc(free_map, blocks);
+    if (map != NULL) {
+        free_map = map;
+    }
+    int *counts = realloc(group_free, sizeof(int) * groups);
+    if (counts != NULL) {
+        group_free = counts;
+    }
+    if (next == NULL || prev == NULL || map == NULL || counts == NULL) {
+        return TFS_MEMORY_ERROR;
+    }
+    memset(free_next + disk_blocks, 0, sizeof(int) * (blocks - disk_blocks));
+    memset(free_prev + disk_blocks, 0, sizeof(int) * (blocks - disk_blocks));
+    memset(free_map + disk_blocks, 0, blocks - disk_blocks);
+    memset(group_free + num_groups, 0, sizeof(int) * (groups - num_groups));
+    return TFS_SUCCESS;
 }
 
 /*
- * Function that can write to one specific byte in file
+ * Grows the mounted file system to nBytes (rounded down to whole blocks)
+ * while it stays in use. The disk is extended first, then the new blocks
+ * are written as a chain of free blocks that ends at the current free list
+ * head, in runs of TFS_IMPORT_BATCH blocks. A single superblock write then
+ * makes them part of the file system, recording the new size and the new
+ * free list head together, so a crash before it leaves the file system as
+ * it was. Shrinking is not supported (TFS_INVALID_SIZE).
  */
-int tfs_writeByte(fileDescriptor FD, int offset, unsigned int data) {
+static int resize_fs(int nBytes) {
     if (mounted_disk == -1) {
         return TFS_DISK_NOT_OPEN;
     }
-
-    if (FD < 0 || FD >= num_fd) {
-        return TFS_FILE_NOT_OPEN;
+    int blocks = nBytes / BLOCKSIZE;
+    if (nBytes < 0 || blocks < disk_blocks) {
+        return TFS_INVALID_SIZE;
     }
-
-    if (file_md[FD].read_only) {
-        return TFS_FILE_READ_ONLY;
+    if (blocks == disk_blocks) {
+        return TFS_SUCCESS;
     }
 
-    if (offset < 0 || offset >= file_md[FD].size) {
-        return TFS_INVALID_SEEK;
+    int ret = grow_free_index(blocks);
+    if (ret < 0) {
+        return ret;
+    }
+    if (diskBlocks(mounted_disk) < blocks && resizeDisk(mounted_disk, blocks * BLOCKSIZE) < 0) {
+        return TFS_DISK_FAILURE;
     }
 
-    // Calculate which block to write to
-    int block_index = offset / (BLOCKSIZE - 4);
-    int byte_offset = offset % (BLOCKSIZE - 4) + 4; // +4 to skip header
-
-
-    int current_block = file_md[FD].start_block;
-    int i; 
-    // Traverse to the correct block
-    for (i = 0; i < block_index; i++) {
-        char block[BLOCKSIZE];
-        if (readBlock(mounted_disk, current_block, block) < 0) {
-            return TFS_READ_ERROR;
+    char batch[TFS_IMPORT_BATCH * BLOCKSIZE];
+    int bNum, k;
+    for (bNum = disk_blocks; bNum < blocks; bNum += TFS_IMPORT_BATCH) {
+        int n = blocks - bNum < TFS_IMPORT_BATCH ? blocks - bNum : TFS_IMPORT_BATCH;
+        for (k = 0; k < n; k++) {
+            char *block = batch + k * BLOCKSIZE;
+            memset(block, 0, BLOCKSIZE);
+            block[0] = 4; // Block type = free
+            block[1] = 0x44; // Magic number
+            put_int(block + BLOCK_HEADER_SIZE + FREE_NEXT, bNum + k + 1 < blocks ? bNum + k + 1 : free_head);
+            stamp_block(block, checksums_enabled, &checksum_stats);
+        }
+        struct timespec io_start;
+        clock_gettime(CLOCK_MONOTONIC, &io_start);
+        ret = writeBlocks(mounted_disk, bNum, n, batch);
+        record_latency(&stats.disk_write, elapsed_ns(&io_start), ret);
+        stats.ops[current_op].blocks_written += n;
+        if (ret < 0) {
+            return TFS_WRITE_ERROR;
         }
-        current_block = (unsigned int)block[2]; // Next block
     }
 
-    // Read the block to modify
     char block[BLOCKSIZE];
-    if (readBlock(mounted_disk, current_block, block) < 0) {
+    if (read_fs_block(mounted_disk, 0, block) < 0) {
         return TFS_READ_ERROR;
     }
+    put_int(block + BLOCK_HEADER_SIZE + SB_FREE_HEAD, disk_blocks);
+    put_int(block + BLOCK_HEADER_SIZE + SB_BLOCK_COUNT, blocks);
+    put_int(block + BLOCK_HEADER_SIZE + SB_BLOCK_SIZE, BLOCKSIZE);
+    if (write_fs_block(mounted_disk, 0, block) < 0) {
+        return TFS_WRITE_ERROR;
+    }
+
+    for (bNum = disk_blocks; bNum < blocks; bNum++) {
+        free_map[bNum] = 1;
+        free_prev[bNum] = bNum > disk_blocks ? bNum - 1 : 0;
+        free_next[bNum] = bNum + 1 < blocks ? bNum + 1 : free_head;
+        count_free(bNum, 1);
+    }
+    if (free_head != 0) {
+        free_prev[free_head] = blocks - 1;
+    }
+    free_head = disk_blocks;
+    disk_blocks = blocks;
+    num_groups = (blocks + TFS_ALLOC_GROUP_BLOCKS - 1) / TFS_ALLOC_GROUP_BLOCKS;
+    return TFS_SUCCESS;
+}
 
-    // Modify the byte
-    block[byte_offset] = (char)data;
+int tfs_resize(int nBytes) {
+    struct timespec start;
+    int prev = op_begin(TFS_OP_RESIZE, &start);
+    return op_end(prev, &start, resize_fs(nBytes));
+}
 
-    // Write the modified block back to the disk
-    if (writeBlock(mounted_disk, current_block, block) < 0) {
-        return TFS_WRITE_ERROR;
+/*
+ Sets how much memory the in-core caches may use together: the block
+ cache (its entry table and the blocks it holds) and the cached
+ directories. Takes effect at once on a mounted file system, evicting
+ what no longer fits, and is kept for later mounts. While read views are
+ pinned the block cache table keeps its size; only what it holds shrinks.
+*/
+static int set_cache_budget(long bytes) {
+    if (bytes < TFS_CACHE_MIN_BUDGET) {
+        return TFS_INVALID_SIZE;
+    }
+    cache_budget = bytes;
+    if (cache == NULL) {
+        return TFS_SUCCESS;
     }
 
-    // Confirm write by reading back
-    if (readBlock(mounted_disk, current_block, block) < 0) {
-        return TFS_READ_ERROR;
+    // When the table shrinks, its own bytes come back too, so the blocks
+    // only have to fit what the budget leaves next to the smaller table
+    int slots = cache_slots(bytes);
+    if (slots < cache->slots && cache_pinned == 0) {
+        shrink_caches(bytes + cache_table_bytes(cache->slots) - cache_table_bytes(slots));
+    } else {
+        shrink_caches(bytes);
     }
+    int ret = cache_resize(slots);
+    return ret == TFS_BUSY ? TFS_SUCCESS : ret;
+}
 
-    if (block[byte_offset] != (char)data) {
-        return TFS_WRITE_ERROR;
+int tfs_setCacheBudget(long bytes) {
+    fs_lock();
+    int ret = set_cache_budget(bytes);
+    fs_unlock();
+    return ret;
+}
+
+/*
+ Fills 'usage' with the cache budget, what the caches use now and their
+ eviction counters. With nothing mounted only the budget is set.
+*/
+static int get_cache_usage(tfsCacheUsage *usage) {
+    if (usage == NULL) {
+        return TFS_ERROR;
+    }
+    memset(usage, 0, sizeof(*usage));
+    usage->budget = cache_budget;
+    if (cache == NULL) {
+        return TFS_SUCCESS;
     }
 
+    int i;
+    for (i = 0; i < cache->slots; i++) {
+        if (cache->entries[i].bNum >= 0) {
+            usage->blocks++;
+            usage->hot_blocks += cache->entries[i].hot;
+        }
+    }
+    usage->table_bytes = cache_table_bytes(cache->slots);
+    usage->block_bytes = (long)cache_blocks * BLOCKSIZE;
+    usage->dir_bytes = dir_bytes;
+    usage->used = cache_used();
+    usage->pins = cache_pinned;
+    usage->dirs = num_dirs_cached;
+    usage->evictions = cache_counters.evictions;
+    usage->dir_evictions = cache_counters.dir_evictions;
+    usage->ghost_hits = cache_counters.ghost_hits;
     return TFS_SUCCESS;
 }
 
+int tfs_getCacheUsage(tfsCacheUsage *usage) {
+    fs_lock();
+    int ret = get_cache_usage(usage);
+    fs_unlock();
+    return ret;
+}
+
 /*
- returns the file’s metadata
+ Releases at least 'bytes' of cache memory now if that much can go, as a
+ process under memory pressure would want: cold blocks first, directories
+ held to half of what is left. The budget stays, so the caches fill up to
+ it again as they are used. The memory pools are trimmed as well, so
+ freed directories go back to malloc. Returns the bytes released.
 */
-int tfs_readFileInfo(fileDescriptor FD) {
+static long shrink_cache(long bytes) {
+    if (bytes < 0) {
+        return TFS_INVALID_SIZE;
+    }
     if (mounted_disk == -1) {
         return TFS_DISK_NOT_OPEN;
     }
+    long released = shrink_caches(cache_used() - bytes);
+    pool_trim();
+    return released;
+}
 
-    if (FD < 0 || FD >= num_fd) {
-        return TFS_FILE_NOT_FOUND;
-    }
-
-    fileMetadata *meta = &file_md[FD];
-    printf("File name: %s\n", meta->name);
-    printf("File size: %d bytes\n", meta->size);
-    printf("File start block: %d\n", meta->start_block);
-    printf("File creation time: %s", ctime(&meta->creation_t));
-    printf("File read-only: %s\n", meta->read_only ? "Yes" : "No");
-
-    return TFS_SUCCESS;
+long tfs_shrinkCache(long bytes) {
+    fs_lock();
+    long ret = shrink_cache(bytes);
+    fs_unlock();
+    return ret;
 }
@@ -5,6 +5,140 @@
 #define DEFAULT_DISK_SIZE 10240
 #define DEFAULT_DISK_NAME "tinyFSDisk"
 
+/* Every block starts with an 8 byte header:
+   [0] block type, [1] magic number 0x44, [2] reserved,
+   [3] flags, [4..7] CRC32C of the block (little endian)
+   Block types: 1 superblock, 2 inode, 3 file data, 4 free,
+   5 block map (continues an inode's block list), 6 directory bucket,
+   7 extended attributes */
+#define BLOCK_HEADER_SIZE 8
+#define BLOCK_DATA_SIZE (BLOCKSIZE - BLOCK_HEADER_SIZE)
+#define BLOCK_FLAG_CHECKSUM 0x01 /* bytes [4..7] hold a valid checksum */
+#define BLOCK_FLAG_COMPRESSED 0x02 /* first block of an LZ compressed chunk */
+
+/* Superblock payload: head of the free list, inode of the root directory
+   and the geometry, the number of blocks in the file system and the block
+   size. Images made before the geometry was recorded hold 0 there and use
+   the whole disk. SB_FLAG_CHECKSUMMED says every block was written with a
+   checksum, so a block without one is damaged; tfs_mkfs sets it and a
+   TFS_MOUNT_NO_CHECKSUM mount clears it for good. */
+#define SB_FREE_HEAD 0
+#define SB_ROOT_INODE 4
+#define SB_BLOCK_COUNT 8
+#define SB_BLOCK_SIZE 12
+#define SB_FLAGS 16
+#define SB_FLAG_CHECKSUMMED 0x01
+
+/* Free block payload: next block on the free list (0 ends the list) */
+#define FREE_NEXT 0
+
+/* Inode payload. The block map lists a file's data blocks in order (for
+   a directory, its hash buckets); the first INODE_DIRECT_COUNT entries
+   live in the inode, the rest in a chain of block map blocks. Times of
+   0 (images made before they were recorded) read as the creation time. */
+#define INODE_KIND 0
+#define INODE_FLAGS 1
+#define INODE_SIZE 4
+#define INODE_CTIME 8
+#define INODE_MAP_LEN 16
+#define INODE_MAP_NEXT 20
+#define INODE_PARENT 24
+#define INODE_MTIME 28
+#define INODE_ATIME 36
+#define INODE_XATTR 44 /* inline attribute bytes with INODE_FLAG_INLINE_XATTR, else the attribute block */
+#define INODE_DIRECT 48
+#define INODE_DIRECT_COUNT ((BLOCK_DATA_SIZE - INODE_DIRECT) / 4)
+
+#define INODE_FILE 1
+#define INODE_DIR 2
+#define INODE_FLAG_READ_ONLY 0x01
+#define INODE_FLAG_COMPRESSED 0x02
+#define INODE_FLAG_INLINE_XATTR 0x04
+
+/* Extended attributes are a list of entries: [0] name length, [1] value
+   length, then the name and the value. They sit at the very end of the
+   inode while they fit in the direct map slots the file doesn't use, and
+   otherwise in an attribute block, which files with identical attributes
+   share. Attribute block payload: bytes of entries, then the entries. */
+#define XATTR_LEN 0
+#define XATTR_ENTRIES 4
+#define TFS_XATTR_MAX (BLOCK_DATA_SIZE - XATTR_ENTRIES) /* all of a file's entries together */
+#define TFS_XATTR_NAME_MAX 32
+
+/* Block map block payload: next map block, then more map entries */
+#define MAP_NEXT 0
+#define MAP_ENTRIES 4
+#define MAP_ENTRY_COUNT ((BLOCK_DATA_SIZE - MAP_ENTRIES) / 4)
+
+/* Directories are extendible hash tables: the directory's block map is
+   the table (2^depth slots, several slots may share a bucket) and each
+   bucket block holds up to BUCKET_SLOTS entries. */
+#define BUCKET_DEPTH 0
+#define BUCKET_COUNT 1
+#define BUCKET_ENTRIES 8
+#define DIRENT_SIZE 32
+#define DIRENT_INODE 0
+#define DIRENT_KIND 4
+#define DIRENT_NAME 5
+#define BUCKET_SLOTS ((BLOCK_DATA_SIZE - BUCKET_ENTRIES) / DIRENT_SIZE)
+#define DIR_MAX_DEPTH 24
+
+#define TFS_MAX_NAME 26 /* longest file or directory name */
+#define TFS_MAX_PATH 256
+
+/* Compressed files are stored in independently compressed chunks */
+#define COMPRESS_CHUNK_BLOCKS 4
+#define COMPRESS_CHUNK_SIZE (COMPRESS_CHUNK_BLOCKS * BLOCK_DATA_SIZE)
+
+/* tfs_append buffers data in memory; a file's buffer is written out once
+   it holds TFS_APPEND_FLUSH_SIZE bytes, and every file's full blocks are
+   written out when all buffers together exceed TFS_APPEND_MEMORY_LIMIT */
+#define TFS_APPEND_FLUSH_SIZE (64 * BLOCK_DATA_SIZE)
+#define TFS_APPEND_MEMORY_LIMIT (1024 * 1024)
+
+/* Memory the in-core caches may use together unless tfs_setCacheBudget
+   says otherwise: the block cache (its entry table and the blocks it
+   holds) and the cached directories. This also bounds how much data the
+   tfs_readView calls in flight can pin. */
+#define TFS_CACHE_BUDGET (512 * 1024)
+#define TFS_CACHE_MIN_BUDGET (64 * BLOCKSIZE)
+
+/* Reads only note the time in memory. The access time goes to disk with
+   the next inode write, or on tfs_flush, tfs_closeFile and tfs_unmount if
+   it is the first read since the file changed or the one on disk is this
+   many seconds old (like relatime), so reading costs no inode writes. */
+#define TFS_ATIME_INTERVAL (24 * 60 * 60)
+
+/* The allocator splits the disk into groups of this many blocks. A file's
+   blocks are kept together near its inode, and new directories go to the
+   group with the most free space so unrelated trees don't interleave. */
+#define TFS_ALLOC_GROUP_BLOCKS 512
+
+/* A file's data starts a new extent only in a run of at least this many
+   free blocks while the disk still has one */
+#define TFS_ALLOC_MIN_RUN 16
+
+/* On a disk made of a fast and a slow device ("tier:fast+slow", see
+   diskFastBlocks) metadata is allocated on the fast device, and so are
+   the first TFS_TIER_SMALL_BLOCKS data blocks of a file while more than
+   1/TFS_TIER_RESERVE of the fast device stays free; other data goes to
+   the slow device. tfs_migrate then moves files read or written in the
+   last TFS_TIER_HOT_AGE seconds up and the rest down. */
+#define TFS_TIER_SMALL_BLOCKS 32
+#define TFS_TIER_RESERVE 8
+#define TFS_TIER_HOT_AGE (2 * TFS_ATIME_INTERVAL)
+
+/* tfs_bulkImport writes with this many threads unless told otherwise, and
+   never more than TFS_IMPORT_MAX_THREADS. Each thread writes runs of up to
+   TFS_IMPORT_BATCH consecutive blocks with one writeBlocks call. */
+#define TFS_IMPORT_THREADS 4
+#define TFS_IMPORT_MAX_THREADS 16
+#define TFS_IMPORT_BATCH 64
+
+/* Options for tfs_mountWithOptions */
+#define TFS_MOUNT_NO_CHECKSUM 0x01 /* skip checksum verification and updates */
+#define TFS_MOUNT_DEDUP 0x02       /* share identical data blocks between files */
+
 #include "libDisk.h"
 #include "TinyFS_errno.h"
 #include <math.h>
@@ -15,21 +149,202 @@
 #include <time.h>
 
 typedef struct {
-    char name[9];
+    char name[TFS_MAX_NAME + 1];
     int size;
     int start_block;
-    int curr_block;
-    int curr_offset;
     int read_only;
     time_t creation_t;
+    time_t modified_t;
+    time_t accessed_t;
+    time_t saved_atime; /* accessed_t as the inode on disk has it */
+    int *block_map;   /* logical block -> disk block, 0 where nothing is stored */
+    int map_len;
+    int compressed;   /* content is stored in compressed chunks */
+    char *chunk_buf;  /* last chunk decompressed for this file */
+    int chunk_index;  /* which chunk chunk_buf holds, -1 if none */
+    int snapshot_id;  /* 0 for live files, else the snapshot this read-only view belongs to */
+    int inode;        /* block holding the inode */
+    int parent;       /* inode of the containing directory */
+    int is_dir;
+    int *index_blocks; /* block map blocks holding map entries past the inode */
+    int num_index_blocks;
+    char *append_buf; /* tfs_append data not yet written, follows byte 'size' */
+    int append_len;
+    int append_cap;
+    char *xattrs;     /* encoded extended attributes */
+    int xattr_len;    /* bytes in 'xattrs', -1 while they are only in the attribute block */
+    int xattr_block;  /* attribute block holding them, 0 if they are inline (or there are none) */
+    int xattr_dirty;  /* changed since the attribute block was written */
+    struct fileCursor *cursor; /* file pointer and the state lock-free readers see; NULL unless open */
 } fileMetadata;
 
 typedef int fileDescriptor;
 
+typedef struct {
+    unsigned long blocks_verified;   /* blocks whose checksum was checked on read */
+    unsigned long blocks_unchecked;  /* blocks read that carried no checksum */
+    unsigned long blocks_updated;    /* blocks whose checksum was computed on write */
+    unsigned long checksum_failures; /* reads rejected with TFS_CHECKSUM_ERROR */
+    long long verify_ns;             /* total time spent verifying, in nanoseconds */
+    long long update_ns;             /* total time spent computing checksums on write */
+} tfsChecksumStats;
+
+typedef struct {
+    unsigned long blocks_written;  /* data blocks written while dedup was on */
+    unsigned long blocks_shared;   /* of those, stored by sharing an identical block */
+    unsigned long cow_copies;      /* shared blocks copied because one file changed them */
+    unsigned long logical_blocks;  /* data block references held by files */
+    unsigned long physical_blocks; /* distinct data blocks in use */
+    double dedup_ratio;            /* logical_blocks / physical_blocks */
+} tfsDedupStats;
+
+/* One directory entry returned by tfs_readdirNext */
+typedef struct {
+    char name[TFS_MAX_NAME + 1];
+    int inode;
+    int is_dir;
+} tfsDirEntry;
+
+/* One piece of file data lent out by tfs_readView */
+typedef struct {
+    const char *data;
+    int len;
+} tfsSegment;
+
+/* File data pinned by tfs_readView until tfs_unpinView. The segments
+   cover 'len' bytes in file order; the other fields are private. */
+typedef struct {
+    tfsSegment *segments;
+    int num_segments;
+    int len;
+    int *pins;          /* block cache entries held by the view */
+    int num_pins;
+    char *copy;         /* decompressed data of a compressed file */
+} tfsReadView;
+
+/* Cursor over one directory, filled in by tfs_opendir. The caller owns it
+   (usually on the stack); it holds the bucket block being read, so a
+   listing reads each bucket once and allocates nothing. */
+typedef struct {
+    int inode;             /* directory being listed, 0 once closed */
+    int slot;              /* hash table slot of the bucket in 'block' */
+    int entry;             /* next entry to look at in that bucket */
+    int loaded;            /* 'block' holds the bucket for 'slot' */
+    char block[BLOCKSIZE];
+} tfsDir;
+
+/* File or directory attributes filled in by tfs_stat / tfs_fstat */
+typedef struct {
+    int inode;
+    int is_dir;
+    int size;         /* bytes; 0 for directories */
+    int blocks;       /* data blocks (directory buckets) in use */
+    int extents;      /* runs of consecutive disk blocks holding the data */
+    int read_only;
+    int compressed;
+    time_t creation_t;
+    time_t modified_t; /* last change to the contents */
+    time_t accessed_t; /* last read, kept lazily (see TFS_ATIME_INTERVAL) */
+    int fast_blocks;  /* of 'blocks', those on the fast device of a tiered disk */
+} tfsStat;
+
+/* One file for tfs_bulkImport */
+typedef struct {
+    char *name;    /* path of the file to create or replace */
+    char *buffer;  /* its contents */
+    int size;
+    int ret;       /* set by tfs_bulkImport: TFS_SUCCESS or why this file failed */
+} tfsImportFile;
+
+/* Operations timed by the built-in instrumentation (see tfs_getStats) */
+#define TFS_OP_MKFS 0
+#define TFS_OP_MOUNT 1
+#define TFS_OP_UNMOUNT 2
+#define TFS_OP_OPEN 3
+#define TFS_OP_CLOSE 4
+#define TFS_OP_WRITE_FILE 5
+#define TFS_OP_DELETE 6
+#define TFS_OP_READ_BYTE 7
+#define TFS_OP_PREAD 8
+#define TFS_OP_SEEK 9
+#define TFS_OP_WRITE_BYTE 10
+#define TFS_OP_RENAME 11
+#define TFS_OP_MKDIR 12
+#define TFS_OP_RMDIR 13
+#define TFS_OP_READDIR 14
+#define TFS_OP_STAT 15
+#define TFS_OP_SNAPSHOT 16
+#define TFS_OP_PWRITE 17
+#define TFS_OP_APPEND 18
+#define TFS_OP_DEFRAG 19
+#define TFS_OP_READ_VIEW 20
+#define TFS_OP_BULK_IMPORT 21
+#define TFS_OP_RESIZE 22
+#define TFS_OP_MIGRATE 23
+#define TFS_OP_COUNT 24
+
+/* Latency histogram bucket i counts calls that took [2^i, 2^(i+1)) ns */
+#define TFS_LATENCY_BUCKETS 32
+
+typedef struct {
+    unsigned long calls;
+    unsigned long errors;         /* calls that returned a negative code */
+    long long total_ns;
+    long long max_ns;
+    unsigned long blocks_read;    /* disk blocks read while serving these calls */
+    unsigned long blocks_written;
+    unsigned long latency[TFS_LATENCY_BUCKETS];
+} tfsOpStats;
+
+typedef struct {
+    tfsOpStats ops[TFS_OP_COUNT];  /* indexed by TFS_OP_* */
+    tfsOpStats disk_read;          /* libDisk readBlock calls */
+    tfsOpStats disk_write;         /* libDisk writeBlock calls */
+    unsigned long blocks_allocated;
+    unsigned long blocks_freed;
+    unsigned long chain_hops;      /* block map blocks followed loading inodes */
+    unsigned long bucket_splits;   /* directory buckets split on insert */
+    unsigned long cache_hits;      /* block reads served by the block cache */
+    unsigned long cache_misses;
+    unsigned long pool_mallocs;    /* in-core allocations that had to call malloc */
+    unsigned long pool_reuses;     /* in-core allocations served from a pool free list */
+    unsigned long bytes_read;      /* bytes returned by tfs_readByte, tfs_pread and tfs_readView */
+    double blocks_per_byte_read;   /* disk blocks read by those calls per byte */
+} tfsStats;
+
+/* Memory held by the in-core caches, filled in by tfs_getCacheUsage */
+typedef struct {
+    long budget;                 /* bytes the caches may use together */
+    long used;                   /* bytes they use now: the next three summed */
+    long table_bytes;            /* block cache entry table */
+    long block_bytes;            /* block buffers held by the block cache */
+    long dir_bytes;              /* cached directories */
+    int blocks;                  /* blocks cached */
+    int hot_blocks;              /* of those, in the hot set */
+    int pins;                    /* pins held by read views */
+    int dirs;                    /* directories cached */
+    unsigned long evictions;     /* blocks evicted to make room, this mount */
+    unsigned long dir_evictions; /* directories dropped to stay in budget */
+    unsigned long ghost_hits;    /* evicted blocks read again soon, which came back hot */
+} tfsCacheUsage;
+
+/* How a tiered disk is used, filled in by tfs_getTierStats */
+typedef struct {
+    int fast_blocks;               /* blocks on the fast device, 0 if the disk isn't tiered */
+    int fast_free;
+    int slow_blocks;
+    int slow_free;
+    unsigned long fast_reads;      /* disk block reads the fast device served, this mount */
+    unsigned long slow_reads;
+    unsigned long blocks_promoted; /* data blocks tfs_migrate moved to the fast device */
+    unsigned long blocks_demoted;  /* and to the slow device */
+} tfsTierStats;
+
 /* Standard function declarations */
 
 int tfs_mkfs(char *filename, int nBytes);
 int tfs_mount(char *diskname);
+int tfs_mountWithOptions(char *diskname, int options);
 int tfs_unmount(void);
 fileDescriptor tfs_openFile(char *name);
 int tfs_closeFile(fileDescriptor FD);
@@ -37,6 +352,14 @@ int tfs_writeFile(fileDescriptor FD, char *buffer, int size);
 int tfs_deleteFile(fileDescriptor FD);
 int tfs_readByte(fileDescriptor FD, char *buffer);
 int tfs_seek(fileDescriptor FD, int offset);
+int tfs_pread(fileDescriptor FD, char *buffer, int size, int offset);
+int tfs_pwrite(fileDescriptor FD, char *buffer, int size, int offset);
+int tfs_append(fileDescriptor FD, char *buffer, int size);
+int tfs_flush(fileDescriptor FD);
+
+/* Zero-copy reads */
+int tfs_readView(fileDescriptor FD, int offset, int len, tfsReadView *view);
+int tfs_unpinView(tfsReadView *view);
 
 /* Implement file system consistency checks */
 int tfs_checkConsistency();
@@ -45,6 +368,17 @@ int tfs_checkConsistency();
 int tfs_rename(fileDescriptor FD, char* newName);
 int tfs_readdir();
 
+/* Hierarchical directories */
+int tfs_mkdir(char *path);
+int tfs_rmdir(char *path);
+
+/* Directory iteration and attributes */
+int tfs_opendir(char *path, tfsDir *dir);
+int tfs_readdirNext(tfsDir *dir, tfsDirEntry *entry);
+int tfs_closedir(tfsDir *dir);
+int tfs_stat(char *path, tfsStat *st);
+int tfs_fstat(fileDescriptor FD, tfsStat *st);
+
 /* Read-only and WriteByte Support */
 int tfs_makeRO(char *name);
 int tfs_makeRW(char *name);
@@ -52,6 +386,53 @@ int tfs_writeByte(fileDescriptor FD, int offset, unsigned int data);
 
 /* Timestamps */
 int tfs_readFileInfo(fileDescriptor FD);
+int tfs_setTimes(char *path, time_t modified, time_t accessed);
+
+/* Extended attributes */
+int tfs_setXattr(char *path, char *name, char *value, int size);
+int tfs_getXattr(char *path, char *name, char *value, int size);
+int tfs_removeXattr(char *path, char *name);
+int tfs_listXattr(char *path, char *list, int size);
+
+/* Transparent compression */
+int tfs_setCompression(fileDescriptor FD, int enabled);
+
+/* Block checksums */
+int tfs_getChecksumStats(tfsChecksumStats *stats);
+void tfs_resetChecksumStats(void);
+
+/* I/O and latency instrumentation */
+int tfs_getStats(tfsStats *stats);
+void tfs_resetStats(void);
+int tfs_dumpStatsJSON(FILE *out);
+const char *tfs_opName(int op);
+
+/* Block deduplication */
+int tfs_getDedupStats(tfsDedupStats *stats);
+
+/* Copy-on-write snapshots */
+int tfs_snapshot(char *name);
+fileDescriptor tfs_openSnapshotFile(char *snapshotName, char *name);
+int tfs_deleteSnapshot(char *name);
+int tfs_listSnapshots();
+
+/* Online defragmentation */
+int tfs_defrag(int maxBlocks);
+
+/* Bulk loading */
+int tfs_bulkImport(tfsImportFile *files, int count, int threads);
+
+/* Online resize */
+int tfs_resize(int nBytes);
+
+/* Cache memory budget */
+int tfs_setCacheBudget(long bytes);
+int tfs_getCacheUsage(tfsCacheUsage *usage);
+long tfs_shrinkCache(long bytes);
+
+/* Hot/cold tiering across two devices */
+int tfs_migrate(int maxBlocks, int hotAge);
+int tfs_getTierStats(tfsTierStats *stats);
 
 #endif
 
@@ -0,0 +1,168 @@
+#include "lzCompress.h"
+#include <stdint.h>
+#include <string.h>
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 0xFFFF
+#define LZ_HASH_BITS 12
+#define LZ_HASH_SIZE (1 << LZ_HASH_BITS)
+
+static int lz_hash(const char *p) {
+    uint32_t seq;
+    memcpy(&seq, p, sizeof(seq));
+    return (int)((seq * 2654435761U) >> (32 - LZ_HASH_BITS));
+}
+
+/*
+ * Writes a length that did not fit in a token nibble as a run of 255s
+ * followed by the remainder. Returns the new output position or -1.
+ */
+static int put_length(char *dst, int op, int dst_cap, int len) {
+    while (len >= 255) {
+        if (op >= dst_cap) {
+            return -1;
+        }
+        dst[op++] = (char)255;
+        len -= 255;
+    }
+    if (op >= dst_cap) {
+        return -1;
+    }
+    dst[op++] = (char)len;
+    return op;
+}
+
+/*
+ * Emits one sequence: 'lit_len' literals followed by a match of 'match_len'
+ * bytes 'offset' back. A match_len of 0 marks the final literal-only sequence.
+ */
+static int put_sequence(char *dst, int op, int dst_cap, const char *lit, int lit_len,
+                        int offset, int match_len) {
+    int token_lit = lit_len < 15 ? lit_len : 15;
+    int token_match = 0;
+
+    if (match_len > 0) {
+        token_match = (match_len - LZ_MIN_MATCH) < 15 ? (match_len - LZ_MIN_MATCH) : 15;
+    }
+    if (op >= dst_cap) {
+        return -1;
+    }
+    dst[op++] = (char)((token_lit << 4) | token_match);
+
+    if (token_lit == 15 && (op = put_length(dst, op, dst_cap, lit_len - 15)) < 0) {
+        return -1;
+    }
+    if (op + lit_len > dst_cap) {
+        return -1;
+    }
+    memcpy(dst + op, lit, lit_len);
+    op += lit_len;
+
+    if (match_len == 0) {
+        return op;
+    }
+    if (op + 2 > dst_cap) {
+        return -1;
+    }
+    dst[op++] = (char)(offset & 0xFF);
+    dst[op++] = (char)(offset >> 8);
+    if (token_match == 15) {
+        op = put_length(dst, op, dst_cap, match_len - LZ_MIN_MATCH - 15);
+    }
+    return op;
+}
+
+int lz_compress(const char *src, int src_len, char *dst, int dst_cap) {
+    int table[LZ_HASH_SIZE];
+    int ip = 0, anchor = 0, op = 0;
+    int i;
+
+    for (i = 0; i < LZ_HASH_SIZE; i++) {
+        table[i] = -1;
+    }
+
+    while (ip + LZ_MIN_MATCH <= src_len) {
+        int h = lz_hash(src + ip);
+        int ref = table[h];
+        table[h] = ip;
+
+        if (ref < 0 || ip - ref > LZ_MAX_OFFSET || memcmp(src + ref, src + ip, LZ_MIN_MATCH) != 0) {
+            ip++;
+            continue;
+        }
+
+        int match_len = LZ_MIN_MATCH;
+        while (ip + match_len < src_len && src[ref + match_len] == src[ip + match_len]) {
+            match_len++;
+        }
+
+        op = put_sequence(dst, op, dst_cap, src + anchor, ip - anchor, ip - ref, match_len);
+        if (op < 0) {
+            return -1;
+        }
+        ip += match_len;
+        anchor = ip;
+    }
+
+    return put_sequence(dst, op, dst_cap, src + anchor, src_len - anchor, 0, 0);
+}
+
+int lz_decompress(const char *src, int src_len, char *dst, int dst_cap) {
+    const unsigned char *in = (const unsigned char *)src;
+    int ip = 0, op = 0;
+
+    while (ip < src_len) {
+        int token = in[ip++];
+        int lit_len = token >> 4;
+        int match_len = token & 0x0F;
+
+        if (lit_len == 15) {
+            int b;
+            do {
+                if (ip >= src_len) {
+                    return -1;
+                }
+                b = in[ip++];
+                lit_len += b;
+            } while (b == 255);
+        }
+        if (ip + lit_len > src_len || op + lit_len > dst_cap) {
+            return -1;
+        }
+        memcpy(dst + op, in + ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+
+        if (ip == src_len) {
+            break; // final sequence carries literals only
+        }
+
+        if (ip + 2 > src_len) {
+            return -1;
+        }
+        int offset = in[ip] | (in[ip + 1] << 8);
+        ip += 2;
+        if (match_len == 15) {
+            int b;
+            do {
+                if (ip >= src_len) {
+                    return -1;
+                }
+                b = in[ip++];
+                match_len += b;
+            } while (b == 255);
+        }
+        match_len += LZ_MIN_MATCH;
+
+        if (offset == 0 || offset > op || op + match_len > dst_cap) {
+            return -1;
+        }
+        // byte by byte so overlapping matches repeat correctly
+        int i;
+        for (i = 0; i < match_len; i++) {
+            dst[op + i] = dst[op - offset + i];
+        }
+        op += match_len;
+    }
+    return op;
+}
@@ -0,0 +1,23 @@
+#ifndef LZCOMPRESS_H
+#define LZCOMPRESS_H
+
+/*
+Small LZ77 compressor in the style of the LZ4 block format: a stream of
+sequences, each a token byte (literal count / match length nibbles),
+the literals, and a 2 byte back reference. No external dependencies.
+*/
+
+/*
+Compresses src_len bytes of 'src' into 'dst'. Returns the compressed
+length, or -1 if the result would not fit in dst_cap bytes.
+*/
+int lz_compress(const char *src, int src_len, char *dst, int dst_cap);
+
+/*
+Decompresses src_len bytes of 'src' into 'dst'. Returns the number of
+bytes produced, or -1 if the stream is malformed or does not fit in
+dst_cap bytes.
+*/
+int lz_decompress(const char *src, int src_len, char *dst, int dst_cap);
+
+#endif
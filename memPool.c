@@ -0,0 +1,138 @@
+#include "memPool.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define POOL_MIN_SHIFT 5   /* smallest class: 32 bytes */
+#define POOL_MAX_SHIFT 20  /* largest class: 1 MB */
+#define POOL_CLASSES (POOL_MAX_SHIFT - POOL_MIN_SHIFT + 1)
+#define POOL_HEADER 16     /* keeps objects 16-byte aligned */
+
+#define CLASS_MALLOC -1    /* too big for a class, malloc'd on its own */
+#define CLASS_ALIGNED -2   /* page-aligned, malloc'd on its own */
+
+/* Sits right in front of every object handed out */
+typedef struct {
+    int size_class;        /* index into free_lists or CLASS_* */
+    size_t size;           /* usable bytes */
+} poolHeader;
+
+/* A free object links to the next free object of its class */
+typedef struct poolFree {
+    struct poolFree *next;
+} poolFree;
+
+static poolFree *free_lists[POOL_CLASSES];
+static poolStats counters;
+
+static poolHeader *header_of(void *ptr) {
+    return (poolHeader *)((char *)ptr - POOL_HEADER);
+}
+
+static int size_class(size_t size) {
+    int c;
+    for (c = 0; c < POOL_CLASSES; c++) {
+        if (size + POOL_HEADER <= ((size_t)1 << (c + POOL_MIN_SHIFT))) {
+            return c;
+        }
+    }
+    return CLASS_MALLOC;
+}
+
+void *pool_alloc(size_t size) {
+    int c = size_class(size);
+    if (c != CLASS_MALLOC && free_lists[c] != NULL) {
+        poolFree *obj = free_lists[c];
+        free_lists[c] = obj->next;
+        counters.reuses++;
+        counters.bytes_pooled -= header_of(obj)->size;
+        return obj;
+    }
+
+    size_t bytes = (c == CLASS_MALLOC) ? size + POOL_HEADER : (size_t)1 << (c + POOL_MIN_SHIFT);
+    char *raw = malloc(bytes);
+    if (raw == NULL) {
+        return NULL;
+    }
+    counters.mallocs++;
+    poolHeader *header = (poolHeader *)raw;
+    header->size_class = c;
+    header->size = bytes - POOL_HEADER;
+    return raw + POOL_HEADER;
+}
+
+void *pool_calloc(size_t count, size_t size) {
+    void *ptr = pool_alloc(count * size);
+    if (ptr != NULL) {
+        memset(ptr, 0, count * size);
+    }
+    return ptr;
+}
+
+void *pool_realloc(void *ptr, size_t size) {
+    if (ptr == NULL) {
+        return pool_alloc(size);
+    }
+    poolHeader *header = header_of(ptr);
+    if (header->size_class >= 0 && size <= header->size) {
+        return ptr;
+    }
+
+    void *grown = pool_alloc(size);
+    if (grown == NULL) {
+        return NULL;
+    }
+    memcpy(grown, ptr, size < header->size ? size : header->size);
+    pool_free(ptr);
+    return grown;
+}
+
+void *pool_alloc_aligned(size_t size) {
+    void *raw;
+    // The header goes at the end of the first page so the object starts
+    // on the next page boundary
+    if (posix_memalign(&raw, POOL_PAGE_SIZE, size + POOL_PAGE_SIZE) != 0) {
+        return NULL;
+    }
+    counters.mallocs++;
+    char *ptr = (char *)raw + POOL_PAGE_SIZE;
+    poolHeader *header = header_of(ptr);
+    header->size_class = CLASS_ALIGNED;
+    header->size = size;
+    return ptr;
+}
+
+void pool_free(void *ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+    poolHeader *header = header_of(ptr);
+    if (header->size_class == CLASS_MALLOC) {
+        free(header);
+        return;
+    }
+    if (header->size_class == CLASS_ALIGNED) {
+        free((char *)ptr - POOL_PAGE_SIZE);
+        return;
+    }
+
+    poolFree *obj = ptr;
+    obj->next = free_lists[header->size_class];
+    free_lists[header->size_class] = obj;
+    counters.bytes_pooled += header->size;
+}
+
+void pool_trim(void) {
+    int c;
+    for (c = 0; c < POOL_CLASSES; c++) {
+        while (free_lists[c] != NULL) {
+            poolFree *obj = free_lists[c];
+            free_lists[c] = obj->next;
+            free(header_of(obj));
+        }
+    }
+    counters.bytes_pooled = 0;
+}
+
+void pool_get_stats(poolStats *out) {
+    *out = counters;
+}
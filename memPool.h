@@ -0,0 +1,46 @@
+#ifndef MEMPOOL_H
+#define MEMPOOL_H
+
+#include <stddef.h>
+
+#define POOL_PAGE_SIZE 4096
+
+/*
+Pooled allocator for in-core metadata. Requests are rounded up to a power
+of two size class, and freed objects go onto a free list for their class
+instead of back to malloc, so once a workload has reached its peak every
+allocation is served from a free list. Objects are 16-byte aligned.
+Requests larger than the biggest class go straight to malloc.
+*/
+
+typedef struct {
+    unsigned long mallocs;  /* allocations that had to call malloc */
+    unsigned long reuses;   /* allocations served from a free list */
+    size_t bytes_pooled;    /* bytes held on the free lists */
+} poolStats;
+
+void *pool_alloc(size_t size);
+void *pool_calloc(size_t count, size_t size);
+
+/*
+Resizes 'ptr' to 'size' bytes. Returns 'ptr' itself whenever the new size
+fits the object's size class, so shrinking never moves it.
+*/
+void *pool_realloc(void *ptr, size_t size);
+
+/*
+Allocates 'size' bytes aligned to POOL_PAGE_SIZE, as direct I/O needs.
+Release with pool_free like any other pool object.
+*/
+void *pool_alloc_aligned(size_t size);
+
+void pool_free(void *ptr);
+
+/*
+Returns the memory on all free lists to malloc
+*/
+void pool_trim(void);
+
+void pool_get_stats(poolStats *stats);
+
+#endif
@@ -0,0 +1,751 @@
+#include "libTinyFS.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "TinyFS_errno.h"
+
+/*
+ * Micro-benchmarks for libDisk and libTinyFS.
+ *
+ * Every result is printed as one tab separated line
+ *     <benchmark> <value> <unit>
+ * so runs can be saved and compared with diff or a spreadsheet. An
+ * optional argument scales the amount of work (default 1).
+ */
+
+#define BENCH_DISK "bench.dsk"
+#define BENCH_DISK_SIZE (BLOCKSIZE * 8192)
+
+static int scale = 1;
+static volatile char sink; /* keeps the compiler from skipping reads of view data */
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void report(char *name, double value, char *unit) {
+    printf("%s\t%.3f\t%s\n", name, value, unit);
+}
+
+/* Small deterministic generator so runs touch the same blocks */
+static unsigned int rand_state = 12345;
+
+static unsigned int next_rand(void) {
+    rand_state = rand_state * 1103515245u + 12345u;
+    return rand_state >> 8;
+}
+
+static int compare_ll(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+/* Prints the 50th, 90th and 99th percentile of 'n' samples (sorts them) */
+static void report_latency(char *name, long long *samples, int n) {
+    char label[64];
+    int pct[3] = {50, 90, 99};
+    int i;
+
+    qsort(samples, n, sizeof(long long), compare_ll);
+    for (i = 0; i < 3; i++) {
+        int index = (n * pct[i]) / 100;
+        if (index >= n) {
+            index = n - 1;
+        }
+        snprintf(label, sizeof(label), "%s_p%d", name, pct[i]);
+        report(label, (double)samples[index], "ns");
+    }
+}
+
+static int fail(char *what, int ret) {
+    fprintf(stderr, "%s failed (%d)\n", what, ret);
+    return -1;
+}
+
+static int bench_mkfs(void) {
+    int runs = 5 * scale, i, ret;
+    long long start = now_ns();
+    for (i = 0; i < runs; i++) {
+        if ((ret = tfs_mkfs(BENCH_DISK, BENCH_DISK_SIZE)) < 0) {
+            return fail("tfs_mkfs", ret);
+        }
+    }
+    report("mkfs_2mb", (now_ns() - start) / 1e6 / runs, "ms");
+    return 0;
+}
+
+/* Raw libDisk throughput, sequential and random, over the whole disk.
+   'prefix' selects the disk backend and names the results. */
+static int bench_disk(char *prefix) {
+    int num_blocks = BENCH_DISK_SIZE / BLOCKSIZE;
+    char block[BLOCKSIZE], name[64], label[64];
+    int pass, i;
+    long long start;
+    double mb = (double)num_blocks * BLOCKSIZE * scale / (1024.0 * 1024.0);
+
+    snprintf(name, sizeof(name), "%s%s", prefix, BENCH_DISK);
+    int disk = openDisk(name, BENCH_DISK_SIZE);
+    if (disk < 0) {
+        return fail("openDisk", disk);
+    }
+    prefix = prefix[0] ? prefix : "file:";
+    memset(block, 0xAB, BLOCKSIZE);
+
+    start = now_ns();
+    for (pass = 0; pass < scale; pass++) {
+        for (i = 0; i < num_blocks; i++) {
+            if (writeBlock(disk, i, block) < 0) {
+                return fail("writeBlock", i);
+            }
+        }
+    }
+    snprintf(label, sizeof(label), "disk_%.*s_seq_write", (int)strlen(prefix) - 1, prefix);
+    report(label, mb / ((now_ns() - start) / 1e9), "MB/s");
+
+    start = now_ns();
+    for (pass = 0; pass < scale; pass++) {
+        for (i = 0; i < num_blocks; i++) {
+            if (readBlock(disk, i, block) < 0) {
+                return fail("readBlock", i);
+            }
+        }
+    }
+    snprintf(label, sizeof(label), "disk_%.*s_seq_read", (int)strlen(prefix) - 1, prefix);
+    report(label, mb / ((now_ns() - start) / 1e9), "MB/s");
+
+    start = now_ns();
+    for (pass = 0; pass < scale; pass++) {
+        for (i = 0; i < num_blocks; i++) {
+            if (writeBlock(disk, next_rand() % num_blocks, block) < 0) {
+                return fail("writeBlock", i);
+            }
+        }
+    }
+    snprintf(label, sizeof(label), "disk_%.*s_rand_write", (int)strlen(prefix) - 1, prefix);
+    report(label, mb / ((now_ns() - start) / 1e9), "MB/s");
+
+    start = now_ns();
+    for (pass = 0; pass < scale; pass++) {
+        for (i = 0; i < num_blocks; i++) {
+            if (readBlock(disk, next_rand() % num_blocks, block) < 0) {
+                return fail("readBlock", i);
+            }
+        }
+    }
+    snprintf(label, sizeof(label), "disk_%.*s_rand_read", (int)strlen(prefix) - 1, prefix);
+    report(label, mb / ((now_ns() - start) / 1e9), "MB/s");
+
+    closeDisk(disk);
+    unlinkDisk(name);
+    return 0;
+}
+
+/* tfs_writeFile and tfs_readByte throughput for a range of file sizes */
+static int bench_file_io(void) {
+    int sizes[] = {1024, 16 * 1024, 256 * 1024};
+    char label[64], c;
+    int s, i, ret;
+    tfsStats stats;
+
+    tfs_resetStats();
+    for (s = 0; s < 3; s++) {
+        int size = sizes[s];
+        int runs = scale * (256 * 1024 / size);
+        char *buffer = malloc(size);
+        long long write_ns = 0, read_ns = 0, view_ns = 0, start;
+
+        if (buffer == NULL) {
+            return fail("malloc", TFS_MEMORY_ERROR);
+        }
+        for (i = 0; i < size; i++) {
+            buffer[i] = "tinyfs bench "[i % 13];
+        }
+
+        for (i = 0; i < runs; i++) {
+            fileDescriptor FD = tfs_openFile("io");
+            if (FD < 0) {
+                return fail("tfs_openFile", FD);
+            }
+            start = now_ns();
+            if ((ret = tfs_writeFile(FD, buffer, size)) < 0) {
+                return fail("tfs_writeFile", ret);
+            }
+            write_ns += now_ns() - start;
+
+            start = now_ns();
+            while (tfs_readByte(FD, &c) == TFS_SUCCESS)
+                ;
+            read_ns += now_ns() - start;
+
+            tfsReadView view;
+            int off, seg;
+            start = now_ns();
+            for (off = 0; off < size; off += 16 * 1024) {
+                if ((ret = tfs_readView(FD, off, 16 * 1024, &view)) < 0) {
+                    return fail("tfs_readView", ret);
+                }
+                for (seg = 0; seg < view.num_segments; seg++) {
+                    sink = view.segments[seg].data[0];
+                }
+                tfs_unpinView(&view);
+            }
+            view_ns += now_ns() - start;
+            tfs_deleteFile(FD);
+        }
+
+        double bytes = (double)size * runs;
+        snprintf(label, sizeof(label), "write_file_%dk", size / 1024);
+        report(label, bytes / (write_ns / 1e9) / (1024.0 * 1024.0), "MB/s");
+        snprintf(label, sizeof(label), "read_byte_%dk", size / 1024);
+        report(label, bytes / (read_ns / 1e9) / (1024.0 * 1024.0), "MB/s");
+        snprintf(label, sizeof(label), "read_view_%dk", size / 1024);
+        report(label, bytes / (view_ns / 1e9) / (1024.0 * 1024.0), "MB/s");
+        free(buffer);
+    }
+
+    tfs_getStats(&stats);
+    report("read_blocks_per_byte", stats.blocks_per_byte_read, "blocks/B");
+    return 0;
+}
+
+/* Latency percentiles of tfs_openFile, tfs_closeFile and tfs_seek */
+static int bench_latency(void) {
+    int n = 2000 * scale, i;
+    int size = 64 * 1024;
+    long long *open_ns = malloc(sizeof(long long) * n);
+    long long *close_ns = malloc(sizeof(long long) * n);
+    long long *seek_ns = malloc(sizeof(long long) * n);
+    char *buffer = calloc(size, 1);
+    long long start;
+
+    if (open_ns == NULL || close_ns == NULL || seek_ns == NULL || buffer == NULL) {
+        return fail("malloc", TFS_MEMORY_ERROR);
+    }
+
+    fileDescriptor FD = tfs_openFile("latency");
+    if (FD < 0 || tfs_writeFile(FD, buffer, size) < 0) {
+        return fail("tfs_writeFile", FD);
+    }
+    for (i = 0; i < n; i++) {
+        start = now_ns();
+        tfs_seek(FD, next_rand() % size);
+        seek_ns[i] = now_ns() - start;
+    }
+    tfs_closeFile(FD);
+
+    for (i = 0; i < n; i++) {
+        start = now_ns();
+        FD = tfs_openFile("latency");
+        open_ns[i] = now_ns() - start;
+        if (FD < 0) {
+            return fail("tfs_openFile", FD);
+        }
+        start = now_ns();
+        tfs_closeFile(FD);
+        close_ns[i] = now_ns() - start;
+    }
+
+    report_latency("open", open_ns, n);
+    report_latency("close", close_ns, n);
+    report_latency("seek", seek_ns, n);
+
+    FD = tfs_openFile("latency");
+    tfs_deleteFile(FD);
+    free(open_ns);
+    free(close_ns);
+    free(seek_ns);
+    free(buffer);
+    return 0;
+}
+
+/* Create, stat and delete many small files in one directory */
+static int bench_metadata(void) {
+    int n = 1000 * scale, i, ret;
+    char name[TFS_MAX_PATH];
+    tfsStat st;
+    long long start;
+
+    if ((ret = tfs_mkdir("/many")) < 0) {
+        return fail("tfs_mkdir", ret);
+    }
+
+    start = now_ns();
+    for (i = 0; i < n; i++) {
+        snprintf(name, sizeof(name), "/many/f%d", i);
+        fileDescriptor FD = tfs_openFile(name);
+        if (FD < 0 || (ret = tfs_writeFile(FD, name, 16)) < 0) {
+            return fail("create", FD < 0 ? FD : ret);
+        }
+        tfs_closeFile(FD);
+    }
+    report("create_files", n / ((now_ns() - start) / 1e9), "ops/s");
+
+    start = now_ns();
+    for (i = 0; i < n; i++) {
+        snprintf(name, sizeof(name), "/many/f%d", next_rand() % n);
+        if ((ret = tfs_stat(name, &st)) < 0) {
+            return fail("tfs_stat", ret);
+        }
+    }
+    report("stat_files", n / ((now_ns() - start) / 1e9), "ops/s");
+
+    tfsDir dir;
+    tfsDirEntry entry;
+    start = now_ns();
+    tfs_opendir("/many", &dir);
+    i = 0;
+    while (tfs_readdirNext(&dir, &entry) == TFS_SUCCESS) {
+        i++;
+    }
+    tfs_closedir(&dir);
+    report("list_entries", i / ((now_ns() - start) / 1e9), "entries/s");
+
+    start = now_ns();
+    for (i = 0; i < n; i++) {
+        snprintf(name, sizeof(name), "/many/f%d", i);
+        fileDescriptor FD = tfs_openFile(name);
+        if (FD < 0 || (ret = tfs_deleteFile(FD)) < 0) {
+            return fail("delete", FD < 0 ? FD : ret);
+        }
+    }
+    report("delete_files", n / ((now_ns() - start) / 1e9), "ops/s");
+
+    return tfs_rmdir("/many");
+}
+
+/* Opens <prefix><i> and deletes it */
+static int delete_path(char *prefix, int i) {
+    char name[TFS_MAX_PATH];
+    snprintf(name, sizeof(name), "%s%d", prefix, i);
+    fileDescriptor FD = tfs_openFile(name);
+    return FD < 0 ? FD : tfs_deleteFile(FD);
+}
+
+/*
+ * Ages the image by creating files of random sizes and deleting half of
+ * them, then reports how fragmented a large file written afterwards is
+ * and how fast it reads back sequentially
+ */
+static int bench_aged(void) {
+    int n = 600 * scale, size = 256 * 1024, i, ret;
+    char name[TFS_MAX_PATH];
+    char *buffer = malloc(size);
+    char *kept = malloc(n);
+    tfsStat st;
+    long long start;
+
+    if (buffer == NULL || kept == NULL) {
+        return fail("malloc", TFS_MEMORY_ERROR);
+    }
+    memset(buffer, 'a', size);
+    if ((ret = tfs_mkdir("/aged")) < 0) {
+        return fail("tfs_mkdir", ret);
+    }
+    for (i = 0; i < n; i++) {
+        snprintf(name, sizeof(name), "/aged/f%d", i);
+        fileDescriptor FD = tfs_openFile(name);
+        if (FD < 0 || (ret = tfs_writeFile(FD, buffer, 1 + next_rand() % 3000)) < 0) {
+            return fail("create", FD < 0 ? FD : ret);
+        }
+        tfs_closeFile(FD);
+    }
+    // Descriptors shift down when one is closed, so files are reopened by
+    // name to delete them
+    for (i = 0; i < n; i++) {
+        kept[i] = next_rand() % 2 == 0;
+        if (!kept[i] && (ret = delete_path("/aged/f", i)) < 0) {
+            return fail("tfs_deleteFile", ret);
+        }
+    }
+
+    fileDescriptor FD = tfs_openFile("/aged/big");
+    if (FD < 0 || (ret = tfs_writeFile(FD, buffer, size)) < 0) {
+        return fail("tfs_writeFile", FD < 0 ? FD : ret);
+    }
+    tfs_fstat(FD, &st);
+    report("aged_file_extents", st.extents, "extents");
+
+    start = now_ns();
+    for (i = 0; i < size; i += 4096) {
+        if ((ret = tfs_pread(FD, buffer, 4096, i)) < 0) {
+            return fail("tfs_pread", ret);
+        }
+    }
+    report("aged_read_256k", size / ((now_ns() - start) / 1e9) / (1024.0 * 1024.0), "MB/s");
+
+    tfs_deleteFile(FD);
+    for (i = 0; i < n; i++) {
+        if (kept[i] && (ret = delete_path("/aged/f", i)) < 0) {
+            return fail("tfs_deleteFile", ret);
+        }
+    }
+    free(kept);
+    free(buffer);
+    return tfs_rmdir("/aged");
+}
+
+/* One reader of bench_parallel_read: preads the shared file 4K at a time */
+typedef struct {
+    fileDescriptor FD;
+    int size;
+    int passes;
+    int ret;
+} readerArgs;
+
+static int readers_running;
+
+static void *parallel_reader(void *arg) {
+    readerArgs *args = arg;
+    char buffer[4096];
+    int pass, off;
+    args->ret = 0;
+    for (pass = 0; pass < args->passes && args->ret >= 0; pass++) {
+        for (off = 0; off < args->size; off += sizeof(buffer)) {
+            if ((args->ret = tfs_pread(args->FD, buffer, sizeof(buffer), off)) < 0) {
+                break;
+            }
+        }
+    }
+    __atomic_sub_fetch(&readers_running, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/*
+ * Aggregate tfs_pread throughput of 1, 2 and 4 threads reading one open
+ * 256K file, then of 4 threads while this thread keeps rewriting another
+ * file
+ */
+static int bench_parallel_read(void) {
+    int size = 256 * 1024, passes = 16 * scale, run, i, ret;
+    int threads_per_run[] = {1, 2, 4, 4};
+    char *buffer = malloc(size);
+    char label[64];
+    pthread_t threads[4];
+    readerArgs args[4];
+    long long start;
+
+    if (buffer == NULL) {
+        return fail("malloc", TFS_MEMORY_ERROR);
+    }
+    memset(buffer, 'p', size);
+    fileDescriptor FD = tfs_openFile("parallel");
+    if (FD < 0 || (ret = tfs_writeFile(FD, buffer, size)) < 0) {
+        return fail("tfs_writeFile", FD < 0 ? FD : ret);
+    }
+    fileDescriptor other = tfs_openFile("parallel_w");
+    if (other < 0) {
+        return fail("tfs_openFile", other);
+    }
+
+    for (run = 0; run < 4; run++) {
+        int n = threads_per_run[run], writer = (run == 3);
+        readers_running = n;
+        start = now_ns();
+        for (i = 0; i < n; i++) {
+            args[i].FD = FD;
+            args[i].size = size;
+            args[i].passes = passes;
+            pthread_create(&threads[i], NULL, parallel_reader, &args[i]);
+        }
+        while (writer && __atomic_load_n(&readers_running, __ATOMIC_ACQUIRE) > 0) {
+            if ((ret = tfs_writeFile(other, buffer, 64 * 1024)) < 0) {
+                return fail("tfs_writeFile", ret);
+            }
+        }
+        for (i = 0; i < n; i++) {
+            pthread_join(threads[i], NULL);
+            if (args[i].ret < 0) {
+                return fail("tfs_pread", args[i].ret);
+            }
+        }
+        double mb = (double)size * passes * n / (1024.0 * 1024.0);
+        snprintf(label, sizeof(label), writer ? "parallel_pread_%dt_with_writer" : "parallel_pread_%dt", n);
+        report(label, mb / ((now_ns() - start) / 1e9), "MB/s");
+    }
+
+    tfs_deleteFile(other);
+    tfs_deleteFile(FD);
+    free(buffer);
+    return 0;
+}
+
+/*
+ * Loads 64 16K files one tfs_openFile/tfs_writeFile/tfs_closeFile at a
+ * time, then all at once with tfs_bulkImport
+ */
+static int bench_bulk_import(void) {
+    int n = 64, size = 16 * 1024, i, ret;
+    tfsImportFile *files = malloc(sizeof(tfsImportFile) * n);
+    char (*names)[TFS_MAX_PATH] = malloc(TFS_MAX_PATH * n);
+    char *buffer = malloc(size);
+    long long start;
+
+    if (files == NULL || names == NULL || buffer == NULL) {
+        return fail("malloc", TFS_MEMORY_ERROR);
+    }
+    memset(buffer, 'b', size);
+    if ((ret = tfs_mkdir("/bulk")) < 0) {
+        return fail("tfs_mkdir", ret);
+    }
+    for (i = 0; i < n; i++) {
+        snprintf(names[i], TFS_MAX_PATH, "/bulk/f%d", i);
+        files[i].name = names[i];
+        files[i].buffer = buffer;
+        files[i].size = size;
+    }
+
+    start = now_ns();
+    for (i = 0; i < n; i++) {
+        fileDescriptor FD = tfs_openFile(names[i]);
+        if (FD < 0 || (ret = tfs_writeFile(FD, buffer, size)) < 0) {
+            return fail("tfs_writeFile", FD < 0 ? FD : ret);
+        }
+        tfs_closeFile(FD);
+    }
+    report("serial_load_16k", (double)size * n / ((now_ns() - start) / 1e9) / (1024.0 * 1024.0), "MB/s");
+    for (i = 0; i < n; i++) {
+        if ((ret = delete_path("/bulk/f", i)) < 0) {
+            return fail("tfs_deleteFile", ret);
+        }
+    }
+
+    start = now_ns();
+    if ((ret = tfs_bulkImport(files, n, 0)) != n) {
+        return fail("tfs_bulkImport", ret);
+    }
+    report("bulk_import_16k", (double)size * n / ((now_ns() - start) / 1e9) / (1024.0 * 1024.0), "MB/s");
+    for (i = 0; i < n; i++) {
+        if ((ret = delete_path("/bulk/f", i)) < 0) {
+            return fail("tfs_deleteFile", ret);
+        }
+    }
+
+    free(files);
+    free(names);
+    free(buffer);
+    return tfs_rmdir("/bulk");
+}
+
+/*
+ * Reads a set of small files over and over between sequential reads of a
+ * file several times the cache budget, and reports how many of the small
+ * files' block reads right after a scan are still cache hits
+ */
+static int bench_cache_scan(void) {
+    int hot = 16, size = 512 * 1024, i, ret;
+    fileDescriptor FDs[16];
+    char name[32], buffer[4096];
+    char *data = malloc(size);
+    tfsStats counters;
+    unsigned long hits = 0, reads = 0;
+
+    if (data == NULL) {
+        return fail("malloc", TFS_MEMORY_ERROR);
+    }
+    memset(data, 's', size);
+    if ((ret = tfs_setCacheBudget(64 * 1024)) < 0) {
+        return fail("tfs_setCacheBudget", ret);
+    }
+    fileDescriptor big = tfs_openFile("/scan");
+    if (big < 0 || (ret = tfs_writeFile(big, data, size)) < 0) {
+        return fail("tfs_writeFile", big < 0 ? big : ret);
+    }
+    for (i = 0; i < hot; i++) {
+        snprintf(name, sizeof(name), "/hot%d", i);
+        if ((FDs[i] = tfs_openFile(name)) < 0 || (ret = tfs_writeFile(FDs[i], data, 500)) < 0) {
+            return fail("tfs_writeFile", FDs[i] < 0 ? FDs[i] : ret);
+        }
+    }
+
+    int round, offset;
+    for (round = 0; round < 4 * scale; round++) {
+        for (i = 0; i < 4 * hot; i++) {
+            tfs_pread(FDs[i % hot], buffer, 500, 0);
+        }
+        for (offset = 0; offset < size; offset += sizeof(buffer)) {
+            tfs_pread(big, buffer, sizeof(buffer), offset);
+        }
+        tfs_resetStats();
+        for (i = 0; i < hot; i++) {
+            tfs_pread(FDs[i], buffer, 500, 0);
+        }
+        tfs_getStats(&counters);
+        hits += counters.cache_hits;
+        reads += counters.cache_hits + counters.cache_misses;
+    }
+    report("hot_hits_after_scan", 100.0 * hits / reads, "%");
+
+    for (i = 0; i < hot; i++) {
+        delete_path("/hot", i);
+    }
+    tfs_deleteFile(tfs_openFile("/scan"));
+    free(data);
+    return tfs_setCacheBudget(TFS_CACHE_BUDGET);
+}
+
+/*
+ * Scans files the way tiering logic would: stat, read an attribute, then
+ * open, read and close. Reports the rate and the disk blocks written per
+ * file once every file was read before, which lazy access times keep at
+ * zero.
+ */
+static int bench_attributes(void) {
+    int n = 500 * scale, i, pass, ret;
+    char name[TFS_MAX_PATH], buffer[300], tier[8];
+    tfsStat st;
+    tfsStats counters;
+    long long start = 0;
+
+    memset(buffer, 'a', sizeof(buffer));
+    if ((ret = tfs_mkdir("/attr")) < 0) {
+        return fail("tfs_mkdir", ret);
+    }
+    for (i = 0; i < n; i++) {
+        snprintf(name, sizeof(name), "/attr/f%d", i);
+        fileDescriptor FD = tfs_openFile(name);
+        if (FD < 0 || (ret = tfs_writeFile(FD, buffer, sizeof(buffer))) < 0 ||
+            (ret = tfs_setXattr(name, "user.tier", i % 2 ? "hot" : "cold", i % 2 ? 3 : 4)) < 0) {
+            return fail("create", FD < 0 ? FD : ret);
+        }
+        tfs_closeFile(FD);
+    }
+
+    for (pass = 0; pass < 2; pass++) {
+        tfs_resetStats();
+        start = now_ns();
+        for (i = 0; i < n; i++) {
+            snprintf(name, sizeof(name), "/attr/f%d", i);
+            if ((ret = tfs_stat(name, &st)) < 0 || (ret = tfs_getXattr(name, "user.tier", tier, sizeof(tier))) < 0) {
+                return fail("attribute scan", ret);
+            }
+            fileDescriptor FD = tfs_openFile(name);
+            tfs_pread(FD, buffer, sizeof(buffer), 0);
+            tfs_closeFile(FD);
+        }
+    }
+    tfs_getStats(&counters);
+    report("attr_scan_files", n / ((now_ns() - start) / 1e9), "ops/s");
+    report("attr_scan_writes_per_file", (double)counters.disk_write.calls / n, "blocks");
+
+    for (i = 0; i < n; i++) {
+        delete_path("/attr/f", i);
+    }
+    return tfs_rmdir("/attr");
+}
+
+#define TIER_FAST "ram:bench_fast"
+#define TIER_SLOW "ram:bench_slow"
+#define TIER_DISK "tier:" TIER_FAST "+" TIER_SLOW
+
+/* Percentage of the data blocks of every fourth /tier/f<i> (the hot set)
+   that are on the fast device */
+static double hot_on_fast(int n) {
+    char name[TFS_MAX_PATH];
+    tfsStat st;
+    int i, blocks = 0, fast = 0;
+    for (i = 0; i < n; i += 4) {
+        snprintf(name, sizeof(name), "/tier/f%d", i);
+        if (tfs_stat(name, &st) == TFS_SUCCESS) {
+            blocks += st.blocks;
+            fast += st.fast_blocks;
+        }
+    }
+    return blocks > 0 ? 100.0 * fast / blocks : 0;
+}
+
+/*
+ * Fills a tiered disk (a fast device an eighth the size of the slow one)
+ * with files, so the ones written first take the fast device, then reads
+ * every fourth file and lets tfs_migrate move files by access time.
+ * Reports how much of that hot set was on the fast device before and
+ * after, and how fast blocks migrate.
+ */
+static int bench_tiering(void) {
+    int n = 400 * scale, size = 2000, i, ret, moved = 0;
+    char name[TFS_MAX_PATH], buffer[2000];
+    tfsTierStats ts;
+
+    int disk = openDisk(TIER_FAST, BLOCKSIZE * 2048 * scale);
+    if (disk < 0) {
+        return fail("openDisk", disk);
+    }
+    closeDisk(disk);
+    if ((ret = tfs_mkfs(TIER_DISK, BLOCKSIZE * 18432 * scale)) < 0 || (ret = tfs_mount(TIER_DISK)) < 0 ||
+        (ret = tfs_mkdir("/tier")) < 0) {
+        return fail("tiered file system", ret);
+    }
+    memset(buffer, 't', size);
+    for (i = 0; i < n; i++) {
+        snprintf(name, sizeof(name), "/tier/f%d", i);
+        fileDescriptor FD = tfs_openFile(name);
+        if (FD < 0 || (ret = tfs_writeFile(FD, buffer, size)) < 0) {
+            return fail("create", FD < 0 ? FD : ret);
+        }
+        tfs_closeFile(FD);
+    }
+    report("tier_hot_on_fast_before", hot_on_fast(n), "%");
+
+    // Files not touched for two seconds count as cold
+    sleep(2);
+    for (i = 0; i < n; i += 4) {
+        snprintf(name, sizeof(name), "/tier/f%d", i);
+        fileDescriptor FD = tfs_openFile(name);
+        tfs_pread(FD, buffer, size, 0);
+        tfs_closeFile(FD);
+    }
+    long long start = now_ns();
+    while ((ret = tfs_migrate(64, 2)) != TFS_EOF) {
+        if (ret < 0) {
+            return fail("tfs_migrate", ret);
+        }
+        moved += ret;
+    }
+    long long elapsed = now_ns() - start;
+    tfs_getTierStats(&ts);
+    report("tier_hot_on_fast_after", hot_on_fast(n), "%");
+    report("tier_migrate", moved / (elapsed / 1e9), "blocks/s");
+    report("tier_blocks_moved", ts.blocks_promoted + ts.blocks_demoted, "blocks");
+
+    tfs_unmount();
+    unlinkDisk(TIER_DISK);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1) {
+        scale = atoi(argv[1]);
+        if (scale < 1) {
+            fprintf(stderr, "usage: %s [scale]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    printf("benchmark\tvalue\tunit\n");
+    if (bench_mkfs() < 0 || bench_disk("") < 0 || bench_disk("mmap:") < 0 || bench_disk("ram:") < 0) {
+        return 1;
+    }
+    // Direct I/O is not available on every file system (tmpfs has none)
+    int disk = openDisk("direct:" BENCH_DISK, BENCH_DISK_SIZE);
+    if (disk >= 0) {
+        closeDisk(disk);
+        if (bench_disk("direct:") < 0) {
+            return 1;
+        }
+    }
+
+    if (tfs_mkfs(BENCH_DISK, BENCH_DISK_SIZE) < 0 || tfs_mount(BENCH_DISK) < 0) {
+        fprintf(stderr, "could not create the benchmark file system\n");
+        return 1;
+    }
+    if (bench_file_io() < 0 || bench_latency() < 0 || bench_metadata() < 0 ||
+        bench_aged() < 0 || bench_parallel_read() < 0 ||
+        bench_bulk_import() < 0 || bench_cache_scan() < 0 || bench_attributes() < 0) {
+        return 1;
+    }
+    tfs_unmount();
+    remove(BENCH_DISK);
+    return bench_tiering() < 0 ? 1 : 0;
+}
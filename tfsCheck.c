@@ -0,0 +1,1686 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include "libTinyFS.h"
+#include "faultDisk.h"
+#include "crc32c.h"
+
+/* Checks of the TinyFS features, one function per feature. Each writes
+   through the library, remounts, reads the data back and then drives the
+   error paths the feature adds. Prints one line per check and exits
+   non-zero if any failed. */
+
+#define TEST_DISK "tfsCheck.dsk"
+#define FAULT_DISK "fault:" TEST_DISK
+#define NUM_BLOCKS (DEFAULT_DISK_SIZE / BLOCKSIZE)
+
+static int failures = 0;
+
+/* Disk the checks run on; test_backends points it at each backend in turn */
+static char *test_disk = TEST_DISK;
+
+static void check(int ok, char *what) {
+    printf("] %s: %s\n", ok ? "ok" : "FAILED", what);
+    if (!ok) {
+        failures++;
+    }
+}
+
+/* Makes writes to the test disk fail once 'writes' more have succeeded;
+   -1 clears every fault. Only a test_disk of FAULT_DISK sees them. */
+static void fail_writes(int writes) {
+    faultDiskConfig config;
+    faultDiskDefaults(&config);
+    config.fail_after_writes = writes;
+    faultDiskConfigure(TEST_DISK, &config);
+}
+
+/* Blocks in the file system the last fresh() made */
+static int disk_blocks = 0;
+
+/* Mounts a new, empty file system of 'blocks' blocks */
+static int fresh(int blocks, int options) {
+    fail_writes(-1);
+    tfs_unmount();
+    disk_blocks = blocks;
+    int ret = tfs_mkfs(test_disk, blocks * BLOCKSIZE);
+    return ret < 0 ? ret : tfs_mountWithOptions(test_disk, options);
+}
+
+/* Size in blocks the superblock of the test disk records; the disk must
+   not be mounted */
+static int image_blocks(void) {
+    char block[BLOCKSIZE];
+    int disk = openDisk(test_disk, 0), blocks = -1;
+    if (disk >= 0 && readBlock(disk, 0, block) == 0) {
+        memcpy(&blocks, block + BLOCK_HEADER_SIZE + SB_BLOCK_COUNT, sizeof(blocks));
+    }
+    closeDisk(disk);
+    return blocks;
+}
+
+static int remount(int options) {
+    int ret = tfs_unmount();
+    return ret < 0 ? ret : tfs_mountWithOptions(test_disk, options);
+}
+
+/* Text-like contents; 'seed' makes files differ */
+static void fill(char *buffer, int size, int seed) {
+    int i;
+    for (i = 0; i < size; i++) {
+        buffer[i] = 'a' + (i / 7 + seed) % 26;
+    }
+}
+
+/* Contents that don't compress */
+static void fill_random(char *buffer, int size, unsigned int seed) {
+    int i;
+    for (i = 0; i < size; i++) {
+        seed = seed * 1103515245 + 12345;
+        buffer[i] = (char)(seed >> 16) | 1;
+    }
+}
+
+static int write_file(char *path, char *buffer, int size) {
+    fileDescriptor FD = tfs_openFile(path);
+    if (FD < 0) {
+        return FD;
+    }
+    int ret = tfs_writeFile(FD, buffer, size);
+    int closed = tfs_closeFile(FD);
+    return ret < 0 ? ret : closed;
+}
+
+static int delete_file(char *path) {
+    fileDescriptor FD = tfs_openFile(path);
+    return FD < 0 ? FD : tfs_deleteFile(FD);
+}
+
+/* Whether the open file FD holds exactly the 'size' bytes at 'expect' */
+static int same_data(fileDescriptor FD, char *expect, int size) {
+    char *buffer = malloc(size + 1);
+    int ok = buffer != NULL && tfs_pread(FD, buffer, size + 1, 0) == size && memcmp(buffer, expect, size) == 0;
+    free(buffer);
+    return ok;
+}
+
+/* Whether the file at 'path' holds exactly the 'size' bytes at 'expect' */
+static int same_contents(char *path, char *expect, int size) {
+    fileDescriptor FD = tfs_openFile(path);
+    if (FD < 0) {
+        return 0;
+    }
+    int ok = same_data(FD, expect, size);
+    tfs_closeFile(FD);
+    return ok;
+}
+
+/* Whether reading FD a byte at a time from 'offset' gives 'expect' and
+   then the end of the file */
+static int same_bytes(fileDescriptor FD, int offset, char *expect, int size) {
+    char byte;
+    int i;
+    if (tfs_seek(FD, offset) < 0) {
+        return 0;
+    }
+    for (i = 0; i < size; i++) {
+        if (tfs_readByte(FD, &byte) < 0 || byte != expect[i]) {
+            return 0;
+        }
+    }
+    return tfs_readByte(FD, &byte) == TFS_EOF;
+}
+
+/* Flips 'bits' of one byte of block 'bNum' of the unmounted test disk, at
+   'offset' into the block, or of the first block whose data holds 'marker'
+   when bNum is -1. Returns the block changed. */
+static int corrupt_block(int bNum, char *marker, int offset, int bits) {
+    char block[BLOCKSIZE];
+    int disk = openDisk(test_disk, 0), i;
+    if (disk < 0) {
+        return -1;
+    }
+    for (i = 0; bNum < 0 && i < disk_blocks && readBlock(disk, i, block) == 0; i++) {
+        if (memcmp(block + BLOCK_HEADER_SIZE, marker, 16) == 0) {
+            bNum = i;
+        }
+    }
+    if (bNum >= 0 && readBlock(disk, bNum, block) == 0) {
+        block[offset] ^= bits;
+        writeBlock(disk, bNum, block);
+    } else {
+        bNum = -1;
+    }
+    closeDisk(disk);
+    return bNum;
+}
+
+/* Each thread checksums the standard check string and stores the result */
+static void *crc_thread(void *arg) {
+    *(uint32_t *)arg = crc32c(0, "123456789", 9);
+    return NULL;
+}
+
+/* Runs first, so the threads race to make the first crc32c call and set
+   up its tables */
+static void test_crc_threads(void) {
+    pthread_t threads[8];
+    uint32_t results[8];
+    int i, right = 0;
+    for (i = 0; i < 8; i++) {
+        pthread_create(&threads[i], NULL, crc_thread, &results[i]);
+    }
+    for (i = 0; i < 8; i++) {
+        pthread_join(threads[i], NULL);
+        right += results[i] == 0xE3069283;
+    }
+    check(right == 8, "checksums: threads making the first crc32c call at once all get the right value");
+}
+
+static void test_checksums(void) {
+    char content[3 * BLOCK_DATA_SIZE], byte;
+    tfsChecksumStats cs;
+    int i, bad = 0;
+    fill(content, sizeof(content), 0);
+
+    check(fresh(NUM_BLOCKS, 0) == TFS_SUCCESS && write_file("a", content, sizeof(content)) == TFS_SUCCESS,
+          "checksums: mkfs and write a file");
+    tfs_resetChecksumStats();
+    check(remount(0) == TFS_SUCCESS && same_contents("a", content, sizeof(content)), "checksums: read it back");
+    check(tfs_getChecksumStats(&cs) == TFS_SUCCESS && cs.blocks_verified >= 3 && cs.blocks_unchecked == 0 &&
+          cs.checksum_failures == 0, "checksums: every block read was verified");
+    check(tfs_checkConsistency() == TFS_SUCCESS, "checksums: fsck");
+
+    // One flipped bit in the middle block of the file, made behind the
+    // library's back, is caught on read and by fsck
+    tfs_unmount();
+    check(corrupt_block(-1, content + BLOCK_DATA_SIZE, BLOCK_HEADER_SIZE + 100, 0x10) > 0, "checksums: damage a block");
+    tfs_resetChecksumStats();
+    check(tfs_mount(test_disk) == TFS_SUCCESS && !same_contents("a", content, sizeof(content)) &&
+          tfs_getChecksumStats(&cs) == TFS_SUCCESS && cs.checksum_failures >= 1, "checksums: the damaged block is refused");
+    check(tfs_checkConsistency() < 0, "checksums: fsck fails on the damaged block");
+
+    // With checking off the damaged data reads back as it is
+    check(remount(TFS_MOUNT_NO_CHECKSUM) == TFS_SUCCESS, "checksums: mount without checking");
+    fileDescriptor FD = tfs_openFile("a");
+    for (i = 0; i < (int)sizeof(content); i++) {
+        bad += tfs_readByte(FD, &byte) < 0 || byte != content[i];
+    }
+    check(bad == 1 && tfs_readByte(FD, &byte) == TFS_EOF, "checksums: with checking off one byte differs and nothing fails");
+    tfs_closeFile(FD);
+
+    // Damage that clears a block's checksum flag doesn't get it past the
+    // check, in a data block or in the superblock
+    check(fresh(NUM_BLOCKS, 0) == TFS_SUCCESS && write_file("a", content, sizeof(content)) == TFS_SUCCESS,
+          "checksums: write the file again");
+    tfs_unmount();
+    check(corrupt_block(-1, content + BLOCK_DATA_SIZE, 3, BLOCK_FLAG_CHECKSUM) > 0,
+          "checksums: clear the checksum flag of a block");
+    tfs_resetChecksumStats();
+    check(tfs_mount(test_disk) == TFS_SUCCESS && !same_contents("a", content, sizeof(content)) &&
+          tfs_getChecksumStats(&cs) == TFS_SUCCESS && cs.checksum_failures >= 1 && cs.blocks_unchecked == 0,
+          "checksums: the block without its flag is refused");
+    check(tfs_checkConsistency() < 0, "checksums: fsck fails on the block without its flag");
+    tfs_unmount();
+    check(corrupt_block(0, NULL, 3, BLOCK_FLAG_CHECKSUM) == 0 && tfs_mount(test_disk) == TFS_INVALID_FILESYSTEM,
+          "checksums: a superblock without its flag is refused at mount");
+    check(corrupt_block(0, NULL, 3, BLOCK_FLAG_CHECKSUM) == 0 && tfs_mount(test_disk) == TFS_SUCCESS,
+          "checksums: and mounts again once the flag is back");
+
+    // A damaged superblock makes the disk unmountable
+    tfs_unmount();
+    check(corrupt_block(0, NULL, BLOCK_HEADER_SIZE + 20, 0x10) == 0 && tfs_mount(test_disk) == TFS_INVALID_FILESYSTEM,
+          "checksums: a damaged superblock is refused at mount");
+
+    // Making another disk doesn't turn checksums back on for a mount
+    // made without them
+    check(fresh(NUM_BLOCKS, TFS_MOUNT_NO_CHECKSUM) == TFS_SUCCESS &&
+          tfs_mkfs("ram:other", NUM_BLOCKS * BLOCKSIZE) == TFS_SUCCESS,
+          "checksums: mkfs another disk while mounted without checking");
+    tfs_resetChecksumStats();
+    check(write_file("a", content, sizeof(content)) == TFS_SUCCESS && tfs_getChecksumStats(&cs) == TFS_SUCCESS &&
+          cs.blocks_updated == 0, "checksums: the mount still writes no checksums");
+    check(remount(0) == TFS_SUCCESS && same_contents("a", content, sizeof(content)) &&
+          tfs_getChecksumStats(&cs) == TFS_SUCCESS && cs.blocks_unchecked > 0 && cs.checksum_failures == 0,
+          "checksums: a later mount reads the blocks written without checksums");
+    tfs_unmount();
+    unlinkDisk("ram:other");
+
+    // A tfs_mkfs the device fails closes the disk, so it can be made again
+    faultDiskConfig config;
+    faultDiskDefaults(&config);
+    config.fail_after_writes = 2;
+    faultDiskConfigure("ram:other", &config);
+    check(tfs_mkfs("fault:ram:other", NUM_BLOCKS * BLOCKSIZE) == TFS_WRITE_ERROR, "checksums: a failing mkfs is reported");
+    faultDiskDefaults(&config);
+    faultDiskConfigure("ram:other", &config);
+    check(tfs_mkfs("fault:ram:other", NUM_BLOCKS * BLOCKSIZE) == TFS_SUCCESS && tfs_mount("ram:other") == TFS_SUCCESS &&
+          tfs_checkConsistency() == TFS_SUCCESS, "checksums: and the disk was closed, so it can be made again");
+    tfs_unmount();
+    unlinkDisk("ram:other");
+}
+
+static void test_compression(void) {
+    int size = 60 * BLOCK_DATA_SIZE, small_size = 2000, i, bad = 0;
+    char *content = malloc(size), *noise = malloc(size), *copy = malloc(size);
+    fill(content, size, 1);
+    fill_random(noise, size, 1);
+
+    // 60 blocks of text don't fit on the disk as they are, but do compressed
+    check(fresh(NUM_BLOCKS, 0) == TFS_SUCCESS, "compression: mkfs and mount");
+    check(write_file("big", content, size) == TFS_DISK_FULL, "compression: the file doesn't fit uncompressed");
+    fileDescriptor FD = tfs_openFile("big");
+    check(tfs_setCompression(FD, 1) == TFS_SUCCESS && tfs_writeFile(FD, content, size) == TFS_SUCCESS,
+          "compression: it fits compressed");
+    tfs_closeFile(FD);
+    FD = tfs_openFile("small");
+    check(tfs_setCompression(FD, 1) == TFS_SUCCESS && tfs_writeFile(FD, content, small_size) == TFS_SUCCESS,
+          "compression: a second, smaller file");
+    tfs_closeFile(FD);
+
+    // Whole file, byte by byte and ranges across chunk boundaries
+    check(remount(0) == TFS_SUCCESS && same_contents("big", content, size), "compression: read back after a remount");
+    FD = tfs_openFile("big");
+    check(same_bytes(FD, size - COMPRESS_CHUNK_SIZE - 10, content + size - COMPRESS_CHUNK_SIZE - 10,
+                     COMPRESS_CHUNK_SIZE + 10), "compression: tfs_readByte across a chunk boundary");
+    for (i = 1; i < size; i += 997) {
+        int len = i + 300 < size ? 300 : size - i;
+        bad += tfs_pread(FD, copy, 300, i) != len || memcmp(copy, content + i, len) != 0;
+    }
+    check(bad == 0, "compression: tfs_pread of ranges anywhere in the file");
+
+    // Changing a byte rewrites its chunk only
+    memcpy(copy, content, size);
+    copy[COMPRESS_CHUNK_SIZE + 5] = '#';
+    check(tfs_writeByte(FD, COMPRESS_CHUNK_SIZE + 5, '#') == TFS_SUCCESS, "compression: change one byte");
+    tfs_closeFile(FD);
+    check(remount(0) == TFS_SUCCESS && same_contents("big", copy, size), "compression: the change survives a remount");
+
+    // Turning compression off rewrites the file as it is
+    FD = tfs_openFile("small");
+    check(tfs_setCompression(FD, 0) == TFS_SUCCESS && same_data(FD, content, small_size),
+          "compression: turning it off keeps the contents");
+    tfs_closeFile(FD);
+    check(remount(0) == TFS_SUCCESS && same_contents("small", content, small_size), "compression: and so does a remount");
+    check(tfs_checkConsistency() == TFS_SUCCESS, "compression: fsck");
+
+    // The new layout is written before the old one goes, so a disk without
+    // room for both refuses the switch and the file stays as it was, here
+    // the big file that only fits compressed and then, on a full disk, the
+    // small one in the other direction
+    tfsStat st;
+    FD = tfs_openFile("big");
+    check(tfs_setCompression(FD, 0) == TFS_DISK_FULL && same_data(FD, copy, size) &&
+          tfs_fstat(FD, &st) == TFS_SUCCESS && st.compressed, "compression: turning it off without room is refused");
+    tfs_closeFile(FD);
+    FD = tfs_openFile("filler");
+    check(tfs_pwrite(FD, noise, size, 0) == TFS_DISK_FULL, "compression: fill the disk");
+    tfs_closeFile(FD);
+    FD = tfs_openFile("small");
+    check(tfs_setCompression(FD, 1) == TFS_DISK_FULL && same_data(FD, content, small_size) &&
+          tfs_fstat(FD, &st) == TFS_SUCCESS && !st.compressed, "compression: turning it on on a full disk is refused");
+    tfs_closeFile(FD);
+    check(remount(0) == TFS_SUCCESS && same_contents("big", copy, size) && same_contents("small", content, small_size) &&
+          tfs_checkConsistency() == TFS_SUCCESS, "compression: both files survive a remount and fsck passes");
+    check(delete_file("filler") == TFS_SUCCESS, "compression: make room again");
+
+    // Error paths: a read-only file, and data that doesn't compress
+    FD = tfs_openFile("small");
+    tfs_makeRO("small");
+    check(tfs_setCompression(FD, 1) == TFS_FILE_READ_ONLY && same_data(FD, content, small_size),
+          "compression: a read-only file is refused and unchanged");
+    tfs_closeFile(FD);
+    FD = tfs_openFile("noise");
+    tfs_setCompression(FD, 1);
+    check(tfs_writeFile(FD, noise, size) == TFS_DISK_FULL, "compression: data that doesn't compress still fills the disk");
+    tfs_closeFile(FD);
+    check(remount(0) == TFS_SUCCESS && same_contents("noise", noise, 0) && same_contents("small", content, small_size) &&
+          tfs_checkConsistency() == TFS_SUCCESS, "compression: the failed write leaves an empty file, the rest intact");
+    free(content);
+    free(noise);
+    free(copy);
+}
+
+static void test_dedup(void) {
+    int size = 20 * BLOCK_DATA_SIZE;
+    char *content = malloc(size), *other = malloc(size);
+    tfsDedupStats ds;
+    int i;
+    fill_random(content, size, 2);
+
+    // Two copies of 20 blocks only fit on the 37 free blocks when shared
+    check(fresh(NUM_BLOCKS, TFS_MOUNT_DEDUP) == TFS_SUCCESS, "dedup: mkfs and mount with TFS_MOUNT_DEDUP");
+    check(write_file("a", content, size) == TFS_SUCCESS && write_file("b", content, size) == TFS_SUCCESS,
+          "dedup: two identical files fit");
+    check(tfs_getDedupStats(&ds) == TFS_SUCCESS && ds.blocks_written == 40 && ds.blocks_shared == 20 &&
+          ds.logical_blocks == 40 && ds.physical_blocks == 20 && ds.dedup_ratio == 2.0,
+          "dedup: the second copy shares every block of the first");
+
+    // A change to a shared block copies it first
+    memcpy(other, content, size);
+    other[300] = 'x';
+    fileDescriptor FD = tfs_openFile("b");
+    check(tfs_writeByte(FD, 300, 'x') == TFS_SUCCESS && tfs_getDedupStats(&ds) == TFS_SUCCESS && ds.cow_copies == 1 &&
+          ds.physical_blocks == 21, "dedup: changing a shared block copies it");
+    tfs_closeFile(FD);
+    check(same_contents("a", content, size) && same_contents("b", other, size), "dedup: the other file keeps the old data");
+    check(delete_file("a") == TFS_SUCCESS && tfs_getDedupStats(&ds) == TFS_SUCCESS && ds.physical_blocks == 20,
+          "dedup: deleting one copy frees only the blocks it didn't share");
+    check(same_contents("b", other, size) && tfs_checkConsistency() == TFS_SUCCESS, "dedup: the other copy is intact");
+    check(remount(TFS_MOUNT_DEDUP) == TFS_SUCCESS && same_contents("b", other, size), "dedup: read back after a remount");
+
+    // The index is rebuilt at mount, so data written before it is shared
+    check(write_file("c", other, size) == TFS_SUCCESS && tfs_getDedupStats(&ds) == TFS_SUCCESS &&
+          ds.blocks_written == 20 && ds.blocks_shared == 20 && ds.physical_blocks == 20,
+          "dedup: a copy of a file written before the remount shares all its blocks");
+    check(delete_file("c") == TFS_SUCCESS && same_contents("b", other, size) && tfs_checkConsistency() == TFS_SUCCESS,
+          "dedup: deleting the copy leaves the original");
+
+    // Error path: without sharing, a third copy doesn't fit
+    check(remount(0) == TFS_SUCCESS, "dedup: remount without dedup");
+    check(write_file("c", content, size) == TFS_DISK_FULL, "dedup: an unshared copy is refused");
+    check(same_contents("b", other, size) && same_contents("c", content, 0) && tfs_checkConsistency() == TFS_SUCCESS,
+          "dedup: the refused write leaves the disk consistent");
+
+    // A device that fails while data blocks are written: the blocks taken
+    // off the free list go back on it
+    test_disk = FAULT_DISK;
+    for (i = 1; i < 4; i++) {
+        check(fresh(NUM_BLOCKS, TFS_MOUNT_DEDUP) == TFS_SUCCESS, "dedup: mkfs on a device that will fail");
+        FD = tfs_openFile("a");
+        fail_writes(i);
+        check(tfs_writeFile(FD, content, size) == TFS_WRITE_ERROR, "dedup: a failing device is reported");
+        fail_writes(-1);
+        tfs_closeFile(FD);
+        check(remount(TFS_MOUNT_DEDUP) == TFS_SUCCESS && tfs_checkConsistency() == TFS_SUCCESS,
+              "dedup: no block leaked");
+    }
+    test_disk = TEST_DISK;
+    free(content);
+    free(other);
+}
+
+static void test_snapshots(void) {
+    int size = 10 * BLOCK_DATA_SIZE, small_size = 5 * BLOCK_DATA_SIZE, large_size = 28 * BLOCK_DATA_SIZE;
+    char *before = malloc(size), *after = malloc(size), *small = malloc(small_size), *changed = malloc(small_size);
+    char *large = malloc(large_size);
+    fill_random(before, size, 3);
+    fill_random(after, size, 4);
+    fill_random(small, small_size, 5);
+    fill_random(large, large_size, 6);
+    memcpy(changed, small, small_size);
+    changed[10] = 'x';
+
+    check(fresh(NUM_BLOCKS, 0) == TFS_SUCCESS && write_file("f", before, size) == TFS_SUCCESS &&
+          write_file("g", small, small_size) == TFS_SUCCESS, "snapshots: mkfs and write two files");
+    check(tfs_snapshot("s1") == TFS_SUCCESS, "snapshots: take a snapshot");
+    check(tfs_snapshot("s1") == TFS_FILE_ALREADY_EXISTS, "snapshots: a name is only used once");
+
+    // Overwrite one file and change a byte of the other; the snapshot
+    // keeps both as they were
+    fileDescriptor G = tfs_openFile("g");
+    check(write_file("f", after, size) == TFS_SUCCESS && tfs_writeByte(G, 10, 'x') == TFS_SUCCESS,
+          "snapshots: overwrite one file and change the other");
+    tfs_closeFile(G);
+    fileDescriptor S = tfs_openSnapshotFile("s1", "f");
+    check(S >= 0 && same_data(S, before, size) && same_contents("f", after, size),
+          "snapshots: the overwritten file reads old in the snapshot and new live");
+    check(tfs_writeFile(S, after, size) == TFS_FILE_READ_ONLY && tfs_writeByte(S, 0, 'x') == TFS_FILE_READ_ONLY,
+          "snapshots: snapshot files are read-only");
+    tfs_closeFile(S);
+    S = tfs_openSnapshotFile("s1", "g");
+    check(S >= 0 && same_data(S, small, small_size) && same_contents("g", changed, small_size),
+          "snapshots: so does the changed one");
+    tfs_closeFile(S);
+
+    // Deleting the live file leaves the snapshot's copy
+    check(delete_file("f") == TFS_SUCCESS, "snapshots: delete the live file");
+    S = tfs_openSnapshotFile("s1", "f");
+    check(S >= 0 && same_data(S, before, size), "snapshots: the snapshot still reads the deleted file");
+    tfs_closeFile(S);
+    check(tfs_checkConsistency() == TFS_SUCCESS, "snapshots: fsck with the snapshot held");
+
+    // The old blocks stay in use until the snapshot is dropped
+    check(write_file("large", large, large_size) == TFS_DISK_FULL, "snapshots: the snapshot's blocks aren't free");
+    check(tfs_deleteSnapshot("s1") == TFS_SUCCESS && tfs_openSnapshotFile("s1", "f") == TFS_FILE_NOT_FOUND,
+          "snapshots: drop the snapshot");
+    check(write_file("large", large, large_size) == TFS_SUCCESS && same_contents("large", large, large_size) &&
+          same_contents("g", changed, small_size), "snapshots: the blocks only it used are free again");
+    check(tfs_checkConsistency() == TFS_SUCCESS, "snapshots: fsck with the snapshot gone");
+
+    // Error paths: names that don't exist
+    check(tfs_openSnapshotFile("none", "g") == TFS_FILE_NOT_FOUND && tfs_deleteSnapshot("none") == TFS_FILE_NOT_FOUND,
+          "snapshots: a missing snapshot");
+    check(tfs_snapshot("s2") == TFS_SUCCESS && tfs_openSnapshotFile("s2", "f") == TFS_FILE_NOT_FOUND &&
+          tfs_deleteSnapshot("s2") == TFS_SUCCESS, "snapshots: a file that wasn't there when it was taken");
+
+    // Names are whole up to TFS_MAX_NAME characters; longer or empty ones
+    // are refused rather than cut short
+    char name[TFS_MAX_NAME + 2];
+    memset(name, 'n', TFS_MAX_NAME);
+    name[TFS_MAX_NAME] = '\0';
+    check(tfs_snapshot(name) == TFS_SUCCESS && (S = tfs_openSnapshotFile(name, "g")) >= 0 &&
+          same_data(S, changed, small_size) && tfs_closeFile(S) == TFS_SUCCESS,
+          "snapshots: a name of TFS_MAX_NAME characters can be opened");
+    check(tfs_snapshot("prefix-1") == TFS_SUCCESS && tfs_snapshot("prefix-12") == TFS_SUCCESS &&
+          tfs_deleteSnapshot("prefix-12") == TFS_SUCCESS && tfs_deleteSnapshot("prefix-1") == TFS_SUCCESS,
+          "snapshots: names sharing a prefix are different snapshots");
+    name[TFS_MAX_NAME] = 'n';
+    name[TFS_MAX_NAME + 1] = '\0';
+    check(tfs_snapshot(name) == TFS_INVALID_NAME && tfs_snapshot("") == TFS_INVALID_NAME,
+          "snapshots: names too long or empty are refused");
+    name[TFS_MAX_NAME] = '\0';
+    check(tfs_deleteSnapshot(name) == TFS_SUCCESS, "snapshots: drop the long-named one");
+
+    // A snapshot still held at unmount ends there, and so do the blocks
+    // only it used
+    check(delete_file("large") == TFS_SUCCESS && write_file("f", before, size) == TFS_SUCCESS &&
+          tfs_snapshot("s3") == TFS_SUCCESS && delete_file("f") == TFS_SUCCESS, "snapshots: hold a deleted file");
+    check(remount(0) == TFS_SUCCESS && tfs_checkConsistency() == TFS_SUCCESS &&
+          tfs_openSnapshotFile("s3", "f") == TFS_FILE_NOT_FOUND, "snapshots: unmount drops the snapshot");
+    check(write_file("large", large, large_size) == TFS_SUCCESS && tfs_checkConsistency() == TFS_SUCCESS,
+          "snapshots: and its blocks are free after the remount");
+
+    // fsck reports a block that is neither free nor used: unlink the head
+    // of the free list behind the library's back
+    char block[BLOCKSIZE];
+    int disk, head, next = -1;
+    tfs_unmount();
+    if ((disk = openDisk(test_disk, 0)) >= 0 && readBlock(disk, 0, block) == 0) {
+        memcpy(&head, block + BLOCK_HEADER_SIZE + SB_FREE_HEAD, sizeof(head));
+        char free_block[BLOCKSIZE];
+        if (head > 0 && readBlock(disk, head, free_block) == 0) {
+            memcpy(&next, free_block + BLOCK_HEADER_SIZE + FREE_NEXT, sizeof(next));
+            memcpy(block + BLOCK_HEADER_SIZE + SB_FREE_HEAD, &next, sizeof(next));
+            writeBlock(disk, 0, block);
+        }
+    }
+    closeDisk(disk);
+    check(next >= 0 && tfs_mountWithOptions(test_disk, TFS_MOUNT_NO_CHECKSUM) == TFS_SUCCESS &&
+          tfs_checkConsistency() == TFS_INVALID_FILESYSTEM, "snapshots: fsck reports a leaked block");
+    tfs_unmount();
+    free(before);
+    free(after);
+    free(small);
+    free(changed);
+    free(large);
+}
+
+static void test_directories(void) {
+    int big_size = 120 * BLOCK_DATA_SIZE, i, found = 0;
+    char content[BLOCK_DATA_SIZE], path[TFS_MAX_PATH], long_name[TFS_MAX_NAME + 3];
+    char *big = malloc(big_size);
+    fill(content, sizeof(content), 7);
+    fill_random(big, big_size, 7);
+    long_name[0] = '/';
+    memset(long_name + 1, 'n', TFS_MAX_NAME + 1);
+    long_name[TFS_MAX_NAME + 2] = '\0';
+
+    check(fresh(1000, 0) == TFS_SUCCESS, "directories: mkfs and mount");
+    check(tfs_mkdir("/a") == TFS_SUCCESS && tfs_mkdir("/a/b") == TFS_SUCCESS && tfs_mkdir("/c") == TFS_SUCCESS,
+          "directories: make nested directories");
+    // Enough entries to split buckets and grow the hash table
+    for (i = 0; i < 200; i++) {
+        snprintf(path, sizeof(path), "/a/b/file%d", i);
+        found += write_file(path, content, 10 + i) == TFS_SUCCESS;
+    }
+    check(found == 200, "directories: 200 files in one directory");
+    // More than the inode's direct map holds, so a block map chain too
+    check(write_file("/c/big", big, big_size) == TFS_SUCCESS, "directories: a file past the direct block map");
+    fileDescriptor FD = tfs_openFile("/a/b/file7");
+    check(tfs_rename(FD, "/c/moved") == TFS_SUCCESS, "directories: move a file to another directory");
+    tfs_closeFile(FD);
+
+    // Everything is on disk, so a remount finds it all again
+    check(remount(0) == TFS_SUCCESS, "directories: remount");
+    for (i = 0, found = 0; i < 200; i++) {
+        snprintf(path, sizeof(path), "/a/b/file%d", i);
+        found += i != 7 && same_contents(path, content, 10 + i);
+    }
+    check(found == 199, "directories: every file reads back");
+    check(same_contents("/c/big", big, big_size), "directories: so does the large one");
+    check(tfs_rmdir("/a/b/file7") == TFS_FILE_NOT_FOUND && same_contents("/c/moved", content, 17),
+          "directories: the moved file is only in its new directory");
+    check(same_contents("a/b/file3", content, 13), "directories: the leading '/' is optional");
+    check(tfs_checkConsistency() == TFS_SUCCESS, "directories: fsck");
+
+    // Removing directories
+    check(tfs_rmdir("/a/b") == TFS_DIRECTORY_NOT_EMPTY, "directories: rmdir of a non-empty directory is refused");
+    for (i = 0; i < 200; i++) {
+        snprintf(path, sizeof(path), "/a/b/file%d", i);
+        delete_file(path);
+    }
+    check(tfs_rmdir("/a/b") == TFS_SUCCESS && tfs_mkdir("/a/b") == TFS_SUCCESS && tfs_rmdir("/a/b") == TFS_SUCCESS,
+          "directories: an empty directory can be removed and made again");
+
+    // Error paths: bad names and paths
+    check(tfs_mkdir("/c/moved/x") == TFS_NOT_A_DIRECTORY && tfs_rmdir("/c/moved") == TFS_NOT_A_DIRECTORY,
+          "directories: a file is not a directory");
+    check(tfs_openFile("/c") == TFS_IS_A_DIRECTORY, "directories: a directory can't be opened as a file");
+    check(tfs_openFile("/missing/f") == TFS_FILE_NOT_FOUND && tfs_mkdir("/missing/d") == TFS_FILE_NOT_FOUND,
+          "directories: a missing parent");
+    check(tfs_mkdir("/c") == TFS_FILE_ALREADY_EXISTS, "directories: a name is only used once");
+    check(tfs_openFile(long_name) == TFS_INVALID_NAME && tfs_mkdir(long_name) == TFS_INVALID_NAME &&
+          tfs_mkdir("/") == TFS_INVALID_NAME, "directories: names too long or empty are refused");
+    check(remount(0) == TFS_SUCCESS && tfs_checkConsistency() == TFS_SUCCESS, "directories: fsck after the refusals");
+
+    // A rename the device fails part way through leaves the file in one of
+    // the two directories, whichever write failed
+    int lost = 0, failed = 0;
+    test_disk = FAULT_DISK;
+    for (i = 0; i < 6; i++) {
+        fresh(NUM_BLOCKS, 0);
+        tfs_mkdir("/a");
+        tfs_mkdir("/c");
+        write_file("/a/f", content, 13);
+        fileDescriptor FD = tfs_openFile("/a/f");
+        fail_writes(i);
+        int ret = tfs_rename(FD, "/c/moved");
+        fail_writes(-1);
+        tfs_closeFile(FD);
+        failed += ret < 0;
+        remount(0);
+        lost += !same_contents("/a/f", content, 13) && !same_contents("/c/moved", content, 13);
+    }
+    test_disk = TEST_DISK;
+    check(failed > 0 && lost == 0, "directories: a rename on a failing device doesn't lose the file");
+
+    // An inode whose block map is longer than its size allows, or negative,
+    // is refused rather than trusted. Checksums are off so the edited block
+    // is read at all.
+    int lengths[2] = { INODE_DIRECT_COUNT, -5 };
+    for (i = 0; i < 2; i++) {
+        tfsStat st;
+        check(fresh(NUM_BLOCKS, 0) == TFS_SUCCESS && write_file("/f", content, 13) == TFS_SUCCESS &&
+              tfs_stat("/f", &st) == TFS_SUCCESS && tfs_unmount() == TFS_SUCCESS, "directories: write a file");
+        char block[BLOCKSIZE];
+        int disk = openDisk(test_disk, 0);
+        readBlock(disk, st.inode, block);
+        memcpy(block + BLOCK_HEADER_SIZE + INODE_MAP_LEN, &lengths[i], sizeof(lengths[i]));
+        writeBlock(disk, st.inode, block);
+        closeDisk(disk);
+        int ret = tfs_mountWithOptions(test_disk, TFS_MOUNT_NO_CHECKSUM);
+        if (ret == TFS_SUCCESS) {
+            ret = tfs_stat("/f", &st);
+        }
+        check(ret == TFS_INVALID_FILESYSTEM, i == 0 ? "directories: a block map too long for the size is refused" :
+                                                      "directories: a negative block map length is refused");
+    }
+    free(big);
+}
+
+static void test_listing(void) {
+    char content[2 * BLOCK_DATA_SIZE], path[TFS_MAX_PATH], seen[40];
+    tfsDir dir;
+    tfsDirEntry entry;
+    tfsStat st, fst;
+    int i, ret, entries = 0, dirs = 0, bad = 0;
+    fill(content, sizeof(content), 8);
+
+    check(fresh(1000, 0) == TFS_SUCCESS && tfs_mkdir("/d") == TFS_SUCCESS && tfs_mkdir("/d/sub") == TFS_SUCCESS,
+          "listing: mkfs and two directories");
+    for (i = 0; i < 40; i++) {
+        snprintf(path, sizeof(path), "/d/f%d", i);
+        write_file(path, content, i * 10);
+    }
+
+    // Every entry once, in whatever order the buckets give, then TFS_EOF
+    check(remount(0) == TFS_SUCCESS && tfs_opendir("/d", &dir) == TFS_SUCCESS, "listing: remount and open a directory");
+    memset(seen, 0, sizeof(seen));
+    while ((ret = tfs_readdirNext(&dir, &entry)) == TFS_SUCCESS) {
+        entries++;
+        if (strcmp(entry.name, "sub") == 0 && entry.is_dir) {
+            dirs++;
+        } else if (sscanf(entry.name, "f%d", &i) == 1 && i >= 0 && i < 40 && !entry.is_dir && !seen[i]) {
+            seen[i] = 1;
+        } else {
+            bad++;
+        }
+    }
+    check(ret == TFS_EOF && entries == 41 && dirs == 1 && bad == 0, "listing: every entry once, then TFS_EOF");
+    check(tfs_readdirNext(&dir, &entry) == TFS_EOF, "listing: and TFS_EOF again");
+    check(tfs_closedir(&dir) == TFS_SUCCESS, "listing: close the listing");
+
+    check(tfs_stat("/d/f25", &st) == TFS_SUCCESS && st.size == 250 && !st.is_dir && st.blocks == 2 && !st.read_only &&
+          !st.compressed, "listing: stat reports size and blocks");
+    fileDescriptor FD = tfs_openFile("/d/f25");
+    check(tfs_fstat(FD, &fst) == TFS_SUCCESS && fst.inode == st.inode && fst.size == st.size &&
+          fst.creation_t == st.creation_t, "listing: fstat agrees with stat");
+    tfs_closeFile(FD);
+    tfs_makeRO("/d/f1");
+    check(tfs_stat("/d/f1", &st) == TFS_SUCCESS && st.read_only && st.size == 10 && st.blocks == 1,
+          "listing: stat reports a read-only file");
+    check(tfs_stat("/d/sub", &st) == TFS_SUCCESS && st.is_dir && st.size == 0, "listing: stat of a directory");
+    check(tfs_opendir("/d/sub", &dir) == TFS_SUCCESS && tfs_readdirNext(&dir, &entry) == TFS_EOF &&
+          tfs_closedir(&dir) == TFS_SUCCESS, "listing: an empty directory lists nothing");
+
+    // Error paths
+    check(tfs_readdirNext(&dir, &entry) == TFS_FILE_NOT_OPEN, "listing: a closed listing can't be read");
+    check(tfs_opendir("/d/f1", &dir) == TFS_NOT_A_DIRECTORY, "listing: a file can't be listed");
+    check(tfs_opendir("/missing", &dir) == TFS_FILE_NOT_FOUND, "listing: a missing directory can't be listed");
+    check(tfs_stat("/d/missing", &st) == TFS_FILE_NOT_FOUND, "listing: stat of a missing file");
+    check(tfs_fstat(1000, &fst) == TFS_FILE_NOT_OPEN, "listing: fstat of a bad descriptor");
+}
+
+static void test_stats(void) {
+    char content[3 * BLOCK_DATA_SIZE], buffer[100];
+    tfsStats st;
+    fill(content, sizeof(content), 4);
+
+    check(fresh(NUM_BLOCKS, 0) == TFS_SUCCESS && write_file("s", content, sizeof(content)) == TFS_SUCCESS,
+          "stats: mkfs and write a file");
+    check(remount(0) == TFS_SUCCESS, "stats: remount so the reads go to the disk");
+    tfs_resetStats();
+    check(tfs_getStats(&st) == TFS_SUCCESS && st.ops[TFS_OP_PREAD].calls == 0 && st.bytes_read == 0 &&
+          st.disk_read.calls == 0, "stats: reset clears the counters");
+    fileDescriptor FD = tfs_openFile("s");
+    check(tfs_pread(FD, buffer, sizeof(buffer), 0) == sizeof(buffer) && tfs_pread(FD, buffer, 10, sizeof(content)) == 0,
+          "stats: pread the file");
+    check(tfs_getStats(&st) == TFS_SUCCESS && st.ops[TFS_OP_OPEN].calls == 1 && st.ops[TFS_OP_PREAD].calls == 2 &&
+          st.bytes_read == sizeof(buffer) && st.ops[TFS_OP_PREAD].blocks_read >= 1 && st.disk_read.calls >= 1,
+          "stats: calls, bytes and blocks are counted");
+    check(st.blocks_per_byte_read > 0.0 && st.ops[TFS_OP_PREAD].max_ns <= st.ops[TFS_OP_PREAD].total_ns,
+          "stats: blocks per byte and latency are consistent");
+    tfs_closeFile(FD);
+
+    tfs_resetStats();
+    FD = tfs_openFile("t");
+    check(tfs_writeFile(FD, content, sizeof(content)) == TFS_SUCCESS && tfs_getStats(&st) == TFS_SUCCESS &&
+          st.blocks_allocated >= 3 && st.ops[TFS_OP_WRITE_FILE].blocks_written >= 3, "stats: allocations are counted");
+    check(tfs_deleteFile(FD) == TFS_SUCCESS && tfs_getStats(&st) == TFS_SUCCESS && st.blocks_freed >= 3,
+          "stats: frees are counted");
+
+    FILE *out = tmpfile();
+    char json[8192];
+    int n = 0;
+    check(out != NULL && tfs_dumpStatsJSON(out) == TFS_SUCCESS, "stats: dump as JSON");
+    if (out != NULL) {
+        rewind(out);
+        n = fread(json, 1, sizeof(json) - 1, out);
+        fclose(out);
+    }
+    json[n] = '\0';
+    check(n > 0 && json[0] == '{' && strstr(json, "\"blocks_freed\"") != NULL && strstr(json, tfs_opName(TFS_OP_PREAD)) != NULL,
+          "stats: the JSON names the counters");
+
+    // Error paths
+    check(tfs_pread(1000, buffer, 1, 0) < 0 && tfs_getStats(&st) == TFS_SUCCESS && st.ops[TFS_OP_PREAD].errors == 1,
+          "stats: a failed call counts as an error");
+    check(tfs_getStats(NULL) == TFS_ERROR && tfs_dumpStatsJSON(NULL) == TFS_ERROR, "stats: NULL output is rejected");
+    check(tfs_opName(-1) == NULL && tfs_opName(TFS_OP_COUNT) == NULL, "stats: unknown operations have no name");
+}
+
+/* The basic round trip on each disk backend: files written before an
+   unmount read back after it, fsck passes, and deleting gives the
+   blocks back */
+static void test_backends(void) {
+    char *disks[] = {TEST_DISK, "mmap:" TEST_DISK, "ram:tfsCheck", "direct:" TEST_DISK};
+    char content[2 * BLOCK_DATA_SIZE + 100], name[64];
+    int i;
+    fill(content, sizeof(content), 5);
+
+    for (i = 0; i < 4; i++) {
+        test_disk = disks[i];
+        // Not every file system supports O_DIRECT (tmpfs doesn't)
+        int disk = openDisk(disks[i], NUM_BLOCKS * BLOCKSIZE);
+        if (disk < 0) {
+            printf("] skipped: backends: %s can't be opened here\n", disks[i]);
+            continue;
+        }
+        closeDisk(disk);
+        snprintf(name, sizeof(name), "backends: %s: mkfs and write files", disks[i]);
+        check(fresh(NUM_BLOCKS, 0) == TFS_SUCCESS && write_file("a", content, sizeof(content)) == TFS_SUCCESS &&
+              write_file("b", content, 100) == TFS_SUCCESS, name);
+        snprintf(name, sizeof(name), "backends: %s: read them back after a remount", disks[i]);
+        check(remount(0) == TFS_SUCCESS && same_contents("a", content, sizeof(content)) &&
+              same_contents("b", content, 100), name);
+        snprintf(name, sizeof(name), "backends: %s: delete and fsck", disks[i]);
+        check(delete_file("a") == TFS_SUCCESS && write_file("c", content, sizeof(content)) == TFS_SUCCESS &&
+              tfs_checkConsistency() == TFS_SUCCESS, name);
+        tfs_unmount();
+    }
+
+    // Error paths
+    check(unlinkDisk("ram:tfsCheck") == TFS_SUCCESS && tfs_mount("ram:tfsCheck") < 0,
+          "backends: an unlinked RAM disk is gone");
+    check(tfs_mount("ram:missing") < 0, "backends: a RAM disk that was never made can't be mounted");
+    test_disk = TEST_DISK;
+}
+
+static void test_sparse(void) {
+    char content[BLOCK_DATA_SIZE], zeros[BLOCK_DATA_SIZE];
+    int size = 101 * BLOCK_DATA_SIZE;
+    char *expect = calloc(size, 1);
+    tfsStat st;
+    fill(content, sizeof(content), 5);
+    memset(zeros, 0, sizeof(zeros));
+
+    check(fresh(NUM_BLOCKS, 0) == TFS_SUCCESS, "sparse: mkfs and mount");
+    fileDescriptor FD = tfs_openFile("/s");
+    check(tfs_pwrite(FD, content, BLOCK_DATA_SIZE, 100 * BLOCK_DATA_SIZE) == BLOCK_DATA_SIZE,
+          "sparse: write past the end");
+    memcpy(expect + 100 * BLOCK_DATA_SIZE, content, BLOCK_DATA_SIZE);
+    check(tfs_fstat(FD, &st) == TFS_SUCCESS && st.size == size && st.blocks == 1,
+          "sparse: the gap is a hole that takes no blocks");
+    check(tfs_pwrite(FD, content, 10, 50 * BLOCK_DATA_SIZE + 5) == 10, "sparse: write into the hole");
+    memcpy(expect + 50 * BLOCK_DATA_SIZE + 5, content, 10);
+    tfs_closeFile(FD);
+
+    check(remount(0) == TFS_SUCCESS, "sparse: remount");
+    check(same_contents("/s", expect, size), "sparse: holes read back as zeros");
+    check(tfs_stat("/s", &st) == TFS_SUCCESS && st.blocks == 2, "sparse: only the written blocks are stored");
+    FD = tfs_openFile("/s");
+    check(tfs_pwrite(FD, zeros, BLOCK_DATA_SIZE, 100 * BLOCK_DATA_SIZE) == BLOCK_DATA_SIZE &&
+          tfs_fstat(FD, &st) == TFS_SUCCESS && st.blocks == 1, "sparse: zeroing a whole block frees it");
+    memset(expect + 100 * BLOCK_DATA_SIZE, 0, BLOCK_DATA_SIZE);
+    tfs_closeFile(FD);
+    check(same_contents("/s", expect, size) && tfs_checkConsistency() == TFS_SUCCESS, "sparse: fsck");
+
+    // Error paths: bad ranges and a read-only file
+    FD = tfs_openFile("/s");
+    check(tfs_pwrite(FD, content, 10, -1) == TFS_INVALID_SEEK, "sparse: negative offset is refused");
+    check(tfs_pwrite(FD, content, 10, 0x7FFFFFFF - 5) == TFS_INVALID_SEEK, "sparse: a range past 2G is refused");
+    tfs_makeRO("/s");
+    check(tfs_pwrite(FD, content, 10, 0) == TFS_FILE_READ_ONLY, "sparse: read-only file is refused");
+    tfs_closeFile(FD);
+    check(same_contents("/s", expect, size), "sparse: refused writes change nothing");
+
+    // A write that runs out of space keeps what it wrote and nothing more
+    check(fresh(30, 0) == TFS_SUCCESS, "sparse: small disk");
+    fill_random(expect, size, 5);
+    FD = tfs_openFile("/s");
+    check(tfs_pwrite(FD, expect, size, 0) == TFS_DISK_FULL, "sparse: full disk is reported");
+    tfs_closeFile(FD);
+    check(remount(0) == TFS_SUCCESS && tfs_stat("/s", &st) == TFS_SUCCESS && st.size > 0 &&
+          st.size == st.blocks * BLOCK_DATA_SIZE && same_contents("/s", expect, st.size),
+          "sparse: the part written before the disk filled survives a remount");
+    check(tfs_checkConsistency() == TFS_SUCCESS, "sparse: fsck after the full disk");
+    free(expect);
+}
+
+static void test_append(void) {
+    int size = 300 * 100;
+    char *content = malloc(size);
+    tfsStat st;
+    int i, ok = 1;
+    fill(content, size, 6);
+
+    check(fresh(1000, 0) == TFS_SUCCESS, "append: mkfs and mount");
+    fileDescriptor FD = tfs_openFile("/log");
+    for (i = 0; i < 300; i++) {
+        ok &= tfs_append(FD, content + i * 100, 100) == TFS_SUCCESS;
+    }
+    check(ok, "append: 300 small appends");
+    check(tfs_fstat(FD, &st) == TFS_SUCCESS && st.size == size, "append: size includes buffered data");
+    char tail[100];
+    check(tfs_pread(FD, tail, 100, size - 100) == 100 && memcmp(tail, content + size - 100, 100) == 0,
+          "append: buffered data can be read");
+    check(tfs_flush(FD) == TFS_SUCCESS, "append: flush");
+    check(tfs_append(FD, content, 50) == TFS_SUCCESS, "append: more data left buffered at unmount");
+
+    check(remount(0) == TFS_SUCCESS, "append: remount");
+    char *expect = malloc(size + 50);
+    memcpy(expect, content, size);
+    memcpy(expect + size, content, 50);
+    check(same_contents("/log", expect, size + 50), "append: everything appended survives a remount");
+    FD = tfs_openFile("/log");
+    check(tfs_append(FD, content, 30) == TFS_SUCCESS && tfs_setCompression(FD, 1) == TFS_SUCCESS,
+          "append: compress a file with data still buffered");
+    tfs_closeFile(FD);
+    char *longer = malloc(size + 80);
+    memcpy(longer, expect, size + 50);
+    memcpy(longer + size + 50, content, 30);
+    check(same_contents("/log", longer, size + 80), "append: compressing kept the buffered data");
+    check(tfs_checkConsistency() == TFS_SUCCESS, "append: fsck");
+
+    // Error paths: a read-only file, and a flush of a file that isn't open
+    FD = tfs_openFile("/log");
+    tfs_makeRO("/log");
+    check(tfs_append(FD, content, 10) == TFS_FILE_READ_ONLY, "append: read-only file is refused");
+    tfs_closeFile(FD);
+    check(same_contents("/log", longer, size + 80), "append: the refused append changed nothing");
+    check(tfs_flush(1000) == TFS_FILE_NOT_OPEN && tfs_append(1000, content, 10) == TFS_FILE_NOT_OPEN,
+          "append: a bad descriptor is refused");
+
+    // A disk that fills up while buffered data is written out
+    check(fresh(30, 0) == TFS_SUCCESS, "append: small disk");
+    FD = tfs_openFile("/big");
+    int ret = TFS_SUCCESS;
+    for (i = 0; i < 300 && ret >= 0; i++) {
+        ret = tfs_append(FD, content + i * 100, 100);
+    }
+    if (ret >= 0) {
+        ret = tfs_flush(FD);
+    }
+    check(ret == TFS_DISK_FULL, "append: full disk is reported");
+    check(tfs_checkConsistency() == TFS_SUCCESS, "append: fsck before unmount after the full disk");
+    check(tfs_closeFile(FD) == TFS_DISK_FULL && tfs_unmount() == TFS_DISK_FULL,
+          "append: close and unmount report the buffered data that doesn't fit");
+    check(tfs_mount(test_disk) == TFS_SUCCESS && tfs_checkConsistency() == TFS_SUCCESS,
+          "append: file system is consistent after the full disk");
+
+    // Unmount still unmounts when the device fails, and says so
+    test_disk = FAULT_DISK;
+    check(fresh(NUM_BLOCKS, 0) == TFS_SUCCESS, "append: mkfs on a device that will fail");
+    FD = tfs_openFile("/log");
+    check(tfs_append(FD, content, 50) == TFS_SUCCESS, "append: data left buffered");
+    fail_writes(0);
+    check(tfs_unmount() == TFS_WRITE_ERROR, "append: unmount reports the failed flush");
+    fail_writes(-1);
+    check(tfs_mount(test_disk) == TFS_SUCCESS && tfs_checkConsistency() == TFS_SUCCESS,
+          "append: the disk mounts again and is consistent");
+    test_disk = TEST_DISK;
+    free(content);
+    free(expect);
+    free(longer);
+}
+
+static void test_allocator(void) {
+    int size = 40 * BLOCK_DATA_SIZE;
+    char *content = malloc(size);
+    tfsStat x, y, fx, fy, st;
+    fill_random(content, size, 7);
+
+    check(fresh(2000, 0) == TFS_SUCCESS, "allocator: mkfs and mount");
+    check(tfs_mkdir("/x") == TFS_SUCCESS && tfs_mkdir("/y") == TFS_SUCCESS, "allocator: two directories");
+    check(write_file("/x/f", content, size) == TFS_SUCCESS && write_file("/y/f", content, size) == TFS_SUCCESS,
+          "allocator: a file in each");
+    tfs_stat("/x", &x);
+    tfs_stat("/y", &y);
+    tfs_stat("/x/f", &fx);
+    tfs_stat("/y/f", &fy);
+    check(x.inode / TFS_ALLOC_GROUP_BLOCKS != y.inode / TFS_ALLOC_GROUP_BLOCKS,
+          "allocator: new directories go to different groups");
+    check(fx.inode / TFS_ALLOC_GROUP_BLOCKS == x.inode / TFS_ALLOC_GROUP_BLOCKS &&
+          fy.inode / TFS_ALLOC_GROUP_BLOCKS == y.inode / TFS_ALLOC_GROUP_BLOCKS,
+          "allocator: a file's inode is in its directory's group");
+    check(fx.extents == 1 && fy.extents == 1, "allocator: each file is one extent");
+
+    // Age the directory: single-block files with every other one deleted
+    // leave one-block holes that a large file must not be threaded through
+    char path[TFS_MAX_PATH];
+    int i;
+    for (i = 0; i < 60; i++) {
+        snprintf(path, sizeof(path), "/x/small%d", i);
+        write_file(path, content, 100);
+    }
+    for (i = 0; i < 60; i += 2) {
+        snprintf(path, sizeof(path), "/x/small%d", i);
+        fileDescriptor FD = tfs_openFile(path);
+        tfs_deleteFile(FD);
+    }
+    // (the block right after the new inode may be one of the holes)
+    check(write_file("/x/a", content, size) == TFS_SUCCESS && tfs_stat("/x/a", &st) == TFS_SUCCESS &&
+          st.extents <= 2, "allocator: a large file skips the small holes of an aged directory");
+
+    check(remount(0) == TFS_SUCCESS, "allocator: remount");
+    check(same_contents("/x/a", content, size) && same_contents("/x/f", content, size) &&
+          same_contents("/y/f", content, size) && same_contents("/x/small1", content, 100),
+          "allocator: files read back after a remount");
+    check(write_file("/y/g", content, size) == TFS_SUCCESS && tfs_stat("/y/g", &st) == TFS_SUCCESS &&
+          st.extents == 1, "allocator: free space is known again after a remount");
+    check(tfs_checkConsistency() == TFS_SUCCESS, "allocator: fsck");
+
+    // Error path: fill the disk, then free space and use it again
+    check(fresh(120, 0) == TFS_SUCCESS, "allocator: small disk");
+    int ret = TFS_SUCCESS;
+    for (i = 0; ret == TFS_SUCCESS; i++) {
+        snprintf(path, sizeof(path), "/f%d", i);
+        ret = write_file(path, content, size);
+    }
+    check(ret == TFS_DISK_FULL, "allocator: full disk is reported");
+    fileDescriptor FD = tfs_openFile("/f0");
+    check(tfs_deleteFile(FD) == TFS_SUCCESS && write_file("/again", content, size) == TFS_SUCCESS,
+          "allocator: freed blocks are used again");
+    check(remount(0) == TFS_SUCCESS && same_contents("/again", content, size) &&
+          tfs_checkConsistency() == TFS_SUCCESS, "allocator: consistent after filling up");
+    free(content);
+}
+
+/* Runs tfs_defrag in small steps until a pass finds nothing to do */
+static int defrag_all(void) {
+    int ret, steps;
+    for (steps = 0; steps < 10000; steps++) {
+        if ((ret = tfs_defrag(16)) < 0) {
+            return ret == TFS_EOF ? TFS_SUCCESS : ret;
+        }
+    }
+    return TFS_ERROR;
+}
+
+static void test_defrag(void) {
+    int size = 40 * BLOCK_DATA_SIZE, i;
+    char *a = malloc(size), *b = malloc(size), *c = malloc(size);
+    tfsStat sa, sb;
+    fill_random(a, size, 8);
+    fill_random(b, size, 9);
+
+    // Two files written a block at a time in turn end up interleaved
+    check(fresh(2000, 0) == TFS_SUCCESS, "defrag: mkfs and mount");
+    fileDescriptor A = tfs_openFile("/a"), B = tfs_openFile("/b");
+    for (i = 0; i < 40; i++) {
+        tfs_pwrite(A, a + i * BLOCK_DATA_SIZE, BLOCK_DATA_SIZE, i * BLOCK_DATA_SIZE);
+        tfs_pwrite(B, b + i * BLOCK_DATA_SIZE, BLOCK_DATA_SIZE, i * BLOCK_DATA_SIZE);
+    }
+    tfs_closeFile(B);
+    check(tfs_fstat(A, &sa) == TFS_SUCCESS && sa.extents > 10, "defrag: interleaved files are fragmented");
+
+    // A file stays open and usable while it is moved
+    int moved = tfs_defrag(16);
+    check(moved > 0 && tfs_pread(A, c, size, 0) == size && memcmp(c, a, size) == 0,
+          "defrag: one step moves blocks and the open file still reads right");
+    check(defrag_all() == TFS_SUCCESS, "defrag: run until a pass finds nothing");
+    tfs_closeFile(A);
+    check(tfs_stat("/a", &sa) == TFS_SUCCESS && tfs_stat("/b", &sb) == TFS_SUCCESS && sa.extents == 1 &&
+          sb.extents == 1, "defrag: each file is one extent");
+
+    check(remount(0) == TFS_SUCCESS, "defrag: remount");
+    check(same_contents("/a", a, size) && same_contents("/b", b, size), "defrag: contents survive a remount");
+    check(tfs_checkConsistency() == TFS_SUCCESS, "defrag: fsck");
+
+    // Error paths: bad step sizes, no mounted disk, and files that share
+    // blocks with a snapshot, which are left where they are
+    check(tfs_defrag(0) == TFS_ERROR, "defrag: a step of no work is refused");
+    check(tfs_snapshot("before") == TFS_SUCCESS, "defrag: take a snapshot");
+    memcpy(c, a, size);
+    A = tfs_openFile("/a");
+    for (i = 0; i < 40; i += 2) {
+        tfs_pwrite(A, b, BLOCK_DATA_SIZE, i * BLOCK_DATA_SIZE);
+        memcpy(c + i * BLOCK_DATA_SIZE, b, BLOCK_DATA_SIZE);
+    }
+    tfs_closeFile(A);
+    check(tfs_stat("/a", &sa) == TFS_SUCCESS && sa.extents > 1, "defrag: rewrites next to the snapshot fragment");
+    check(defrag_all() == TFS_SUCCESS && tfs_stat("/a", &sb) == TFS_SUCCESS && sb.extents == sa.extents,
+          "defrag: files sharing blocks with a snapshot are left alone");
+    fileDescriptor S = tfs_openSnapshotFile("before", "/a");
+    char *old = malloc(size);
+    check(S >= 0 && tfs_pread(S, old, size, 0) == size && memcmp(old, a, size) == 0 && same_contents("/a", c, size),
+          "defrag: the snapshot and the file both read right");
+    tfs_closeFile(S);
+    free(old);
+    check(tfs_deleteSnapshot("before") == TFS_SUCCESS && tfs_checkConsistency() == TFS_SUCCESS,
+          "defrag: fsck with the snapshot gone");
+    tfs_unmount();
+    check(tfs_defrag(16) == TFS_DISK_NOT_OPEN, "defrag: nothing to do without a mounted disk");
+
+    // A device that fails while blocks are moved keeps the old copies and
+    // gives the destination blocks back
+    test_disk = FAULT_DISK;
+    for (i = 1; i < 4; i++) {
+        check(fresh(2000, 0) == TFS_SUCCESS, "defrag: mkfs on a device that will fail");
+        A = tfs_openFile("/a");
+        B = tfs_openFile("/b");
+        int j;
+        for (j = 0; j < 40; j++) {
+            tfs_pwrite(A, a + j * BLOCK_DATA_SIZE, BLOCK_DATA_SIZE, j * BLOCK_DATA_SIZE);
+            tfs_pwrite(B, b + j * BLOCK_DATA_SIZE, BLOCK_DATA_SIZE, j * BLOCK_DATA_SIZE);
+        }
+        tfs_closeFile(A);
+        tfs_closeFile(B);
+        fail_writes(i);
+        check(tfs_defrag(16) == TFS_WRITE_ERROR, "defrag: a failing device is reported");
+        fail_writes(-1);
+        check(remount(0) == TFS_SUCCESS && same_contents("/a", a, size) && same_contents("/b", b, size) &&
+              tfs_checkConsistency() == TFS_SUCCESS, "defrag: the files read right and no block leaked");
+    }
+    test_disk = TEST_DISK;
+    free(a);
+    free(b);
+    free(c);
+}
+
+/* Copies what 'view' covers into 'buffer', in order */
+static int view_copy(tfsReadView *view, char *buffer) {
+    int i, done = 0;
+    for (i = 0; i < view->num_segments; i++) {
+        memcpy(buffer + done, view->segments[i].data, view->segments[i].len);
+        done += view->segments[i].len;
+    }
+    return done;
+}
+
+static void test_views(void) {
+    int size = 20 * BLOCK_DATA_SIZE;
+    char *content = malloc(size), *copy = malloc(size), *other = malloc(size);
+    tfsReadView view, view2;
+    tfsStats before, after;
+    fill_random(content, size, 10);
+    fill_random(other, size, 11);
+
+    check(fresh(2000, 0) == TFS_SUCCESS && write_file("/v", content, size) == TFS_SUCCESS &&
+          remount(0) == TFS_SUCCESS, "views: write and remount");
+    fileDescriptor FD = tfs_openFile("/v");
+    int off = BLOCK_DATA_SIZE / 2, len = 5 * BLOCK_DATA_SIZE;
+    check(tfs_readView(FD, off, len, &view) == len && view.len == len && view_copy(&view, copy) == len &&
+          memcmp(copy, content + off, len) == 0, "views: a range spanning blocks reads right");
+
+    // The cache serves the same blocks again without going to the disk
+    tfs_getStats(&before);
+    check(tfs_readView(FD, off, len, &view2) == len, "views: a second view of the same range");
+    tfs_getStats(&after);
+    check(after.cache_hits > before.cache_hits && after.cache_misses == before.cache_misses,
+          "views: the second view is served by the block cache");
+    tfs_unpinView(&view2);
+
+    // A pinned view keeps the old data while the file changes under it
+    check(tfs_pwrite(FD, other, size, 0) == size, "views: overwrite the file");
+    check(view_copy(&view, copy) == len && memcmp(copy, content + off, len) == 0,
+          "views: a pinned view still holds the data it was given");
+    check(tfs_unmount() == TFS_BUSY, "views: unmount is refused while a view is pinned");
+    check(tfs_unpinView(&view) == TFS_SUCCESS && view.num_segments == 0, "views: unpin");
+    tfs_closeFile(FD);
+    check(remount(0) == TFS_SUCCESS, "views: remount once unpinned");
+
+    // The tail of the file: the view covers only what is there
+    FD = tfs_openFile("/v");
+    check(tfs_readView(FD, size - 10, 100, &view) == 10 && view_copy(&view, copy) == 10 &&
+          memcmp(copy, other + size - 10, 10) == 0, "views: a view past the end is cut short");
+    tfs_unpinView(&view);
+    check(tfs_checkConsistency() == TFS_SUCCESS, "views: fsck");
+
+    // Error paths: bad ranges, files that aren't open and no view to fill
+    check(tfs_readView(FD, size, 10, &view) == 0 && view.num_segments == 0, "views: a view at the end is empty");
+    check(tfs_readView(FD, -1, 10, &view) == TFS_INVALID_SEEK, "views: a negative offset is refused");
+    check(tfs_readView(FD, 0, -1, &view) == TFS_INVALID_SEEK, "views: a negative length is refused");
+    check(tfs_readView(FD, 0, 10, NULL) == TFS_ERROR, "views: a view is needed");
+    tfs_closeFile(FD);
+    check(tfs_readView(-1, 0, 10, &view) == TFS_FILE_NOT_OPEN, "views: a bad descriptor is refused");
+    free(content);
+    free(copy);
+    free(other);
+}
+
+/* One round of metadata churn: create, list, reopen and delete files */
+static int churn(char *content) {
+    char path[TFS_MAX_PATH];
+    tfsDir dir;
+    tfsDirEntry entry;
+    int i, ok = tfs_mkdir("/p") == TFS_SUCCESS;
+    for (i = 0; i < 20; i++) {
+        snprintf(path, sizeof(path), "/p/f%d", i);
+        ok &= write_file(path, content, 3 * BLOCK_DATA_SIZE) == TFS_SUCCESS;
+    }
+    ok &= tfs_opendir("/p", &dir) == TFS_SUCCESS;
+    while (tfs_readdirNext(&dir, &entry) == TFS_SUCCESS) {
+    }
+    tfs_closedir(&dir);
+    for (i = 0; i < 20; i++) {
+        snprintf(path, sizeof(path), "/p/f%d", i);
+        ok &= same_contents(path, content, 3 * BLOCK_DATA_SIZE) && delete_file(path) == TFS_SUCCESS;
+    }
+    return ok && tfs_rmdir("/p") == TFS_SUCCESS;
+}
+
+static void test_pools(void) {
+    char content[3 * BLOCK_DATA_SIZE];
+    tfsStats before, after;
+    fill(content, sizeof(content), 12);
+
+    check(fresh(2000, 0) == TFS_SUCCESS && churn(content), "pools: a round of metadata churn");
+    tfs_getStats(&before);
+    check(churn(content), "pools: the same round again");
+    tfs_getStats(&after);
+    check(after.pool_mallocs == before.pool_mallocs && after.pool_reuses > before.pool_reuses,
+          "pools: once warm, every in-core allocation comes from a free list");
+    check(write_file("/kept", content, sizeof(content)) == TFS_SUCCESS && remount(0) == TFS_SUCCESS &&
+          same_contents("/kept", content, sizeof(content)) && tfs_checkConsistency() == TFS_SUCCESS,
+          "pools: remount and fsck");
+}
+
+/* Shared by test_concurrent_reads and its threads */
+#define READERS 4
+#define READ_ROUNDS 2000
+#define WRITE_ROUNDS 200
+static char *version_a, *version_b;
+static int size_a = 8 * BLOCK_DATA_SIZE, size_b = 5 * BLOCK_DATA_SIZE;
+static fileDescriptor shared_fd;
+
+/* Reads the whole file over and over; each read must be one version or
+   the other, never a mix. Returns the number of reads that weren't. */
+static void *reader(void *arg) {
+    char *buffer = malloc(size_a);
+    long torn = 0;
+    int i;
+    for (i = 0; i < READ_ROUNDS; i++) {
+        int n = tfs_pread(shared_fd, buffer, size_a, 0);
+        if (!(n == size_a && memcmp(buffer, version_a, size_a) == 0) &&
+            !(n == size_b && memcmp(buffer, version_b, size_b) == 0)) {
+            torn++;
+        }
+    }
+    free(buffer);
+    return (void *)torn;
+}
+
+/* Replaces the file with the other version, WRITE_ROUNDS times */
+static void *writer(void *arg) {
+    long failed = 0;
+    int i;
+    for (i = 0; i < WRITE_ROUNDS; i++) {
+        int ret = i % 2 ? tfs_writeFile(shared_fd, version_a, size_a) : tfs_writeFile(shared_fd, version_b, size_b);
+        if (ret != TFS_SUCCESS) {
+            failed++;
+        }
+    }
+    return (void *)failed;
+}
+
+static void test_concurrent_reads(void) {
+    pthread_t readers[READERS], writer_thread;
+    void *result;
+    long torn = 0;
+    int i;
+    version_a = malloc(size_a);
+    version_b = malloc(size_b);
+    fill_random(version_a, size_a, 12);
+    fill_random(version_b, size_b, 13);
+
+    check(fresh(2000, 0) == TFS_SUCCESS && write_file("/r", version_a, size_a) == TFS_SUCCESS,
+          "concurrent reads: write the first version");
+    shared_fd = tfs_openFile("/r");
+    pthread_create(&writer_thread, NULL, writer, NULL);
+    for (i = 0; i < READERS; i++) {
+        pthread_create(&readers[i], NULL, reader, NULL);
+    }
+    for (i = 0; i < READERS; i++) {
+        pthread_join(readers[i], &result);
+        torn += (long)result;
+    }
+    pthread_join(writer_thread, &result);
+    check((long)result == 0, "concurrent reads: every rewrite succeeds");
+    check(torn == 0, "concurrent reads: readers see one version or the other, never a mix");
+    tfs_closeFile(shared_fd);
+
+    // The writer ended on the first version
+    check(remount(0) == TFS_SUCCESS && same_contents("/r", version_a, size_a), "concurrent reads: remount and read back");
+    check(tfs_checkConsistency() == TFS_SUCCESS, "concurrent reads: fsck with every replaced block freed");
+
+    // Error path: a descriptor closed while the fast path had it published
+    shared_fd = tfs_openFile("/r");
+    char byte;
+    check(tfs_readByte(shared_fd, &byte) == TFS_SUCCESS && byte == version_a[0], "concurrent reads: read a byte");
+    tfs_closeFile(shared_fd);
+    check(tfs_pread(shared_fd, &byte, 1, 0) == TFS_FILE_NOT_OPEN && tfs_readByte(shared_fd, &byte) == TFS_FILE_NOT_OPEN,
+          "concurrent reads: a closed descriptor is refused");
+    free(version_a);
+    free(version_b);
+}
+
+#define IMPORT_FILES 60
+
+static void test_bulk_import(void) {
+    int size = 12 * BLOCK_DATA_SIZE, i, found;
+    char *content = malloc(size), *sparse = calloc(1, size), names[IMPORT_FILES][TFS_MAX_PATH];
+    tfsImportFile files[IMPORT_FILES + 4];
+    tfsStat st;
+    fill_random(content, size, 14);
+    memcpy(sparse + 7 * BLOCK_DATA_SIZE, content, 100);
+
+    check(fresh(2000, 0) == TFS_SUCCESS && tfs_mkdir("/d") == TFS_SUCCESS &&
+          write_file("/d/file3", sparse, 10) == TFS_SUCCESS, "bulk import: mkfs, a directory and a file to replace");
+    for (i = 0; i < IMPORT_FILES; i++) {
+        snprintf(names[i], sizeof(names[i]), "/d/file%d", i);
+        files[i].name = names[i];
+        files[i].buffer = i == 5 ? sparse : content;
+        files[i].size = i == 5 ? size : (i * 97) % size;
+    }
+    // A bad parent, a directory, and a name given twice (the later wins)
+    files[i++] = (tfsImportFile){"/missing/x", content, 10, 0};
+    files[i++] = (tfsImportFile){"/d", content, 10, 0};
+    files[i++] = (tfsImportFile){"/d/file1", content, 20, 0};
+    files[i++] = (tfsImportFile){NULL, content, 10, 0};
+    check(tfs_bulkImport(files, i, 3) == IMPORT_FILES + 1, "bulk import: import with three threads");
+    for (i = 0, found = 0; i < IMPORT_FILES; i++) {
+        found += files[i].ret == TFS_SUCCESS;
+    }
+    check(found == IMPORT_FILES && files[IMPORT_FILES + 2].ret == TFS_SUCCESS, "bulk import: each good file succeeds");
+    check(files[IMPORT_FILES].ret == TFS_FILE_NOT_FOUND && files[IMPORT_FILES + 1].ret == TFS_IS_A_DIRECTORY &&
+          files[IMPORT_FILES + 3].ret == TFS_ERROR, "bulk import: bad names fail on their own");
+    check(tfs_stat("/d/file9", &st) == TFS_SUCCESS && st.extents == 1, "bulk import: a new file is one extent");
+    check(tfs_stat("/d/file5", &st) == TFS_SUCCESS && st.blocks < 12, "bulk import: zero blocks stay holes");
+
+    check(remount(0) == TFS_SUCCESS, "bulk import: remount");
+    for (i = 0, found = 0; i < IMPORT_FILES; i++) {
+        if (i == 1) {
+            found += same_contents(names[i], content, 20);
+        } else {
+            found += same_contents(names[i], i == 5 ? sparse : content, files[i].size);
+        }
+    }
+    check(found == IMPORT_FILES, "bulk import: every file reads back after a remount, replaced ones included");
+    check(tfs_checkConsistency() == TFS_SUCCESS, "bulk import: fsck");
+
+    // Error paths: files that can't all fit, and a device that fails while
+    // the free list or the data is written; no new file is left behind and
+    // the blocks taken go back to the free list once the device recovers
+    check(fresh(60, 0) == TFS_SUCCESS && tfs_mkdir("/d") == TFS_SUCCESS, "bulk import: small disk");
+    for (i = 0; i < 8; i++) {
+        files[i] = (tfsImportFile){names[i], content, size, 0};
+    }
+    check(tfs_bulkImport(files, 8, 0) == TFS_DISK_FULL && files[0].ret == TFS_DISK_FULL,
+          "bulk import: too much data is refused up front");
+    check(tfs_stat(names[0], &st) == TFS_FILE_NOT_FOUND && tfs_checkConsistency() == TFS_SUCCESS,
+          "bulk import: nothing was created and the disk is consistent");
+    int fail_at[2] = { 0, 20 };
+    test_disk = FAULT_DISK;
+    for (i = 0; i < 2; i++) {
+        check(fresh(2000, 0) == TFS_SUCCESS && tfs_mkdir("/d") == TFS_SUCCESS, "bulk import: mkfs again");
+        fail_writes(fail_at[i]);
+        check(tfs_bulkImport(files, 8, 0) == TFS_WRITE_ERROR, "bulk import: a failing device is reported");
+        fail_writes(-1);
+        check(remount(0) == TFS_SUCCESS && tfs_stat(names[0], &st) == TFS_FILE_NOT_FOUND &&
+              tfs_checkConsistency() == TFS_SUCCESS, "bulk import: no file is left behind and the disk is consistent");
+    }
+    test_disk = TEST_DISK;
+    free(content);
+    free(sparse);
+}
+
+#define DUMP_DISK "tfsCheck2.dsk"
+#define DUMP_ARCHIVE "tfsCheck.dump"
+
+/* Whether the files of test_dump read back from the mounted disk with
+   the same contents and flags */
+static int dump_matches(char *text, int text_size, char *noise, int noise_size, char *hole, int hole_size) {
+    tfsStat st;
+    char value[TFS_XATTR_MAX];
+    // Times first: reading the file moves its access time on
+    int ok = tfs_stat("/d/e/noise", &st) == TFS_SUCCESS && st.modified_t == 1000000 && st.accessed_t == 2000000;
+    ok &= same_contents("/d/text", text, text_size) && same_contents("/d/e/noise", noise, noise_size) &&
+             same_contents("/ro", text, 100) && same_contents("/hole", hole, hole_size) &&
+             same_contents("/empty", text, 0);
+    ok &= tfs_stat("/d/text", &st) == TFS_SUCCESS && st.compressed && !st.read_only;
+    ok &= tfs_stat("/ro", &st) == TFS_SUCCESS && st.read_only;
+    ok &= tfs_stat("/hole", &st) == TFS_SUCCESS && st.blocks == 1;
+    ok &= tfs_stat("/d/e", &st) == TFS_SUCCESS && st.is_dir;
+    ok &= tfs_getXattr("/d/text", "user.small", value, sizeof(value)) == 5 && memcmp(value, "small", 5) == 0;
+    ok &= tfs_getXattr("/d/text", "user.big", value, sizeof(value)) == 200 && memcmp(value, noise, 200) == 0;
+    ok &= tfs_getXattr("/ro", "user.tag", value, sizeof(value)) == 2 && memcmp(value, "ro", 2) == 0;
+    return ok;
+}
+
+static void test_dump(void) {
+    int text_size = 30 * BLOCK_DATA_SIZE, noise_size = 7 * BLOCK_DATA_SIZE + 3, hole_size = 50 * BLOCK_DATA_SIZE;
+    char *text = malloc(text_size), *noise = malloc(noise_size), *hole = calloc(1, hole_size);
+    char *options[] = {"", " -z"}, command[200], name[80];
+    int i;
+    fill(text, text_size, 15);
+    fill_random(noise, noise_size, 16);
+    memcpy(hole + hole_size - 100, noise, 100);
+
+    check(fresh(2000, 0) == TFS_SUCCESS && tfs_mkdir("/d") == TFS_SUCCESS && tfs_mkdir("/d/e") == TFS_SUCCESS &&
+          write_file("/d/text", text, text_size) == TFS_SUCCESS &&
+          write_file("/d/e/noise", noise, noise_size) == TFS_SUCCESS && write_file("/ro", text, 100) == TFS_SUCCESS &&
+          write_file("/empty", text, 0) == TFS_SUCCESS, "dump: directories and files");
+    fileDescriptor FD = tfs_openFile("/d/text");
+    check(tfs_setCompression(FD, 1) == TFS_SUCCESS, "dump: a compressed file");
+    tfs_closeFile(FD);
+    FD = tfs_openFile("/hole");
+    check(tfs_pwrite(FD, noise, 100, hole_size - 100) == 100, "dump: a file that is mostly a hole");
+    tfs_closeFile(FD);
+    check(tfs_setXattr("/d/text", "user.small", "small", 5) == TFS_SUCCESS &&
+          tfs_setXattr("/d/text", "user.big", noise, 200) == TFS_SUCCESS &&
+          tfs_setXattr("/ro", "user.tag", "ro", 2) == TFS_SUCCESS, "dump: extended attributes, inline and in a block");
+    check(tfs_makeRO("/ro") == TFS_SUCCESS, "dump: a read-only file");
+
+    for (i = 0; i < 2; i++) {
+        // (the previous dump read the file, which moved its access time on)
+        snprintf(name, sizeof(name), "dump: set a file's times and unmount (dump %d)", i + 1);
+        check((i == 0 || tfs_mount(TEST_DISK) == TFS_SUCCESS) &&
+              tfs_setTimes("/d/e/noise", 1000000, 2000000) == TFS_SUCCESS && tfs_unmount() == TFS_SUCCESS, name);
+        snprintf(command, sizeof(command), "./tfsDump dump %s %s%s", TEST_DISK, DUMP_ARCHIVE, options[i]);
+        snprintf(name, sizeof(name), "dump: %s", command + 2);
+        check(system(command) == 0, name);
+        snprintf(command, sizeof(command), "./tfsDump restore %s %s", DUMP_ARCHIVE, DUMP_DISK);
+        snprintf(name, sizeof(name), "dump: restore the%s archive and mount it", options[i]);
+        check(system(command) == 0 && tfs_mount(DUMP_DISK) == TFS_SUCCESS, name);
+        snprintf(name, sizeof(name), "dump: the%s archive gives back every file, flag, time and attribute", options[i]);
+        check(dump_matches(text, text_size, noise, noise_size, hole, hole_size), name);
+        check(tfs_checkConsistency() == TFS_SUCCESS && tfs_unmount() == TFS_SUCCESS, "dump: fsck the restored disk");
+    }
+
+    // Error paths: no such disk or archive, and an archive cut short
+    check(system("./tfsDump dump missing.dsk " DUMP_ARCHIVE " 2>/dev/null") != 0, "dump: a missing disk is reported");
+    check(system("./tfsDump restore missing.dump " DUMP_DISK " 2>/dev/null") != 0,
+          "dump: a missing archive is reported");
+    check(system("head -c 1000 " DUMP_ARCHIVE " > " DUMP_ARCHIVE ".cut && ./tfsDump restore " DUMP_ARCHIVE ".cut "
+                 DUMP_DISK " 2>/dev/null") != 0, "dump: a truncated archive is reported");
+    check(system("./tfsDump list " DUMP_ARCHIVE ".cut > /dev/null 2>&1") != 0, "dump: and can't be listed");
+    remove(DUMP_ARCHIVE);
+    remove(DUMP_ARCHIVE ".cut");
+    remove(DUMP_DISK);
+    free(text);
+    free(noise);
+    free(hole);
+}
+
+static void test_resize(void) {
+    int size = 300 * BLOCK_DATA_SIZE;
+    char *content = malloc(size), *small = malloc(BLOCK_DATA_SIZE), *copy = malloc(BLOCK_DATA_SIZE);
+    fill_random(content, size, 15);
+    fill_random(small, BLOCK_DATA_SIZE, 16);
+
+    test_disk = FAULT_DISK;
+    check(fresh(200, 0) == TFS_SUCCESS && write_file("/small", small, BLOCK_DATA_SIZE) == TFS_SUCCESS,
+          "resize: mkfs a small disk and write a file");
+    check(write_file("/big", content, size) == TFS_DISK_FULL && delete_file("/big") == TFS_SUCCESS,
+          "resize: the big file doesn't fit yet");
+
+    // Grow while a file is open, then the big file fits
+    fileDescriptor FD = tfs_openFile("/small");
+    check(tfs_resize(600 * BLOCKSIZE) == TFS_SUCCESS, "resize: grow to 600 blocks");
+    check(tfs_pread(FD, copy, BLOCK_DATA_SIZE, 0) == BLOCK_DATA_SIZE && memcmp(copy, small, BLOCK_DATA_SIZE) == 0,
+          "resize: an open file still reads right");
+    tfs_closeFile(FD);
+    check(write_file("/big", content, size) == TFS_SUCCESS, "resize: the big file fits now");
+    check(tfs_unmount() == TFS_SUCCESS && image_blocks() == 600, "resize: the superblock records 600 blocks");
+
+    check(tfs_mount(test_disk) == TFS_SUCCESS && same_contents("/big", content, size) &&
+          same_contents("/small", small, BLOCK_DATA_SIZE), "resize: contents survive a remount");
+    check(tfs_checkConsistency() == TFS_SUCCESS, "resize: fsck");
+
+    // Error paths: shrinking, bad sizes, no mounted disk, and a device that
+    // fails part way, which leaves the old size
+    check(tfs_resize(599 * BLOCKSIZE) == TFS_INVALID_SIZE, "resize: shrinking is refused");
+    check(tfs_resize(-1) == TFS_INVALID_SIZE, "resize: a negative size is refused");
+    check(tfs_resize(600 * BLOCKSIZE + 100) == TFS_SUCCESS && tfs_unmount() == TFS_SUCCESS && image_blocks() == 600,
+          "resize: a partial block is rounded down to no change");
+    check(tfs_mount(test_disk) == TFS_SUCCESS, "resize: remount");
+    fail_writes(1);
+    check(tfs_resize(1000 * BLOCKSIZE) == TFS_WRITE_ERROR, "resize: a failing device is reported");
+    fail_writes(-1);
+    check(tfs_unmount() == TFS_SUCCESS && image_blocks() == 600 && tfs_mount(test_disk) == TFS_SUCCESS &&
+          tfs_checkConsistency() == TFS_SUCCESS, "resize: still 600 blocks after the failure, and consistent");
+    check(tfs_resize(1000 * BLOCKSIZE) == TFS_SUCCESS && tfs_unmount() == TFS_SUCCESS && image_blocks() == 1000 &&
+          tfs_mount(test_disk) == TFS_SUCCESS && tfs_checkConsistency() == TFS_SUCCESS,
+          "resize: trying again once the device is back works");
+    check(write_file("/big2", content, size) == TFS_SUCCESS && same_contents("/big", content, size),
+          "resize: the new space is used");
+    tfs_unmount();
+    check(tfs_resize(2000 * BLOCKSIZE) == TFS_DISK_NOT_OPEN, "resize: no mounted disk");
+    test_disk = TEST_DISK;
+    free(content);
+    free(small);
+    free(copy);
+}
+
+/* Block reads tfs_pread of the whole file at 'path' had to take to the disk */
+static long read_misses(char *path, char *buffer, int size) {
+    tfsStats before, after;
+    fileDescriptor FD = tfs_openFile(path);
+    tfs_getStats(&before);
+    int ok = tfs_pread(FD, buffer, size, 0) == size;
+    tfs_getStats(&after);
+    tfs_closeFile(FD);
+    return ok ? (long)(after.cache_misses - before.cache_misses) : -1;
+}
+
+static void test_cache_budget(void) {
+    int hot_size = 16 * BLOCK_DATA_SIZE, scan_size = 500 * BLOCK_DATA_SIZE, budget = 4 * TFS_CACHE_MIN_BUDGET;
+    char *hot = malloc(hot_size), *scan = malloc(scan_size), *copy = malloc(scan_size);
+    tfsCacheUsage usage;
+    fill_random(hot, hot_size, 17);
+    fill_random(scan, scan_size, 18);
+
+    check(fresh(2000, 0) == TFS_SUCCESS && write_file("/hot", hot, hot_size) == TFS_SUCCESS &&
+          write_file("/scan", scan, scan_size) == TFS_SUCCESS, "cache budget: write a small and a large file");
+    check(tfs_setCacheBudget(budget) == TFS_SUCCESS && remount(0) == TFS_SUCCESS, "cache budget: set a small budget");
+
+    // The small file, read twice, stays cached through a scan of a file
+    // far bigger than the budget
+    tfsStats before, after;
+    check(read_misses("/hot", copy, hot_size) >= 16, "cache budget: the first read of the small file misses");
+    tfs_getStats(&before);
+    long warm = read_misses("/hot", copy, hot_size);
+    tfs_getStats(&after);
+    check(warm == 0 && after.cache_hits - before.cache_hits >= 16, "cache budget: the second read hits every block");
+    tfs_getCacheUsage(&usage);
+    unsigned long evicted = usage.evictions;
+    long scanned = read_misses("/scan", copy, scan_size);
+    check(scanned >= 500 && tfs_getCacheUsage(&usage) == TFS_SUCCESS && usage.evictions >= evicted + 400,
+          "cache budget: scanning the large file misses and evicts");
+    long after_scan = read_misses("/hot", copy, hot_size);
+    check(after_scan <= 2, "cache budget: a scan doesn't push out the hot file");
+    check(memcmp(copy, hot, hot_size) == 0, "cache budget: cached data reads right");
+    check(tfs_getCacheUsage(&usage) == TFS_SUCCESS && usage.budget == budget && usage.used <= budget &&
+          usage.evictions > 0, "cache budget: the caches stay within the budget");
+
+    // Memory pressure: give back what can go; reads still work
+    check(tfs_shrinkCache(0) == 0, "cache budget: asking for nothing releases nothing");
+    long released = tfs_shrinkCache(budget);
+    check(released > 0 && tfs_getCacheUsage(&usage) == TFS_SUCCESS && usage.blocks == 0 && usage.block_bytes == 0,
+          "cache budget: shrinking by the whole budget releases every cached block");
+    check(read_misses("/hot", copy, hot_size) >= 16 && memcmp(copy, hot, hot_size) == 0,
+          "cache budget: reads after shrinking go to the disk and read right");
+
+    check(remount(0) == TFS_SUCCESS && tfs_getCacheUsage(&usage) == TFS_SUCCESS && usage.budget == budget,
+          "cache budget: the budget is kept across a remount");
+    check(same_contents("/hot", hot, hot_size) && same_contents("/scan", scan, scan_size),
+          "cache budget: contents read back after a remount");
+    check(tfs_checkConsistency() == TFS_SUCCESS, "cache budget: fsck");
+
+    // Error paths: budgets too small, bad sizes and no mounted disk
+    check(tfs_setCacheBudget(TFS_CACHE_MIN_BUDGET - 1) == TFS_INVALID_SIZE && tfs_getCacheUsage(&usage) == TFS_SUCCESS &&
+          usage.budget == budget, "cache budget: a budget below the minimum is refused");
+    check(tfs_shrinkCache(-1) == TFS_INVALID_SIZE, "cache budget: a negative shrink is refused");
+    check(tfs_getCacheUsage(NULL) == TFS_ERROR, "cache budget: usage needs somewhere to go");
+    tfs_unmount();
+    check(tfs_shrinkCache(0) == TFS_DISK_NOT_OPEN, "cache budget: nothing to shrink without a mounted disk");
+    check(tfs_setCacheBudget(TFS_CACHE_BUDGET) == TFS_SUCCESS, "cache budget: back to the default");
+    free(hot);
+    free(scan);
+    free(copy);
+}
+
+static void test_attributes(void) {
+    char content[3 * BLOCK_DATA_SIZE], big[200], value[TFS_XATTR_MAX + 1], list[100];
+    char long_name[TFS_XATTR_NAME_MAX + 2];
+    tfsStat st;
+    tfsStats before, after;
+    fill(content, sizeof(content), 19);
+    fill(big, sizeof(big), 20);
+    memset(long_name, 'n', sizeof(long_name) - 1);
+    long_name[sizeof(long_name) - 1] = '\0';
+
+    check(fresh(2000, 0) == TFS_SUCCESS && write_file("/a", content, sizeof(content)) == TFS_SUCCESS &&
+          write_file("/b", content, sizeof(content)) == TFS_SUCCESS && tfs_mkdir("/d") == TFS_SUCCESS,
+          "attributes: mkfs, two files and a directory");
+    time_t written = time(NULL);
+    tfs_getStats(&before);
+    check(tfs_setXattr("/a", "user.tag", "red", 3) == TFS_SUCCESS && tfs_setXattr("/a", "user.tag", "blue", 4) == TFS_SUCCESS,
+          "attributes: set and replace a small attribute");
+    tfs_getStats(&after);
+    check(after.blocks_allocated == before.blocks_allocated, "attributes: a small attribute stays in the inode");
+    check(tfs_setXattr("/a", "user.big", big, sizeof(big)) == TFS_SUCCESS, "attributes: add a large one");
+    tfs_getStats(&before);
+    check(before.blocks_allocated == after.blocks_allocated + 1, "attributes: it moves them to an attribute block");
+    check(tfs_setXattr("/b", "user.tag", "blue", 4) == TFS_SUCCESS &&
+          tfs_setXattr("/b", "user.big", big, sizeof(big)) == TFS_SUCCESS, "attributes: the same two on another file");
+    tfs_getStats(&after);
+    check(after.blocks_allocated == before.blocks_allocated,
+          "attributes: which share the first file's attribute block");
+
+    check(remount(0) == TFS_SUCCESS, "attributes: remount");
+    check(tfs_stat("/a", &st) == TFS_SUCCESS && st.modified_t >= written - 1 && st.modified_t <= time(NULL) &&
+          st.accessed_t >= st.modified_t, "attributes: the times survive a remount");
+    check(tfs_getXattr("/a", "user.tag", NULL, 0) == 4 && tfs_getXattr("/a", "user.tag", value, sizeof(value)) == 4 &&
+          memcmp(value, "blue", 4) == 0, "attributes: the replaced value reads back");
+    check(tfs_getXattr("/b", "user.big", value, sizeof(value)) == (int)sizeof(big) && memcmp(value, big, sizeof(big)) == 0,
+          "attributes: the large value reads back");
+    check(tfs_getXattr("/b", "user.tag", value, sizeof(value)) == 4 && memcmp(value, "blue", 4) == 0,
+          "attributes: and so does the shared one");
+    check(tfs_setTimes("/b", 1000000, 2000000) == TFS_SUCCESS && remount(0) == TFS_SUCCESS &&
+          tfs_stat("/b", &st) == TFS_SUCCESS && st.modified_t == 1000000 && st.accessed_t == 2000000,
+          "attributes: times set with tfs_setTimes survive a remount");
+    check(tfs_listXattr("/a", list, sizeof(list)) == 18 && memcmp(list, "user.tag\0user.big\0", 18) == 0,
+          "attributes: list the names");
+    check(tfs_removeXattr("/a", "user.tag") == TFS_SUCCESS && tfs_getXattr("/a", "user.tag", value, 4) == TFS_ATTR_NOT_FOUND &&
+          tfs_getXattr("/a", "user.big", value, sizeof(value)) == (int)sizeof(big), "attributes: remove one, keep the other");
+    fileDescriptor FD = tfs_openFile("/b");
+    check(tfs_deleteFile(FD) == TFS_SUCCESS && tfs_getXattr("/a", "user.big", value, sizeof(value)) == (int)sizeof(big),
+          "attributes: deleting a file sharing the attribute block leaves the other's");
+    check(same_contents("/a", content, sizeof(content)) && tfs_checkConsistency() == TFS_SUCCESS, "attributes: fsck");
+
+    // Error paths: bad names and sizes, too much in all, missing attributes,
+    // missing files and directories
+    check(tfs_setXattr("/a", long_name, "x", 1) == TFS_INVALID_NAME && tfs_setXattr("/a", "", "x", 1) == TFS_INVALID_NAME,
+          "attributes: names too long or empty are refused");
+    check(tfs_setXattr("/a", "user.x", value, TFS_XATTR_MAX + 1) == TFS_INVALID_SIZE &&
+          tfs_setXattr("/a", "user.x", value, -1) == TFS_INVALID_SIZE, "attributes: bad value sizes are refused");
+    check(tfs_setXattr("/a", "user.more", big, sizeof(big)) == TFS_INVALID_SIZE &&
+          tfs_listXattr("/a", list, sizeof(list)) == 9, "attributes: a set that can't fit is refused and changes nothing");
+    check(tfs_removeXattr("/a", "user.none") == TFS_ATTR_NOT_FOUND, "attributes: removing a missing attribute");
+    check(tfs_getXattr("/missing", "user.tag", value, 4) == TFS_FILE_NOT_FOUND &&
+          tfs_setTimes("/missing", 1, 1) == TFS_FILE_NOT_FOUND, "attributes: a missing file");
+    check(tfs_setXattr("/d", "user.tag", "x", 1) == TFS_IS_A_DIRECTORY && tfs_setTimes("/d", 1, 1) == TFS_IS_A_DIRECTORY,
+          "attributes: directories have none");
+    check(tfs_setTimes("/a", -1, 1) == TFS_ERROR, "attributes: negative times are refused");
+    check(remount(0) == TFS_SUCCESS && tfs_checkConsistency() == TFS_SUCCESS, "attributes: fsck after the refusals");
+
+    // A device that fails at each write in turn, until the call gets
+    // through, while an attribute block or a block map block is added: no
+    // block is lost
+    int size = (INODE_DIRECT_COUNT + 2) * BLOCK_DATA_SIZE, i, ret, tries = 0, clean = 0;
+    char *longer = malloc(size);
+    fill_random(longer, size, 21);
+    test_disk = FAULT_DISK;
+    for (i = 0; i < 2; i++) {
+        int writes = 0;
+        do {
+            fresh(2000, 0);
+            fileDescriptor A = tfs_openFile("/a");
+            fail_writes(writes++);
+            ret = i == 0 ? tfs_setXattr("/a", "user.big", big, sizeof(big)) : tfs_writeFile(A, longer, size);
+            fail_writes(-1);
+            tfs_closeFile(A);
+            tries++;
+            clean += (ret == TFS_SUCCESS || ret == TFS_WRITE_ERROR) && remount(0) == TFS_SUCCESS &&
+                     tfs_checkConsistency() == TFS_SUCCESS;
+        } while (ret == TFS_WRITE_ERROR);
+    }
+    check(clean == tries && same_contents("/a", longer, size), "attributes: a failing device loses no attribute or block map block");
+    test_disk = TEST_DISK;
+    free(longer);
+}
+
+#define FAST_DISK "ram:fast"
+#define SLOW_DISK "ram:slow"
+#define TIER_DISK "tier:" FAST_DISK "+fault:" SLOW_DISK
+
+/* Runs tfs_migrate steps until a pass moves nothing; files used in the
+   last second are hot */
+static int migrate_all(void) {
+    int ret, steps;
+    for (steps = 0; steps < 10000; steps++) {
+        if ((ret = tfs_migrate(16, 1)) < 0) {
+            return ret == TFS_EOF ? TFS_SUCCESS : ret;
+        }
+    }
+    return TFS_ERROR;
+}
+
+static void test_tiering(void) {
+    int small_size = 10 * BLOCK_DATA_SIZE, bulk_size = 100 * BLOCK_DATA_SIZE;
+    char *small = malloc(small_size), *bulk = malloc(bulk_size);
+    tfsTierStats ts;
+    tfsStat st;
+    fill_random(small, small_size, 21);
+    fill_random(bulk, bulk_size, 22);
+
+    // The fast device has to exist first; its size sets the boundary
+    tfs_unmount();
+    unlinkDisk("tier:" FAST_DISK "+" SLOW_DISK);
+    int disk = openDisk(FAST_DISK, 200 * BLOCKSIZE);
+    check(disk >= 0 && closeDisk(disk) >= 0 && tfs_mkfs("tier:" FAST_DISK "+" SLOW_DISK, 2000 * BLOCKSIZE) == TFS_SUCCESS &&
+          tfs_mount(TIER_DISK) == TFS_SUCCESS, "tiering: mkfs and mount a fast and a slow device");
+    check(tfs_getTierStats(&ts) == TFS_SUCCESS && ts.fast_blocks == 200 && ts.slow_blocks == 2000 - 200,
+          "tiering: the devices split where the fast one ends");
+
+    // Small files start on the fast device, bulk data mostly on the slow one
+    check(write_file("/small", small, small_size) == TFS_SUCCESS && write_file("/bulk", bulk, bulk_size) == TFS_SUCCESS,
+          "tiering: write a small and a large file");
+    check(tfs_stat("/small", &st) == TFS_SUCCESS && st.fast_blocks == st.blocks, "tiering: the small file is on the fast device");
+    check(tfs_stat("/bulk", &st) == TFS_SUCCESS && st.fast_blocks <= TFS_TIER_SMALL_BLOCKS,
+          "tiering: the large file is mostly on the slow device");
+
+    // Once the small file goes cold and the large one is in use, they swap
+    char *copy = malloc(bulk_size);
+    sleep(1);
+    fileDescriptor FD = tfs_openFile("/bulk");
+    check(tfs_pread(FD, copy, bulk_size, 0) == bulk_size, "tiering: a second later only the large file is read");
+    tfs_closeFile(FD);
+    free(copy);
+    check(migrate_all() == TFS_SUCCESS && tfs_getTierStats(&ts) == TFS_SUCCESS && ts.blocks_promoted > 0 &&
+          ts.blocks_demoted > 0, "tiering: migrate until a pass moves nothing");
+    check(tfs_stat("/small", &st) == TFS_SUCCESS && st.fast_blocks == 0, "tiering: the cold file moved down");
+    check(tfs_stat("/bulk", &st) == TFS_SUCCESS && st.fast_blocks == st.blocks, "tiering: the hot file moved up");
+
+    check(tfs_unmount() == TFS_SUCCESS && tfs_mount(TIER_DISK) == TFS_SUCCESS, "tiering: remount");
+    tfsTierStats before;
+    tfs_getTierStats(&before);
+    check(same_contents("/bulk", bulk, bulk_size) && tfs_getTierStats(&ts) == TFS_SUCCESS &&
+          ts.fast_reads > before.fast_reads && ts.slow_reads == before.slow_reads,
+          "tiering: the hot file reads back from the fast device alone");
+    check(same_contents("/small", small, small_size) && tfs_getTierStats(&ts) == TFS_SUCCESS &&
+          ts.slow_reads > before.slow_reads, "tiering: the cold file reads back from the slow device");
+    check(tfs_checkConsistency() == TFS_SUCCESS, "tiering: fsck");
+
+    // Error paths: bad step sizes, a slow device that fails mid-move, a
+    // tier without its fast device, and a disk that isn't tiered
+    check(tfs_migrate(0, 0) == TFS_ERROR, "tiering: a step of no work is refused");
+    sleep(1);
+    faultDiskConfig config;
+    faultDiskDefaults(&config);
+    config.fail_after_writes = 20;
+    faultDiskConfigure(SLOW_DISK, &config);
+    check(migrate_all() == TFS_WRITE_ERROR, "tiering: a failing slow device is reported");
+    faultDiskDefaults(&config);
+    faultDiskConfigure(SLOW_DISK, &config);
+    check(tfs_unmount() == TFS_SUCCESS && tfs_mount(TIER_DISK) == TFS_SUCCESS && same_contents("/bulk", bulk, bulk_size) &&
+          tfs_checkConsistency() == TFS_SUCCESS, "tiering: after the failed move the file reads right and fsck passes");
+    sleep(1);
+    check(migrate_all() == TFS_SUCCESS &&
+          tfs_stat("/bulk", &st) == TFS_SUCCESS && st.fast_blocks == 0 &&
+          same_contents("/bulk", bulk, bulk_size), "tiering: the move finishes once the device is back");
+    tfs_unmount();
+    check(tfs_mount("tier:ram:nofast+" SLOW_DISK) < 0, "tiering: the fast device must exist");
+    check(fresh(2000, 0) == TFS_SUCCESS && tfs_migrate(16, 0) == TFS_EOF && tfs_getTierStats(&ts) == TFS_SUCCESS &&
+          ts.fast_blocks == 0 && ts.slow_blocks == 2000, "tiering: nothing to migrate on a disk that isn't tiered");
+    unlinkDisk("tier:" FAST_DISK "+" SLOW_DISK);
+    free(small);
+    free(bulk);
+}
+
+int main() {
+    registerDiskBackend(&faultDiskBackend);
+    test_crc_threads();
+    test_checksums();
+    test_compression();
+    test_dedup();
+    test_snapshots();
+    test_directories();
+    test_listing();
+    test_stats();
+    test_backends();
+    test_sparse();
+    test_append();
+    test_allocator();
+    test_defrag();
+    test_views();
+    test_pools();
+    test_concurrent_reads();
+    test_bulk_import();
+    test_dump();
+    test_resize();
+    test_cache_budget();
+    test_attributes();
+    test_tiering();
+
+    tfs_unmount();
+    remove(TEST_DISK);
+    printf("] %d failures\n", failures);
+    return failures != 0;
+}
@@ -0,0 +1,110 @@
+#include "libTinyFS.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "TinyFS_errno.h"
+
+/*
+ * Defragments a TinyFS disk image:
+ *
+ *     tfsDefrag <disk> [blocks per step] [pause ms]
+ *
+ * Runs tfs_defrag in steps of at most the given number of blocks (default
+ * 64), sleeping between steps when a pause is given, and reports how many
+ * files and extents the disk has before and after.
+ */
+
+#define DEFAULT_STEP 64
+
+typedef struct {
+    int files;
+    int blocks;
+    int extents;
+} fragReport;
+
+static int scan_dir(char *path, fragReport *report) {
+    tfsDir dir;
+    tfsDirEntry entry;
+    tfsStat st;
+    char child[TFS_MAX_PATH];
+    int ret = tfs_opendir(path, &dir);
+    if (ret < 0) {
+        return ret;
+    }
+
+    while ((ret = tfs_readdirNext(&dir, &entry)) == TFS_SUCCESS) {
+        snprintf(child, sizeof(child), "%s/%s", strcmp(path, "/") == 0 ? "" : path, entry.name);
+        if (entry.is_dir) {
+            ret = scan_dir(child, report);
+        } else if ((ret = tfs_stat(child, &st)) == TFS_SUCCESS) {
+            report->files++;
+            report->blocks += st.blocks;
+            report->extents += st.extents;
+        }
+        if (ret < 0) {
+            break;
+        }
+    }
+    tfs_closedir(&dir);
+    return ret == TFS_EOF ? TFS_SUCCESS : ret;
+}
+
+static int print_report(char *when) {
+    fragReport report = {0, 0, 0};
+    int ret = scan_dir("/", &report);
+    if (ret < 0) {
+        fprintf(stderr, "could not scan the tree (%d)\n", ret);
+        return ret;
+    }
+    printf("%s: %d files, %d blocks, %d extents\n", when, report.files, report.blocks, report.extents);
+    return TFS_SUCCESS;
+}
+
+int main(int argc, char *argv[]) {
+    int step = DEFAULT_STEP, pause_ms = 0, steps = 0, moved = 0, ret;
+
+    if (argc < 2 || argc > 4) {
+        fprintf(stderr, "usage: %s <disk> [blocks per step] [pause ms]\n", argv[0]);
+        return 1;
+    }
+    if (argc > 2 && (step = atoi(argv[2])) <= 0) {
+        fprintf(stderr, "blocks per step must be positive\n");
+        return 1;
+    }
+    if (argc > 3) {
+        pause_ms = atoi(argv[3]);
+    }
+
+    if ((ret = tfs_mount(argv[1])) < 0) {
+        fprintf(stderr, "could not mount %s (%d)\n", argv[1], ret);
+        return 1;
+    }
+    if (print_report("before") < 0) {
+        tfs_unmount();
+        return 1;
+    }
+
+    while ((ret = tfs_defrag(step)) >= 0) {
+        moved += ret;
+        steps++;
+        if (pause_ms > 0) {
+            struct timespec ts = {pause_ms / 1000, (pause_ms % 1000) * 1000000L};
+            nanosleep(&ts, NULL);
+        }
+    }
+    if (ret != TFS_EOF) {
+        fprintf(stderr, "defrag failed after %d blocks (%d)\n", moved, ret);
+        tfs_unmount();
+        return 1;
+    }
+
+    printf("moved %d blocks in %d steps\n", moved, steps);
+    ret = print_report("after");
+    if (tfs_checkConsistency() != TFS_SUCCESS) {
+        fprintf(stderr, "consistency check failed\n");
+        ret = -1;
+    }
+    tfs_unmount();
+    return ret < 0;
+}
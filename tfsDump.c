@@ -0,0 +1,537 @@
+#include "libTinyFS.h"
+#include "lzCompress.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "TinyFS_errno.h"
+
+/*
+ * Backs up and restores TinyFS disks as a stream of live data only:
+ *
+ *     tfsDump dump <disk> <archive> [-z]
+ *     tfsDump restore <archive> <disk> [bytes]
+ *     tfsDump list <archive>
+ *
+ * An archive name of "-" means stdout or stdin. The archive holds every
+ * directory and file (not free blocks, not snapshots), so its size follows
+ * the space in use rather than the disk size. It is a sequence of records,
+ * each padded to a multiple of BLOCKSIZE:
+ *
+ *     archive header   magic, version, flags, disk size in blocks
+ *     entry            kind, flags, size, creation, modification and access
+ *                      times, path, extended attributes (files only)
+ *     data chunk ...   (files only) offset, length, stored length, bytes
+ *     end chunk        a data chunk of length 0 closes the file
+ *     end entry        closes the archive
+ *
+ * File data is cut into DUMP_CHUNK_SIZE chunks; chunks that are all zeros
+ * (holes) are left out, and with -z each chunk is LZ compressed unless that
+ * doesn't make it smaller. Restore makes a new file system (as big as the
+ * one dumped unless a size is given) and loads files with tfs_bulkImport,
+ * so the disk is written sequentially in large batches, then sets each
+ * file's extended attributes and times.
+ */
+
+#define DUMP_MAGIC "TFSDUMP"
+#define DUMP_VERSION 2
+#define DUMP_COMPRESSED 0x01       /* archive flag: chunks may be LZ compressed */
+
+#define DUMP_DIR 1
+#define DUMP_FILE 2
+#define DUMP_END 3
+
+#define DUMP_READ_ONLY 0x01        /* entry flags */
+#define DUMP_FILE_COMPRESSED 0x02
+
+#define DUMP_ENTRY_HEADER 44       /* kind, flags, size, path length, three times, xattr length */
+#define DUMP_CHUNK_HEADER 16       /* offset, length, stored length, unused */
+#define DUMP_CHUNK_SIZE (64 * 1024)
+
+/* Restore hands files to tfs_bulkImport in batches of at most this much */
+#define RESTORE_BATCH_FILES 1024
+#define RESTORE_BATCH_BYTES (8 * 1024 * 1024)
+
+static char record[DUMP_CHUNK_HEADER + DUMP_CHUNK_SIZE + BLOCKSIZE];
+static char chunk[DUMP_CHUNK_SIZE];
+
+static int get_int(char *p) {
+    int v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static void put_int(char *p, int v) {
+    memcpy(p, &v, sizeof(v));
+}
+
+static int padded(int len) {
+    return (len + BLOCKSIZE - 1) / BLOCKSIZE * BLOCKSIZE;
+}
+
+/* Writes 'len' bytes of 'record' padded with zeros to a whole block */
+static int put_record(FILE *out, int len) {
+    memset(record + len, 0, padded(len) - len);
+    return fwrite(record, 1, padded(len), out) == (size_t)padded(len) ? 0 : -1;
+}
+
+/* Reads a record of 'len' bytes (plus padding) into 'record' */
+static int get_record(FILE *in, int len) {
+    return fread(record, 1, padded(len), in) == (size_t)padded(len) ? 0 : -1;
+}
+
+/* Times and extended attributes of an entry */
+typedef struct {
+    time_t creation_t;
+    time_t modified_t;
+    time_t accessed_t;
+    int xattr_len;
+    char xattrs[TFS_XATTR_MAX]; /* name length, value length, name, value; ... */
+} entryAttrs;
+
+static void put_time(char *p, time_t t) {
+    long long v = t;
+    memcpy(p, &v, sizeof(v));
+}
+
+static time_t get_time(char *p) {
+    long long v;
+    memcpy(&v, p, sizeof(v));
+    return (time_t)v;
+}
+
+static int put_entry(FILE *out, int kind, int flags, int size, entryAttrs *attrs, char *path) {
+    int len = (int)strlen(path);
+    memset(record, 0, DUMP_ENTRY_HEADER);
+    put_int(record, kind);
+    put_int(record + 4, flags);
+    put_int(record + 8, size);
+    put_int(record + 12, len);
+    put_time(record + 16, attrs->creation_t);
+    put_time(record + 24, attrs->modified_t);
+    put_time(record + 32, attrs->accessed_t);
+    put_int(record + 40, attrs->xattr_len);
+    memcpy(record + DUMP_ENTRY_HEADER, path, len);
+    memcpy(record + DUMP_ENTRY_HEADER + len, attrs->xattrs, attrs->xattr_len);
+    return put_record(out, DUMP_ENTRY_HEADER + len + attrs->xattr_len);
+}
+
+/* Collects the extended attributes of the file at 'path' into 'attrs' */
+static int get_xattrs(char *path, entryAttrs *attrs) {
+    char names[TFS_XATTR_MAX];
+    int total = tfs_listXattr(path, names, sizeof(names));
+    int pos;
+    attrs->xattr_len = 0;
+    if (total < 0) {
+        return total;
+    }
+    for (pos = 0; pos < total; pos += strlen(names + pos) + 1) {
+        int name_len = (int)strlen(names + pos);
+        char *entry = attrs->xattrs + attrs->xattr_len;
+        int size = tfs_getXattr(path, names + pos, entry + 2 + name_len,
+                                TFS_XATTR_MAX - attrs->xattr_len - 2 - name_len);
+        if (size < 0) {
+            return size;
+        }
+        entry[0] = (char)name_len;
+        entry[1] = (char)size;
+        memcpy(entry + 2, names + pos, name_len);
+        attrs->xattr_len += 2 + name_len + size;
+    }
+    return TFS_SUCCESS;
+}
+
+/* Gives the file at 'path' the extended attributes and times of 'attrs' */
+static int set_attrs(char *path, entryAttrs *attrs) {
+    int pos = 0, ret = TFS_SUCCESS;
+    while (pos < attrs->xattr_len && ret == TFS_SUCCESS) {
+        unsigned char *entry = (unsigned char *)attrs->xattrs + pos;
+        char name[TFS_XATTR_NAME_MAX + 1];
+        memcpy(name, entry + 2, entry[0]);
+        name[entry[0]] = '\0';
+        ret = tfs_setXattr(path, name, (char *)entry + 2 + entry[0], entry[1]);
+        pos += 2 + entry[0] + entry[1];
+    }
+    if (ret == TFS_SUCCESS) {
+        ret = tfs_setTimes(path, attrs->modified_t, attrs->accessed_t);
+    }
+    return ret;
+}
+
+static int is_zero(char *data, int len) {
+    int i;
+    for (i = 0; i < len; i++) {
+        if (data[i] != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Streams one file's data as chunk records, leaving out holes */
+static int dump_data(FILE *out, char *path, int size, int compress) {
+    fileDescriptor FD = tfs_openFile(path);
+    if (FD < 0) {
+        return FD;
+    }
+    int offset, ret = TFS_SUCCESS;
+    for (offset = 0; offset < size && ret == TFS_SUCCESS; offset += DUMP_CHUNK_SIZE) {
+        int len = size - offset < DUMP_CHUNK_SIZE ? size - offset : DUMP_CHUNK_SIZE;
+        if ((ret = tfs_pread(FD, chunk, len, offset)) < 0) {
+            break;
+        }
+        ret = TFS_SUCCESS;
+        if (is_zero(chunk, len)) {
+            continue;
+        }
+        int stored = compress ? lz_compress(chunk, len, record + DUMP_CHUNK_HEADER, len - 1) : -1;
+        if (stored < 0) {
+            memcpy(record + DUMP_CHUNK_HEADER, chunk, len);
+            stored = len;
+        }
+        memset(record, 0, DUMP_CHUNK_HEADER);
+        put_int(record, offset);
+        put_int(record + 4, len);
+        put_int(record + 8, stored);
+        if (put_record(out, DUMP_CHUNK_HEADER + stored) < 0) {
+            ret = TFS_WRITE_ERROR;
+        }
+    }
+    tfs_closeFile(FD);
+    if (ret == TFS_SUCCESS) {
+        memset(record, 0, DUMP_CHUNK_HEADER);
+        ret = put_record(out, DUMP_CHUNK_HEADER) < 0 ? TFS_WRITE_ERROR : TFS_SUCCESS;
+    }
+    return ret;
+}
+
+/* Dumps the tree under 'path', parents before their children */
+static int dump_dir(FILE *out, char *path, int compress) {
+    tfsDir dir;
+    tfsDirEntry entry;
+    tfsStat st;
+    static entryAttrs attrs;
+    char child[TFS_MAX_PATH];
+    int ret = tfs_opendir(path, &dir);
+    if (ret < 0) {
+        return ret;
+    }
+
+    while ((ret = tfs_readdirNext(&dir, &entry)) == TFS_SUCCESS) {
+        snprintf(child, sizeof(child), "%s/%s", strcmp(path, "/") == 0 ? "" : path, entry.name);
+        if ((ret = tfs_stat(child, &st)) < 0) {
+            break;
+        }
+        int flags = (st.read_only ? DUMP_READ_ONLY : 0) | (st.compressed ? DUMP_FILE_COMPRESSED : 0);
+        attrs.creation_t = st.creation_t;
+        attrs.modified_t = st.modified_t;
+        attrs.accessed_t = st.accessed_t;
+        attrs.xattr_len = 0;
+        if (!entry.is_dir && (ret = get_xattrs(child, &attrs)) < 0) {
+            break;
+        }
+        if (put_entry(out, entry.is_dir ? DUMP_DIR : DUMP_FILE, flags, st.size, &attrs, child) < 0) {
+            ret = TFS_WRITE_ERROR;
+        } else if (entry.is_dir) {
+            ret = dump_dir(out, child, compress);
+        } else {
+            ret = dump_data(out, child, st.size, compress);
+        }
+        if (ret < 0) {
+            break;
+        }
+    }
+    tfs_closedir(&dir);
+    return ret == TFS_EOF ? TFS_SUCCESS : ret;
+}
+
+static int dump(char *disk_name, FILE *out, int compress) {
+    static entryAttrs end;
+    // The disk's size goes in the header so restore can recreate it
+    int disk = openDisk(disk_name, 0);
+    if (disk < 0) {
+        return disk;
+    }
+    int blocks = diskBlocks(disk);
+    closeDisk(disk);
+
+    int ret = tfs_mount(disk_name);
+    if (ret < 0) {
+        return ret;
+    }
+    memset(record, 0, BLOCKSIZE);
+    memcpy(record, DUMP_MAGIC, sizeof(DUMP_MAGIC));
+    put_int(record + 8, DUMP_VERSION);
+    put_int(record + 12, compress ? DUMP_COMPRESSED : 0);
+    put_int(record + 16, blocks);
+    if (put_record(out, BLOCKSIZE) < 0) {
+        ret = TFS_WRITE_ERROR;
+    } else if ((ret = dump_dir(out, "/", compress)) == TFS_SUCCESS &&
+               (put_entry(out, DUMP_END, 0, 0, &end, "") < 0 || fflush(out) != 0)) {
+        ret = TFS_WRITE_ERROR;
+    }
+    tfs_unmount();
+    return ret;
+}
+
+/* Files of a restore waiting for the next tfs_bulkImport call */
+typedef struct {
+    tfsImportFile files[RESTORE_BATCH_FILES];
+    int read_only[RESTORE_BATCH_FILES];
+    entryAttrs attrs[RESTORE_BATCH_FILES];
+    int count;
+    long bytes;
+} restoreBatch;
+
+static int flush_batch(restoreBatch *batch) {
+    int i, ret = TFS_SUCCESS;
+    if (batch->count > 0 && tfs_bulkImport(batch->files, batch->count, 0) < 0) {
+        ret = batch->files[0].ret < 0 ? batch->files[0].ret : TFS_ERROR;
+    }
+    for (i = 0; i < batch->count; i++) {
+        if (batch->files[i].ret < 0 && ret == TFS_SUCCESS) {
+            fprintf(stderr, "could not restore %s (%d)\n", batch->files[i].name, batch->files[i].ret);
+            ret = batch->files[i].ret;
+        }
+        if (ret == TFS_SUCCESS) {
+            ret = set_attrs(batch->files[i].name, &batch->attrs[i]);
+        }
+        if (ret == TFS_SUCCESS && batch->read_only[i]) {
+            ret = tfs_makeRO(batch->files[i].name);
+        }
+        free(batch->files[i].name);
+        free(batch->files[i].buffer);
+    }
+    batch->count = 0;
+    batch->bytes = 0;
+    return ret;
+}
+
+/*
+ * Reads a file's chunk records into a buffer of 'size' bytes; holes stay
+ * zero
+ */
+static int read_data(FILE *in, char *buffer, int size) {
+    while (1) {
+        if (get_record(in, DUMP_CHUNK_HEADER) < 0) {
+            return TFS_READ_ERROR;
+        }
+        int offset = get_int(record), len = get_int(record + 4), stored = get_int(record + 8);
+        if (len == 0) {
+            return TFS_SUCCESS;
+        }
+        if (offset < 0 || len < 0 || len > DUMP_CHUNK_SIZE || stored < 0 || stored > len ||
+            offset > size - len) {
+            return TFS_INVALID_FILESYSTEM;
+        }
+        // The first block of the record has been read already
+        int rest = padded(DUMP_CHUNK_HEADER + stored) - BLOCKSIZE;
+        if (rest > 0 && fread(record + BLOCKSIZE, 1, rest, in) != (size_t)rest) {
+            return TFS_READ_ERROR;
+        }
+        if (stored == len) {
+            memcpy(buffer + offset, record + DUMP_CHUNK_HEADER, len);
+        } else if (lz_decompress(record + DUMP_CHUNK_HEADER, stored, buffer + offset, len) != len) {
+            return TFS_INVALID_FILESYSTEM;
+        }
+    }
+}
+
+/*
+ * Reads the next entry; the path is left in 'path' and the times and
+ * extended attributes in 'attrs'. Returns its kind.
+ */
+static int read_entry(FILE *in, int *flags, int *size, entryAttrs *attrs, char *path) {
+    if (get_record(in, DUMP_ENTRY_HEADER) < 0) {
+        return TFS_READ_ERROR;
+    }
+    int kind = get_int(record), len = get_int(record + 12);
+    *flags = get_int(record + 4);
+    *size = get_int(record + 8);
+    attrs->creation_t = get_time(record + 16);
+    attrs->modified_t = get_time(record + 24);
+    attrs->accessed_t = get_time(record + 32);
+    attrs->xattr_len = get_int(record + 40);
+    if (len < 0 || len >= TFS_MAX_PATH || *size < 0 || kind < DUMP_DIR || kind > DUMP_END ||
+        attrs->xattr_len < 0 || attrs->xattr_len > TFS_XATTR_MAX) {
+        return TFS_INVALID_FILESYSTEM;
+    }
+    int rest = padded(DUMP_ENTRY_HEADER + len + attrs->xattr_len) - BLOCKSIZE;
+    if (rest > 0 && fread(record + BLOCKSIZE, 1, rest, in) != (size_t)rest) {
+        return TFS_READ_ERROR;
+    }
+    memcpy(path, record + DUMP_ENTRY_HEADER, len);
+    path[len] = '\0';
+    memcpy(attrs->xattrs, record + DUMP_ENTRY_HEADER + len, attrs->xattr_len);
+
+    // Each attribute must lie within the list
+    int pos = 0;
+    while (pos < attrs->xattr_len) {
+        unsigned char *entry = (unsigned char *)attrs->xattrs + pos;
+        if (attrs->xattr_len - pos < 2 || entry[0] == 0 || entry[0] > TFS_XATTR_NAME_MAX ||
+            2 + entry[0] + entry[1] > attrs->xattr_len - pos) {
+            return TFS_INVALID_FILESYSTEM;
+        }
+        pos += 2 + entry[0] + entry[1];
+    }
+    return kind;
+}
+
+/* Checks the archive header and returns the dumped disk's size in blocks */
+static int read_header(FILE *in) {
+    if (get_record(in, BLOCKSIZE) < 0 || memcmp(record, DUMP_MAGIC, sizeof(DUMP_MAGIC)) != 0 ||
+        get_int(record + 8) != DUMP_VERSION) {
+        fprintf(stderr, "not a TinyFS dump\n");
+        return TFS_INVALID_FILESYSTEM;
+    }
+    return get_int(record + 16);
+}
+
+static int restore(FILE *in, char *disk_name, int nBytes) {
+    int blocks = read_header(in);
+    if (blocks < 0) {
+        return blocks;
+    }
+    int ret = tfs_mkfs(disk_name, nBytes > 0 ? nBytes : blocks * BLOCKSIZE);
+    if (ret < 0 || (ret = tfs_mount(disk_name)) < 0) {
+        return ret;
+    }
+
+    restoreBatch *batch = calloc(1, sizeof(restoreBatch));
+    char path[TFS_MAX_PATH];
+    int kind, flags, size;
+    static entryAttrs attrs;
+    if (batch == NULL) {
+        tfs_unmount();
+        return TFS_MEMORY_ERROR;
+    }
+    while (ret == TFS_SUCCESS && (kind = read_entry(in, &flags, &size, &attrs, path)) != DUMP_END) {
+        if (kind < 0) {
+            ret = kind;
+        } else if (kind == DUMP_DIR) {
+            ret = tfs_mkdir(path);
+        } else {
+            char *buffer = calloc(size > 0 ? size : 1, 1);
+            if (buffer == NULL) {
+                ret = TFS_MEMORY_ERROR;
+            } else if ((ret = read_data(in, buffer, size)) < 0) {
+                free(buffer);
+            } else if (flags & DUMP_FILE_COMPRESSED) {
+                // Compressed files are rare and written on their own
+                fileDescriptor FD = tfs_openFile(path);
+                ret = FD;
+                if (FD >= 0 && (ret = tfs_setCompression(FD, 1)) == TFS_SUCCESS &&
+                    (ret = tfs_writeFile(FD, buffer, size)) == TFS_SUCCESS) {
+                    ret = tfs_closeFile(FD);
+                }
+                if (ret == TFS_SUCCESS) {
+                    ret = set_attrs(path, &attrs);
+                }
+                if (ret == TFS_SUCCESS && (flags & DUMP_READ_ONLY)) {
+                    ret = tfs_makeRO(path);
+                }
+                free(buffer);
+            } else {
+                tfsImportFile *file = &batch->files[batch->count];
+                file->name = strdup(path);
+                file->buffer = buffer;
+                file->size = size;
+                batch->attrs[batch->count] = attrs;
+                batch->read_only[batch->count++] = (flags & DUMP_READ_ONLY) != 0;
+                batch->bytes += size;
+                if (batch->count == RESTORE_BATCH_FILES || batch->bytes >= RESTORE_BATCH_BYTES) {
+                    ret = flush_batch(batch);
+                }
+            }
+        }
+    }
+    int flushed = flush_batch(batch);
+    if (ret == TFS_SUCCESS) {
+        ret = flushed;
+    }
+    free(batch);
+    if (ret == TFS_SUCCESS) {
+        ret = tfs_checkConsistency();
+    }
+    tfs_unmount();
+    return ret;
+}
+
+/* Prints the entries of an archive without restoring it */
+static int list(FILE *in) {
+    int blocks = read_header(in);
+    if (blocks < 0) {
+        return blocks;
+    }
+    printf("disk of %d blocks, %scompressed\n", blocks, (get_int(record + 12) & DUMP_COMPRESSED) ? "" : "un");
+
+    char path[TFS_MAX_PATH];
+    int kind, flags, size;
+    static entryAttrs attrs;
+    while ((kind = read_entry(in, &flags, &size, &attrs, path)) != DUMP_END) {
+        if (kind < 0) {
+            return kind;
+        }
+        char when[32];
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M", localtime(&attrs.modified_t));
+        printf("%c%c%c %10d %s %s\n", kind == DUMP_DIR ? 'd' : '-', (flags & DUMP_READ_ONLY) ? 'r' : 'w',
+               (flags & DUMP_FILE_COMPRESSED) ? 'z' : '-', size, when, path);
+        if (kind == DUMP_FILE) {
+            // Skip the data chunks
+            do {
+                if (get_record(in, DUMP_CHUNK_HEADER) < 0) {
+                    return TFS_READ_ERROR;
+                }
+                int rest = padded(DUMP_CHUNK_HEADER + get_int(record + 8)) - BLOCKSIZE;
+                if (rest < 0 || rest > DUMP_CHUNK_SIZE || (rest > 0 && fread(record + BLOCKSIZE, 1, rest, in) != (size_t)rest)) {
+                    return TFS_READ_ERROR;
+                }
+            } while (get_int(record + 4) != 0);
+        }
+    }
+    return TFS_SUCCESS;
+}
+
+static int usage(char *prog) {
+    fprintf(stderr, "usage: %s dump <disk> <archive> [-z]\n"
+                    "       %s restore <archive> <disk> [bytes]\n"
+                    "       %s list <archive>\n", prog, prog, prog);
+    return 1;
+}
+
+int main(int argc, char *argv[]) {
+    int ret;
+    if (argc < 3) {
+        return usage(argv[0]);
+    }
+
+    if (strcmp(argv[1], "dump") == 0 && (argc == 4 || (argc == 5 && strcmp(argv[4], "-z") == 0))) {
+        FILE *out = strcmp(argv[3], "-") == 0 ? stdout : fopen(argv[3], "wb");
+        if (out == NULL) {
+            perror(argv[3]);
+            return 1;
+        }
+        ret = dump(argv[2], out, argc == 5);
+        if (out != stdout && fclose(out) != 0) {
+            ret = TFS_WRITE_ERROR;
+        }
+    } else if ((strcmp(argv[1], "restore") == 0 && (argc == 4 || argc == 5)) ||
+               (strcmp(argv[1], "list") == 0 && argc == 3)) {
+        FILE *in = strcmp(argv[2], "-") == 0 ? stdin : fopen(argv[2], "rb");
+        if (in == NULL) {
+            perror(argv[2]);
+            return 1;
+        }
+        ret = argv[1][0] == 'r' ? restore(in, argv[3], argc == 5 ? atoi(argv[4]) : 0) : list(in);
+        if (in != stdin) {
+            fclose(in);
+        }
+    } else {
+        return usage(argv[0]);
+    }
+
+    if (ret < 0) {
+        fprintf(stderr, "%s failed (%d)\n", argv[1], ret);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,623 @@
+#define FUSE_USE_VERSION 31
+#define _GNU_SOURCE
+#include <fuse.h>
+#include "libTinyFS.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/xattr.h>
+#include <time.h>
+#include <unistd.h>
+#include "TinyFS_errno.h"
+
+/*
+ * Serves a TinyFS disk image through FUSE (libfuse 3), so unmodified tools
+ * can work on it:
+ *
+ *     tfsFuse <disk> <mountpoint> [FUSE options]
+ *     cp -r src mnt/ ; tar -C mnt -cf out.tar . ; fio --directory=mnt ...
+ *     fusermount3 -u mnt
+ *
+ * The disk is mounted before FUSE starts, so a bad image is reported right
+ * away. Requests are handled by FUSE's thread pool (-s serves them one at
+ * a time, -f stays in the foreground). Reads of open files go through
+ * tfs_pread and so run in parallel on its lock-free path; everything else
+ * is serialized by the library lock.
+ *
+ * TinyFS has no hard links or permissions, so every file is owned by the
+ * user running the daemon, mode 0644 (0444 when read-only, which chmod
+ * toggles) and directories 0755. utimens sets a file's modification and
+ * access times through tfs_setTimes; directories have no times to set, so
+ * it leaves them alone. Files have extended attributes, directories don't.
+ * Only files can be renamed; renaming a directory fails with EXDEV, which
+ * makes mv fall back to copying.
+ */
+
+#ifndef RENAME_NOREPLACE
+#define RENAME_NOREPLACE (1 << 0)
+#endif
+
+/* A file the daemon holds open; FUSE file handles point at these */
+typedef struct {
+    int fd;   /* TinyFS descriptor, -1 once the file was deleted */
+    int refs; /* FUSE opens sharing it: TinyFS opens a file only once */
+} openFile;
+
+/* Open files indexed by their TinyFS descriptor. Closing a file shifts the
+   descriptors after it down by one, so the daemon keeps its table in the
+   library's order and fixes up 'fd' on every close. Anything that opens or
+   closes files holds table_lock for writing; reads and writes through a
+   handle hold it for reading, so descriptors stay put under them. */
+static openFile **open_files = NULL;
+static int num_open = 0;
+static int open_cap = 0;
+static pthread_rwlock_t table_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static int to_errno(int ret) {
+    switch (ret) {
+    case TFS_FILE_NOT_FOUND:
+        return -ENOENT;
+    case TFS_FILE_ALREADY_EXISTS:
+        return -EEXIST;
+    case TFS_FILE_NOT_OPEN:
+        return -EBADF;
+    case TFS_FILE_READ_ONLY:
+        return -EACCES;
+    case TFS_INVALID_SEEK:
+        return -EINVAL;
+    case TFS_DISK_FULL:
+        return -ENOSPC;
+    case TFS_MEMORY_ERROR:
+        return -ENOMEM;
+    case TFS_NOT_A_DIRECTORY:
+        return -ENOTDIR;
+    case TFS_IS_A_DIRECTORY:
+        return -EISDIR;
+    case TFS_DIRECTORY_NOT_EMPTY:
+        return -ENOTEMPTY;
+    case TFS_INVALID_NAME:
+        return -ENAMETOOLONG;
+    case TFS_BUSY:
+        return -EBUSY;
+    case TFS_INVALID_SIZE:
+        return -EFBIG;
+    case TFS_ATTR_NOT_FOUND:
+        return -ENODATA;
+    default:
+        return -EIO;
+    }
+}
+
+static openFile *handle_of(struct fuse_file_info *fi) {
+    return (openFile *)(uintptr_t)fi->fh;
+}
+
+/*
+ * Takes descriptor 'fd' out of the table after the library let go of it
+ */
+static void forget_descriptor(int fd) {
+    int i;
+    for (i = fd; i < num_open - 1; i++) {
+        open_files[i] = open_files[i + 1];
+        open_files[i]->fd = i;
+    }
+    num_open--;
+}
+
+/*
+ * Opens (or creates) the file at 'path' and returns its handle, shared
+ * with any other open of the same file. Holds table_lock for writing.
+ */
+static int hold_file(const char *path, openFile **handle) {
+    int fd = tfs_openFile((char *)path);
+    if (fd < 0) {
+        return to_errno(fd);
+    }
+    if (fd < num_open) {
+        open_files[fd]->refs++;
+        *handle = open_files[fd];
+        return 0;
+    }
+
+    // A new descriptor is always the next one
+    if (num_open == open_cap) {
+        int cap = open_cap ? 2 * open_cap : 64;
+        openFile **grown = realloc(open_files, sizeof(openFile *) * cap);
+        if (grown == NULL) {
+            tfs_closeFile(fd);
+            return -ENOMEM;
+        }
+        open_files = grown;
+        open_cap = cap;
+    }
+    openFile *file = malloc(sizeof(openFile));
+    if (file == NULL) {
+        tfs_closeFile(fd);
+        return -ENOMEM;
+    }
+    file->fd = fd;
+    file->refs = 1;
+    open_files[num_open++] = file;
+    *handle = file;
+    return 0;
+}
+
+/*
+ * Drops one open of a handle, closing the file after the last. Holds
+ * table_lock for writing.
+ */
+static int release_file(openFile *file) {
+    int ret = 0;
+    if (--file->refs > 0) {
+        return 0;
+    }
+    if (file->fd >= 0) {
+        int fd = file->fd;
+        if ((ret = tfs_closeFile(fd)) == TFS_SUCCESS) {
+            forget_descriptor(fd);
+        }
+    }
+    free(file);
+    return ret < 0 ? to_errno(ret) : 0;
+}
+
+/*
+ * Deletes the file at 'path'. If the daemon has it open, its handle stays
+ * valid but refers to nothing any more. Holds table_lock for writing.
+ */
+static int delete_path(const char *path) {
+    int fd = tfs_openFile((char *)path);
+    if (fd < 0) {
+        return to_errno(fd);
+    }
+    int ret = tfs_deleteFile(fd);
+    if (ret < 0) {
+        if (fd >= num_open) {
+            tfs_closeFile(fd);
+        }
+        return to_errno(ret);
+    }
+    if (fd < num_open) {
+        open_files[fd]->fd = -1;
+        forget_descriptor(fd);
+    }
+    return 0;
+}
+
+/*
+ * Sets the size of open file 'fd'. TinyFS has no truncate: growing writes
+ * a zero byte at the new end (the gap is a hole), and shrinking rewrites
+ * the part that is kept.
+ */
+static int truncate_fd(int fd, off_t size) {
+    tfsStat st;
+    int ret = tfs_fstat(fd, &st);
+    if (ret < 0) {
+        return to_errno(ret);
+    }
+    if (size > INT_MAX) {
+        return -EFBIG;
+    }
+    if (size == st.size) {
+        return 0;
+    }
+    if (size > st.size) {
+        char zero = 0;
+        ret = tfs_pwrite(fd, &zero, 1, (int)size - 1);
+        return ret < 0 ? to_errno(ret) : 0;
+    }
+
+    char *kept = malloc(size > 0 ? size : 1);
+    if (kept == NULL) {
+        return -ENOMEM;
+    }
+    ret = tfs_pread(fd, kept, (int)size, 0);
+    if (ret >= 0) {
+        ret = tfs_writeFile(fd, kept, (int)size);
+    }
+    free(kept);
+    return ret < 0 ? to_errno(ret) : 0;
+}
+
+static void fill_stat(tfsStat *st, struct stat *out) {
+    memset(out, 0, sizeof(*out));
+    out->st_ino = st->inode;
+    if (st->is_dir) {
+        out->st_mode = S_IFDIR | 0755;
+        out->st_nlink = 2;
+    } else {
+        out->st_mode = S_IFREG | (st->read_only ? 0444 : 0644);
+        out->st_nlink = 1;
+    }
+    out->st_uid = getuid();
+    out->st_gid = getgid();
+    out->st_size = st->size;
+    out->st_blksize = BLOCKSIZE;
+    out->st_blocks = (blkcnt_t)st->blocks * BLOCKSIZE / 512;
+    out->st_atime = st->accessed_t;
+    out->st_mtime = st->modified_t;
+    out->st_ctime = st->modified_t;
+}
+
+static int tfs_fuse_getattr(const char *path, struct stat *out, struct fuse_file_info *fi) {
+    tfsStat st;
+    int ret;
+    if (fi != NULL && handle_of(fi) != NULL) {
+        pthread_rwlock_rdlock(&table_lock);
+        openFile *file = handle_of(fi);
+        ret = file->fd >= 0 ? tfs_fstat(file->fd, &st) : TFS_FILE_NOT_FOUND;
+        pthread_rwlock_unlock(&table_lock);
+    } else {
+        ret = tfs_stat((char *)path, &st);
+    }
+    if (ret < 0) {
+        return to_errno(ret);
+    }
+    fill_stat(&st, out);
+    return 0;
+}
+
+static int tfs_fuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
+                            struct fuse_file_info *fi, enum fuse_readdir_flags flags) {
+    tfsDir dir;
+    tfsDirEntry entry;
+    struct stat st;
+    int ret = tfs_opendir((char *)path, &dir);
+    if (ret < 0) {
+        return to_errno(ret);
+    }
+
+    filler(buf, ".", NULL, 0, 0);
+    filler(buf, "..", NULL, 0, 0);
+    while ((ret = tfs_readdirNext(&dir, &entry)) == TFS_SUCCESS) {
+        memset(&st, 0, sizeof(st));
+        st.st_ino = entry.inode;
+        st.st_mode = entry.is_dir ? S_IFDIR : S_IFREG;
+        if (filler(buf, entry.name, &st, 0, 0) != 0) {
+            break;
+        }
+    }
+    tfs_closedir(&dir);
+    return ret < 0 && ret != TFS_EOF ? to_errno(ret) : 0;
+}
+
+static int tfs_fuse_mkdir(const char *path, mode_t mode) {
+    int ret = tfs_mkdir((char *)path);
+    return ret < 0 ? to_errno(ret) : 0;
+}
+
+static int tfs_fuse_rmdir(const char *path) {
+    int ret = tfs_rmdir((char *)path);
+    return ret < 0 ? to_errno(ret) : 0;
+}
+
+static int tfs_fuse_unlink(const char *path) {
+    tfsStat st;
+    int ret = tfs_stat((char *)path, &st);
+    if (ret < 0) {
+        return to_errno(ret);
+    }
+    if (st.is_dir) {
+        return -EISDIR;
+    }
+    pthread_rwlock_wrlock(&table_lock);
+    ret = delete_path(path);
+    pthread_rwlock_unlock(&table_lock);
+    return ret;
+}
+
+static int tfs_fuse_rename(const char *from, const char *to, unsigned int flags) {
+    tfsStat st;
+    int ret;
+    if (flags & ~RENAME_NOREPLACE) {
+        return -EINVAL;
+    }
+
+    pthread_rwlock_wrlock(&table_lock);
+    if ((ret = tfs_stat((char *)from, &st)) < 0) {
+        ret = to_errno(ret);
+    } else if (st.is_dir) {
+        ret = -EXDEV;
+    } else if ((ret = tfs_stat((char *)to, &st)) == TFS_SUCCESS) {
+        // rename replaces the target; TinyFS refuses to
+        if (flags & RENAME_NOREPLACE) {
+            ret = -EEXIST;
+        } else if (st.is_dir) {
+            ret = -EISDIR;
+        } else {
+            ret = delete_path(to);
+        }
+    } else {
+        ret = ret == TFS_FILE_NOT_FOUND ? 0 : to_errno(ret);
+    }
+
+    if (ret == 0) {
+        openFile *file;
+        if ((ret = hold_file(from, &file)) == 0) {
+            int renamed = tfs_rename(file->fd, (char *)to);
+            ret = release_file(file);
+            if (renamed < 0) {
+                ret = to_errno(renamed);
+            }
+        }
+    }
+    pthread_rwlock_unlock(&table_lock);
+    return ret;
+}
+
+static int tfs_fuse_chmod(const char *path, mode_t mode, struct fuse_file_info *fi) {
+    tfsStat st;
+    int ret = tfs_stat((char *)path, &st);
+    if (ret < 0) {
+        return to_errno(ret);
+    }
+    if (st.is_dir) {
+        return 0;
+    }
+    ret = (mode & 0222) ? tfs_makeRW((char *)path) : tfs_makeRO((char *)path);
+    return ret < 0 ? to_errno(ret) : 0;
+}
+
+static int tfs_fuse_chown(const char *path, uid_t uid, gid_t gid, struct fuse_file_info *fi) {
+    return 0; // everything belongs to the daemon's user
+}
+
+/* The time utimens asks for: its own, now, or 'current' when left out */
+static time_t utimens_time(const struct timespec *tv, time_t now, time_t current) {
+    if (tv == NULL || tv->tv_nsec == UTIME_NOW) {
+        return now;
+    }
+    return tv->tv_nsec == UTIME_OMIT ? current : tv->tv_sec;
+}
+
+static int tfs_fuse_utimens(const char *path, const struct timespec tv[2], struct fuse_file_info *fi) {
+    tfsStat st;
+    int ret = tfs_stat((char *)path, &st);
+    if (ret < 0) {
+        return to_errno(ret);
+    }
+    if (st.is_dir) {
+        return 0; // directories keep no times of their own
+    }
+    time_t now = time(NULL);
+    ret = tfs_setTimes((char *)path, utimens_time(tv ? &tv[1] : NULL, now, st.modified_t),
+                       utimens_time(tv ? &tv[0] : NULL, now, st.accessed_t));
+    if (ret == TFS_ERROR) {
+        return -EINVAL; // times before 1970
+    }
+    return ret < 0 ? to_errno(ret) : 0;
+}
+
+static int tfs_fuse_setxattr(const char *path, const char *name, const char *value, size_t size, int flags) {
+    if (flags & (XATTR_CREATE | XATTR_REPLACE)) {
+        int ret = tfs_getXattr((char *)path, (char *)name, NULL, 0);
+        if (ret >= 0 && (flags & XATTR_CREATE)) {
+            return -EEXIST;
+        }
+        if (ret < 0 && (ret != TFS_ATTR_NOT_FOUND || (flags & XATTR_REPLACE))) {
+            return to_errno(ret);
+        }
+    }
+    if (size > TFS_XATTR_MAX) {
+        return -ENOSPC;
+    }
+    int ret = tfs_setXattr((char *)path, (char *)name, (char *)value, (int)size);
+    if (ret == TFS_INVALID_NAME) {
+        return -ERANGE;
+    }
+    return ret == TFS_INVALID_SIZE ? -ENOSPC : (ret < 0 ? to_errno(ret) : 0);
+}
+
+static int tfs_fuse_getxattr(const char *path, const char *name, char *value, size_t size) {
+    int ret = tfs_getXattr((char *)path, (char *)name, value, size > INT_MAX ? INT_MAX : (int)size);
+    if (ret < 0) {
+        return to_errno(ret);
+    }
+    return size > 0 && (size_t)ret > size ? -ERANGE : ret;
+}
+
+static int tfs_fuse_listxattr(const char *path, char *list, size_t size) {
+    int ret = tfs_listXattr((char *)path, list, size > INT_MAX ? INT_MAX : (int)size);
+    if (ret < 0) {
+        return to_errno(ret);
+    }
+    return size > 0 && (size_t)ret > size ? -ERANGE : ret;
+}
+
+static int tfs_fuse_removexattr(const char *path, const char *name) {
+    int ret = tfs_removeXattr((char *)path, (char *)name);
+    return ret < 0 ? to_errno(ret) : 0;
+}
+
+static int tfs_fuse_truncate(const char *path, off_t size, struct fuse_file_info *fi) {
+    int ret;
+    pthread_rwlock_wrlock(&table_lock);
+    if (fi != NULL && handle_of(fi) != NULL) {
+        openFile *file = handle_of(fi);
+        ret = file->fd >= 0 ? truncate_fd(file->fd, size) : -ENOENT;
+    } else {
+        openFile *file;
+        if ((ret = hold_file(path, &file)) == 0) {
+            ret = truncate_fd(file->fd, size);
+            int closed = release_file(file);
+            if (ret == 0) {
+                ret = closed;
+            }
+        }
+    }
+    pthread_rwlock_unlock(&table_lock);
+    return ret;
+}
+
+/*
+ * Opens an existing file, or creates one when 'create' is set, and hands
+ * FUSE the shared handle
+ */
+static int open_path(const char *path, struct fuse_file_info *fi, int create) {
+    tfsStat st;
+    openFile *file;
+    int ret;
+
+    pthread_rwlock_wrlock(&table_lock);
+    ret = tfs_stat((char *)path, &st);
+    if (ret == TFS_SUCCESS) {
+        if (create && (fi->flags & O_EXCL)) {
+            ret = -EEXIST;
+        } else if (st.is_dir) {
+            ret = -EISDIR;
+        } else if (st.read_only && (fi->flags & O_ACCMODE) != O_RDONLY) {
+            ret = -EACCES;
+        }
+    } else {
+        ret = (create && ret == TFS_FILE_NOT_FOUND) ? 0 : to_errno(ret);
+    }
+    if (ret == 0 && (ret = hold_file(path, &file)) == 0) {
+        if ((fi->flags & O_TRUNC) && (ret = truncate_fd(file->fd, 0)) < 0) {
+            release_file(file);
+        } else {
+            fi->fh = (uintptr_t)file;
+        }
+    }
+    pthread_rwlock_unlock(&table_lock);
+    return ret;
+}
+
+static int tfs_fuse_open(const char *path, struct fuse_file_info *fi) {
+    return open_path(path, fi, 0);
+}
+
+static int tfs_fuse_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+    return open_path(path, fi, 1);
+}
+
+static int tfs_fuse_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+    if (offset >= INT_MAX) {
+        return 0;
+    }
+    if (size > INT_MAX) {
+        size = INT_MAX;
+    }
+    pthread_rwlock_rdlock(&table_lock);
+    openFile *file = handle_of(fi);
+    int ret = file->fd >= 0 ? tfs_pread(file->fd, buf, (int)size, (int)offset) : TFS_FILE_NOT_FOUND;
+    pthread_rwlock_unlock(&table_lock);
+    return ret < 0 ? to_errno(ret) : ret;
+}
+
+static int tfs_fuse_write(const char *path, const char *buf, size_t size, off_t offset,
+                          struct fuse_file_info *fi) {
+    if (offset + (off_t)size > INT_MAX) {
+        return -EFBIG;
+    }
+    pthread_rwlock_rdlock(&table_lock);
+    openFile *file = handle_of(fi);
+    int ret = file->fd >= 0 ? tfs_pwrite(file->fd, (char *)buf, (int)size, (int)offset) : TFS_FILE_NOT_FOUND;
+    pthread_rwlock_unlock(&table_lock);
+    return ret < 0 ? to_errno(ret) : ret;
+}
+
+static int tfs_fuse_flush(const char *path, struct fuse_file_info *fi) {
+    pthread_rwlock_rdlock(&table_lock);
+    openFile *file = handle_of(fi);
+    int ret = file->fd >= 0 ? tfs_flush(file->fd) : TFS_SUCCESS;
+    pthread_rwlock_unlock(&table_lock);
+    return ret < 0 ? to_errno(ret) : 0;
+}
+
+static int tfs_fuse_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+    return tfs_fuse_flush(path, fi); // writes go through to the disk image
+}
+
+static int tfs_fuse_release(const char *path, struct fuse_file_info *fi) {
+    pthread_rwlock_wrlock(&table_lock);
+    int ret = release_file(handle_of(fi));
+    pthread_rwlock_unlock(&table_lock);
+    return ret;
+}
+
+static int tfs_fuse_statfs(const char *path, struct statvfs *st) {
+    // The tier stats split the file system's blocks and the allocator's
+    // free count between the devices; an untiered disk is all "slow"
+    tfsTierStats tier;
+    int ret = tfs_getTierStats(&tier);
+    if (ret < 0) {
+        return to_errno(ret);
+    }
+    memset(st, 0, sizeof(*st));
+    st->f_bsize = BLOCKSIZE;
+    st->f_frsize = BLOCKSIZE;
+    st->f_blocks = tier.fast_blocks + tier.slow_blocks;
+    st->f_bfree = tier.fast_free + tier.slow_free;
+    st->f_bavail = st->f_bfree;
+    // Every file takes an inode block from the same pool
+    st->f_files = st->f_blocks;
+    st->f_ffree = st->f_bfree;
+    st->f_favail = st->f_bfree;
+    st->f_namemax = TFS_MAX_NAME;
+    return 0;
+}
+
+static void *tfs_fuse_init(struct fuse_conn_info *conn, struct fuse_config *cfg) {
+    cfg->use_ino = 1; // st_ino is the inode block
+    return NULL;
+}
+
+static void tfs_fuse_destroy(void *private_data) {
+    int i;
+    for (i = num_open - 1; i >= 0; i--) {
+        tfs_closeFile(i);
+        free(open_files[i]);
+    }
+    free(open_files);
+    tfs_unmount();
+}
+
+static const struct fuse_operations tfs_operations = {
+    .getattr = tfs_fuse_getattr,
+    .readdir = tfs_fuse_readdir,
+    .mkdir = tfs_fuse_mkdir,
+    .rmdir = tfs_fuse_rmdir,
+    .unlink = tfs_fuse_unlink,
+    .rename = tfs_fuse_rename,
+    .chmod = tfs_fuse_chmod,
+    .chown = tfs_fuse_chown,
+    .utimens = tfs_fuse_utimens,
+    .setxattr = tfs_fuse_setxattr,
+    .getxattr = tfs_fuse_getxattr,
+    .listxattr = tfs_fuse_listxattr,
+    .removexattr = tfs_fuse_removexattr,
+    .truncate = tfs_fuse_truncate,
+    .open = tfs_fuse_open,
+    .create = tfs_fuse_create,
+    .read = tfs_fuse_read,
+    .write = tfs_fuse_write,
+    .flush = tfs_fuse_flush,
+    .fsync = tfs_fuse_fsync,
+    .release = tfs_fuse_release,
+    .statfs = tfs_fuse_statfs,
+    .init = tfs_fuse_init,
+    .destroy = tfs_fuse_destroy,
+};
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s <disk> <mountpoint> [FUSE options]\n", argv[0]);
+        return 1;
+    }
+    int ret = tfs_mount(argv[1]);
+    if (ret < 0) {
+        fprintf(stderr, "could not mount %s (%d)\n", argv[1], ret);
+        return 1;
+    }
+
+    // FUSE gets everything after the disk
+    argv[1] = argv[0];
+    return fuse_main(argc - 1, argv + 1, &tfs_operations, NULL);
+}
@@ -11,6 +11,9 @@
 #include "TinyFS_errno.h"
 #include "libTinyFS.c"
 #include "libDisk.c"
+#include "crc32c.c"
+#include "lzCompress.c"
+#include "memPool.c"
 /* simple helper function to fill Buffer with as many inPhrase strings as possible before reaching size */
 int fillBufferWithPhrase(char *inPhrase, char *Buffer, int size) {
   int index = 0, i;